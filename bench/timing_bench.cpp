@@ -0,0 +1,398 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   timing_bench.cpp -- characterizes the timing behaviour of a host through the libks paths
+*
+*   measures how much the following overshoot the requested intervals:
+*
+*   + nanotimer::sleep() (relative, and in the periodic mode)
+*   + sleep_msec()
+*   + the timeout of Condition::wait()
+*
+*   as well as the latency from Flag::set() to the wakeup of a waiting thread, and
+*   the cost and the resolution of nanostamp::get() for every ClockSource.
+*   every measurement is repeated with and without a real-time priority
+*   (where permitted), and with and without all the CPUs busy.
+*
+*   usage: ks-timing-bench [-n samples] [-H]
+*       -n  the number of samples per measurement (100 by default)
+*       -H  prints the whole histogram of every measurement, not just its percentiles
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "ks/timing.h"
+#include "ks/thread.h"
+#include "ks/atomic.h"
+#include "ks/hdrhistogram.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using ks::HdrSnapshot;
+
+const uint64_t USEC = 1000;
+const uint64_t MSEC = 1000000;
+
+int  samples_      = 100;
+bool histograms_   = false;
+
+struct Scenario
+{
+    const char *label;
+    bool        realtime;
+    bool        loaded;
+};
+
+std::string format_nsec(uint64_t nsec)
+{
+    char buf[32];
+    if( nsec < 10 * USEC ){
+        std::sprintf(buf, "%lluns", static_cast<unsigned long long>(nsec));
+    } else if( nsec < 10 * MSEC ){
+        std::sprintf(buf, "%.1fus", nsec / 1e3);
+    } else {
+        std::sprintf(buf, "%.2fms", nsec / 1e6);
+    }
+    return buf;
+}
+
+void print_result(const char *what, uint64_t interval, const HdrSnapshot &result)
+{
+    std::printf("  %-22s %9s  p50 %9s  p90 %9s  p99 %9s  p99.9 %9s  max %9s\n",
+                what, (interval > 0)? format_nsec(interval).c_str(): "-",
+                format_nsec(result.percentile(0.5)).c_str(), format_nsec(result.percentile(0.9)).c_str(),
+                format_nsec(result.percentile(0.99)).c_str(), format_nsec(result.percentile(0.999)).c_str(),
+                format_nsec(result.max()).c_str());
+    if( !histograms_ || (result.count() == 0) ){
+        return;
+    }
+
+    // merges the buckets into powers of two for display
+    std::vector<uint64_t> pow2(65, 0);
+    const std::vector<uint64_t> &counts = result.counts();
+    for( size_t i=0; i<counts.size(); i++ ){
+        if( counts[i] > 0 ){
+            uint64_t low = ks::hdr_lowest_value(i, result.precision());
+            pow2[(low == 0)? 0: (ks::hdr_msb(low) + 1)] += counts[i];
+        }
+    }
+    uint64_t peak = 0;
+    for( size_t i=0; i<pow2.size(); i++ ){
+        peak = (pow2[i] > peak)? pow2[i]: peak;
+    }
+    for( size_t i=0; i<pow2.size(); i++ ){
+        if( pow2[i] == 0 ){
+            continue;
+        }
+        uint64_t low = (i == 0)? 0: (static_cast<uint64_t>(1) << (i - 1));
+        int bar = static_cast<int>((pow2[i] * 40 + peak - 1) / peak);
+        std::printf("      >= %9s | %-40s %llu\n", format_nsec(low).c_str(), std::string(bar, '#').c_str(),
+                    static_cast<unsigned long long>(pow2[i]));
+    }
+}
+
+/**
+ * switches the calling thread to (or back from) a real-time priority. returns false if not permitted.
+ */
+bool set_realtime(bool enable)
+{
+#ifdef _WIN32
+    return SetThreadPriority(GetCurrentThread(), enable? THREAD_PRIORITY_TIME_CRITICAL: THREAD_PRIORITY_NORMAL) != 0;
+#else
+    struct sched_param param;
+    std::memset(&param, 0, sizeof(param));
+    param.sched_priority = enable? sched_get_priority_min(SCHED_FIFO) + 1: 0;
+    return pthread_setschedparam(pthread_self(), enable? SCHED_FIFO: SCHED_OTHER, &param) == 0;
+#endif
+}
+
+/**
+ * keeps a CPU busy until stopped
+ */
+class Spinner: public ks::Thread
+{
+public:
+    explicit Spinner(ks::atomic<bool> *stop): ks::Thread(), stop_(stop) {}
+protected:
+    virtual void run()
+    {
+        volatile uint64_t sink = 0;
+        while( !stop_->load(ks::memory_order_relaxed) ){
+            sink = sink + 1;
+        }
+    }
+private:
+    ks::atomic<bool> *stop_;
+};
+
+class Load
+{
+public:
+    explicit Load(bool enable): stop_(false), spinners_()
+    {
+        if( !enable ){
+            return;
+        }
+        unsigned int cpus = ks::Thread::hardwareConcurrency();
+        for( unsigned int i=0; i<cpus; i++ ){
+            Spinner *spinner = new Spinner(&stop_);
+            spinner->setName("bench-load");
+            spinner->start();
+            spinners_.push_back(spinner);
+        }
+    }
+
+    ~Load()
+    {
+        stop_.store(true);
+        for( std::vector<Spinner *>::iterator it=spinners_.begin(); it!=spinners_.end(); ++it ){
+            (*it)->join();
+            delete *it;
+        }
+    }
+
+private:
+    ks::atomic<bool>       stop_;
+    std::vector<Spinner *> spinners_;
+};
+
+HdrSnapshot bench_nanotimer(uint64_t interval, bool periodic)
+{
+    HdrSnapshot result;
+    ks::nanotimer timer;
+    timer.set_interval(interval);
+    if( periodic ){
+        timer.start_periodic();
+    }
+    for( int i=0; i<samples_; i++ ){
+        uint64_t start = ks::nanotimer::now();
+        timer.sleep();
+        uint64_t elapsed = ks::nanotimer::now() - start;
+        if( periodic ){
+            result.record(timer.last_lateness());
+        } else {
+            result.record((elapsed > interval)? (elapsed - interval): 0);
+        }
+    }
+    return result;
+}
+
+HdrSnapshot bench_sleep_msec(unsigned int msec)
+{
+    HdrSnapshot result;
+    for( int i=0; i<samples_; i++ ){
+        uint64_t start = ks::nanotimer::now();
+        ks::sleep_msec(msec);
+        uint64_t elapsed = ks::nanotimer::now() - start;
+        result.record((elapsed > msec * MSEC)? (elapsed - msec * MSEC): 0);
+    }
+    return result;
+}
+
+HdrSnapshot bench_condition_timeout(long msec)
+{
+    HdrSnapshot result;
+    ks::Condition cond;
+    cond.lock();
+    for( int i=0; i<samples_; i++ ){
+        uint64_t start = ks::nanotimer::now();
+        cond.wait(msec); // nobody notifies
+        uint64_t elapsed = ks::nanotimer::now() - start;
+        result.record((elapsed > msec * MSEC)? (elapsed - msec * MSEC): 0);
+    }
+    cond.unlock();
+    return result;
+}
+
+/**
+ * waits on the Flag `samples_` times, and records the time from set() to the wakeup
+ */
+class FlagWaiter: public ks::Thread
+{
+public:
+    FlagWaiter(ks::Flag *flag, ks::Flag *ack, ks::atomic<uint64_t> *setat, bool realtime):
+        ks::Thread(), result(), flag_(flag), ack_(ack), setat_(setat), realtime_(realtime) {}
+
+    HdrSnapshot result;
+
+protected:
+    virtual void run()
+    {
+        if( realtime_ ){
+            set_realtime(true);
+        }
+        for( int i=0; i<samples_; i++ ){
+            flag_->lock();
+            while( !flag_->isset() ){
+                flag_->wait();
+            }
+            uint64_t woken = ks::nanotimer::now();
+            flag_->unset();
+            flag_->unlock();
+            uint64_t setat = setat_->load(ks::memory_order_acquire);
+            result.record((woken > setat)? (woken - setat): 0);
+
+            ack_->lock();
+            ack_->set();
+            ack_->unlock();
+        }
+    }
+
+private:
+    ks::Flag             *flag_;
+    ks::Flag             *ack_;
+    ks::atomic<uint64_t> *setat_;
+    bool                  realtime_;
+};
+
+HdrSnapshot bench_flag_wakeup(bool realtime)
+{
+    ks::Flag flag, ack;
+    ks::atomic<uint64_t> setat(0);
+    FlagWaiter waiter(&flag, &ack, &setat, realtime);
+    waiter.start();
+    for( int i=0; i<samples_; i++ ){
+        ks::sleep_msec(1); // lets the waiter go to sleep
+        flag.lock();
+        setat.store(ks::nanotimer::now(), ks::memory_order_release);
+        flag.set();
+        flag.unlock();
+        ack.lock(); // waits for the waiter to consume it
+        while( !ack.isset() ){
+            ack.wait();
+        }
+        ack.unset();
+        ack.unlock();
+    }
+    waiter.join();
+    return waiter.result;
+}
+
+void bench_nanostamp()
+{
+    const int  CALLS = 1000000;
+    std::printf("nanostamp::get() (%d calls)\n", CALLS);
+    for( int s=0; s<ks::CLOCK_SOURCES; s++ ){
+        ks::nanostamp stamp(static_cast<ks::ClockSource>(s));
+        uint64_t prev = 0, now = 0, resolution = ~static_cast<uint64_t>(0), backwards = 0;
+        uint64_t start = ks::nanotimer::now();
+        stamp.get(&prev);
+        for( int i=0; i<CALLS; i++ ){
+            stamp.get(&now);
+            if( now < prev ){
+                backwards++;
+            } else if( (now > prev) && ((now - prev) < resolution) ){
+                resolution = now - prev;
+            }
+            prev = now;
+        }
+        uint64_t elapsed = ks::nanotimer::now() - start;
+        std::printf("  %-15s (in use: %-14s) cost %6.1fns/call  resolution %s  backward steps %llu\n",
+                    ks::clock_name(static_cast<ks::ClockSource>(s)), ks::clock_name(stamp.source()), static_cast<double>(elapsed) / CALLS,
+                    format_nsec(resolution).c_str(), static_cast<unsigned long long>(backwards));
+    }
+}
+
+void run_scenario(const Scenario &scenario)
+{
+    const uint64_t intervals[] = { 10 * USEC, 100 * USEC, 1 * MSEC, 10 * MSEC };
+    const int      nintervals  = sizeof(intervals) / sizeof(intervals[0]);
+
+    std::printf("\n%s: overshoot (periodic: lateness), %d samples each\n", scenario.label, samples_);
+    Load load(scenario.loaded);
+    if( scenario.realtime ){
+        set_realtime(true);
+    }
+
+    for( int i=0; i<nintervals; i++ ){
+        print_result("nanotimer::sleep", intervals[i], bench_nanotimer(intervals[i], false));
+    }
+    for( int i=0; i<nintervals; i++ ){
+        print_result("nanotimer (periodic)", intervals[i], bench_nanotimer(intervals[i], true));
+    }
+    for( int i=0; i<nintervals; i++ ){
+        if( intervals[i] >= MSEC ){
+            print_result("sleep_msec", intervals[i], bench_sleep_msec(static_cast<unsigned int>(intervals[i] / MSEC)));
+        }
+    }
+    for( int i=0; i<nintervals; i++ ){
+        if( intervals[i] >= MSEC ){
+            print_result("Condition::wait timeout", intervals[i], bench_condition_timeout(static_cast<long>(intervals[i] / MSEC)));
+        }
+    }
+    print_result("Flag wakeup", 0, bench_flag_wakeup(scenario.realtime));
+
+    if( scenario.realtime ){
+        set_realtime(false);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    for( int i=1; i<argc; i++ ){
+        if( (std::strcmp(argv[i], "-n") == 0) && (i + 1 < argc) ){
+            samples_ = std::atoi(argv[++i]);
+        } else if( std::strcmp(argv[i], "-H") == 0 ){
+            histograms_ = true;
+        } else {
+            std::fprintf(stderr, "usage: %s [-n samples] [-H]\n", argv[0]);
+            return 1;
+        }
+    }
+    if( samples_ <= 0 ){
+        samples_ = 1;
+    }
+
+    bench_nanostamp();
+
+    bool realtime = set_realtime(true);
+    if( realtime ){
+        set_realtime(false);
+    } else {
+        std::printf("\n(real-time priority is not permitted: the real-time scenarios are skipped)\n");
+    }
+
+    const Scenario scenarios[] = {
+        { "idle, normal priority",      false, false },
+        { "idle, real-time priority",   true,  false },
+        { "loaded, normal priority",    false, true  },
+        { "loaded, real-time priority", true,  true  },
+    };
+    for( size_t i=0; i<sizeof(scenarios)/sizeof(scenarios[0]); i++ ){
+        if( scenarios[i].realtime && !realtime ){
+            continue;
+        }
+        run_scenario(scenarios[i]);
+    }
+    return 0;
+}
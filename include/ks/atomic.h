@@ -0,0 +1,417 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   atomic.h -- atomic variables and memory ordering for C++03 (and later) builds
+*
+*   ks::atomic<T> follows a subset of std::atomic<T> for the integral, bool and pointer types
+*   of 1, 4 or 8 bytes. the backend is selected as follows (or by defining one of the
+*   macros beforehand):
+*
+*   + KS_ATOMIC_STD:   std::atomic<T> (C++11 or later)
+*   + KS_ATOMIC_GCC:   the GCC/clang __atomic builtins
+*   + KS_ATOMIC_WIN32: the Interlocked* functions (older MSVC)
+*
+*   with every backend, an atomic<T> has the size and the representation of T, so that
+*   address() can be handed over to the system calls (e.g. futexes) that expect a T.
+*
+*   cache_padded<T> keeps a variable on a cache line of its own, in order to avoid
+*   false sharing between the variables that are written by different threads.
+*/
+#ifndef __KS_ATOMIC_H__
+#define __KS_ATOMIC_H__
+
+#include <stddef.h>
+#include <string.h>
+
+#if !defined(KS_ATOMIC_STD) && !defined(KS_ATOMIC_GCC) && !defined(KS_ATOMIC_WIN32)
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1900))
+#define KS_ATOMIC_STD
+#elif defined(__GNUC__)
+#define KS_ATOMIC_GCC
+#elif defined(_WIN32)
+#define KS_ATOMIC_WIN32
+#else
+#error "ks/atomic.h: no atomic operations are available for this compiler"
+#endif
+#endif
+
+#if defined(KS_ATOMIC_STD)
+#include <atomic>
+#elif defined(KS_ATOMIC_WIN32)
+#include <winsock2.h> // instead of windows.h
+#include <intrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__APPLE__)
+#define KS_CACHE_LINE_SIZE 128
+#else
+#define KS_CACHE_LINE_SIZE 64
+#endif
+
+#ifdef _MSC_VER
+#define KS_CACHE_ALIGNED __declspec(align(KS_CACHE_LINE_SIZE))
+#else
+#define KS_CACHE_ALIGNED __attribute__((aligned(KS_CACHE_LINE_SIZE)))
+#endif
+
+namespace ks {
+
+/**
+ * the values are those of the __ATOMIC_* constants of GCC
+ */
+enum memory_order {
+    memory_order_relaxed = 0,
+    memory_order_consume = 1,
+    memory_order_acquire = 2,
+    memory_order_release = 3,
+    memory_order_acq_rel = 4,
+    memory_order_seq_cst = 5,
+};
+
+/**
+ * the strongest order allowed for the failure of a compare-and-swap
+ */
+inline memory_order _atomic_failure_order(memory_order order)
+{
+    switch( order ){
+    case memory_order_release: return memory_order_relaxed;
+    case memory_order_acq_rel: return memory_order_acquire;
+    default:                   return order;
+    }
+}
+
+template <typename T>
+struct _atomic_traits
+{
+    typedef T difference_type;
+    static const ptrdiff_t step = 1;
+};
+
+template <typename T>
+struct _atomic_traits<T *>
+{
+    typedef ptrdiff_t difference_type;
+    static const ptrdiff_t step = sizeof(T);  // the builtins add bytes to a pointer
+};
+
+#if defined(KS_ATOMIC_STD)
+
+inline std::memory_order _std_order(memory_order order)
+{
+    switch( order ){
+    case memory_order_relaxed: return std::memory_order_relaxed;
+    case memory_order_consume: return std::memory_order_consume;
+    case memory_order_acquire: return std::memory_order_acquire;
+    case memory_order_release: return std::memory_order_release;
+    case memory_order_acq_rel: return std::memory_order_acq_rel;
+    default:                   return std::memory_order_seq_cst;
+    }
+}
+
+inline void atomic_thread_fence(memory_order order) { std::atomic_thread_fence(_std_order(order)); }
+inline void atomic_signal_fence(memory_order order) { std::atomic_signal_fence(_std_order(order)); }
+
+#elif defined(KS_ATOMIC_GCC)
+
+inline void atomic_thread_fence(memory_order order) { __atomic_thread_fence(order); }
+inline void atomic_signal_fence(memory_order order) { __atomic_signal_fence(order); }
+
+#else // KS_ATOMIC_WIN32
+
+/**
+ * the fence for the acquire and release orders. x86 does not reorder those cases, so only
+ * the compiler has to be stopped there; ARM and the others need a hardware barrier.
+ */
+inline void _acq_rel_fence()
+{
+#if defined(_M_IX86) || defined(_M_X64)
+    _ReadWriteBarrier();
+#elif defined(_M_ARM64)
+    __dmb(_ARM64_BARRIER_ISH);
+#else
+    MemoryBarrier();
+#endif
+}
+
+inline void atomic_thread_fence(memory_order order)
+{
+    if( order == memory_order_seq_cst ){
+        MemoryBarrier();
+    } else if( order != memory_order_relaxed ){
+        _acq_rel_fence();
+    }
+}
+
+inline void atomic_signal_fence(memory_order) { _ReadWriteBarrier(); }
+
+/**
+ * the Interlocked* functions for each size of the operands
+ */
+template <size_t N> struct _interlocked;
+
+template <> struct _interlocked<1>
+{
+    typedef char type;
+    static type cas(volatile type *p, type desired, type expected) { return _InterlockedCompareExchange8(p, desired, expected); }
+};
+
+template <> struct _interlocked<4>
+{
+    typedef LONG type;
+    static type cas(volatile type *p, type desired, type expected) { return InterlockedCompareExchange(p, desired, expected); }
+};
+
+template <> struct _interlocked<8>
+{
+    typedef LONG64 type;
+    static type cas(volatile type *p, type desired, type expected) { return InterlockedCompareExchange64(p, desired, expected); }
+};
+
+template <typename To, typename From>
+inline To _atomic_cast(const From &from)
+{
+    To to;
+    memcpy(&to, &from, sizeof(To));
+    return to;
+}
+
+#endif
+
+/**
+ * @brief The atomic class -- an atomic variable of type T
+ */
+template <typename T>
+class atomic
+{
+public:
+    typedef typename _atomic_traits<T>::difference_type difference_type;
+
+    atomic(): v_(T()) {}
+    atomic(T value): v_(value) {}
+    explicit atomic(atomic &ref); // cannot copy
+
+#if defined(KS_ATOMIC_STD)
+    T    load(memory_order order=memory_order_seq_cst) const  { return v_.load(_std_order(order)); }
+    void store(T value, memory_order order=memory_order_seq_cst) { v_.store(value, _std_order(order)); }
+    T    exchange(T value, memory_order order=memory_order_seq_cst) { return v_.exchange(value, _std_order(order)); }
+
+    bool compare_exchange_strong(T &expected, T desired, memory_order order=memory_order_seq_cst)
+    {
+        return v_.compare_exchange_strong(expected, desired, _std_order(order), _std_order(_atomic_failure_order(order)));
+    }
+
+    bool compare_exchange_weak(T &expected, T desired, memory_order order=memory_order_seq_cst)
+    {
+        return v_.compare_exchange_weak(expected, desired, _std_order(order), _std_order(_atomic_failure_order(order)));
+    }
+
+    T fetch_add(difference_type d, memory_order order=memory_order_seq_cst) { return v_.fetch_add(d, _std_order(order)); }
+    T fetch_sub(difference_type d, memory_order order=memory_order_seq_cst) { return v_.fetch_sub(d, _std_order(order)); }
+    T fetch_and(T value, memory_order order=memory_order_seq_cst)          { return v_.fetch_and(value, _std_order(order)); }
+    T fetch_or(T value, memory_order order=memory_order_seq_cst)           { return v_.fetch_or(value, _std_order(order)); }
+    T fetch_xor(T value, memory_order order=memory_order_seq_cst)          { return v_.fetch_xor(value, _std_order(order)); }
+
+    volatile T *address() { return reinterpret_cast<volatile T *>(&v_); }
+
+private:
+    std::atomic<T> v_;
+
+#elif defined(KS_ATOMIC_GCC)
+    T    load(memory_order order=memory_order_seq_cst) const  { return __atomic_load_n(&v_, order); }
+    void store(T value, memory_order order=memory_order_seq_cst) { __atomic_store_n(&v_, value, order); }
+    T    exchange(T value, memory_order order=memory_order_seq_cst) { return __atomic_exchange_n(&v_, value, order); }
+
+    bool compare_exchange_strong(T &expected, T desired, memory_order order=memory_order_seq_cst)
+    {
+        return __atomic_compare_exchange_n(&v_, &expected, desired, false, order, _atomic_failure_order(order));
+    }
+
+    bool compare_exchange_weak(T &expected, T desired, memory_order order=memory_order_seq_cst)
+    {
+        return __atomic_compare_exchange_n(&v_, &expected, desired, true, order, _atomic_failure_order(order));
+    }
+
+    T fetch_add(difference_type d, memory_order order=memory_order_seq_cst)
+    {
+        return __atomic_fetch_add(&v_, d * _atomic_traits<T>::step, order);
+    }
+
+    T fetch_sub(difference_type d, memory_order order=memory_order_seq_cst)
+    {
+        return __atomic_fetch_sub(&v_, d * _atomic_traits<T>::step, order);
+    }
+
+    T fetch_and(T value, memory_order order=memory_order_seq_cst) { return __atomic_fetch_and(&v_, value, order); }
+    T fetch_or(T value, memory_order order=memory_order_seq_cst)  { return __atomic_fetch_or(&v_, value, order); }
+    T fetch_xor(T value, memory_order order=memory_order_seq_cst) { return __atomic_fetch_xor(&v_, value, order); }
+
+    volatile T *address() { return &v_; }
+
+private:
+    volatile T v_;
+
+#else // KS_ATOMIC_WIN32
+    typedef typename _interlocked<sizeof(T)>::type storage;
+
+    T load(memory_order order=memory_order_seq_cst) const
+    {
+        if( order == memory_order_seq_cst ){
+            MemoryBarrier();
+        }
+        T value = _atomic_cast<T>(*reinterpret_cast<const volatile storage *>(&v_));
+        if( order == memory_order_relaxed ){
+            _ReadWriteBarrier();
+        } else {
+            _acq_rel_fence();
+        }
+        return value;
+    }
+
+    void store(T value, memory_order order=memory_order_seq_cst)
+    {
+        if( order == memory_order_seq_cst ){
+            exchange(value, order);
+        } else {
+            if( order == memory_order_relaxed ){
+                _ReadWriteBarrier();
+            } else {
+                _acq_rel_fence();
+            }
+            *reinterpret_cast<volatile storage *>(&v_) = _atomic_cast<storage>(value);
+        }
+    }
+
+    T exchange(T value, memory_order order=memory_order_seq_cst)
+    {
+        T current = load(memory_order_relaxed);
+        while( !compare_exchange_weak(current, value, order) ){}
+        return current;
+    }
+
+    bool compare_exchange_strong(T &expected, T desired, memory_order=memory_order_seq_cst)
+    {
+        storage e = _atomic_cast<storage>(expected);
+        storage prev = _interlocked<sizeof(T)>::cas(reinterpret_cast<volatile storage *>(&v_), _atomic_cast<storage>(desired), e);
+        if( prev == e ){
+            return true;
+        }
+        expected = _atomic_cast<T>(prev);
+        return false;
+    }
+
+    bool compare_exchange_weak(T &expected, T desired, memory_order order=memory_order_seq_cst)
+    {
+        return compare_exchange_strong(expected, desired, order);
+    }
+
+    T fetch_add(difference_type d, memory_order order=memory_order_seq_cst)
+    {
+        T current = load(memory_order_relaxed);
+        while( !compare_exchange_weak(current, current + d, order) ){}
+        return current;
+    }
+
+    T fetch_sub(difference_type d, memory_order order=memory_order_seq_cst)
+    {
+        T current = load(memory_order_relaxed);
+        while( !compare_exchange_weak(current, current - d, order) ){}
+        return current;
+    }
+
+    T fetch_and(T value, memory_order order=memory_order_seq_cst)
+    {
+        T current = load(memory_order_relaxed);
+        while( !compare_exchange_weak(current, current & value, order) ){}
+        return current;
+    }
+
+    T fetch_or(T value, memory_order order=memory_order_seq_cst)
+    {
+        T current = load(memory_order_relaxed);
+        while( !compare_exchange_weak(current, current | value, order) ){}
+        return current;
+    }
+
+    T fetch_xor(T value, memory_order order=memory_order_seq_cst)
+    {
+        T current = load(memory_order_relaxed);
+        while( !compare_exchange_weak(current, current ^ value, order) ){}
+        return current;
+    }
+
+    volatile T *address() { return &v_; }
+
+private:
+    volatile T v_;
+#endif
+
+public:
+    operator T() const          { return load(); }
+    T operator=(T value)        { store(value); return value; }
+    T operator++()              { return fetch_add(1) + 1; }
+    T operator++(int)           { return fetch_add(1); }
+    T operator--()              { return fetch_sub(1) - 1; }
+    T operator--(int)           { return fetch_sub(1); }
+    T operator+=(difference_type d) { return fetch_add(d) + d; }
+    T operator-=(difference_type d) { return fetch_sub(d) - d; }
+};
+
+/**
+ * raises (lowers) `a` to `value` if it is greater (less); returns the previous value
+ */
+template <typename T>
+T atomic_fetch_max(atomic<T> &a, T value, memory_order order=memory_order_seq_cst)
+{
+    T current = a.load(memory_order_relaxed);
+    while( (value > current) && !a.compare_exchange_weak(current, value, order) ){}
+    return current;
+}
+
+template <typename T>
+T atomic_fetch_min(atomic<T> &a, T value, memory_order order=memory_order_seq_cst)
+{
+    T current = a.load(memory_order_relaxed);
+    while( (value < current) && !a.compare_exchange_weak(current, value, order) ){}
+    return current;
+}
+
+/**
+ * @brief The cache_padded struct -- a value on a cache line of its own
+ *
+ * the alignment is only guaranteed for the static and automatic storage
+ * (and for the heap with C++17); the padding applies anywhere.
+ */
+template <typename T>
+struct KS_CACHE_ALIGNED cache_padded
+{
+    cache_padded(): value() {}
+
+    T value;
+};
+
+}
+
+#endif // __KS_ATOMIC_H__
@@ -0,0 +1,109 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   clockdomain.h -- conversions between the clock domains
+*
+*   a timestamp is best taken on a cheap monotonic clock (MonotonicClock, or TSCClock
+*   for the lowest cost), while the logs want the wall time. instead of reading both
+*   clocks for every event, ClockDomains keeps the offset of every ClockSource to the
+*   wall clock, so that a monotonic timestamp is converted (with an addition) when
+*   it is formatted:
+*
+*       ks::nanostamp clock(ks::MonotonicClock);
+*       uint64_t      stamp;
+*       clock.get(&stamp);
+*       ...
+*       std::cout << ks::ClockDomains::format(stamp, ks::MonotonicClock);
+*
+*   the offsets are measured on the first use and at every refresh(). between the
+*   refreshes, the conversion misses the NTP slews (up to 0.5 ms per second) and steps
+*   of the wall clock; a ClockDomainRefresher thread keeps the offsets up to date.
+*   refresh() also re-syncs the TSC calibration (see nanostamp::resync_tsc()).
+*/
+#ifndef __KS_CLOCKDOMAIN_H__
+#define __KS_CLOCKDOMAIN_H__
+
+#include <stdint.h>
+#include <string>
+#include "ks/timing.h"
+#include "ks/thread.h"
+
+namespace ks {
+
+/**
+ * @brief The ClockDomains class -- the process-wide mapping between the ClockSources.
+ *
+ * the timestamps are in nanosec as returned by nanostamp::get() (or nanostamp::to_nsec()).
+ * the conversions are lock-free; only refresh() takes a lock.
+ * on Windows, RealtimeClock here is the system time (unlike nanostamp, which reads QPC).
+ */
+class ClockDomains
+{
+public:
+    static uint64_t now(ClockSource clock); // reads the clock, in nanosec
+
+    /**
+    *   re-measures the offsets between the clocks
+    */
+    static void refresh();
+
+    /**
+    *   the value to add to a timestamp on `from` to get one on `to`
+    */
+    static int64_t  offset(ClockSource from, ClockSource to);
+    static uint64_t convert(uint64_t nsec, ClockSource from, ClockSource to);
+    static uint64_t to_realtime(uint64_t nsec, ClockSource from) { return convert(nsec, from, RealtimeClock); }
+
+    /**
+    *   the wall time of the timestamp as in "2019-04-01 12:34:56.123456789"
+    *   (in the local time zone, or in UTC)
+    */
+    static std::string format(uint64_t nsec, ClockSource from=MonotonicClock, bool utc=false);
+
+    /**
+    *   the uncertainty of the last measured offset to the wall clock, in nanosec
+    *   i.e. how long it took to read the clock around the wall clock
+    */
+    static uint64_t uncertainty(ClockSource clock);
+
+    static uint64_t refreshes();    // the number of the refreshes so far
+    static uint64_t last_refresh(); // the time of the last refresh on MonotonicClock, in nanosec
+};
+
+/**
+ * @brief The ClockDomainRefresher class -- runs ClockDomains::refresh() periodically.
+ */
+class ClockDomainRefresher: public PeriodicThread
+{
+public:
+    explicit ClockDomainRefresher(long interval_msec=1000): PeriodicThread(interval_msec) {}
+
+protected:
+    virtual void tick();
+};
+
+}
+
+#endif // __KS_CLOCKDOMAIN_H__
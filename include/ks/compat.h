@@ -0,0 +1,110 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   compat.h -- the switches between the C++03 and the C++11/17 builds of the headers
+*
+*   the library builds as C++03 (`make STD=-std=c++03`). when the headers are compiled as C++11 or later
+*   (the default of recent compilers, or e.g. `make STD=-std=c++17`), they add the move constructors,
+*   the rvalue overloads and `noexcept` on top of the C++03 API; define KS_NO_CXX11 to keep the C++03 headers regardless.
+*   the library and the application must be built in the same mode: KS_HAS_CXX11 changes the inline
+*   members and the templates of the headers, so mixing the modes breaks the one-definition rule.
+*
+*   string_ref is the C++03 stand-in for std::string_view, for the parameters (e.g. the titles of
+*   ks::logger) that are only read: a string literal, a std::string or (C++17) a std::string_view
+*   can be passed without constructing a std::string. it does not own the characters,
+*   so it must not outlive its source.
+*/
+#ifndef __KS_COMPAT_H__
+#define __KS_COMPAT_H__
+
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+#if !defined(KS_NO_CXX11) && ((__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1900)))
+#define KS_HAS_CXX11
+#endif
+
+#if defined(KS_HAS_CXX11) && ((__cplusplus >= 201703L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 201703L)))
+#define KS_HAS_CXX17
+#endif
+
+#ifdef KS_HAS_CXX11
+#include <utility>
+#define KS_NOEXCEPT noexcept
+#define KS_MOVE(x)  std::move(x)
+#else
+#define KS_NOEXCEPT
+#define KS_MOVE(x)  (x)
+#endif
+
+#ifdef KS_HAS_CXX17
+#include <string_view>
+#endif
+
+namespace ks {
+
+/**
+ * @brief The string_ref class -- a read-only view of a character range
+ */
+class string_ref
+{
+public:
+    string_ref() KS_NOEXCEPT: data_(""), size_(0) {}
+    string_ref(const char *str): data_(str), size_((str != 0)? strlen(str): 0)
+    {
+        if( data_ == 0 ){
+            data_ = "";
+        }
+    }
+    string_ref(const char *data, size_t size) KS_NOEXCEPT: data_(data), size_(size) {}
+    string_ref(const std::string &str) KS_NOEXCEPT: data_(str.data()), size_(str.size()) {}
+#ifdef KS_HAS_CXX17
+    string_ref(std::string_view str) KS_NOEXCEPT: data_(str.data()), size_(str.size()) {}
+    operator std::string_view() const KS_NOEXCEPT { return std::string_view(data_, size_); }
+#endif
+
+    const char *data() const KS_NOEXCEPT { return data_; }
+    size_t      size() const KS_NOEXCEPT { return size_; }
+    bool        empty() const KS_NOEXCEPT { return size_ == 0; }
+    std::string str() const { return std::string(data_, size_); }
+
+private:
+    const char *data_;
+    size_t      size_;
+};
+
+inline bool operator==(const std::string &lhs, const string_ref &rhs)
+{
+    return (lhs.size() == rhs.size()) && (lhs.compare(0, lhs.size(), rhs.data(), rhs.size()) == 0);
+}
+
+inline bool operator==(const string_ref &lhs, const std::string &rhs) { return (rhs == lhs); }
+inline bool operator!=(const std::string &lhs, const string_ref &rhs) { return !(lhs == rhs); }
+inline bool operator!=(const string_ref &lhs, const std::string &rhs) { return !(rhs == lhs); }
+
+}
+
+#endif // __KS_COMPAT_H__
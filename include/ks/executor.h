@@ -0,0 +1,124 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   executor.h -- tasks and the executors that run them
+*/
+#ifndef __KS_EXECUTOR_H__
+#define __KS_EXECUTOR_H__
+
+#include <deque>
+#include <vector>
+#include "ks/thread.h"
+#include "ks/sync.h"
+
+namespace ks {
+
+/**
+ * @brief The Task class -- a unit of work to be run by an Executor.
+ * you are supposed to inherit this class and override run().
+ */
+class Task
+{
+public:
+    Task();
+    virtual ~Task();
+    virtual void run()=0;
+};
+
+/**
+ * @brief The Executor class -- the interface for anything that can run a Task
+ */
+class Executor
+{
+public:
+    Executor();
+    virtual ~Executor();
+
+    /**
+    *   schedules `task` to be run. the executor takes the ownership of `task`,
+    *   and deletes it after it has been run.
+    */
+    virtual void execute(Task *task)=0;
+};
+
+/**
+ * @brief The InlineExecutor class -- runs the task immediately on the calling thread
+ */
+class InlineExecutor: public Executor
+{
+public:
+    InlineExecutor();
+    virtual void execute(Task *task);
+
+    static InlineExecutor *instance();
+};
+
+/**
+ * @brief The ThreadPool class -- runs the tasks on a fixed set of persistent worker threads
+ */
+class ThreadPool: public Executor
+{
+public:
+    explicit ThreadPool(unsigned int workers=0); // 0 means Thread::hardwareConcurrency()
+    explicit ThreadPool(ThreadPool &ref); // cannot copy
+    virtual ~ThreadPool(); // calls shutdown()
+
+    virtual void execute(Task *task); // throws std::runtime_error after shutdown()
+    unsigned int size() const;
+
+    /**
+    *   stops accepting new tasks, runs the ones already queued, and joins the workers.
+    */
+    void shutdown();
+
+    /**
+    *   the process-wide pool, created on the first call.
+    */
+    static ThreadPool *global();
+
+private:
+    class Worker: public Thread
+    {
+    public:
+        explicit Worker(ThreadPool *pool);
+    protected:
+        virtual void run();
+    private:
+        ThreadPool *pool_;
+    };
+
+    Task *next(); // returns 0 when the pool has been shut down and drained
+
+    Mutex                 lock_;
+    Semaphore             pending_;
+    std::deque<Task *>    queue_;
+    std::vector<Worker *> workers_;
+    bool                  stopping_;
+};
+
+}
+
+#endif // __KS_EXECUTOR_H__
@@ -0,0 +1,187 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   fiber.h -- lightweight cooperative fibers, multiplexed onto a few carrier threads
+*
+*   a fiber runs on its own small stack, and switches with the hand-written
+*   context switch (x86-64 and aarch64; ucontext on the other POSIX platforms).
+*   a fiber that yields, sleeps or waits on a FiberMutex/FiberCondition is parked,
+*   and its carrier thread goes on to run another fiber.
+*
+*   fibers are not supported on Windows yet; the FiberScheduler constructor throws there.
+*/
+#ifndef __KS_FIBER_H__
+#define __KS_FIBER_H__
+
+#include <stddef.h>
+#include <deque>
+#include <vector>
+#include "ks/thread.h"
+#include "ks/sync.h"
+#include "ks/scheduler.h"
+
+namespace ks {
+
+const size_t FIBER_DEFAULT_STACK = 64 * 1024;
+const size_t FIBER_MIN_STACK     = 16 * 1024; // the usable part, above the guard page
+
+class FiberScheduler;
+class _Carrier;
+struct _FiberContext;
+
+/**
+ * @brief The Fiber class -- a cooperative task with its own stack.
+ *
+ * you are supposed to inherit this class and override run(), and pass
+ * the instance to FiberScheduler::spawn(). the scheduler deletes the fiber
+ * after run() returns.
+ */
+class Fiber
+{
+public:
+    /**
+    *   `stack_size` is rounded up to the page size, and includes the guard page.
+    *   throws std::runtime_error if less than FIBER_MIN_STACK is left above the guard page.
+    */
+    explicit Fiber(size_t stack_size=FIBER_DEFAULT_STACK);
+    explicit Fiber(Fiber &ref); // cannot copy
+    virtual ~Fiber();
+
+    static Fiber *current(); // the fiber running on this thread, or 0 outside fibers
+
+    /**
+    *   lets the other ready fibers run. no-op outside fibers.
+    */
+    static void yield();
+
+    /**
+    *   parks the current fiber for `msec` milliseconds.
+    *   outside fibers, the calling thread sleeps instead.
+    */
+    static void sleep(long msec);
+
+protected:
+    virtual void run()=0;
+
+private:
+    friend class FiberScheduler;
+    friend class _Carrier;
+    friend class FiberMutex;
+    friend class FiberCondition;
+    friend void _fiber_start(Fiber *fiber);
+
+    void entry_();
+    void suspend_(int action, Mutex *guard); // switches back to the carrier, requesting `action`
+    void park_(Mutex *guard); // switches to the carrier, which unlocks `guard` afterwards
+
+    size_t          stacksize_;
+    _FiberContext  *context_;
+    FiberScheduler *scheduler_;
+    long            sleepfor_;
+};
+
+/**
+ * @brief The FiberScheduler class -- runs the fibers on a fixed set of carrier threads
+ */
+class FiberScheduler
+{
+public:
+    explicit FiberScheduler(unsigned int carriers=0); // 0 means Thread::hardwareConcurrency()
+    explicit FiberScheduler(FiberScheduler &ref); // cannot copy
+    ~FiberScheduler(); // calls shutdown()
+
+    void spawn(Fiber *fiber); // takes the ownership of `fiber`
+    void join();              // blocks until all the spawned fibers have finished
+    void shutdown();          // join()s, and then stops the carriers
+
+    size_t live();            // the number of fibers spawned and not finished yet
+
+private:
+    friend class Fiber;
+    friend class _Carrier;
+    friend class _FiberWakeup;
+    friend class FiberMutex;
+    friend class FiberCondition;
+
+    void   ready_(Fiber *fiber); // makes `fiber` runnable
+    Fiber *next_();              // blocks for the next runnable fiber; 0 upon shutdown
+    void   finished_(Fiber *fiber);
+
+    void  *allocStack_(size_t size);
+    void   freeStack_(void *stack, size_t size);
+
+    Mutex                    lock_;
+    Semaphore                runnable_;
+    std::deque<Fiber *>      queue_;
+    std::vector<_Carrier *>  carriers_;
+    std::vector<void *>      stacks_;   // the cache of the default-sized stacks
+    Condition                idle_;
+    size_t                   live_;
+    bool                     stopping_;
+    TimerScheduler          *timers_;
+};
+
+/**
+ * @brief The FiberMutex class -- a mutex that parks the waiting fiber instead of its carrier.
+ * it must be used from within fibers.
+ */
+class FiberMutex
+{
+public:
+    FiberMutex();
+    explicit FiberMutex(FiberMutex &ref); // cannot copy
+
+    void lock();
+    bool tryLock();
+    void unlock();
+
+private:
+    Mutex               guard_;
+    bool                locked_;
+    std::deque<Fiber *> waiters_;
+};
+
+/**
+ * @brief The FiberCondition class -- a condition variable for fibers, used along with a FiberMutex
+ */
+class FiberCondition
+{
+public:
+    FiberCondition();
+    explicit FiberCondition(FiberCondition &ref); // cannot copy
+
+    void wait(FiberMutex &mutex); // `mutex` must be locked by the calling fiber
+    void notify();
+    void notifyAll();
+
+private:
+    Mutex               guard_;
+    std::deque<Fiber *> waiters_;
+};
+
+}
+
+#endif // __KS_FIBER_H__
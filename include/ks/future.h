@@ -0,0 +1,613 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   future.h -- Future/Promise pairs carrying a ks::Result<T>
+*
+*   a Future is a cheap, copyable handle to a value that a Promise will set
+*   at some point. waiting on a Future sleeps on a Latch, and never holds
+*   a mutex while doing so.
+*
+*   continuations and async() take a functor object `F` (C++03 has no lambdas):
+*
+*       struct Parse {
+*           typedef int result_type;
+*           ks::Result<int> operator()(ks::Result<std::vector<char> > &input) { ... }
+*       };
+*
+*   the result_type typedef names the value type of the resulting Future.
+*   for async(), operator() takes no argument.
+*/
+#ifndef __KS_FUTURE_H__
+#define __KS_FUTURE_H__
+
+#include <stdexcept>
+#include <vector>
+#include <string>
+#include "ks/thread.h"
+#include "ks/sync.h"
+#include "ks/executor.h"
+#include "ks/utils.h"
+#include "ks/log.h"
+
+namespace ks {
+
+template <typename T> class Future;
+template <typename T> class Promise;
+
+/**
+ * @brief The _FutureCallback class -- gets fired once when the associated future becomes ready.
+ * fire() is responsible for disposing the callback object.
+ */
+class _FutureCallback
+{
+public:
+    virtual ~_FutureCallback() {}
+    virtual void fire()=0;
+};
+
+/**
+ * @brief The _FutureState class -- the reference-counted state shared between a Promise and its Futures
+ */
+template <typename T>
+class _FutureState
+{
+public:
+    _FutureState(): refs_(1), result_(0), ready_(1) {}
+
+    ~_FutureState()
+    {
+        for( typename std::vector<_FutureCallback *>::iterator it=callbacks_.begin(); it!=callbacks_.end(); ++it ){
+            delete *it;
+        }
+        delete result_;
+    }
+
+    void acquire()
+    {
+        lock_.lock();
+        refs_++;
+        lock_.unlock();
+    }
+
+    void release()
+    {
+        lock_.lock();
+        int refs = --refs_;
+        lock_.unlock();
+        if( refs == 0 ){
+            delete this;
+        }
+    }
+
+    /**
+    *   sets the result and fires the callbacks.
+    *   returns false if the result had already been set.
+    */
+    bool complete(const Result<T> &result)
+    {
+        if( ready() ){
+            return false; // e.g. the Promise is destroyed after set()
+        }
+        return complete_(new Result<T>(result));
+    }
+
+#ifdef KS_HAS_CXX11
+    bool complete(Result<T> &&result)
+    {
+        if( ready() ){
+            return false;
+        }
+        return complete_(new Result<T>(std::move(result)));
+    }
+#endif
+
+    /**
+    *   registers the callback; it is fired immediately if the result is already there.
+    */
+    void addCallback(_FutureCallback *callback)
+    {
+        lock_.lock();
+        if( result_ == 0 ){
+            callbacks_.push_back(callback);
+            lock_.unlock();
+        } else {
+            lock_.unlock();
+            callback->fire();
+        }
+    }
+
+    bool ready()                     { return ready_.tryWait(); }
+    bool wait(long timeout_msec=-1)  { return ready_.wait(timeout_msec); }
+
+    /**
+    *   the result is immutable once ready, so it can be read without the lock
+    */
+    Result<T> &result()
+    {
+        ready_.wait();
+        return *result_;
+    }
+
+private:
+    explicit _FutureState(_FutureState &ref); // cannot copy
+
+    bool complete_(Result<T> *result) // takes over `result`
+    {
+        std::vector<_FutureCallback *> callbacks;
+        lock_.lock();
+        if( result_ != 0 ){
+            lock_.unlock();
+            delete result;
+            return false;
+        }
+        result_ = result;
+        callbacks.swap(callbacks_);
+        lock_.unlock();
+
+        ready_.countDown();
+        // a failing callback (e.g. its executor has been shut down) must not keep the others from firing,
+        // nor escape from ~Promise()
+        for( typename std::vector<_FutureCallback *>::iterator it=callbacks.begin(); it!=callbacks.end(); ++it ){
+            try {
+                (*it)->fire();
+            } catch(std::exception &e) {
+                ks::logger::error("ks::Future") << "a callback threw an exception: " << e.what() << ks::endl;
+            }
+        }
+        return true;
+    }
+
+    Mutex                          lock_;
+    int                            refs_;
+    Result<T>                     *result_;
+    Latch                          ready_;
+    std::vector<_FutureCallback *> callbacks_;
+};
+
+/**
+ * @brief The Future class -- a handle to a value that becomes available later
+ */
+template <typename T>
+class Future
+{
+public:
+    Future(): state_(0) {}
+
+    Future(const Future<T> &other): state_(other.state_)
+    {
+        if( state_ != 0 ){
+            state_->acquire();
+        }
+    }
+
+    Future<T> &operator=(const Future<T> &other)
+    {
+        if( other.state_ != 0 ){
+            other.state_->acquire();
+        }
+        if( state_ != 0 ){
+            state_->release();
+        }
+        state_ = other.state_;
+        return *this;
+    }
+
+#ifdef KS_HAS_CXX11
+    Future(Future<T> &&other) noexcept: state_(other.state_)
+    {
+        other.state_ = 0;
+    }
+
+    Future<T> &operator=(Future<T> &&other) noexcept
+    {
+        if( this != &other ){
+            if( state_ != 0 ){
+                state_->release();
+            }
+            state_ = other.state_;
+            other.state_ = 0;
+        }
+        return *this;
+    }
+#endif
+
+    ~Future()
+    {
+        if( state_ != 0 ){
+            state_->release();
+        }
+    }
+
+    bool valid() const { return (state_ != 0); }
+    bool ready() const { return (state_ != 0) && state_->ready(); }
+
+    /**
+    *   blocks until the future becomes ready. true if ready within the timeout.
+    */
+    bool wait(long timeout_msec=-1) const
+    {
+        checkValid();
+        return state_->wait(timeout_msec);
+    }
+
+    /**
+    *   blocks until the future becomes ready, and returns the result.
+    */
+    Result<T> get() const
+    {
+        checkValid();
+        return state_->result();
+    }
+
+    /**
+    *   runs `func` on `executor` once this future is ready, with the result as its argument.
+    *   the returned future is failed if `func` throws a std::exception.
+    *   `executor` may be 0, in which case `func` runs on the completing thread.
+    */
+    template <typename F>
+    Future<typename F::result_type> then(Executor *executor, F func) const;
+
+    /**
+    *   returns a future that is ready from the beginning
+    */
+    static Future<T> makeReady(const Result<T> &result)
+    {
+        _FutureState<T> *state = new _FutureState<T>();
+        state->complete(result);
+        return Future<T>(state);
+    }
+
+    _FutureState<T> *state() const { return state_; } // for the combinators
+
+private:
+    explicit Future(_FutureState<T> *state): state_(state) {} // takes over the reference
+
+    void checkValid() const
+    {
+        if( state_ == 0 ){
+            throw std::runtime_error("operation on an invalid Future");
+        }
+    }
+
+    _FutureState<T> *state_;
+
+    friend class Promise<T>;
+};
+
+/**
+ * @brief The Promise class -- the writing end of a Future.
+ * if a Promise is destroyed without setting a result, its Future fails with "broken promise".
+ */
+template <typename T>
+class Promise
+{
+public:
+    Promise(): state_(new _FutureState<T>()) {}
+
+    ~Promise()
+    {
+        state_->complete(Result<T>::failure("broken promise"));
+        state_->release();
+    }
+
+    Future<T> future()
+    {
+        state_->acquire();
+        return Future<T>(state_);
+    }
+
+    // the following return false if a result has already been set
+    bool set(const Result<T> &result)       { return state_->complete(result); }
+    bool setValue(const T &value)           { return state_->complete(Result<T>::success(value)); }
+    bool setError(const std::string &msg)   { return state_->complete(Result<T>::failure(msg)); }
+#ifdef KS_HAS_CXX11
+    bool set(Result<T> &&result)            { return state_->complete(std::move(result)); }
+    bool setValue(T &&value)                { return state_->complete(Result<T>::success(std::move(value))); }
+    bool setError(std::string &&msg)        { return state_->complete(Result<T>::failure(std::move(msg))); }
+#endif
+
+private:
+    explicit Promise(Promise &ref); // cannot copy
+    Promise &operator=(const Promise &ref);
+
+    _FutureState<T> *state_;
+};
+
+/**
+ * the task run by Future::then(): it waits as a callback, then runs as a Task
+ */
+template <typename T, typename F>
+class _ThenTask: public Task, public _FutureCallback
+{
+public:
+    typedef typename F::result_type R;
+
+    _ThenTask(_FutureState<T> *input, Executor *executor, F func):
+        Task(), input_(input), executor_(executor), func_(func), output_()
+    {
+        input_->acquire();
+    }
+
+    virtual ~_ThenTask()
+    {
+        input_->release();
+    }
+
+    virtual void fire()
+    {
+        if( executor_ == 0 ){
+            InlineExecutor::instance()->execute(this);
+        } else {
+            executor_->execute(this);
+        }
+    }
+
+    virtual void run()
+    {
+        try {
+            output_.set(func_(input_->result()));
+        } catch(std::exception &e) {
+            output_.setError(e.what());
+        }
+    }
+
+    Future<R> future() { return output_.future(); }
+
+private:
+    _FutureState<T> *input_;
+    Executor        *executor_;
+    F                func_;
+    Promise<R>       output_;
+};
+
+template <typename T>
+template <typename F>
+Future<typename F::result_type> Future<T>::then(Executor *executor, F func) const
+{
+    checkValid();
+    _ThenTask<T, F> *task = new _ThenTask<T, F>(state_, executor, func);
+    Future<typename F::result_type> ret = task->future();
+    state_->addCallback(task);
+    return ret;
+}
+
+/**
+ * the task run by async()
+ */
+template <typename F>
+class _AsyncTask: public Task
+{
+public:
+    typedef typename F::result_type R;
+
+    explicit _AsyncTask(F func): Task(), func_(func), output_() {}
+
+    virtual void run()
+    {
+        try {
+            output_.set(func_());
+        } catch(std::exception &e) {
+            output_.setError(e.what());
+        }
+    }
+
+    Future<R> future() { return output_.future(); }
+
+private:
+    F          func_;
+    Promise<R> output_;
+};
+
+/**
+ * runs `func` on `executor` (the global ThreadPool if 0), and returns the future for its result
+ */
+template <typename F>
+Future<typename F::result_type> async(Executor *executor, F func)
+{
+    _AsyncTask<F> *task = new _AsyncTask<F>(func);
+    Future<typename F::result_type> ret = task->future();
+    if( executor == 0 ){
+        executor = ThreadPool::global();
+    }
+    executor->execute(task);
+    return ret;
+}
+
+/**
+ * the shared aggregation for when_all()
+ */
+template <typename T>
+class _WhenAll
+{
+public:
+    explicit _WhenAll(const std::vector<Future<T> > &inputs):
+        inputs_(inputs), refs_(1), remaining_(static_cast<int>(inputs.size())) {}
+
+    /**
+    *   holds a reference to the aggregation, so that it is released
+    *   even if the callback is disposed of without being fired
+    */
+    class Callback: public _FutureCallback
+    {
+    public:
+        explicit Callback(_WhenAll<T> *parent): parent_(parent) { parent_->acquire(); }
+        virtual ~Callback() { parent_->release(); }
+        virtual void fire()
+        {
+            parent_->arrive();
+            delete this;
+        }
+    private:
+        _WhenAll<T> *parent_;
+    };
+
+    void acquire()
+    {
+        lock_.lock();
+        refs_++;
+        lock_.unlock();
+    }
+
+    void release()
+    {
+        lock_.lock();
+        int refs = --refs_;
+        lock_.unlock();
+        if( refs == 0 ){
+            delete this;
+        }
+    }
+
+    void arrive()
+    {
+        lock_.lock();
+        int remaining = --remaining_;
+        lock_.unlock();
+        if( remaining > 0 ){
+            return;
+        }
+
+        std::vector<T> values;
+        values.reserve(inputs_.size());
+        for( typename std::vector<Future<T> >::iterator it=inputs_.begin(); it!=inputs_.end(); ++it ){
+            Result<T> &r = it->state()->result();
+            if( r.failed() ){
+                output_.setError(r.what());
+                return;
+            }
+            values.push_back(r.get());
+        }
+        output_.setValue(values);
+    }
+
+    Future<std::vector<T> > future() { return output_.future(); }
+
+private:
+    std::vector<Future<T> >    inputs_;
+    Mutex                      lock_;
+    int                        refs_;
+    int                        remaining_;
+    Promise<std::vector<T> >   output_;
+};
+
+/**
+ * returns a future that becomes ready when all the `inputs` are ready.
+ * it fails with the message of the first failed input (in the order of `inputs`).
+ */
+template <typename T>
+Future<std::vector<T> > when_all(const std::vector<Future<T> > &inputs)
+{
+    if( inputs.empty() ){
+        return Future<std::vector<T> >::makeReady(Result<std::vector<T> >::success(std::vector<T>()));
+    }
+    _WhenAll<T> *agg = new _WhenAll<T>(inputs);
+    Future<std::vector<T> > ret = agg->future();
+    for( typename std::vector<Future<T> >::const_iterator it=inputs.begin(); it!=inputs.end(); ++it ){
+        it->state()->addCallback(new typename _WhenAll<T>::Callback(agg));
+    }
+    agg->release();
+    return ret;
+}
+
+/**
+ * the shared aggregation for when_any()
+ */
+template <typename T>
+class _WhenAny
+{
+public:
+    _WhenAny(): refs_(1) {}
+
+    /**
+    *   holds a reference to the aggregation (see _WhenAll)
+    */
+    class Callback: public _FutureCallback
+    {
+    public:
+        Callback(_WhenAny<T> *parent, size_t index): parent_(parent), index_(index) { parent_->acquire(); }
+        virtual ~Callback() { parent_->release(); }
+        virtual void fire()
+        {
+            parent_->arrive(index_);
+            delete this;
+        }
+    private:
+        _WhenAny<T> *parent_;
+        size_t       index_;
+    };
+
+    void arrive(size_t index)
+    {
+        output_.setValue(index); // only the first one succeeds
+    }
+
+    void acquire()
+    {
+        lock_.lock();
+        refs_++;
+        lock_.unlock();
+    }
+
+    void release()
+    {
+        lock_.lock();
+        int refs = --refs_;
+        lock_.unlock();
+        if( refs == 0 ){
+            delete this;
+        }
+    }
+
+    Future<size_t> future() { return output_.future(); }
+
+private:
+    Mutex           lock_;
+    int             refs_;
+    Promise<size_t> output_;
+};
+
+/**
+ * returns a future for the index of the first of `inputs` to become ready.
+ * it fails immediately if `inputs` is empty.
+ */
+template <typename T>
+Future<size_t> when_any(const std::vector<Future<T> > &inputs)
+{
+    if( inputs.empty() ){
+        return Future<size_t>::makeReady(Result<size_t>::failure("when_any() called with no futures"));
+    }
+    _WhenAny<T> *agg = new _WhenAny<T>();
+    Future<size_t> ret = agg->future();
+    for( size_t i=0; i<inputs.size(); i++ ){
+        inputs[i].state()->addCallback(new typename _WhenAny<T>::Callback(agg, i));
+    }
+    agg->release();
+    return ret;
+}
+
+}
+
+#endif // __KS_FUTURE_H__
@@ -0,0 +1,561 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   hashmap.h -- an open-addressing hash map for the registries keyed by ids
+*
+*   FlatHashMap follows the design of the SwissTable: the slots are in one flat array,
+*   and a parallel array of control bytes keeps, for every slot, either 'empty', 'deleted'
+*   or the low 7 bits of the hash of its key. a lookup loads a group of 16 control bytes
+*   at a time and compares them with the 7 bits at once (with SSE2, or in two 64-bit words),
+*   so that the keys are compared only for the few slots that match, typically once.
+*
+*   the API is the subset of std::map that the library uses (find(), operator[], insert(),
+*   erase(), iteration, ...), so that a std::map can be replaced in place; the iteration
+*   order is not sorted, and any insertion may invalidate the iterators (an erase() does not).
+*/
+#ifndef __KS_HASHMAP_H__
+#define __KS_HASHMAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include "ks/compat.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define KS_HASHMAP_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace ks {
+
+const size_t HASHMAP_GROUP_SIZE = 16;
+const int8_t HASHMAP_EMPTY      = -128;
+const int8_t HASHMAP_DELETED    = -2;
+
+/**
+ * the finalizer of MurmurHash3: spreads the bits of the ids that are aligned addresses (e.g. pthread_t)
+ */
+inline uint64_t hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * the default hash functions: for the integers and the enums, the pointers and std::string.
+ * the other keys need a hash function of their own.
+ */
+template <typename K>
+struct FlatHash
+{
+    uint64_t operator()(const K &key) const { return hash_mix(static_cast<uint64_t>(key)); }
+};
+
+template <typename T>
+struct FlatHash<T *>
+{
+    uint64_t operator()(T *key) const { return hash_mix(static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key))); }
+};
+
+template <>
+struct FlatHash<std::string>
+{
+    uint64_t operator()(const std::string &key) const
+    {
+        // FNV-1a
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for( size_t i=0; i<key.size(); i++ ){
+            h ^= static_cast<unsigned char>(key[i]);
+            h *= 0x100000001b3ULL;
+        }
+        return hash_mix(h);
+    }
+};
+
+inline unsigned int hashmap_ctz(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return static_cast<unsigned int>(idx);
+#else
+    return static_cast<unsigned int>(__builtin_ctz(mask));
+#endif
+}
+
+/**
+ * a group of HASHMAP_GROUP_SIZE control bytes: each match returns the bitmask of the slots in question
+ */
+class _HashGroup
+{
+public:
+    explicit _HashGroup(const int8_t *ctrl): ctrl_(ctrl) {}
+
+    uint32_t match(int8_t h2) const
+    {
+#ifdef KS_HASHMAP_SSE2
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl_));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), group)));
+#else
+        // may report a false match next to a true one, which the key comparison rejects
+        const uint64_t pattern = HASHMAP_LSBS * static_cast<uint8_t>(h2);
+        uint64_t lo = word_(0) ^ pattern, hi = word_(1) ^ pattern;
+        return bits_((lo - HASHMAP_LSBS) & ~lo & HASHMAP_MSBS) | (bits_((hi - HASHMAP_LSBS) & ~hi & HASHMAP_MSBS) << 8);
+#endif
+    }
+
+    uint32_t matchEmpty() const
+    {
+#ifdef KS_HASHMAP_SSE2
+        return match(HASHMAP_EMPTY);
+#else
+        // only EMPTY has the highest bit set and the second lowest bit cleared
+        uint64_t lo = word_(0), hi = word_(1);
+        return bits_(lo & (~lo << 6) & HASHMAP_MSBS) | (bits_(hi & (~hi << 6) & HASHMAP_MSBS) << 8);
+#endif
+    }
+
+    uint32_t matchFree() const // empty or deleted
+    {
+#ifdef KS_HASHMAP_SSE2
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl_));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), group)));
+#else
+        // EMPTY and DELETED have the highest bit set and the lowest bit cleared
+        uint64_t lo = word_(0), hi = word_(1);
+        return bits_(lo & ~(lo << 7) & HASHMAP_MSBS) | (bits_(hi & ~(hi << 7) & HASHMAP_MSBS) << 8);
+#endif
+    }
+
+private:
+#ifndef KS_HASHMAP_SSE2
+    static const uint64_t HASHMAP_LSBS = 0x0101010101010101ULL;
+    static const uint64_t HASHMAP_MSBS = 0x8080808080808080ULL;
+
+    uint64_t word_(size_t half) const
+    {
+        uint64_t word;
+        memcpy(&word, ctrl_ + half * 8, sizeof(word));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        word = __builtin_bswap64(word);
+#endif
+        return word;
+    }
+
+    // the highest bits of the 8 bytes into the 8 lowest bits
+    static uint32_t bits_(uint64_t msbs) { return static_cast<uint32_t>(((msbs >> 7) * 0x0102040810204080ULL) >> 56); }
+#endif
+
+    const int8_t *ctrl_;
+};
+
+/**
+ * the iterator of FlatHashMap (Slot is the value_type, or the const value_type for a const_iterator)
+ */
+template <typename Slot>
+class _HashMapIterator
+{
+public:
+    _HashMapIterator(): ctrl_(0), slots_(0), index_(0), capacity_(0) {}
+    _HashMapIterator(const int8_t *ctrl, Slot *slots, size_t index, size_t capacity):
+        ctrl_(ctrl), slots_(slots), index_(index), capacity_(capacity) { skip_(); }
+
+    // iterator to const_iterator
+    template <typename Other>
+    _HashMapIterator(const _HashMapIterator<Other> &other):
+        ctrl_(other.ctrl()), slots_(other.slots()), index_(other.index()), capacity_(other.capacity()) {}
+
+    Slot &operator*() const { return slots_[index_]; }
+    Slot *operator->() const { return slots_ + index_; }
+
+    _HashMapIterator &operator++()
+    {
+        index_++;
+        skip_();
+        return *this;
+    }
+
+    _HashMapIterator operator++(int)
+    {
+        _HashMapIterator previous(*this);
+        ++(*this);
+        return previous;
+    }
+
+    bool operator==(const _HashMapIterator &other) const { return index_ == other.index_; }
+    bool operator!=(const _HashMapIterator &other) const { return index_ != other.index_; }
+
+    const int8_t *ctrl() const { return ctrl_; }
+    Slot         *slots() const { return slots_; }
+    size_t        index() const { return index_; }
+    size_t        capacity() const { return capacity_; }
+
+private:
+    void skip_() // to the next full slot (or the end)
+    {
+        while( (index_ < capacity_) && (ctrl_[index_] < 0) ){
+            index_++;
+        }
+    }
+
+    const int8_t *ctrl_;
+    Slot         *slots_;
+    size_t        index_;
+    size_t        capacity_;
+};
+
+/**
+ * @brief The FlatHashMap class -- an open-addressing hash map with SwissTable-style group probing.
+ *
+ * the table holds at most 7/8 of its capacity (a power of two, in groups of HASHMAP_GROUP_SIZE),
+ * and the groups are probed triangularly from the one that the hash selects.
+ * the keys and the values must be copy-constructible (they are copied, or moved in the C++11 build, when the table grows).
+ */
+template <typename K, typename V, typename Hash=FlatHash<K> >
+class FlatHashMap
+{
+public:
+    typedef K                                   key_type;
+    typedef V                                   mapped_type;
+    typedef std::pair<const K, V>               value_type;
+    typedef size_t                              size_type;
+    typedef _HashMapIterator<value_type>        iterator;
+    typedef _HashMapIterator<const value_type>  const_iterator;
+
+    FlatHashMap(): ctrl_(0), slots_(0), capacity_(0), size_(0), growth_(0), hash_() {}
+
+    FlatHashMap(const FlatHashMap &other): ctrl_(0), slots_(0), capacity_(0), size_(0), growth_(0), hash_(other.hash_)
+    {
+        copy_(other);
+    }
+
+    FlatHashMap &operator=(const FlatHashMap &other)
+    {
+        if( this != &other ){
+            FlatHashMap copy(other);
+            swap(copy);
+        }
+        return *this;
+    }
+
+#ifdef KS_HAS_CXX11
+    FlatHashMap(FlatHashMap &&other) noexcept: ctrl_(0), slots_(0), capacity_(0), size_(0), growth_(0), hash_(other.hash_)
+    {
+        swap(other);
+    }
+
+    FlatHashMap &operator=(FlatHashMap &&other) noexcept
+    {
+        FlatHashMap moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+#endif
+
+    ~FlatHashMap() { destroy_(); }
+
+    iterator       begin() { return iterator(ctrl_, slots_, 0, capacity_); }
+    iterator       end() { return iterator(ctrl_, slots_, capacity_, capacity_); }
+    const_iterator begin() const { return const_iterator(ctrl_, slots_, 0, capacity_); }
+    const_iterator end() const { return const_iterator(ctrl_, slots_, capacity_, capacity_); }
+
+    bool      empty() const { return size_ == 0; }
+    size_type size() const { return size_; }
+    size_type capacity() const { return capacity_; }
+
+    iterator find(const K &key)
+    {
+        size_t idx = find_(key, hash_(key));
+        return (idx == capacity_)? end(): iterator(ctrl_, slots_, idx, capacity_);
+    }
+
+    const_iterator find(const K &key) const
+    {
+        size_t idx = find_(key, hash_(key));
+        return (idx == capacity_)? end(): const_iterator(ctrl_, slots_, idx, capacity_);
+    }
+
+    size_type count(const K &key) const { return (find_(key, hash_(key)) == capacity_)? 0: 1; }
+
+    V &operator[](const K &key)
+    {
+        uint64_t hash = hash_(key);
+        size_t   idx  = find_(key, hash);
+        if( idx == capacity_ ){
+            idx = prepareInsert_(hash);
+            new (slots_ + idx) value_type(key, V());
+            commit_(idx, hash);
+        }
+        return slots_[idx].second;
+    }
+
+    std::pair<iterator, bool> insert(const value_type &value)
+    {
+        uint64_t hash = hash_(value.first);
+        size_t   idx  = find_(value.first, hash);
+        if( idx != capacity_ ){
+            return std::make_pair(iterator(ctrl_, slots_, idx, capacity_), false);
+        }
+        idx = prepareInsert_(hash);
+        new (slots_ + idx) value_type(value);
+        commit_(idx, hash);
+        return std::make_pair(iterator(ctrl_, slots_, idx, capacity_), true);
+    }
+
+    size_type erase(const K &key)
+    {
+        size_t idx = find_(key, hash_(key));
+        if( idx == capacity_ ){
+            return 0;
+        }
+        erase_(idx);
+        return 1;
+    }
+
+    void erase(iterator it) { erase_(it.index()); }
+
+    void clear()
+    {
+        for( size_t i=0; i<capacity_; i++ ){
+            if( ctrl_[i] >= 0 ){
+                slots_[i].~value_type();
+            }
+        }
+        if( capacity_ > 0 ){
+            memset(ctrl_, HASHMAP_EMPTY, capacity_);
+        }
+        size_   = 0;
+        growth_ = maxLoad_(capacity_);
+    }
+
+    /**
+    *   makes room for `n` elements without growing
+    */
+    void reserve(size_type n)
+    {
+        size_t capacity = (capacity_ > 0)? capacity_: HASHMAP_GROUP_SIZE;
+        while( maxLoad_(capacity) < n ){
+            capacity *= 2;
+        }
+        if( capacity > capacity_ ){
+            rehash_(capacity);
+        }
+    }
+
+    void swap(FlatHashMap &other) KS_NOEXCEPT
+    {
+        std::swap(ctrl_, other.ctrl_);
+        std::swap(slots_, other.slots_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(size_, other.size_);
+        std::swap(growth_, other.growth_);
+        std::swap(hash_, other.hash_);
+    }
+
+private:
+    static size_t  maxLoad_(size_t capacity) { return capacity - capacity / 8; }
+    static int8_t  h2_(uint64_t hash) { return static_cast<int8_t>(hash & 0x7F); }
+    size_t         groupMask_() const { return capacity_ / HASHMAP_GROUP_SIZE - 1; }
+    size_t         firstGroup_(uint64_t hash) const { return static_cast<size_t>(hash >> 7) & groupMask_(); }
+
+    /**
+    *   the index of the key, or capacity_ if it is absent
+    */
+    size_t find_(const K &key, uint64_t hash) const
+    {
+        if( size_ == 0 ){
+            return capacity_;
+        }
+        const int8_t h2    = h2_(hash);
+        const size_t gmask = groupMask_();
+        size_t       g     = firstGroup_(hash);
+        for( size_t step=1; step<=gmask+1; step++ ){
+            _HashGroup group(ctrl_ + g * HASHMAP_GROUP_SIZE);
+            for( uint32_t mask=group.match(h2); mask!=0; mask&=(mask - 1) ){
+                size_t idx = g * HASHMAP_GROUP_SIZE + hashmap_ctz(mask);
+                if( slots_[idx].first == key ){
+                    return idx;
+                }
+            }
+            if( group.matchEmpty() != 0 ){
+                break;
+            }
+            g = (g + step) & gmask;
+        }
+        return capacity_;
+    }
+
+    /**
+    *   the first free slot on the probe sequence of `hash` in a table with room
+    */
+    size_t findFree_(uint64_t hash) const
+    {
+        const size_t gmask = groupMask_();
+        size_t       g     = firstGroup_(hash);
+        for( size_t step=1; ; step++ ){
+            uint32_t mask = _HashGroup(ctrl_ + g * HASHMAP_GROUP_SIZE).matchFree();
+            if( mask != 0 ){
+                return g * HASHMAP_GROUP_SIZE + hashmap_ctz(mask);
+            }
+            g = (g + step) & gmask;
+        }
+    }
+
+    size_t prepareInsert_(uint64_t hash)
+    {
+        if( growth_ == 0 ){
+            // many deleted slots: rehash in place; otherwise grow
+            if( (capacity_ > 0) && (size_ < maxLoad_(capacity_) / 2) ){
+                rehash_(capacity_);
+            } else {
+                rehash_((capacity_ > 0)? (capacity_ * 2): HASHMAP_GROUP_SIZE);
+            }
+        }
+        return findFree_(hash);
+    }
+
+    void commit_(size_t idx, uint64_t hash)
+    {
+        if( ctrl_[idx] == HASHMAP_EMPTY ){
+            growth_--;
+        }
+        ctrl_[idx] = h2_(hash);
+        size_++;
+    }
+
+    void erase_(size_t idx)
+    {
+        slots_[idx].~value_type();
+        size_--;
+        // a probe never passes a group with an empty slot, so the slot can become empty again
+        const int8_t *group = ctrl_ + (idx / HASHMAP_GROUP_SIZE) * HASHMAP_GROUP_SIZE;
+        if( _HashGroup(group).matchEmpty() != 0 ){
+            ctrl_[idx] = HASHMAP_EMPTY;
+            growth_++;
+        } else {
+            ctrl_[idx] = HASHMAP_DELETED;
+        }
+    }
+
+    void allocate_(size_t capacity)
+    {
+        ctrl_     = static_cast<int8_t *>(::operator new(capacity));
+        slots_    = static_cast<value_type *>(::operator new(capacity * sizeof(value_type)));
+        capacity_ = capacity;
+        memset(ctrl_, HASHMAP_EMPTY, capacity);
+    }
+
+    void rehash_(size_t capacity)
+    {
+        int8_t     *oldctrl     = ctrl_;
+        value_type *oldslots    = slots_;
+        size_t      oldcapacity = capacity_;
+
+        allocate_(capacity);
+        for( size_t i=0; i<oldcapacity; i++ ){
+            if( oldctrl[i] >= 0 ){
+                uint64_t hash = hash_(oldslots[i].first);
+                size_t   idx  = findFree_(hash);
+                new (slots_ + idx) value_type(KS_MOVE(oldslots[i]));
+                ctrl_[idx] = h2_(hash);
+                oldslots[i].~value_type();
+            }
+        }
+        growth_ = maxLoad_(capacity) - size_;
+        ::operator delete(oldctrl);
+        ::operator delete(oldslots);
+    }
+
+    void copy_(const FlatHashMap &other)
+    {
+        if( other.capacity_ == 0 ){
+            return;
+        }
+        allocate_(other.capacity_);
+        for( size_t i=0; i<capacity_; i++ ){
+            if( other.ctrl_[i] >= 0 ){
+                new (slots_ + i) value_type(other.slots_[i]);
+                size_++;
+            }
+            ctrl_[i] = other.ctrl_[i];
+        }
+        growth_ = other.growth_;
+    }
+
+    void destroy_()
+    {
+        clear();
+        ::operator delete(ctrl_);
+        ::operator delete(slots_);
+    }
+
+    int8_t     *ctrl_;
+    value_type *slots_;
+    size_t      capacity_;
+    size_t      size_;
+    size_t      growth_;    // the insertions into empty slots before the table must be rehashed
+    Hash        hash_;
+};
+
+/**
+*   the counterparts of clear_byvalue()/clear_bykey() in utils.h for a FlatHashMap:
+*   the map is taken by reference and emptied (swapped out) before the callbacks
+*   are invoked, so that nothing is copied or allocated, and the callbacks may
+*   modify the map (e.g. re-insert into it).
+*/
+template<typename Cls, typename K, typename V, typename H>
+void clear_byvalue(Cls instance, FlatHashMap<K, V, H> &mapobj, void (*finalize_element)(Cls, V))
+{
+    FlatHashMap<K, V, H> entries;
+    entries.swap(mapobj);
+    for( typename FlatHashMap<K, V, H>::iterator it=entries.begin(); it!=entries.end(); ++it ){
+        finalize_element(instance, it->second);
+    }
+}
+
+template<typename Cls, typename K, typename V, typename H>
+void clear_bykey(Cls instance, FlatHashMap<K, V, H> &mapobj, void (*finalize_element)(Cls, K))
+{
+    FlatHashMap<K, V, H> entries;
+    entries.swap(mapobj);
+    for( typename FlatHashMap<K, V, H>::iterator it=entries.begin(); it!=entries.end(); ++it ){
+        finalize_element(instance, it->first);
+    }
+}
+
+}
+
+#endif // __KS_HASHMAP_H__
@@ -0,0 +1,235 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   hdrhistogram.h -- high-dynamic-range histograms for latency percentiles
+*
+*   the values are counted in log-linear buckets: the values below 2^Precision
+*   are counted exactly, and every power-of-two range above it is divided into
+*   2^(Precision-1) buckets, so that the relative error of a reported value is
+*   below 2^-(Precision-1) (e.g. 1.6% with Precision=7, 0.1% with Precision=11)
+*   up to 2^RangeBits - 1 (larger values are counted as 2^RangeBits - 1).
+*
+*   HdrHistogram<> is recorded into concurrently: each thread counts into an instance
+*   of its own without any atomic read-modify-write, and the instances are merged
+*   into an HdrSnapshot on read. unlike ks::averager, nothing is ever reset implicitly.
+*/
+#ifndef __KS_HDRHISTOGRAM_H__
+#define __KS_HDRHISTOGRAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+#include "ks/utils.h"
+
+namespace ks {
+
+inline size_t hdr_bucket_count(unsigned int precision, unsigned int rangebits)
+{
+    return static_cast<size_t>(rangebits - precision + 2) << (precision - 1);
+}
+
+inline uint64_t hdr_max_value(unsigned int rangebits)
+{
+    return (rangebits >= 64)? ~static_cast<uint64_t>(0): ((static_cast<uint64_t>(1) << rangebits) - 1);
+}
+
+inline size_t hdr_index(uint64_t v, unsigned int precision, unsigned int rangebits)
+{
+    if( v > hdr_max_value(rangebits) ){
+        v = hdr_max_value(rangebits);
+    }
+    if( v < (static_cast<uint64_t>(1) << precision) ){
+        return static_cast<size_t>(v);
+    }
+    unsigned int shift = static_cast<unsigned int>(log2_bucket(v)) - precision + 1;
+    return (static_cast<size_t>(shift) << (precision - 1)) + static_cast<size_t>(v >> shift);
+}
+
+/**
+ * the smallest and the largest values counted in the bucket `index`
+ */
+inline uint64_t hdr_lowest_value(size_t index, unsigned int precision)
+{
+    if( index < (static_cast<size_t>(1) << precision) ){
+        return index;
+    }
+    unsigned int shift = static_cast<unsigned int>(index >> (precision - 1)) - 1;
+    uint64_t mantissa = index - (static_cast<size_t>(shift) << (precision - 1));
+    return mantissa << shift;
+}
+
+inline uint64_t hdr_highest_value(size_t index, unsigned int precision)
+{
+    if( index < (static_cast<size_t>(1) << precision) ){
+        return index;
+    }
+    unsigned int shift = static_cast<unsigned int>(index >> (precision - 1)) - 1;
+    uint64_t mantissa = index - (static_cast<size_t>(shift) << (precision - 1));
+    return ((mantissa + 1) << shift) - 1; // wraps around to the maximum for the last bucket of 64 bits
+}
+
+/**
+ * @brief The HdrSnapshot class -- a plain (single-threaded) HDR histogram.
+ * it is what HdrHistogram<> merges into, and the unit of serialization.
+ */
+class HdrSnapshot
+{
+public:
+    explicit HdrSnapshot(unsigned int precision=7, unsigned int rangebits=40); // throws std::runtime_error if invalid (precision up to 14)
+
+    void record(uint64_t v, uint64_t count=1);
+    void merge(const HdrSnapshot &other); // throws std::runtime_error if the layouts differ
+    void clear();
+
+    uint64_t count() const { return total_; }
+    uint64_t min() const { return min_; }     // 0 when empty
+    uint64_t max() const { return max_; }
+    double   mean() const;
+
+    /**
+    *   the value below which the `fraction` (0-1) of the samples fall, e.g. percentile(0.999).
+    *   the value is the highest one of its bucket (capped at max()), i.e. never below the true percentile.
+    */
+    uint64_t percentile(double fraction) const;
+
+    unsigned int precision() const { return precision_; }
+    unsigned int rangeBits() const { return rangebits_; }
+    const std::vector<uint64_t> &counts() const { return counts_; }
+
+    /**
+    *   a compact binary form: the layout, min, max and the non-empty buckets as
+    *   (gap, count) pairs of variable-length integers.
+    */
+    std::string serialize() const;
+    static HdrSnapshot deserialize(const std::string &data); // throws std::runtime_error if malformed
+
+private:
+    friend class _HdrHistogramBase;
+
+    unsigned int          precision_;
+    unsigned int          rangebits_;
+    std::vector<uint64_t> counts_;
+    uint64_t              total_;
+    uint64_t              min_;
+    uint64_t              max_;
+};
+
+/**
+ * @brief The _HdrRecord class -- the counters of one thread.
+ * only the owner thread writes to them, so that the updates need no read-modify-write.
+ */
+class _HdrRecord
+{
+public:
+    explicit _HdrRecord(size_t buckets);
+    ~_HdrRecord();
+
+    void add(atomic<uint64_t> &counter, uint64_t n)
+    {
+        counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    _HdrRecord        *next;    // immutable once published
+    atomic<int>        inuse;
+    ks_thread_id       owner;
+    atomic<uint64_t>  *counts;
+    atomic<uint64_t>   total;
+    atomic<uint64_t>   min;
+    atomic<uint64_t>   max;
+};
+
+/**
+ * @brief The _HdrHistogramBase class -- the per-thread records of an HdrHistogram<>.
+ *
+ * the records are registered to Thread::addExitHandler(), so the histograms must
+ * not be constructed during the static initialization. the record of an exited
+ * ks::Thread is adopted by the next new thread, with its counts kept.
+ */
+class _HdrHistogramBase: public ThreadExitHandler
+{
+public:
+    void snapshot(HdrSnapshot &out) const;
+
+    /**
+    *   clears the counts. the samples recorded concurrently may or may not survive.
+    */
+    void reset();
+
+    virtual void threadExiting(Thread *thread);
+
+protected:
+    _HdrHistogramBase(unsigned int precision, unsigned int rangebits);
+    explicit _HdrHistogramBase(_HdrHistogramBase &ref); // cannot copy
+    virtual ~_HdrHistogramBase();
+
+    _HdrRecord *record_(); // the record of the calling thread
+
+private:
+    const uint64_t        id_;
+    const unsigned int    precision_;
+    const unsigned int    rangebits_;
+    atomic<_HdrRecord *>  records_;
+};
+
+/**
+ * @brief The HdrHistogram class -- a concurrent HDR histogram.
+ *
+ * record() is lock-free; snapshot() merges the threads' counts.
+ */
+template <unsigned int Precision=7, unsigned int RangeBits=40>
+class HdrHistogram: public _HdrHistogramBase
+{
+public:
+    HdrHistogram(): _HdrHistogramBase(Precision, RangeBits) {}
+
+    using _HdrHistogramBase::snapshot;
+
+    void record(uint64_t v)
+    {
+        _HdrRecord *r = record_();
+        r->add(r->counts[hdr_index(v, Precision, RangeBits)], 1);
+        r->add(r->total, 1);
+        if( v < r->min.load(memory_order_relaxed) ){
+            r->min.store(v, memory_order_relaxed);
+        }
+        if( v > r->max.load(memory_order_relaxed) ){
+            r->max.store(v, memory_order_relaxed);
+        }
+    }
+
+    HdrSnapshot snapshot() const
+    {
+        HdrSnapshot out(Precision, RangeBits);
+        _HdrHistogramBase::snapshot(out);
+        return out;
+    }
+};
+
+}
+
+#endif // __KS_HDRHISTOGRAM_H__
@@ -0,0 +1,149 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   lockprofile.h -- opt-in contention profiling for the named Mutex/Condition objects
+*
+*   give a name to the object of interest, e.g. `ks::Mutex queuelock("queue");`,
+*   and call LockProfiler::enable(). objects sharing a name share a record.
+*   unnamed objects, and every object while profiling is disabled, only pay a single branch.
+*/
+#ifndef __KS_LOCKPROFILE_H__
+#define __KS_LOCKPROFILE_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+#include "ks/log.h"
+
+namespace ks {
+
+const int LOCK_HISTOGRAM_BUCKETS = 40; // bucket i counts durations in [2^i, 2^(i+1)) nanosec
+
+/**
+ * @brief The LockStats struct -- a snapshot of the contention of the lock(s) of one name.
+ * all the durations are in nanoseconds.
+ */
+struct LockStats
+{
+    LockStats();
+
+    std::string name;
+    uint64_t    acquisitions;
+    uint64_t    contended;      // acquisitions that had to wait
+    uint64_t    failedTries;    // tryLock() calls that returned false
+    uint64_t    waitTotal;
+    uint64_t    waitMax;
+    uint64_t    holdTotal;
+    uint64_t    holdMax;
+    uint64_t    waitHistogram[LOCK_HISTOGRAM_BUCKETS]; // the contended acquisitions only
+    uint64_t    holdHistogram[LOCK_HISTOGRAM_BUCKETS];
+
+    /**
+    *   the upper bound of the histogram bucket where the `fraction` (0-1) of samples fall in.
+    *   waitPercentile() is over the contended acquisitions (those that had to wait).
+    */
+    uint64_t waitPercentile(double fraction) const;
+    uint64_t holdPercentile(double fraction) const;
+};
+
+/**
+ * @brief The _LockRecord class -- the live counters for one name, updated atomically
+ */
+class _LockRecord
+{
+public:
+    explicit _LockRecord(const std::string &name);
+
+    void acquired(bool contended, uint64_t wait_nsec);
+    void failedTry();
+    void released(uint64_t hold_nsec);
+
+    void snapshot(LockStats &out) const;
+    void reset();
+
+private:
+    std::string       name_;
+    atomic<uint64_t>  acquisitions_;
+    atomic<uint64_t>  contended_;
+    atomic<uint64_t>  failedtries_;
+    atomic<uint64_t>  waittotal_;
+    atomic<uint64_t>  waitmax_;
+    atomic<uint64_t>  holdtotal_;
+    atomic<uint64_t>  holdmax_;
+    atomic<uint64_t>  waithist_[LOCK_HISTOGRAM_BUCKETS];
+    atomic<uint64_t>  holdhist_[LOCK_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * @brief The LockProfiler class -- the global switch and registry of the lock records
+ */
+class LockProfiler
+{
+public:
+    static void enable();
+    static void disable();
+    static bool enabled() { return enabled_.load(memory_order_relaxed); }
+
+    /**
+    *   retrieves the record for `name`, creating one if necessary.
+    *   the record lives until the end of the program.
+    */
+    static _LockRecord *record(const std::string &name);
+
+    static void snapshot(std::vector<LockStats> &out); // sorted by the total wait time, longest first
+    static void reset();
+
+    /**
+    *   writes one line per lock through ks::logger
+    */
+    static void report(LogLevel level=Info);
+
+    static uint64_t now(); // a monotonic clock in nanosec
+
+private:
+    static atomic<bool> enabled_;
+};
+
+/**
+ * @brief The LockProfileReporter class -- a Thread that calls LockProfiler::report() periodically
+ */
+class LockProfileReporter: public PeriodicThread
+{
+public:
+    explicit LockProfileReporter(long interval_msec, LogLevel level=Info);
+
+protected:
+    virtual void tick();
+
+private:
+    LogLevel level_;
+};
+
+}
+
+#endif // __KS_LOCKPROFILE_H__
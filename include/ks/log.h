@@ -30,6 +30,8 @@
 #include <map>
 #include <vector>
 #include "ks/thread.h"
+#include "ks/hashmap.h"
+#include "ks/compat.h"
 
 namespace ks {
 
@@ -48,6 +50,17 @@ enum LogLevel {
 
 class logger;
 
+const int LOG_LEVEL_SLOTS = Error + 1; // indexed by LogLevel
+
+/**
+ * the current loggers of a thread, by their level (or 0)
+ */
+struct _ThreadLoggers
+{
+    _ThreadLoggers();
+    logger *levels[LOG_LEVEL_SLOTS];
+};
+
 class LogHandler
 {
 public:
@@ -83,21 +96,23 @@ class LogService: public LogHandler, public LogHandlerManager
 public:
     LogService();
     ~LogService();
-    logger &get(ks_thread_id id, std::string title, LogLevel level, const bool &autoflush);
+    logger &get(ks_thread_id id, string_ref title, LogLevel level, const bool &autoflush);
     virtual void handleLog(logger *msg);
 
 private:
-    static void dispatch_static(LogService *service, logger *msg);
     static void clean(LogService *service, ks_thread_id id);
 
     void writeTitle(std::ostream &out, const std::string &title) const;
     void writeContent(std::ostream &out, const std::string &text) const;
 
 
+    _ThreadLoggers *loggers_(ks_thread_id id);
+
     virtual void clean(logger *msg);
     void clean(ks_thread_id id);
     void clean();
-    std::map<ks_thread_id, std::map<LogLevel, logger *> > pool_;
+    FlatHashMap<ks_thread_id, _ThreadLoggers *> pool_;     // the entries never move, so that the threads cache them
+    Mutex                                       poollock_; // guards pool_ (get() is called from any thread)
 };
 
 /**
@@ -125,19 +140,25 @@ private:
 class logger
 {
 public:
-    static logger &log(std::string title=std::string(), LogLevel level=Info, const bool &autoflush=true);
-
-    static logger &error(std::string title=std::string(), const bool &autoflush=true);
-    static logger &warning(std::string title=std::string(), const bool &autoflush=true);
-    static logger &info(std::string title=std::string(), const bool &autoflush=true);
-    static logger &fine(std::string title=std::string(), const bool &autoflush=true);
-    static logger &debug(std::string title=std::string(), const bool &autoflush=true);
+    // the title is copied only when a new logger is started (see string_ref in compat.h)
+    static logger &log(string_ref title=string_ref(), LogLevel level=Info, const bool &autoflush=true);
+
+    static logger &error(string_ref title=string_ref(), const bool &autoflush=true);
+    static logger &warning(string_ref title=string_ref(), const bool &autoflush=true);
+    static logger &info(string_ref title=string_ref(), const bool &autoflush=true);
+    static logger &fine(string_ref title=string_ref(), const bool &autoflush=true);
+    static logger &debug(string_ref title=string_ref(), const bool &autoflush=true);
     static void setLoggedLevel(const LogLevel &level);
 
     static void addHandler(LogHandler *handler);
     static void removeHandler(LogHandler *handler);
 
-    logger(ks_thread_id id, std::string title, LogLevel level, const bool &autoflush);
+    logger(ks_thread_id id, string_ref title, LogLevel level, const bool &autoflush);
+
+    // loggers are created and deleted on every message, so they come from a SlabAllocator
+    static void *operator new(size_t size);
+    static void  operator delete(void *ptr, size_t size);
+
     void        dispatch();
     std::stringstream &buffer();
     std::string &title();
@@ -0,0 +1,262 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   metrics.h -- named counters, gauges and histograms, and their periodic reporting
+*
+*   the counters and the histograms are sharded: each thread updates one of METRIC_SHARDS
+*   cache-line padded slots with a relaxed atomic operation, and the slots are merged
+*   when the metric is read. the hot path thus never takes a lock, and the threads
+*   updating the same metric do not share cache lines (as long as there are no more
+*   threads than shards).
+*
+*   the metrics are usually obtained from the registry by name, e.g.
+*
+*       ks::Counter &requests = ks::Metrics::counter("requests");
+*       requests.add();
+*
+*   and reported by a MetricsReporter thread through a MetricsExporter.
+*/
+#ifndef __KS_METRICS_H__
+#define __KS_METRICS_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+#include "ks/log.h"
+
+namespace ks {
+
+const int METRIC_SHARDS            = 16;
+const int METRIC_HISTOGRAM_BUCKETS = 64; // bucket i counts values in [2^i, 2^(i+1)); bucket 0 also counts 0
+
+enum MetricKind {
+    CounterMetric,
+    GaugeMetric,
+    HistogramMetric,
+};
+
+/**
+ * @brief The MetricSample struct -- a snapshot of one metric
+ */
+struct MetricSample
+{
+    MetricSample();
+
+    std::string name;
+    MetricKind  kind;
+    int64_t     value;  // the count of a Counter, the value of a Gauge, the sample count of a Histogram
+    uint64_t    sum;    // Histogram only
+    uint64_t    max;    // Histogram only
+    std::vector<uint64_t> buckets; // Histogram only (METRIC_HISTOGRAM_BUCKETS elements)
+
+    /**
+    *   the upper bound of the histogram bucket where the `fraction` (0-1) of samples fall in
+    */
+    uint64_t percentile(double fraction) const;
+};
+
+/**
+ * @brief The Metric class -- the base class of the metrics
+ */
+class Metric
+{
+public:
+    Metric(const std::string &name, MetricKind kind);
+    explicit Metric(Metric &ref); // cannot copy
+    virtual ~Metric();
+
+    const std::string &name() const { return name_; }
+    MetricKind kind() const { return kind_; }
+
+    virtual void snapshot(MetricSample &out) const=0;
+    virtual void reset()=0;
+
+protected:
+    static int shard(); // the shard index of the calling thread
+
+private:
+    std::string name_;
+    MetricKind  kind_;
+};
+
+/**
+ * @brief The Counter class -- a monotonic event counter
+ */
+class Counter: public Metric
+{
+public:
+    explicit Counter(const std::string &name);
+    ~Counter();
+
+    void add(uint64_t n=1) { shards_[shard()].value.fetch_add(n, memory_order_relaxed); }
+    uint64_t value() const; // merges the shards
+
+    virtual void snapshot(MetricSample &out) const;
+    virtual void reset();
+
+private:
+    cache_padded<atomic<uint64_t> > *shards_;
+};
+
+/**
+ * @brief The Gauge class -- a value that goes up and down (e.g. a queue length).
+ *
+ * a gauge is a single atomic variable, as a set() cannot be sharded.
+ */
+class Gauge: public Metric
+{
+public:
+    explicit Gauge(const std::string &name);
+
+    void set(int64_t v) { value_.store(v, memory_order_relaxed); }
+    void add(int64_t n=1) { value_.fetch_add(n, memory_order_relaxed); }
+    void sub(int64_t n=1) { value_.fetch_sub(n, memory_order_relaxed); }
+    int64_t value() const { return value_.load(memory_order_relaxed); }
+
+    virtual void snapshot(MetricSample &out) const;
+    virtual void reset();
+
+private:
+    atomic<int64_t> value_;
+};
+
+/**
+ * @brief The _HistogramShard struct -- the per-shard counters of a Histogram
+ */
+struct KS_CACHE_ALIGNED _HistogramShard
+{
+    atomic<uint64_t> count;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> max;
+    atomic<uint64_t> buckets[METRIC_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * @brief The Histogram class -- the distribution of values (e.g. latencies in nanosec)
+ * in power-of-two buckets
+ */
+class Histogram: public Metric
+{
+public:
+    explicit Histogram(const std::string &name);
+    ~Histogram();
+
+    void record(uint64_t v);
+
+    virtual void snapshot(MetricSample &out) const;
+    virtual void reset();
+
+private:
+    _HistogramShard *shards_;
+};
+
+/**
+ * @brief The Metrics class -- the registry of the named metrics.
+ *
+ * the metrics are created on their first lookup and live until the end of the program,
+ * so that the references may be cached. looking up an existing name with a different
+ * kind throws std::runtime_error.
+ */
+class Metrics
+{
+public:
+    static Counter   &counter(const std::string &name);
+    static Gauge     &gauge(const std::string &name);
+    static Histogram &histogram(const std::string &name);
+
+    static void snapshot(std::vector<MetricSample> &out); // sorted by name
+    static void reset();
+};
+
+/**
+ * @brief The MetricsExporter class -- the interface for the destinations of the snapshots
+ */
+class MetricsExporter
+{
+public:
+    virtual ~MetricsExporter() {}
+    virtual void exportMetrics(const std::vector<MetricSample> &samples)=0;
+};
+
+/**
+ * @brief The LogMetricsExporter class -- writes one line per metric through ks::logger
+ */
+class LogMetricsExporter: public MetricsExporter
+{
+public:
+    explicit LogMetricsExporter(LogLevel level=Info);
+    virtual void exportMetrics(const std::vector<MetricSample> &samples);
+
+private:
+    LogLevel level_;
+};
+
+/**
+ * @brief The TextMetricsExporter class -- (re-)writes the snapshot to a file in the
+ * Prometheus text exposition format.
+ *
+ * the file is replaced atomically (by renaming a temporary file), so that a scraper
+ * never reads a partial snapshot. the characters that are invalid in a metric name are
+ * replaced with '_'.
+ */
+class TextMetricsExporter: public MetricsExporter
+{
+public:
+    explicit TextMetricsExporter(const std::string &path);
+    virtual void exportMetrics(const std::vector<MetricSample> &samples);
+
+    static std::string format(const std::vector<MetricSample> &samples);
+
+private:
+    std::string path_;
+};
+
+/**
+ * @brief The MetricsReporter class -- a Thread that takes a snapshot of the registry
+ * and hands it to an exporter periodically.
+ *
+ * the exporter is not owned by the reporter; by default (`exporter` = 0),
+ * the snapshots are written through ks::logger at the Info level.
+ */
+class MetricsReporter: public PeriodicThread
+{
+public:
+    explicit MetricsReporter(long interval_msec, MetricsExporter *exporter=0);
+
+protected:
+    virtual void tick();
+    virtual void finish(); // the final values
+
+private:
+    LogMetricsExporter         defaultexporter_;
+    MetricsExporter           *exporter_;
+    std::vector<MetricSample>  samples_;
+};
+
+}
+
+#endif // __KS_METRICS_H__
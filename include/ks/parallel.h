@@ -0,0 +1,337 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   parallel.h -- data-parallel loops, reductions and sorting on a ThreadPool
+*
+*   the work is split into chunks, which are claimed one by one by the calling thread
+*   and by the helper tasks submitted to the pool. the calling thread always takes
+*   part in the work, so the algorithms may be nested or called from the pool workers.
+*
+*   the body functors are copied into the job, and are run concurrently;
+*   if a body throws a std::exception, the algorithm throws a std::runtime_error
+*   with the same message after the other chunks have finished.
+*
+*   `grain` is the number of indices per chunk; 0 lets the algorithm choose.
+*   it is raised if needed, so that there are no more than PARALLEL_MAX_CHUNKS chunks.
+*   `pool` defaults to ThreadPool::global().
+*/
+#ifndef __KS_PARALLEL_H__
+#define __KS_PARALLEL_H__
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+#include "ks/sync.h"
+#include "ks/executor.h"
+
+namespace ks {
+
+const size_t PARALLEL_MAX_CHUNKS = 0x40000000; // the chunks are counted down on a 32-bit Latch
+
+/**
+ * @brief The _ParallelJob class -- the chunk dispenser shared by the caller and the helper tasks.
+ * it is reference-counted, as the helpers may only start running after the work is over.
+ */
+class _ParallelJob
+{
+public:
+    explicit _ParallelJob(size_t chunks);
+    virtual ~_ParallelJob();
+
+    /**
+    *   runs the job on the calling thread and on `pool`, and blocks until all the chunks are done.
+    *   the job must be allocated with `new`; it is released by this call.
+    */
+    static void run(_ParallelJob *job, ThreadPool *pool);
+
+    /**
+    *   the number of chunks to use when `grain` is not specified
+    */
+    static size_t autoChunks(size_t count, ThreadPool *pool);
+
+protected:
+    virtual void runChunk(size_t idx)=0;
+
+private:
+    class Helper: public Task
+    {
+    public:
+        explicit Helper(_ParallelJob *job);
+        virtual ~Helper();
+        virtual void run();
+    private:
+        _ParallelJob *job_;
+    };
+
+    void work();
+    void acquire();
+    void release();
+
+    const size_t    chunks_;
+    atomic<size_t>  next_;
+    atomic<int>     refs_;
+    Latch           done_;
+    Mutex           errlock_;
+    bool            failed_;
+    std::string     error_;
+};
+
+/**
+ * resolves the pool and the chunk size for [first, last)
+ */
+inline size_t _parallel_grain(size_t count, size_t grain, ThreadPool *pool)
+{
+    if( grain == 0 ){
+        size_t chunks = _ParallelJob::autoChunks(count, pool);
+        grain = (count + chunks - 1) / chunks;
+    }
+    size_t mingrain = count / PARALLEL_MAX_CHUNKS + ((count % PARALLEL_MAX_CHUNKS != 0)? 1: 0);
+    return std::max(grain, std::max(mingrain, static_cast<size_t>(1)));
+}
+
+template <typename F>
+class _ParallelRangeJob: public _ParallelJob
+{
+public:
+    _ParallelRangeJob(size_t first, size_t last, size_t grain, F body):
+        _ParallelJob((last - first + grain - 1) / grain),
+        first_(first), last_(last), grain_(grain), body_(body) {}
+
+protected:
+    virtual void runChunk(size_t idx)
+    {
+        size_t lo = first_ + idx * grain_;
+        size_t hi = std::min(lo + grain_, last_);
+        body_(lo, hi);
+    }
+
+private:
+    size_t first_;
+    size_t last_;
+    size_t grain_;
+    F      body_;
+};
+
+/**
+ * calls body(lo, hi) for the consecutive sub-ranges [lo, hi) covering [first, last)
+ */
+template <typename F>
+void parallel_for_range(size_t first, size_t last, F body, size_t grain=0, ThreadPool *pool=0)
+{
+    if( last <= first ){
+        return;
+    }
+    if( pool == 0 ){
+        pool = ThreadPool::global();
+    }
+    grain = _parallel_grain(last - first, grain, pool);
+    if( grain >= last - first ){
+        body(first, last);
+        return;
+    }
+    _ParallelJob::run(new _ParallelRangeJob<F>(first, last, grain, body), pool);
+}
+
+template <typename F>
+class _ForEachIndex
+{
+public:
+    explicit _ForEachIndex(F body): body_(body) {}
+    void operator()(size_t lo, size_t hi)
+    {
+        for( size_t i=lo; i<hi; i++ ){
+            body_(i);
+        }
+    }
+private:
+    F body_;
+};
+
+/**
+ * calls body(i) for every i in [first, last)
+ */
+template <typename F>
+void parallel_for(size_t first, size_t last, F body, size_t grain=0, ThreadPool *pool=0)
+{
+    parallel_for_range(first, last, _ForEachIndex<F>(body), grain, pool);
+}
+
+template <typename T, typename F>
+class _ReduceChunk
+{
+public:
+    _ReduceChunk(std::vector<T> *partials, size_t first, size_t grain, const T &identity, F func):
+        partials_(partials), first_(first), grain_(grain), identity_(identity), func_(func) {}
+    void operator()(size_t lo, size_t hi)
+    {
+        (*partials_)[(lo - first_) / grain_] = func_(lo, hi, identity_);
+    }
+private:
+    std::vector<T> *partials_;
+    size_t          first_;
+    size_t          grain_;
+    T               identity_;
+    F               func_;
+};
+
+/**
+ * reduces [first, last) in parallel:
+ * `func(lo, hi, identity)` returns the partial result of a sub-range, and
+ * `combine(a, b)` merges two partial results. the partial results are
+ * combined in the order of the sub-ranges, so that `combine` needs not be commutative.
+ */
+template <typename T, typename F, typename C>
+T parallel_reduce(size_t first, size_t last, const T &identity, F func, C combine, size_t grain=0, ThreadPool *pool=0)
+{
+    if( last <= first ){
+        return identity;
+    }
+    if( pool == 0 ){
+        pool = ThreadPool::global();
+    }
+    grain = _parallel_grain(last - first, grain, pool);
+    std::vector<T> partials((last - first + grain - 1) / grain, identity);
+    parallel_for_range(first, last, _ReduceChunk<T, F>(&partials, first, grain, identity, func), grain, pool);
+
+    T result = partials[0];
+    for( size_t i=1; i<partials.size(); i++ ){
+        result = combine(result, partials[i]);
+    }
+    return result;
+}
+
+template <typename InputIt, typename OutputIt, typename F>
+class _TransformChunk
+{
+public:
+    _TransformChunk(InputIt input, OutputIt output, F func): input_(input), output_(output), func_(func) {}
+    void operator()(size_t lo, size_t hi)
+    {
+        for( size_t i=lo; i<hi; i++ ){
+            output_[i] = func_(input_[i]);
+        }
+    }
+private:
+    InputIt  input_;
+    OutputIt output_;
+    F        func_;
+};
+
+/**
+ * output[i] = func(first[i]) for every element of [first, last).
+ * both iterators must be random-access. returns the end of the output.
+ */
+template <typename InputIt, typename OutputIt, typename F>
+OutputIt parallel_transform(InputIt first, InputIt last, OutputIt output, F func, size_t grain=0, ThreadPool *pool=0)
+{
+    size_t count = static_cast<size_t>(std::distance(first, last));
+    parallel_for_range(0, count, _TransformChunk<InputIt, OutputIt, F>(first, output, func), grain, pool);
+    return output + count;
+}
+
+template <typename RandomIt, typename Compare>
+class _SortChunk
+{
+public:
+    _SortChunk(RandomIt first, size_t count, size_t width, Compare comp):
+        first_(first), count_(count), width_(width), comp_(comp) {}
+    void operator()(size_t idx)
+    {
+        size_t lo = idx * width_;
+        std::sort(first_ + lo, first_ + std::min(lo + width_, count_), comp_);
+    }
+private:
+    RandomIt first_;
+    size_t   count_;
+    size_t   width_;
+    Compare  comp_;
+};
+
+template <typename RandomIt, typename Compare>
+class _MergeChunk
+{
+public:
+    _MergeChunk(RandomIt first, size_t count, size_t width, Compare comp):
+        first_(first), count_(count), width_(width), comp_(comp) {}
+    void operator()(size_t idx)
+    {
+        size_t lo  = idx * 2 * width_;
+        size_t mid = std::min(lo + width_, count_);
+        size_t hi  = std::min(lo + 2 * width_, count_);
+        if( mid < hi ){
+            std::inplace_merge(first_ + lo, first_ + mid, first_ + hi, comp_);
+        }
+    }
+private:
+    RandomIt first_;
+    size_t   count_;
+    size_t   width_;
+    Compare  comp_;
+};
+
+const size_t PARALLEL_SORT_THRESHOLD = 4096; // below this, parallel_sort() falls back to std::sort()
+
+/**
+ * a parallel merge sort: the runs are sorted in parallel, then merged pairwise in parallel rounds.
+ */
+template <typename RandomIt, typename Compare>
+void parallel_sort(RandomIt first, RandomIt last, Compare comp, ThreadPool *pool=0)
+{
+    size_t count = static_cast<size_t>(std::distance(first, last));
+    if( count < PARALLEL_SORT_THRESHOLD ){
+        std::sort(first, last, comp);
+        return;
+    }
+    if( pool == 0 ){
+        pool = ThreadPool::global();
+    }
+
+    size_t runs  = std::min(_ParallelJob::autoChunks(count, pool), count / (PARALLEL_SORT_THRESHOLD / 4));
+    size_t width = (count + runs - 1) / runs;
+    runs = (count + width - 1) / width;
+    parallel_for(0, runs, _SortChunk<RandomIt, Compare>(first, count, width, comp), 1, pool);
+
+    while( width < count ){
+        size_t pairs = (count + 2 * width - 1) / (2 * width);
+        parallel_for(0, pairs, _MergeChunk<RandomIt, Compare>(first, count, width, comp), 1, pool);
+        width *= 2;
+    }
+}
+
+template <typename RandomIt>
+void parallel_sort(RandomIt first, RandomIt last, ThreadPool *pool=0)
+{
+    parallel_sort(first, last, std::less<typename std::iterator_traits<RandomIt>::value_type>(), pool);
+}
+
+}
+
+#endif // __KS_PARALLEL_H__
@@ -0,0 +1,544 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   pipeline.h -- staged dataflow with bounded queues and backpressure
+*
+*   a Pipeline<T> chains PipelineStage<T> objects. each stage runs on its own worker
+*   thread(s), and takes its input from a BoundedQueue in front of it:
+*
+*       push() --> [queue] stage 1 --> [queue] stage 2 --> ... --> [queue] stage N
+*
+*   a stage receives up to `batch` items at a time and edits the batch in place:
+*   the items left in the batch are forwarded to the next stage (and discarded
+*   after the last one), so that a filter simply erases items, and a transform
+*   modifies them. all the stages share the item type T; use a struct (or a pointer)
+*   that carries the data of every step when the steps produce different types.
+*
+*   what happens when a queue is full is chosen per stage (see Backpressure).
+*   shutdown() closes the first queue; every stage drains its queue before closing
+*   the next one, so that all the items pushed before shutdown() go through.
+*   with more than one thread per stage, the order of the items is not preserved.
+*/
+#ifndef __KS_PIPELINE_H__
+#define __KS_PIPELINE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <stdexcept>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+#include "ks/wait.h"
+#include "ks/metrics.h"
+#include "ks/log.h"
+
+namespace ks {
+
+/**
+ * what a BoundedQueue does when an item is pushed while it is full
+ */
+enum Backpressure {
+    BlockWhenFull,      // the producer waits until there is room
+    DropWhenFull,       // the incoming item is discarded
+    CoalesceWhenFull,   // the incoming item replaces the newest queued one (the latest value wins)
+};
+
+/**
+ * @brief The QueueStats struct -- the counters of a BoundedQueue
+ */
+struct QueueStats
+{
+    QueueStats(): pushed(0), popped(0), dropped(0), coalesced(0), blocked(0),
+        size(0), capacity(0), highWatermark(0) {}
+
+    uint64_t pushed;        // the items accepted (including the coalesced ones)
+    uint64_t popped;
+    uint64_t dropped;
+    uint64_t coalesced;
+    uint64_t blocked;       // the push() calls that had to wait for room
+    size_t   size;          // the occupancy at the time of the snapshot
+    size_t   capacity;
+    size_t   highWatermark; // the largest occupancy so far
+};
+
+/**
+ * @brief The BoundedQueue class -- a multi-producer, multi-consumer queue of a fixed capacity
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity, Backpressure policy=BlockWhenFull):
+        capacity_((capacity == 0)? 1: capacity), policy_(policy), closed_(false),
+        producers_(0), consumers_(0), cond_(), items_(), stats_()
+    {
+        stats_.capacity = capacity_;
+    }
+    explicit BoundedQueue(BoundedQueue &ref); // cannot copy
+
+    /**
+    *   returns false if the item has been dropped, or if the queue has been closed.
+    *   a coalesced item counts as accepted.
+    */
+    bool push(const T &item)
+    {
+        cond_.lock();
+        if( !closed_ && (items_.size() >= capacity_) ){
+            if( policy_ == DropWhenFull ){
+                stats_.dropped++;
+                cond_.unlock();
+                return false;
+            } else if( policy_ == CoalesceWhenFull ){
+                items_.back() = item;
+                stats_.pushed++;
+                stats_.coalesced++;
+                cond_.unlock();
+                return true;
+            }
+            stats_.blocked++;
+            producers_++;
+            while( !closed_ && (items_.size() >= capacity_) ){
+                cond_.wait();
+            }
+            producers_--;
+        }
+        if( closed_ ){
+            cond_.unlock();
+            return false;
+        }
+        items_.push_back(item);
+        stats_.pushed++;
+        if( items_.size() > stats_.highWatermark ){
+            stats_.highWatermark = items_.size();
+        }
+        if( consumers_ > 0 ){
+            cond_.notifyAll();
+        }
+        cond_.unlock();
+        return true;
+    }
+
+    /**
+    *   moves up to `max` items into `out` (which is cleared beforehand), waiting for
+    *   at least one. returns 0 only when the queue has been closed and drained.
+    */
+    size_t popBatch(std::vector<T> &out, size_t max)
+    {
+        out.clear();
+        cond_.lock();
+        consumers_++;
+        while( items_.empty() && !closed_ ){
+            cond_.wait();
+        }
+        consumers_--;
+        bool wasfull = (items_.size() >= capacity_);
+        while( !items_.empty() && (out.size() < max) ){
+            out.push_back(items_.front());
+            items_.pop_front();
+        }
+        stats_.popped += out.size();
+        if( wasfull && (producers_ > 0) && !out.empty() ){
+            cond_.notifyAll();
+        }
+        cond_.unlock();
+        return out.size();
+    }
+
+    /**
+    *   refuses the items pushed afterwards; the queued ones can still be popped
+    */
+    void close()
+    {
+        cond_.lock();
+        closed_ = true;
+        cond_.notifyAll();
+        cond_.unlock();
+    }
+
+    bool closed()
+    {
+        cond_.lock();
+        bool ret = closed_;
+        cond_.unlock();
+        return ret;
+    }
+
+    size_t size()
+    {
+        cond_.lock();
+        size_t ret = items_.size();
+        cond_.unlock();
+        return ret;
+    }
+
+    QueueStats stats()
+    {
+        cond_.lock();
+        QueueStats ret = stats_;
+        ret.size = items_.size();
+        cond_.unlock();
+        return ret;
+    }
+
+private:
+    const size_t       capacity_;
+    const Backpressure policy_;
+    bool               closed_;
+    int                producers_; // waiting for room
+    int                consumers_; // waiting for items
+    Condition          cond_;
+    std::deque<T>      items_;
+    QueueStats         stats_;
+};
+
+/**
+ * @brief The PipelineStage class -- a step of a Pipeline.
+ * you are supposed to inherit this class and override process().
+ */
+template <typename T>
+class PipelineStage
+{
+public:
+    explicit PipelineStage(const std::string &name): name_(name) {}
+    virtual ~PipelineStage() {}
+
+    /**
+    *   processes a batch of items. the items left in `batch` on return are handed
+    *   over to the next stage. called concurrently when the stage has more than one thread.
+    *   an exception thrown here is logged, and the batch is discarded.
+    */
+    virtual void process(std::vector<T> &batch)=0;
+
+    const std::string &name() const { return name_; }
+
+private:
+    std::string name_;
+};
+
+/**
+ * @brief The StageOptions struct -- how a stage is run
+ */
+struct StageOptions
+{
+    explicit StageOptions(unsigned int nthreads=1, size_t qcapacity=1024,
+                          Backpressure policy=BlockWhenFull, size_t maxbatch=1):
+        threads((nthreads == 0)? 1: nthreads), capacity(qcapacity),
+        backpressure(policy), batch((maxbatch == 0)? 1: maxbatch) {}
+
+    unsigned int threads;       // the number of the worker threads
+    size_t       capacity;      // the capacity of the input queue
+    Backpressure backpressure;  // the policy of the input queue
+    size_t       batch;         // the maximum number of items per process() call
+};
+
+/**
+ * @brief The StageStats struct -- a snapshot of a stage
+ */
+struct StageStats
+{
+    StageStats(): name(), batches(0), items(0), errors(0), busyNanos(0), queue(), latency() {}
+
+    std::string  name;
+    uint64_t     batches;   // the process() calls
+    uint64_t     items;     // the items passed to process()
+    uint64_t     errors;    // the process() calls that have thrown
+    uint64_t     busyNanos; // the total time spent in process()
+    QueueStats   queue;     // the input queue
+    MetricSample latency;   // per item, from entering the input queue to the end of process(), in nanosec
+};
+
+/**
+ * @brief The _PipelineItem struct -- an item with the time it has entered the current queue
+ */
+template <typename T>
+struct _PipelineItem
+{
+    _PipelineItem(): item(), stamp(0) {}
+    _PipelineItem(const T &item_, uint64_t stamp_): item(item_), stamp(stamp_) {}
+
+    T        item;
+    uint64_t stamp;
+};
+
+/**
+ * @brief The _PipelineRunner class -- the queue, the threads and the counters of a stage
+ */
+template <typename T>
+class _PipelineRunner
+{
+public:
+    _PipelineRunner(PipelineStage<T> *stage, const StageOptions &options, Flag *drained):
+        stage_(stage), options_(options), queue_(options.capacity, options.backpressure),
+        next_(0), drained_(drained), workers_(), running_(0),
+        batches_(0), items_(0), errors_(0), busy_(0), latency_(stage->name())
+    {}
+    explicit _PipelineRunner(_PipelineRunner &ref); // cannot copy
+
+    ~_PipelineRunner()
+    {
+        for( typename std::vector<Worker *>::iterator it=workers_.begin(); it!=workers_.end(); ++it ){
+            delete *it;
+        }
+        delete stage_;
+    }
+
+    void setNext(_PipelineRunner *next) { next_ = next; }
+
+    bool push(const T &item) { return queue_.push(_PipelineItem<T>(item, wait_now_nsec())); }
+
+    void start()
+    {
+        running_.store(static_cast<int>(options_.threads));
+        for( unsigned int i=0; i<options_.threads; i++ ){
+            Worker *worker = new Worker(this);
+            workers_.push_back(worker);
+            worker->start();
+        }
+    }
+
+    void close() { queue_.close(); }
+
+    void join()
+    {
+        for( typename std::vector<Worker *>::iterator it=workers_.begin(); it!=workers_.end(); ++it ){
+            (*it)->join();
+        }
+    }
+
+    void stats(StageStats &out)
+    {
+        out.name      = stage_->name();
+        out.batches   = batches_.load(memory_order_relaxed);
+        out.items     = items_.load(memory_order_relaxed);
+        out.errors    = errors_.load(memory_order_relaxed);
+        out.busyNanos = busy_.load(memory_order_relaxed);
+        out.queue     = queue_.stats();
+        latency_.snapshot(out.latency);
+    }
+
+private:
+    class Worker: public Thread
+    {
+    public:
+        explicit Worker(_PipelineRunner *runner): Thread(), runner_(runner) {}
+    protected:
+        virtual void run() { runner_->work_(); }
+    private:
+        _PipelineRunner *runner_;
+    };
+
+    void work_()
+    {
+        std::vector<_PipelineItem<T> > entries;
+        std::vector<T>                 batch;
+        while( queue_.popBatch(entries, options_.batch) > 0 ){
+            batch.clear();
+            for( typename std::vector<_PipelineItem<T> >::iterator it=entries.begin(); it!=entries.end(); ++it ){
+                batch.push_back(it->item);
+            }
+
+            uint64_t started = wait_now_nsec();
+            bool ok = true;
+            try {
+                stage_->process(batch);
+            } catch(std::exception &e) {
+                ok = false;
+                ks::logger::error("ks::Pipeline") << stage_->name() << ": " << e.what() << ks::endl;
+            } catch(...) {
+                ok = false;
+                ks::logger::error("ks::Pipeline") << stage_->name() << ": unknown exception" << ks::endl;
+            }
+            uint64_t finished = wait_now_nsec();
+
+            batches_.fetch_add(1, memory_order_relaxed);
+            items_.fetch_add(entries.size(), memory_order_relaxed);
+            busy_.fetch_add(finished - started, memory_order_relaxed);
+            for( typename std::vector<_PipelineItem<T> >::iterator it=entries.begin(); it!=entries.end(); ++it ){
+                latency_.record(finished - it->stamp);
+            }
+
+            if( !ok ){
+                errors_.fetch_add(1, memory_order_relaxed);
+            } else if( next_ != 0 ){
+                for( typename std::vector<T>::iterator it=batch.begin(); it!=batch.end(); ++it ){
+                    next_->push(*it);
+                }
+            }
+        }
+
+        // the last worker to leave hands the end of the stream over to the next stage
+        if( running_.fetch_sub(1, memory_order_acq_rel) == 1 ){
+            if( next_ != 0 ){
+                next_->close();
+            } else {
+                drained_->lock();
+                drained_->set();
+                drained_->unlock();
+            }
+        }
+    }
+
+    PipelineStage<T>                 *stage_;
+    StageOptions                      options_;
+    BoundedQueue<_PipelineItem<T> >   queue_;
+    _PipelineRunner                  *next_;
+    Flag                             *drained_;
+    std::vector<Worker *>             workers_;
+    atomic<int>                       running_;
+    atomic<uint64_t>                  batches_;
+    atomic<uint64_t>                  items_;
+    atomic<uint64_t>                  errors_;
+    atomic<uint64_t>                  busy_;
+    Histogram                         latency_;
+};
+
+/**
+ * @brief The Pipeline class -- a chain of stages
+ */
+template <typename T>
+class Pipeline
+{
+public:
+    explicit Pipeline(const std::string &name="pipeline"):
+        name_(name), runners_(), started_(false), stopped_(false), drained_() {}
+    explicit Pipeline(Pipeline &ref); // cannot copy
+
+    ~Pipeline()
+    {
+        shutdown();
+        for( typename std::vector<_PipelineRunner<T> *>::iterator it=runners_.begin(); it!=runners_.end(); ++it ){
+            delete *it;
+        }
+    }
+
+    /**
+    *   appends a stage; the pipeline takes the ownership of `stage`.
+    *   throws std::runtime_error after start().
+    */
+    void addStage(PipelineStage<T> *stage, const StageOptions &options=StageOptions())
+    {
+        if( started_ ){
+            delete stage;
+            ks::logger::error("ks::Pipeline") << name_ << ": cannot add a stage after start()" << ks::endl;
+            throw std::runtime_error("cannot add a stage after start()");
+        }
+        _PipelineRunner<T> *runner = new _PipelineRunner<T>(stage, options, &drained_);
+        if( !runners_.empty() ){
+            runners_.back()->setNext(runner);
+        }
+        runners_.push_back(runner);
+    }
+
+    void start()
+    {
+        if( started_ ){
+            return;
+        }
+        if( runners_.empty() ){
+            ks::logger::error("ks::Pipeline") << name_ << ": no stages to start" << ks::endl;
+            throw std::runtime_error("no stages to start");
+        }
+        started_ = true;
+        for( typename std::vector<_PipelineRunner<T> *>::iterator it=runners_.begin(); it!=runners_.end(); ++it ){
+            (*it)->start();
+        }
+    }
+
+    /**
+    *   feeds an item to the first stage, following its Backpressure policy.
+    *   returns false if the item has been dropped, or after shutdown().
+    */
+    bool push(const T &item)
+    {
+        return runners_.empty()? false: runners_.front()->push(item);
+    }
+
+    /**
+    *   stops accepting items, lets the stages drain the ones in flight, and joins the threads
+    */
+    void shutdown()
+    {
+        if( stopped_ ){
+            return;
+        }
+        stopped_ = true;
+        if( !started_ ){
+            return;
+        }
+        runners_.front()->close();
+        for( typename std::vector<_PipelineRunner<T> *>::iterator it=runners_.begin(); it!=runners_.end(); ++it ){
+            (*it)->join();
+        }
+    }
+
+    /**
+    *   waits until the last stage has drained after shutdown() (called from another thread).
+    *   returns false on timeout.
+    */
+    bool waitDrained(long timeout_msec=-1)
+    {
+        // one deadline for the whole wait, which the wakeups do not push back
+        const uint64_t million = 1000000;
+        uint64_t deadline = (timeout_msec >= 0)? (wait_now_nsec() + static_cast<uint64_t>(timeout_msec) * million): 0;
+        drained_.lock();
+        while( !drained_.isset() ){
+            long remaining = -1;
+            if( timeout_msec >= 0 ){
+                uint64_t now = wait_now_nsec();
+                if( now >= deadline ){
+                    break;
+                }
+                remaining = static_cast<long>((deadline - now + million - 1) / million);
+            }
+            drained_.wait(remaining);
+        }
+        bool ret = drained_.isset();
+        drained_.unlock();
+        return ret;
+    }
+
+    void stats(std::vector<StageStats> &out)
+    {
+        out.resize(runners_.size());
+        for( size_t i=0; i<runners_.size(); i++ ){
+            runners_[i]->stats(out[i]);
+        }
+    }
+
+    const std::string &name() const { return name_; }
+
+private:
+    std::string                       name_;
+    std::vector<_PipelineRunner<T> *> runners_;
+    bool                              started_;
+    bool                              stopped_;
+    Flag                              drained_;
+};
+
+}
+
+#endif // __KS_PIPELINE_H__
@@ -0,0 +1,209 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   pool.h -- a thread-caching allocator for fixed-size objects
+*
+*   SlabAllocator hands out fixed-size blocks carved from large slabs.
+*   each thread keeps two 'magazines' (small stacks of free blocks), so that
+*   most allocations and frees never touch a lock. when both magazines run
+*   out (or fill up), a whole magazine is exchanged with the shared depot.
+*   a block freed on another thread simply goes into that thread's magazine,
+*   and travels back through the depot.
+*
+*   the slabs are only returned to the system when the allocator is destroyed.
+*   when a ks::Thread exits, its magazines are handed over to the depot.
+*
+*   allocators register themselves to Thread::addExitHandler(), so they must not be
+*   constructed during the static initialization.
+*/
+#ifndef __KS_POOL_H__
+#define __KS_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+
+namespace ks {
+
+const size_t POOL_DEFAULT_MAGAZINE = 64;    // the number of blocks per magazine
+const size_t POOL_SLAB_SIZE        = 1 << 16;
+const size_t POOL_HUGE_SLAB_SIZE   = 1 << 21;
+
+/**
+ * the statistics of a pool.
+ * the per-thread counters are read without synchronization,
+ * so the values are approximate while other threads are allocating.
+ */
+struct PoolStats
+{
+    PoolStats();
+
+    size_t   objectSize;
+    uint64_t allocations;
+    uint64_t deallocations;
+    uint64_t live;          // allocations - deallocations
+    uint64_t cacheHits;     // allocations served from the thread's own magazines
+    uint64_t cacheMisses;
+    uint64_t depotGets;     // full magazines taken from the depot
+    uint64_t depotPuts;     // full magazines returned to the depot
+    size_t   slabs;
+    size_t   bytesReserved;
+    bool     hugePages;     // true if the slabs are mapped with (or advised to use) huge pages
+};
+
+class _PoolMagazine;
+class _PoolRecord;
+
+/**
+ * @brief The SlabAllocator class -- the untyped allocator behind ObjectPool
+ */
+class SlabAllocator: public ThreadExitHandler
+{
+public:
+    /**
+    *   `hugepages` requests the slabs to be backed by huge pages (on Linux):
+    *   explicit huge pages are tried first, and then transparent huge pages are advised.
+    */
+    explicit SlabAllocator(size_t object_size, size_t magazine=POOL_DEFAULT_MAGAZINE, bool hugepages=false);
+    explicit SlabAllocator(SlabAllocator &ref); // cannot copy
+    virtual ~SlabAllocator(); // releases all the slabs, whether or not the blocks are still in use
+
+    void *allocate();   // throws std::bad_alloc
+    void  deallocate(void *ptr);
+
+    size_t    objectSize() const { return size_; }
+    PoolStats stats();
+
+    virtual void threadExiting(Thread *thread);
+
+private:
+    _PoolRecord *record_();
+    void         refill_(_PoolRecord *record);
+    void         flush_(_PoolRecord *record);
+    void         carve_(_PoolMagazine *magazine);
+    void         mapSlab_();
+    _PoolMagazine *emptyMagazine_();
+
+    const uint64_t id_;
+    const size_t   size_;
+    const size_t   capacity_;
+    const bool     hugepages_;
+    bool           huge_;       // whether the huge pages are actually in use
+
+    Mutex                        lock_;     // guards all the members below
+    std::vector<_PoolRecord *>   records_;
+    std::vector<_PoolMagazine *> full_;
+    std::vector<_PoolMagazine *> empty_;
+    std::vector<void *>          slabs_;
+    size_t                       slabsize_;
+    char                        *cursor_;   // the unused part of the latest slab
+    char                        *end_;
+    uint64_t                     depotgets_;
+    uint64_t                     depotputs_;
+};
+
+/**
+ * @brief The ObjectPool class -- a SlabAllocator for the objects of type T
+ *
+ * the objects must be created and destroyed through create() and destroy().
+ * the objects left alive are not destructed when the pool is destroyed.
+ */
+template <typename T>
+class ObjectPool
+{
+public:
+    explicit ObjectPool(size_t magazine=POOL_DEFAULT_MAGAZINE, bool hugepages=false):
+        alloc_(sizeof(T), magazine, hugepages) {}
+    explicit ObjectPool(ObjectPool &ref); // cannot copy
+
+    T *create()
+    {
+        void *ptr = alloc_.allocate();
+        try {
+            return new (ptr) T();
+        } catch(...) {
+            alloc_.deallocate(ptr);
+            throw;
+        }
+    }
+
+    template <typename A1>
+    T *create(const A1 &a1)
+    {
+        void *ptr = alloc_.allocate();
+        try {
+            return new (ptr) T(a1);
+        } catch(...) {
+            alloc_.deallocate(ptr);
+            throw;
+        }
+    }
+
+    template <typename A1, typename A2>
+    T *create(const A1 &a1, const A2 &a2)
+    {
+        void *ptr = alloc_.allocate();
+        try {
+            return new (ptr) T(a1, a2);
+        } catch(...) {
+            alloc_.deallocate(ptr);
+            throw;
+        }
+    }
+
+    template <typename A1, typename A2, typename A3>
+    T *create(const A1 &a1, const A2 &a2, const A3 &a3)
+    {
+        void *ptr = alloc_.allocate();
+        try {
+            return new (ptr) T(a1, a2, a3);
+        } catch(...) {
+            alloc_.deallocate(ptr);
+            throw;
+        }
+    }
+
+    void destroy(T *obj)
+    {
+        if( obj != 0 ){
+            obj->~T();
+            alloc_.deallocate(obj);
+        }
+    }
+
+    PoolStats      stats()           { return alloc_.stats(); }
+    SlabAllocator &allocator()       { return alloc_; }
+
+private:
+    SlabAllocator alloc_;
+};
+
+}
+
+#endif // __KS_POOL_H__
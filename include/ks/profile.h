@@ -0,0 +1,100 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   profile.h -- an in-process sampling CPU profiler (Linux only)
+*
+*   every running ks::Thread (as registered in _ThreadService) gets a POSIX timer on its own
+*   CPU-time clock, which delivers SIGPROF to that very thread (SIGEV_THREAD_ID) at the given
+*   frequency of its CPU time. the signal handler unwinds the interrupted stack into a
+*   lock-free buffer of the thread; a collector thread drains the buffers into per-thread
+*   stack counts. the threads that start later are armed as they start (see ThreadStartHandler).
+*
+*   the stacks are kept as raw addresses, and are symbolized only when written:
+*   as folded stacks ("thread;outer;...;inner count", for flamegraph.pl and the like),
+*   or in the legacy pprof CPU profile format with the memory map of the process appended,
+*   so that `pprof <binary> <profile>` symbolizes it offline.
+*
+*       ks::Profiler::start();
+*       ...
+*       ks::Profiler::writeFoldedFile("cpu.folded");
+*
+*   the threads that are not ks::Threads are not sampled. the kernel checks the CPU-time
+*   timers at its ticks, so the frequency is effectively capped at CONFIG_HZ. the symbolization in folded
+*   stacks uses dladdr(), which only knows the exported symbols (link with -rdynamic for
+*   those of the executable); the others are written as "module+0xoffset" for addr2line.
+*   with glibc older than 2.34, link with -ldl and -lrt.
+*/
+#ifndef __KS_PROFILE_H__
+#define __KS_PROFILE_H__
+
+#include <stdint.h>
+#include <string>
+#include <ostream>
+
+namespace ks {
+
+const int  PROFILE_DEFAULT_HZ = 99;  // not 100, so as not to sample in lockstep with periodic activities
+const int  PROFILE_MAX_DEPTH  = 64;
+
+/**
+*   how the signal handler walks the stack
+*/
+enum ProfileUnwinder {
+    UnwindTables,       // glibc's backtrace() on the unwind tables (.eh_frame): works on any code
+                        // built with the default flags, at a few microseconds per sample
+    FramePointers,      // follows the frame pointer chain: much cheaper, but the code must be
+                        // built with -fno-omit-frame-pointer (or the stacks come out truncated)
+};
+
+/**
+ * @brief The Profiler class -- the process-wide sampling profiler.
+ *
+ * the profiler is meant to be kept running in production: the overhead is one signal
+ * per sample, and the aggregated stacks can be written (and clear()ed) at any time.
+ */
+class Profiler
+{
+public:
+    /**
+    *   starts sampling every thread at `frequency` Hz of its CPU time.
+    *   throws std::runtime_error if the timers or the signal handler cannot be set up.
+    */
+    static void start(int frequency=PROFILE_DEFAULT_HZ, ProfileUnwinder unwinder=UnwindTables);
+    static void stop();    // the samples so far are kept until clear()
+    static bool running();
+
+    static void writeFolded(std::ostream &out);
+    static bool writeFoldedFile(const std::string &path);
+    static void writePprof(std::ostream &out);
+    static bool writePprofFile(const std::string &path);
+
+    static void     clear();     // discards the samples so far
+    static uint64_t samples();   // the samples taken so far
+    static uint64_t dropped();   // the samples lost to full buffers
+};
+
+}
+
+#endif // __KS_PROFILE_H__
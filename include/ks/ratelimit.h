@@ -0,0 +1,149 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   ratelimit.h -- lock-free rate limiters
+*
+*   both limiters below are built on the same core: a single atomic
+*   'theoretical arrival time' (TAT), i.e. the time at which the limiter would
+*   be idle again had it granted everything so far. a permit costs 1/rate seconds
+*   of TAT, and a request is granted when it leaves TAT no further ahead of now than
+*   the burst allowance. one compare-and-swap updates the state, so the limiters
+*   are shared by any number of threads without a mutex.
+*
+*   the blocking acquire() reserves its permits right away (pushing TAT ahead of
+*   now) and then sleeps until their time has come, so the waiting threads are
+*   served in the order of their arrival and are never starved by try_acquire().
+*
+*       ks::TokenBucket flushes(100, 10); // 100 per second, bursts of up to 10
+*       flushes.acquire();
+*       flush();
+*/
+#ifndef __KS_RATELIMIT_H__
+#define __KS_RATELIMIT_H__
+
+#include <stdint.h>
+#include "ks/atomic.h"
+#include "ks/timing.h"
+
+namespace ks {
+
+/**
+ * @brief The RateLimiter class -- the common core of TokenBucket and LeakyBucket.
+ *
+ * the times are in nanosec on the clock of the limiter (MonotonicClock by default).
+ */
+class RateLimiter
+{
+public:
+    explicit RateLimiter(RateLimiter &ref); // cannot copy
+    virtual ~RateLimiter();
+
+    /**
+    *   takes `n` permits if they are available now; never blocks.
+    *   (a request larger than the burst allowance never succeeds)
+    */
+    bool try_acquire(uint64_t n=1);
+
+    /**
+    *   takes `n` permits, sleeping until they are available.
+    *   returns the time spent waiting, in nanosec.
+    */
+    uint64_t acquire(uint64_t n=1);
+
+    /**
+    *   how long until `n` permits are available (0 if they are available now), in nanosec.
+    *   this is only a hint when other threads use the limiter at the same time.
+    */
+    uint64_t time_until_available(uint64_t n=1);
+
+    /**
+    *   acquire() sleeps until `nsec` before the permits are due, and busy-waits for the rest,
+    *   for a precision better than the scheduler's. 0 (the default) never spins.
+    */
+    void set_spin(uint64_t nsec) { spin_ = nsec; }
+
+    double   rate() const { return NSEC_IN_SEC / interval_; } // permits per second
+    uint64_t now();                                          // the clock of the limiter
+
+protected:
+    /**
+    *   `interval_nsec` is the cost of a permit; a request is granted when it leaves
+    *   TAT at most `limit_nsec` ahead of now. `initial` is the offset of TAT from now.
+    */
+    RateLimiter(double interval_nsec, uint64_t limit_nsec, uint64_t initial, ClockSource clock);
+
+    uint64_t cost_(uint64_t n) const;
+    uint64_t tat_now_(uint64_t *now); // the current TAT, and the time
+
+    const double        interval_;
+    const uint64_t      limit_;
+
+private:
+    void sleep_until_(uint64_t deadline);
+
+    nanostamp           clock_;
+    uint64_t            spin_;
+    atomic<uint64_t>    tat_;
+};
+
+/**
+ * @brief The TokenBucket class -- `rate` tokens per second flow into a bucket of `burst` tokens.
+ *
+ * after an idle period, up to `burst` permits are granted at once.
+ */
+class TokenBucket: public RateLimiter
+{
+public:
+    TokenBucket(double rate, double burst, bool full=true, ClockSource clock=MonotonicClock);
+
+    /**
+    *   the tokens in the bucket now; negative when acquire() has reserved tokens
+    *   that have not been refilled yet
+    */
+    double available();
+
+    double burst() const { return limit_ / interval_; }
+};
+
+/**
+ * @brief The LeakyBucket class -- the generic cell rate algorithm (GCRA).
+ *
+ * the permits are spaced by 1/rate seconds. a permit may come up to `tolerance_nsec`
+ * earlier than its slot (e.g. to absorb the jitter of the callers); with the default
+ * tolerance of 0, the permits are strictly paced and never come in bursts.
+ */
+class LeakyBucket: public RateLimiter
+{
+public:
+    explicit LeakyBucket(double rate, uint64_t tolerance_nsec=0, ClockSource clock=MonotonicClock);
+
+    uint64_t emission_interval() const { return cost_(1); } // in nanosec
+    uint64_t tolerance() const { return limit_ - cost_(1); }   // in nanosec
+    uint64_t theoretical_arrival();                            // TAT (or now, if earlier) on the clock of the limiter
+};
+
+}
+
+#endif // __KS_RATELIMIT_H__
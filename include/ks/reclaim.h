@@ -0,0 +1,200 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   reclaim.h -- safe memory reclamation for lock-free structures
+*
+*   EpochDomain implements epoch-based reclamation: readers bracket their accesses
+*   with enter()/exit() (or an EpochGuard), and a retired node is freed once every
+*   thread has left the epoch in which it was retired.
+*
+*   HazardDomain implements hazard pointers: a reader publishes the pointer it is
+*   about to dereference with protect(), and a retired node is freed once no
+*   hazard pointer refers to it.
+*
+*   in both domains, each thread gets a record on its first use. the retired nodes
+*   are kept in per-thread lists and processed in batches. when a ks::Thread exits,
+*   its record is released for reuse, and the nodes it still holds are handed over
+*   to the domain.
+*
+*   domains register themselves to Thread::addExitHandler(), so they must not be
+*   constructed during the static initialization; use the global() instances or
+*   construct them at run-time.
+*/
+#ifndef __KS_RECLAIM_H__
+#define __KS_RECLAIM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+
+namespace ks {
+
+typedef void (*ReclaimDeleter)(void *);
+
+template <typename T>
+void reclaim_delete(void *ptr)
+{
+    delete static_cast<T *>(ptr);
+}
+
+struct _RetiredNode
+{
+    _RetiredNode(): ptr(0), deleter(0), epoch(0) {}
+    _RetiredNode(void *p, ReclaimDeleter d, uint64_t e): ptr(p), deleter(d), epoch(e) {}
+
+    void           *ptr;
+    ReclaimDeleter  deleter;
+    uint64_t        epoch;  // the epoch of retirement (EpochDomain only)
+};
+
+class _ReclaimRecord;
+class _EpochRecord;
+class _HazardRecord;
+
+/**
+ * @brief The EpochDomain class -- epoch-based reclamation
+ */
+class EpochDomain: public ThreadExitHandler
+{
+public:
+    explicit EpochDomain(size_t batch=64);
+    explicit EpochDomain(EpochDomain &ref); // cannot copy
+    virtual ~EpochDomain(); // frees all the retired nodes; no thread may be within enter()/exit()
+
+    void enter(); // nestable
+    void exit();
+
+    /**
+    *   schedules `ptr` to be freed by `deleter`, once no thread can be referring to it
+    */
+    void retire(void *ptr, ReclaimDeleter deleter);
+
+    template <typename T>
+    void retire(T *ptr) { retire(ptr, &reclaim_delete<T>); }
+
+    /**
+    *   tries to advance the epoch, and frees the calling thread's nodes that have become safe
+    */
+    void reclaim();
+
+    uint64_t epoch() const;
+
+    virtual void threadExiting(Thread *thread);
+
+    static EpochDomain &global();
+
+private:
+    _EpochRecord *record_(); // the record of the calling thread
+    bool          tryAdvance_();
+    void          free_(std::vector<_RetiredNode> &nodes, uint64_t safe_before);
+
+    const uint64_t            id_;
+    const size_t              batch_;
+    atomic<uint64_t>          epoch_;
+    atomic<_ReclaimRecord *>  records_;
+    Mutex                     orphanlock_;
+    std::vector<_RetiredNode> orphans_;
+};
+
+/**
+ * @brief The EpochGuard class -- enter()s the domain within the scope
+ */
+class EpochGuard
+{
+public:
+    explicit EpochGuard(EpochDomain &domain=EpochDomain::global());
+    ~EpochGuard();
+
+private:
+    EpochDomain &domain_;
+};
+
+/**
+ * @brief The HazardDomain class -- hazard-pointer based reclamation
+ */
+class HazardDomain: public ThreadExitHandler
+{
+public:
+    explicit HazardDomain(int slots=4, size_t batch=64);
+    explicit HazardDomain(HazardDomain &ref); // cannot copy
+    virtual ~HazardDomain(); // frees all the retired nodes; no hazard pointers may be in use
+
+    /**
+    *   reads `src` and publishes it in the hazard pointer `slot` of the calling thread.
+    *   the returned pointer stays valid until the slot is cleared or reused.
+    */
+    template <typename T>
+    T *protect(int slot, const atomic<T *> &src)
+    {
+        T *ptr = src.load(memory_order_acquire);
+        while( true ){
+            publish_(slot, ptr);
+            T *current = src.load(memory_order_acquire);
+            if( current == ptr ){
+                return ptr;
+            }
+            ptr = current;
+        }
+    }
+
+    void clear(int slot);
+    void clearAll();
+
+    void retire(void *ptr, ReclaimDeleter deleter);
+
+    template <typename T>
+    void retire(T *ptr) { retire(ptr, &reclaim_delete<T>); }
+
+    /**
+    *   frees the calling thread's nodes that are not protected by any hazard pointer
+    */
+    void reclaim();
+
+    int slots() const { return slots_; }
+
+    virtual void threadExiting(Thread *thread);
+
+    static HazardDomain &global();
+
+private:
+    void           publish_(int slot, void *ptr);
+    _HazardRecord *record_();
+    void           scan_(std::vector<_RetiredNode> &nodes);
+
+    const uint64_t            id_;
+    const int                 slots_;
+    const size_t              batch_;
+    atomic<_ReclaimRecord *>  records_;
+    atomic<int>               count_;   // the number of records
+    Mutex                     orphanlock_;
+    std::vector<_RetiredNode> orphans_;
+};
+
+}
+
+#endif // __KS_RECLAIM_H__
@@ -0,0 +1,154 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   scheduler.h -- delayed and periodic tasks on a hierarchical timing wheel
+*
+*   a single timer thread keeps track of all the timers, and hands the due
+*   ones to an Executor. scheduling and cancellation are O(1).
+*/
+#ifndef __KS_SCHEDULER_H__
+#define __KS_SCHEDULER_H__
+
+#include <stdint.h>
+#include <vector>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+#include "ks/executor.h"
+
+namespace ks {
+
+/**
+ * @brief The TimerTask class -- the callback of a timer.
+ * you are supposed to inherit this class and override fire().
+ *
+ * a TimerTask is owned by the scheduler once scheduled, and is deleted
+ * after it is cancelled (or has fired, for a one-shot timer) and
+ * none of its fire() calls are running anymore.
+ */
+class TimerTask
+{
+public:
+    TimerTask();
+    virtual ~TimerTask();
+    virtual void fire()=0;
+
+    void acquire();
+    void release(); // deletes the task when the last reference is released
+
+private:
+    atomic<int>  refs_;
+};
+
+class _TimerNode;
+
+/**
+ * @brief The TimerHandle struct -- identifies a scheduled timer for cancellation.
+ * a handle stays safe to use after its timer has fired or been cancelled.
+ */
+struct TimerHandle
+{
+    TimerHandle(): node(0), generation(0) {}
+
+    _TimerNode *node;
+    uint32_t    generation;
+};
+
+/**
+ * @brief The TimerScheduler class -- a hierarchical timing wheel run by one timer thread
+ */
+class TimerScheduler
+{
+public:
+    /**
+    *   `executor` runs the due tasks (ThreadPool::global() if 0).
+    *   `tick_msec` is the resolution of the wheel.
+    *   the timer thread starts immediately.
+    */
+    explicit TimerScheduler(Executor *executor=0, long tick_msec=1);
+    explicit TimerScheduler(TimerScheduler &ref); // cannot copy
+    ~TimerScheduler(); // calls stop(); pending timers are discarded
+
+    TimerHandle schedule(TimerTask *task, long delay_msec);
+    TimerHandle schedulePeriodic(TimerTask *task, long delay_msec, long period_msec);
+
+    bool   cancel(const TimerHandle &handle); // true if the timer was still pending
+    size_t pending();
+
+    void stop(); // stops the timer thread; timers that have not fired yet will not fire
+
+private:
+    static const int    WHEEL_BITS   = 8;
+    static const int    WHEEL_SIZE   = 1 << WHEEL_BITS;
+    static const int    WHEEL_LEVELS = 4;
+
+    /**
+    *   a timer that is due; `handle` is set for the periodic timers, to cancel them if they cannot be run
+    */
+    struct DueTimer
+    {
+        TimerTask   *task;
+        TimerHandle  handle;
+    };
+
+    class TimerThread: public Thread
+    {
+    public:
+        explicit TimerThread(TimerScheduler *scheduler);
+    protected:
+        virtual void run();
+    private:
+        TimerScheduler *scheduler_;
+    };
+
+    TimerHandle add_(TimerTask *task, long delay_msec, long period_msec);
+    uint64_t    toTicks_(long msec) const;
+    uint64_t    nowTick_() const;
+    _TimerNode *allocNode_();
+    void        freeNode_(_TimerNode *node);
+    void        link_(_TimerNode *node, uint64_t base);
+    void        unlink_(_TimerNode *node);
+    void        cascade_(int level);
+    void        advance_(uint64_t until, std::vector<DueTimer> &due);
+    uint64_t    nextEventTick_() const;
+    void        loop_();
+
+    Executor                 *executor_;
+    const long                tick_;
+    uint64_t                  origin_;   // the monotonic time (msec) of tick 0
+    uint64_t                  current_;  // the last tick processed by the wheel
+    uint64_t                  wakeat_;   // the tick that the timer thread is sleeping towards
+    size_t                    count_;
+    bool                      stopping_;
+    _TimerNode               *slots_[WHEEL_LEVELS][WHEEL_SIZE];
+    _TimerNode               *freelist_;
+    std::vector<_TimerNode *> allocated_;
+    Condition                 cond_;
+    TimerThread              *thread_;
+};
+
+}
+
+#endif // __KS_SCHEDULER_H__
@@ -0,0 +1,434 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   stats.h -- constant-memory streaming statistics
+*
+*   RunningStats (mean and variance by Welford's method), Ewma (exponentially
+*   weighted moving average by half-life), MinMax and QuantileSketch (a KLL sketch)
+*   summarize any number of samples in a fixed (or, for the sketch, a few kilobytes of)
+*   memory, and never reset themselves like ks::averager.
+*
+*   every estimator has a batch add() for arrays of samples, whose loops keep
+*   STATS_LANES independent accumulators so that the compiler vectorizes them,
+*   and a merge(): the estimators are not thread-safe, so each thread updates
+*   an instance of its own, and the instances are merged for reporting.
+*/
+#ifndef __KS_STATS_H__
+#define __KS_STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+
+namespace ks {
+
+const size_t STATS_LANES = 4;
+
+/**
+ * the total of the STATS_LANES accumulators
+ */
+inline double stats_lane_sum(const double *lanes)
+{
+    double sum = 0;
+    for( size_t j=0; j<STATS_LANES; j++ ){
+        sum += lanes[j];
+    }
+    return sum;
+}
+
+/**
+ * @brief The RunningStats class -- the count, mean and variance of the samples.
+ *
+ * Welford's update is numerically stable for long streams, where the naive sum
+ * of squares loses its precision; the batches and the merges are combined by
+ * Chan's pairwise formula.
+ */
+class RunningStats
+{
+public:
+    RunningStats(): count_(0), mean_(0), m2_(0) {}
+
+    void add(double v)
+    {
+        count_++;
+        double delta = v - mean_;
+        mean_ += delta / static_cast<double>(count_);
+        m2_   += delta * (v - mean_);
+    }
+
+    template <typename T>
+    void add(const T *values, size_t n)
+    {
+        if( n == 0 ){
+            return;
+        }
+        // two passes over the batch: its mean, and then the squared deviations from it
+        const size_t blocks = n / STATS_LANES;
+        double sums[STATS_LANES] = { 0 };
+        for( size_t b=0; b<blocks; b++ ){
+            const T *block = values + b * STATS_LANES;
+            for( size_t j=0; j<STATS_LANES; j++ ){
+                sums[j] += static_cast<double>(block[j]);
+            }
+        }
+        for( size_t i=blocks * STATS_LANES; i<n; i++ ){
+            sums[0] += static_cast<double>(values[i]);
+        }
+        double mean = stats_lane_sum(sums) / static_cast<double>(n);
+
+        double squares[STATS_LANES] = { 0 };
+        for( size_t b=0; b<blocks; b++ ){
+            const T *block = values + b * STATS_LANES;
+            for( size_t j=0; j<STATS_LANES; j++ ){
+                double d = static_cast<double>(block[j]) - mean;
+                squares[j] += d * d;
+            }
+        }
+        for( size_t i=blocks * STATS_LANES; i<n; i++ ){
+            double d = static_cast<double>(values[i]) - mean;
+            squares[0] += d * d;
+        }
+        combine_(n, mean, stats_lane_sum(squares));
+    }
+
+    void merge(const RunningStats &other) { combine_(other.count_, other.mean_, other.m2_); }
+    void clear() { count_ = 0; mean_ = 0; m2_ = 0; }
+
+    uint64_t count() const { return count_; }
+    double   mean() const { return mean_; }
+    double   variance() const { return (count_ > 0)? m2_ / static_cast<double>(count_): 0; }            // of the population
+    double   sampleVariance() const { return (count_ > 1)? m2_ / static_cast<double>(count_ - 1): 0; } // unbiased
+    double   stddev() const { return std::sqrt(variance()); }
+
+private:
+    void combine_(uint64_t count, double mean, double m2)
+    {
+        if( count == 0 ){
+            return;
+        }
+        uint64_t total = count_ + count;
+        double   delta = mean - mean_;
+        double   ratio = static_cast<double>(count) / static_cast<double>(total);
+        mean_  += delta * ratio;
+        m2_    += m2 + delta * delta * static_cast<double>(count_) * ratio;
+        count_  = total;
+    }
+
+    uint64_t count_;
+    double   mean_;
+    double   m2_;   // the sum of the squared deviations from the mean
+};
+
+/**
+ * @brief The Ewma class -- an exponentially weighted moving average.
+ *
+ * a sample loses half of its weight every `halflife`. the time advances by one
+ * for every add(v), so that the half-life is counted in samples, or is given
+ * explicitly by add(v, time) in any unit (e.g. nanosec from a nanostamp).
+ * the average is normalized by the total weight, so that it is not biased
+ * towards zero before the first half-lives have passed.
+ */
+class Ewma
+{
+public:
+    explicit Ewma(double halflife); // throws std::runtime_error unless 0 < halflife < inf
+
+    void add(double v)
+    {
+        sum_     = sum_ * decay_ + v;
+        weight_  = weight_ * decay_ + 1.0;
+        time_   += 1;
+    }
+
+    /**
+    *   adds a sample at `time`; a sample older than the latest one counts with its decayed weight
+    */
+    void add(double v, double time)
+    {
+        double w = 1.0;
+        if( time > time_ ){
+            advance(time);
+        } else {
+            w = decayOver_(time_ - time);
+        }
+        sum_    += w * v;
+        weight_ += w;
+    }
+
+    /**
+    *   the same as add(v) for every sample in order
+    */
+    template <typename T>
+    void add(const T *values, size_t n)
+    {
+        size_t blocks = n / STATS_LANES;
+        if( blocks > 0 ){
+            // lane j runs Horner's scheme over the samples j, j+LANES, j+2*LANES, ...
+            double lanedecay = std::pow(decay_, static_cast<double>(STATS_LANES));
+            double lanes[STATS_LANES] = { 0 };
+            for( size_t b=0; b<blocks; b++ ){
+                for( size_t j=0; j<STATS_LANES; j++ ){
+                    lanes[j] = lanes[j] * lanedecay + static_cast<double>(values[b * STATS_LANES + j]);
+                }
+            }
+            size_t steps = blocks * STATS_LANES;
+            double total = std::pow(decay_, static_cast<double>(steps));
+            double sum   = 0, w = 1.0;
+            for( size_t j=STATS_LANES; j>0; j-- ){
+                sum += lanes[j-1] * w;
+                w   *= decay_;
+            }
+            sum_    = sum_ * total + sum;
+            weight_ = weight_ * total + (1.0 - total) / (1.0 - decay_);
+            time_  += static_cast<double>(steps);
+        }
+        for( size_t i=blocks * STATS_LANES; i<n; i++ ){
+            add(static_cast<double>(values[i]));
+        }
+    }
+
+    /**
+    *   moves the time forward without a sample (i.e. lets the weights decay)
+    */
+    void advance(double time)
+    {
+        if( time > time_ ){
+            double d = decayOver_(time - time_);
+            sum_    *= d;
+            weight_ *= d;
+            time_    = time;
+        }
+    }
+
+    /**
+    *   merges another average (of the same half-life) at the later of the two times
+    */
+    void merge(const Ewma &other)
+    {
+        double d = 1.0;
+        if( other.time_ > time_ ){
+            advance(other.time_);
+        } else {
+            d = decayOver_(time_ - other.time_);
+        }
+        sum_    += other.sum_ * d;
+        weight_ += other.weight_ * d;
+    }
+
+    void clear() { sum_ = 0; weight_ = 0; time_ = 0; }
+
+    double value() const { return (weight_ > 0)? sum_ / weight_: 0; }
+    double weight() const { return weight_; } // the decayed number of the samples
+    double time() const { return time_; }
+    double halflife() const { return halflife_; }
+
+private:
+    double decayOver_(double elapsed) const { return std::pow(0.5, elapsed / halflife_); }
+
+    double  halflife_;
+    double  decay_;     // per unit of time
+    double  sum_;       // the decayed sum of the samples
+    double  weight_;
+    double  time_;
+};
+
+/**
+ * @brief The MinMax class -- the extremes of the samples.
+ */
+template <typename T>
+class MinMax
+{
+public:
+    MinMax(): count_(0), min_(), max_() {}
+
+    void add(T v)
+    {
+        if( count_++ == 0 ){
+            min_ = max_ = v;
+        } else {
+            min_ = (v < min_)? v: min_;
+            max_ = (v > max_)? v: max_;
+        }
+    }
+
+    void add(const T *values, size_t n)
+    {
+        if( n == 0 ){
+            return;
+        }
+        T lo[STATS_LANES], hi[STATS_LANES];
+        for( size_t j=0; j<STATS_LANES; j++ ){
+            lo[j] = (count_ > 0)? min_: values[0];
+            hi[j] = (count_ > 0)? max_: values[0];
+        }
+        const size_t blocks = n / STATS_LANES;
+        for( size_t b=0; b<blocks; b++ ){
+            const T *block = values + b * STATS_LANES;
+            for( size_t j=0; j<STATS_LANES; j++ ){
+                lo[j] = (block[j] < lo[j])? block[j]: lo[j];
+                hi[j] = (block[j] > hi[j])? block[j]: hi[j];
+            }
+        }
+        for( size_t i=blocks * STATS_LANES; i<n; i++ ){
+            lo[0] = (values[i] < lo[0])? values[i]: lo[0];
+            hi[0] = (values[i] > hi[0])? values[i]: hi[0];
+        }
+        for( size_t j=1; j<STATS_LANES; j++ ){
+            lo[0] = (lo[j] < lo[0])? lo[j]: lo[0];
+            hi[0] = (hi[j] > hi[0])? hi[j]: hi[0];
+        }
+        min_    = lo[0];
+        max_    = hi[0];
+        count_ += n;
+    }
+
+    void merge(const MinMax &other)
+    {
+        if( other.count_ == 0 ){
+            return;
+        }
+        if( count_ == 0 ){
+            *this = other;
+            return;
+        }
+        min_    = (other.min_ < min_)? other.min_: min_;
+        max_    = (other.max_ > max_)? other.max_: max_;
+        count_ += other.count_;
+    }
+
+    void clear() { count_ = 0; }
+
+    uint64_t count() const { return count_; }
+    bool     empty() const { return count_ == 0; }
+    T        min() const { return min_; } // only meaningful when !empty()
+    T        max() const { return max_; }
+
+private:
+    uint64_t count_;
+    T        min_;
+    T        max_;
+};
+
+/**
+ * @brief The QuantileSketch class -- approximate quantiles by the KLL sketch.
+ *
+ * the samples are kept in a stack of 'compactors': when a level is full, it is sorted
+ * and every other sample (starting at random) is promoted to the next level with
+ * twice the weight. the capacities shrink geometrically down the stack, so that the sketch
+ * keeps about 3k samples whatever the count is, and the rank of a reported quantile
+ * is within about 1.7/k (1.3% at k=200) of the requested one, with high probability.
+ * the minimum and the maximum are kept exactly.
+ */
+class QuantileSketch
+{
+public:
+    explicit QuantileSketch(unsigned int k=200);
+
+    void add(double v)
+    {
+        update_(v, v, 1);
+        levels_[0].push_back(v);
+        if( ++retained_ >= capacity_ ){
+            compress_();
+        }
+    }
+
+    template <typename T>
+    void add(const T *values, size_t n)
+    {
+        if( n == 0 ){
+            return;
+        }
+        MinMax<T> extremes;
+        extremes.add(values, n);
+        update_(static_cast<double>(extremes.min()), static_cast<double>(extremes.max()), n);
+
+        // fill the level 0 up to the capacity at a time (compress_() always leaves room)
+        while( n > 0 ){
+            size_t chunk = capacity_ - retained_;
+            chunk = (chunk < n)? chunk: n;
+            levels_[0].insert(levels_[0].end(), values, values + chunk);
+            retained_ += chunk;
+            if( retained_ >= capacity_ ){
+                compress_();
+            }
+            values += chunk;
+            n      -= chunk;
+        }
+    }
+
+    void merge(const QuantileSketch &other);
+    void clear();
+
+    /**
+    *   the approximate value at `fraction` (0 to 1) of the samples, e.g. 0.99 for the 99th percentile.
+    *   0 and 1 return the exact minimum and maximum; 0 if there are no samples.
+    */
+    double quantile(double fraction) const;
+
+    /**
+    *   the approximate fraction of the samples that are not larger than `v`
+    */
+    double rank(double v) const;
+
+    uint64_t count() const { return count_; }
+    double   min() const { return min_; }
+    double   max() const { return max_; }
+    size_t   retained() const { return retained_; } // the samples kept in the sketch
+    unsigned int k() const { return k_; }
+
+private:
+    void update_(double lo, double hi, uint64_t added)
+    {
+        if( count_ == 0 ){
+            min_ = lo;
+            max_ = hi;
+        } else {
+            min_ = (lo < min_)? lo: min_;
+            max_ = (hi > max_)? hi: max_;
+        }
+        count_ += added;
+    }
+
+    void   compress_(); // compacts the levels until retained_ < capacity_
+    void   compact_(size_t level);
+    size_t levelCapacity_(size_t level) const;
+    void   recomputeCapacity_();
+    void   weighted_(std::vector<std::pair<double, uint64_t> > &out) const;
+
+    unsigned int                        k_;
+    std::vector<std::vector<double> >   levels_;   // the samples at level h weigh 2^h
+    size_t                              retained_;
+    size_t                              capacity_; // compress when retained_ reaches it
+    uint64_t                            count_;
+    double                              min_;
+    double                              max_;
+    uint64_t                            random_;
+};
+
+}
+
+#endif // __KS_STATS_H__
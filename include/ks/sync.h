@@ -0,0 +1,171 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   sync.h -- coordination primitives beyond Mutex/Condition/Flag
+*
+*   on Linux, these are built directly on futexes (on the words of ks::atomic<int32_t>), so that an uncontended
+*   operation never enters the kernel and a wakeup costs a single syscall.
+*   on the other platforms they fall back to a Condition.
+*/
+#ifndef __KS_SYNC_H__
+#define __KS_SYNC_H__
+
+#include <stdint.h>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+
+#ifdef __linux__
+#define KS_USE_FUTEX
+#endif
+
+namespace ks {
+
+/**
+ * @brief The Semaphore class -- a counting semaphore
+ */
+class Semaphore
+{
+public:
+    explicit Semaphore(int32_t initial=0); // throws std::runtime_error if initial < 0
+    explicit Semaphore(Semaphore &ref); // cannot copy
+    ~Semaphore();
+
+    bool wait(long timeout_msec=-1); // true if a count has been taken
+    bool tryWait();                  // true if a count has been taken without blocking
+    void post(int32_t count=1);
+
+    int32_t value(); // the current count (for diagnostic purposes only)
+
+private:
+    atomic<int32_t>  count_;
+    atomic<int32_t>  waiters_;
+#ifndef KS_USE_FUTEX
+    Condition        cond_;
+#endif
+};
+
+/**
+ * @brief The Latch class -- a one-shot countdown; wait() returns once the count reaches zero
+ */
+class Latch
+{
+public:
+    explicit Latch(int32_t count);
+    explicit Latch(Latch &ref); // cannot copy
+    ~Latch();
+
+    void countDown(int32_t n=1);
+    bool tryWait();                  // true if the count has already reached zero
+    bool wait(long timeout_msec=-1); // true if the count has reached zero
+
+    void arriveAndWait();            // countDown() followed by wait()
+
+private:
+    atomic<int32_t>  count_;
+#ifndef KS_USE_FUTEX
+    Condition        cond_;
+#endif
+};
+
+/**
+ * @brief The Barrier class -- a reusable barrier for a fixed number of parties.
+ *
+ * the barrier keeps a 'sense' (phase) counter that flips every time all the
+ * parties have arrived. a waiting thread spins shortly on the sense before
+ * going to sleep (see setWaitPolicy()), so that tightly-coupled phases never enter the kernel.
+ */
+class Barrier
+{
+public:
+    explicit Barrier(int32_t parties);
+    explicit Barrier(Barrier &ref); // cannot copy
+    ~Barrier();
+
+    /**
+    *   blocks until all the parties have called wait().
+    *   returns true for exactly one of the parties (the last one to arrive).
+    */
+    bool wait();
+
+    int32_t parties() const { return parties_; }
+
+    void setWaitPolicy(const WaitPolicy &policy); // WaitPolicy::spinPark() by default
+
+private:
+    const int32_t    parties_;
+    WaitPolicy       policy_;
+    atomic<int32_t>  remaining_;
+    atomic<uint32_t> sense_;
+#ifndef KS_USE_FUTEX
+    Condition        cond_;
+#endif
+};
+
+/**
+ * @brief The EventCount class -- lets lock-free structures sleep and wake without lost wakeups.
+ *
+ * the consumer side follows the pattern below:
+ *
+ *      while( !queue.tryPop(item) ){
+ *          EventCount::Key key = ec.prepareWait();
+ *          if( queue.tryPop(item) ){
+ *              ec.cancelWait();
+ *              break;
+ *          }
+ *          ec.commitWait(key);
+ *      }
+ *
+ * and the producer calls notify() (or notifyAll()) after publishing its data.
+ * notify*() are cheap when nobody is waiting.
+ */
+class EventCount
+{
+public:
+    typedef uint32_t Key;
+
+    EventCount();
+    explicit EventCount(EventCount &ref); // cannot copy
+    ~EventCount();
+
+    Key  prepareWait();
+    void cancelWait();
+    void commitWait(Key key);
+
+    void notify();
+    void notifyAll();
+
+private:
+    void notify_(bool all);
+
+    atomic<uint32_t>  epoch_;
+    atomic<int32_t>   waiters_;
+#ifndef KS_USE_FUTEX
+    Condition         cond_;
+#endif
+};
+
+}
+
+#endif // __KS_SYNC_H__
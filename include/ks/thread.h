@@ -27,6 +27,8 @@
 
 #include <stdint.h>
 #include <map>
+#include <vector>
+#include <string>
 
 #ifdef _WIN32
 #include <winsock2.h> // instead of windows.h
@@ -34,34 +36,71 @@
 #include <pthread.h>
 #endif
 
+#include "ks/atomic.h"
+#include "ks/hashmap.h"
+#include "ks/wait.h"
+
 typedef uint64_t ks_thread_id;
 
 namespace ks {
 
 class Thread;
 
+class _ThreadService;
+class Condition;
+class _ConditionListeners;
+
 /**
- * _ThreadService class
+ * ThreadExitHandler class
  *
- * The global structure to monitor/manage all the threads in the program.
+ * The interface for the objects that keep per-thread state (e.g. reclamation records),
+ * and need to clean it up when a Thread exits.
+ * threadExiting() is called on the exiting thread itself, from Thread::exit().
+ */
+class ThreadExitHandler
+{
+public:
+    virtual ~ThreadExitHandler();
+    virtual void threadExiting(Thread *thread)=0;
+};
+
+/**
+ * ThreadStartHandler class
  *
- * Every Thread object is supposed to call put() when the Thread has been initialised
- * and when it is being destroyed.
- * This class also ensures that the main thread can be found from Thread::current(),
- * as the method internally uses _ThreadService::get() call.
+ * The interface for the objects that need to know when a Thread starts (e.g. to set up
+ * per-thread state from the outside). threadStarting() is called on the new thread itself,
+ * before run().
  */
-class _ThreadService
+class ThreadStartHandler
 {
 public:
-    _ThreadService();
-    virtual ~_ThreadService();
-    void    put(ks_thread_id tid, Thread *tptr);
-    Thread *get(ks_thread_id tid);
-private:
-    std::map<ks_thread_id, Thread *> pool_;
-    Thread *main_;
+    virtual ~ThreadStartHandler();
+    virtual void threadStarting(Thread *thread)=0;
 };
 
+/**
+ * ConditionListener class
+ *
+ * The interface for the objects that need to know when a Condition (or a Flag) is notified,
+ * e.g. a WaitSet. conditionNotified() is called from within notify*(), usually with
+ * the Condition locked, so it must return quickly without blocking.
+ */
+class ConditionListener
+{
+public:
+    virtual ~ConditionListener();
+    virtual void conditionNotified(Condition *cond)=0;
+};
+
+/**
+ * KS_THREAD_LOCAL -- the storage class for the thread-local variables (C++03 has no thread_local)
+ */
+#ifdef _MSC_VER
+#define KS_THREAD_LOCAL __declspec(thread)
+#else
+#define KS_THREAD_LOCAL __thread
+#endif
+
 #ifdef _WIN32
 typedef HANDLE              ks_thread_handle_t;
 typedef CRITICAL_SECTION    ks_mutex_t;
@@ -72,6 +111,34 @@ typedef pthread_mutex_t     ks_mutex_t;
 typedef pthread_cond_t      ks_cond_t;
 #endif
 
+/**
+ * ThreadStats struct
+ *
+ * The scheduling statistics of a thread, as taken by Thread::stats() or Thread::snapshot().
+ * The counters are cumulative since the thread started, unless the struct is the result of diff().
+ * The fields that the platform cannot provide are left 0 (lastCpu is left -1).
+ */
+struct ThreadStats
+{
+    ThreadStats();
+
+    ks_thread_id id;
+    long         systemId;              // the kernel thread id (0 until the thread starts running)
+    std::string  name;
+    uint64_t     timestamp;             // the monotonic time of the snapshot, in nanoseconds
+    uint64_t     interval;              // the time between the two snapshots, for a diff() (otherwise 0)
+    uint64_t     cpuNanos;              // CPU time consumed by the thread
+    uint64_t     voluntarySwitches;     // the thread blocked (e.g. on a lock or on I/O)
+    uint64_t     involuntarySwitches;   // the thread was preempted
+    uint64_t     runNanos;              // time spent on a CPU, as seen by the scheduler
+    uint64_t     waitNanos;             // time spent runnable, waiting on a run queue
+    uint64_t     timeslices;
+    int          lastCpu;               // the CPU the thread last ran on
+
+    ThreadStats since(const ThreadStats &earlier) const; // the difference from an earlier snapshot
+    double      cpuUsage() const;       // cpuNanos / interval (for a diff())
+};
+
 /**
  * Thread class
  *
@@ -95,13 +162,35 @@ public:
     static Thread *current(); // returns the current thread
     static ks_thread_id id(); // returns the current thread id
     static void exit(int code); // used from within the thread execution
+    static unsigned int hardwareConcurrency(); // the number of online processors (at least 1)
+
+    static void addExitHandler(ThreadExitHandler *handler); // does not own 'handler' pointer
+    static void removeExitHandler(ThreadExitHandler *handler);
+    static void addStartHandler(ThreadStartHandler *handler); // does not own 'handler' pointer
+    static void removeStartHandler(ThreadStartHandler *handler);
+
+    void               setName(const std::string &name); // also applied to the OS thread, where supported
+    const std::string &name() const { return name_; }
+    long               systemId() const { return sysid_; }
+
+    ThreadStats stats(); // the statistics of this thread (which must be running)
+
+    /**
+    *   the statistics of all the running Threads (including the main thread).
+    *   take snapshots periodically, and compare them with diff().
+    */
+    static std::vector<ThreadStats> snapshot();
+    static std::vector<ThreadStats> diff(const std::vector<ThreadStats> &before, const std::vector<ThreadStats> &after);
 protected:
     virtual void run();
     void exit_(int code);
 
 private:
+    friend class _ThreadService;
+
     static _ThreadService service_;
     void         run_();
+    ThreadStats  sample_(); // the part of stats() that does no file I/O
 
     ks_thread_handle_t handle_;
 #ifdef _WIN32
@@ -116,16 +205,23 @@ private:
 #endif
     bool running_;
     int exitcode_;
+    std::string   name_;
+    atomic<long>  sysid_;
 };
 
+class _LockRecord;
+
 /**
  * @brief The lockableobject class -- a base class for handling any 'lockable' object.
  * actually this class holds the ks_mutex_t object. any subclass can obtain its reference by the protected mutex() method.
+ *
+ * a named object is recorded by LockProfiler (see lockprofile.h) while profiling is enabled.
  */
 class lockableobject
 {
 public:
     lockableobject();
+    explicit lockableobject(const std::string &name);
     explicit lockableobject(lockableobject &ref); // cannot copy
     virtual ~lockableobject();
 
@@ -133,11 +229,24 @@ public:
     bool tryLock(); // returns true if the thread can/does own the lock; false otherwise
     void unlock();
 
+    void setName(const std::string &name); // the name under which the contention is profiled
+
 protected:
     ks_mutex_t *mutex();
 
+    // for the subclasses that release the mutex internally (e.g. Condition::wait())
+    void profileRelease();
+    void profileReacquire();
+    void lock_();       // without profiling
+    void unlock_();
+
 private:
-    ks_mutex_t mutex_;
+    void init_();
+    bool tryLock_();
+
+    ks_mutex_t   mutex_;
+    _LockRecord *profile_;   // 0 unless named
+    uint64_t     lockedat_;  // the time of acquisition, when profiled
 };
 
 /**
@@ -147,6 +256,7 @@ class Mutex: public lockableobject
 {
 public:
     Mutex();
+    explicit Mutex(const std::string &name);
     explicit Mutex(Mutex &ref); // cannot copy
 };
 
@@ -166,11 +276,16 @@ private:
 
 /**
  * @brief The Condition class -- a wrapper for a condition variable, with its associated Mutex object
+ *
+ * with a spinning WaitPolicy (see wait.h), wait() releases the mutex and spins on a
+ * notification counter before (optionally) blocking on the condition variable.
+ * the spinning only pays off when notify*() is called with the lock held, as usual.
  */
 class Condition: public lockableobject
 {
 public:
     Condition();
+    explicit Condition(const std::string &name);
     explicit Condition(Condition &ref); // cannot copy
     virtual ~Condition();
 
@@ -178,8 +293,22 @@ public:
     void notify();
     void notifyAll();
 
+    void       setWaitPolicy(const WaitPolicy &policy);
+    WaitPolicy waitPolicy() const; // the default of the calling thread, unless set
+
+    void addListener(ConditionListener *listener); // does not own 'listener' pointer
+    void removeListener(ConditionListener *listener);
+
 private:
-    ks_cond_t  cond_;
+    void init_();
+    bool park_(long timeout_msec);
+    void notifyListeners_();
+
+    ks_cond_t         cond_;
+    atomic<_ConditionListeners *> listeners_; // created on the first addListener()
+    WaitPolicy        policy_;
+    bool              custom_;  // whether policy_ is set
+    atomic<uint32_t>  seq_;     // incremented at every notify*()
 };
 
 /**
@@ -189,16 +318,80 @@ class Flag: public Condition
 {
 public:
     Flag();
+    explicit Flag(const std::string &name);
     explicit Flag(Flag &ref); // cannot copy
 
     // you must obtain lock() on this object when calling the following methods
     virtual bool wait(long timeout_msec=-1); // true when the state is/becomes true
-    bool isset() { return state_; }
+    bool isset() { return state_.load(memory_order_acquire); }
     void set(); // sets the state to true; internally it invokes notifyAll()
     void unset(); // sets the state to false; executes silently i.e. notify*() will not be invoked
 
 private:
-    bool        state_;
+    atomic<bool> state_;
+};
+
+/**
+ *  @brief PeriodicThread class -- a Thread that calls tick() at a fixed interval until stop()
+ *
+ *  the interval is measured from the end of a tick() to the start of the next one.
+ *  after stop(), finish() is called once on the thread itself, e.g. to report the final values.
+ */
+class PeriodicThread: public Thread
+{
+public:
+    explicit PeriodicThread(long interval_msec);
+    void stop(); // stops the ticking and joins the thread
+
+protected:
+    virtual void run();
+    virtual void tick() = 0;
+    virtual void finish(); // does nothing by default
+
+private:
+    long interval_;
+    Flag stop_;
+};
+
+/**
+ * _ThreadService class
+ *
+ * The global structure to monitor/manage all the threads in the program.
+ *
+ * Every Thread object is supposed to call put() when the Thread has been initialised
+ * and when it is being destroyed.
+ * This class also ensures that the main thread can be found from Thread::current(),
+ * as the method internally uses _ThreadService::get() call.
+ */
+class _ThreadService
+{
+public:
+    _ThreadService();
+    virtual ~_ThreadService();
+    void    put(ks_thread_id tid, Thread *tptr);
+    Thread *get(ks_thread_id tid);
+    std::vector<ThreadStats> snapshot();
+
+    // remove*Handler() waits for the calls of the handler in progress on the other threads,
+    // so that the handler may be destroyed right after
+    void    addExitHandler(ThreadExitHandler *handler); // does not own 'handler' pointer
+    void    removeExitHandler(ThreadExitHandler *handler);
+    void    notifyExit(Thread *thread);
+    void    addStartHandler(ThreadStartHandler *handler); // does not own 'handler' pointer
+    void    removeStartHandler(ThreadStartHandler *handler);
+    void    notifyStart(Thread *thread);
+private:
+    bool    beginCall_(const void *handler, bool registered);
+    void    endCall_(const void *handler, const void *outer);
+    void    waitCalls_(const void *handler);
+
+    FlatHashMap<ks_thread_id, Thread *> pool_;
+    Thread *main_;
+    Mutex   poollock_;
+    Condition handlerlock_;
+    std::vector<ThreadExitHandler *> handlers_;
+    std::vector<ThreadStartHandler *> starthandlers_;
+    std::vector<const void *> calling_; // the handlers being called, one entry per call
 };
 
 }
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #ifdef _WIN32
 #include <winsock2.h>
+#include <intrin.h>
 #else
 #include <time.h>
 #include <sys/time.h>
@@ -42,26 +43,113 @@ namespace ks {
     const uint64_t NSEC_IN_SEC = 1000000000ULL;
 
     /**
-    *   platform-specific wrapper for a real-time clock
+    *   the clocks that a nanostamp can read
+    */
+    enum ClockSource {
+        RealtimeClock,      // the wall clock; subject to the NTP slews and steps
+        MonotonicClock,     // CLOCK_MONOTONIC (QPC on Windows)
+        TSCClock,           // the invariant TSC (the virtual counter on aarch64), calibrated against
+                            // and reading on CLOCK_MONOTONIC_RAW; falls back to MonotonicClock if unsuitable
+        MonotonicRawClock,  // CLOCK_MONOTONIC_RAW: never slewed by NTP
+        BoottimeClock,      // CLOCK_BOOTTIME: keeps counting while the system is suspended
+    };
+
+    const int CLOCK_SOURCES = 5;
+
+    /**
+    *   the name of the clock e.g. "monotonic" (for diagnostic purposes)
+    */
+    const char *clock_name(ClockSource source);
+
+    /**
+    *   reads the CPU cycle counter (or 0 where there is none).
+    *   the value is only meaningful for a nanostamp with TSCClock.
+    *   the read waits for the preceding instructions (lfence, or isb on aarch64),
+    *   so that it is not executed ahead of the code being timed.
+    */
+    inline uint64_t read_tsc()
+    {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_lfence();
+        return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+        uint32_t lo, hi;
+        __asm__ __volatile__("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+        return (static_cast<uint64_t>(hi) << 32) | lo;
+#elif defined(__aarch64__)
+        uint64_t ticks;
+        __asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r"(ticks) : : "memory");
+        return ticks;
+#else
+        return 0;
+#endif
+    }
+
+    /**
+    *   platform-specific wrapper for one of the ClockSources.
+    *   a clock that the platform lacks falls back to MonotonicClock (see source()).
+    *   on Windows, all the clocks but TSCClock read QPC.
     */
     class nanostamp
     {
     public:
-        nanostamp();
+        /**
+        *   with TSCClock, the TSC is checked and calibrated on the first construction
+        *   (which takes about 10 ms); the later ones reuse the calibration.
+        */
+        explicit nanostamp(ClockSource source=RealtimeClock);
         /**
         *   get the timestamp into `holder`
         *   somehow it did not work by returning a uint64_t value.
         */
         void get(uint64_t *holder);
 
+        /**
+        *   the cheapest possible read, for timestamping at a high rate:
+        *   the raw TSC ticks with TSCClock, and nanoseconds otherwise.
+        *   the value is converted afterwards with to_nsec().
+        */
+        uint64_t ticks()
+        {
+            if (source_ == TSCClock) {
+                return read_tsc();
+            }
+            uint64_t nsec = 0;
+            get(&nsec);
+            return nsec;
+        }
+
+        uint64_t to_nsec(uint64_t ticks) const;
+
         /**
         *   tells if the real-time clock is available on the platform
         */
         bool is_available();
+
+        /**
+        *   the clock actually in use (i.e. MonotonicClock when the requested one has fallen back)
+        */
+        ClockSource source() const { return source_; }
+
+        /**
+        *   tells if the TSC is usable on this machine (runs the calibration if necessary)
+        */
+        static bool tsc_available();
+
+        /**
+        *   re-measures the TSC rate (over the whole time since the calibration) and re-bases it
+        *   on CLOCK_MONOTONIC_RAW, so that the TSCClock does not drift away from it.
+        *   the TSCClock stays monotonic across a resync: the new base is never below the old
+        *   mapping, so it may run ahead of the raw clock by the sampling error until that catches up.
+        *   ClockDomains::refresh() calls it, i.e. a ClockDomainRefresher keeps it in sync.
+        *   safe to call while the other threads convert.
+        */
+        static void resync_tsc();
     private:
-        bool     supported_;
+        bool        supported_;
+        ClockSource source_;
 #ifdef _WIN32
-        uint64_t freq_;
+        uint64_t    freq_;
 #endif
     };
 
@@ -79,19 +167,58 @@ namespace ks {
 
     /**
     *   platform-specific wrapper for a presicion timer
+    *
+    *   by default, sleep() sleeps for the interval relative to the call (so that a loop
+    *   drifts by its own execution time). in the periodic mode (see start_periodic()),
+    *   sleep() instead waits until the next of the absolute deadlines
+    *   start + k * interval on the monotonic clock, and keeps track of the deadlines
+    *   that have been overrun.
     */
     class nanotimer
     {
     public:
-        nanotimer() {}
+        nanotimer();
         /**
         *   sets the value to sleep during each sleep() call.
         *   (actual sleep duration will be `value` nanosec at minimum)
         */
         void set_interval(uint64_t value);
         void sleep();
+
+        /**
+        *   switches to the periodic mode, with the first deadline one interval from now.
+        *   with `spin_nsec` > 0, sleep() wakes up that much before the deadline and
+        *   busy-waits for the rest, for a wakeup precision better than the scheduler's
+        *   (at the cost of a CPU for `spin_nsec` every period).
+        */
+        void start_periodic(uint64_t spin_nsec=0);
+        void stop_periodic();       // back to the relative sleep()
+        bool is_periodic() const { return periodic_; }
+
+        /**
+        *   the accounting of the periodic mode. a sleep() called after its deadline returns
+        *   immediately and counts as an overrun; if whole periods have passed, their
+        *   deadlines are skipped (counted as missed) so that the phase is kept.
+        */
+        uint64_t overruns() const { return overruns_; }
+        uint64_t missed() const { return missed_; }
+        uint64_t last_lateness() const { return lastlate_; } // of the last wakeup, in nanosec
+        uint64_t max_lateness() const { return maxlate_; }
+        uint64_t next_deadline() const { return deadline_; } // on the monotonic clock, in nanosec
+
+        static uint64_t now(); // the monotonic clock used for the deadlines, in nanosec
     private:
+        void sleep_periodic_();
+
         timerspec_t spec_;
+        uint64_t    interval_;
+        bool        periodic_;
+        uint64_t    spin_;
+        uint64_t    deadline_;
+        uint64_t    overruns_;
+        uint64_t    missed_;
+        uint64_t    lastlate_;
+        uint64_t    maxlate_;
     };
 
 }
@@ -0,0 +1,140 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   trace.h -- timeline tracing, exported in the Chrome trace-event JSON format
+*
+*   while Tracer is enabled, each thread appends its events to a buffer of its own
+*   (without locking). Tracer::writeFile() merges the buffers into a JSON file that
+*   chrome://tracing and Perfetto (ui.perfetto.dev) can open, with one track per thread,
+*   named after the ks::Thread names.
+*
+*       void Encoder::process()
+*       {
+*           ks::TraceSpan span("encode", "pipeline");
+*           ...
+*       }
+*
+*   the names and the categories are not copied: pass string literals (or strings that
+*   outlive the writing). while tracing is disabled, a span or an event costs a single branch.
+*/
+#ifndef __KS_TRACE_H__
+#define __KS_TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <ostream>
+#include "ks/atomic.h"
+#include "ks/thread.h"
+
+#define KS_TRACE_CONCAT_(a, b) a##b
+#define KS_TRACE_CONCAT(a, b)  KS_TRACE_CONCAT_(a, b)
+
+/**
+ * traces the rest of the enclosing scope
+ */
+#define KS_TRACE_SCOPE(name) ks::TraceSpan KS_TRACE_CONCAT(ks_trace_span_, __LINE__)(name)
+
+namespace ks {
+
+const size_t TRACE_DEFAULT_CAPACITY = 1 << 16; // the events per thread
+
+/**
+ * @brief The Tracer class -- the global switch and the buffers of the trace events
+ */
+class Tracer
+{
+public:
+    /**
+    *   starts (or resumes) recording. `capacity` is the number of events a thread
+    *   can keep; the events beyond it are dropped (and counted).
+    *   the timestamps come from a nanostamp with TSCClock.
+    */
+    static void enable(size_t capacity=TRACE_DEFAULT_CAPACITY);
+    static void disable();
+    static bool enabled() { return enabled_.load(memory_order_relaxed); }
+
+    static void instant(const char *name, const char *category="ks")
+    {
+        if( enabled() ){
+            event_(name, category, 'i', timestamp(), 0, 0);
+        }
+    }
+
+    static void counter(const char *name, int64_t value, const char *category="ks")
+    {
+        if( enabled() ){
+            event_(name, category, 'C', timestamp(), 0, value);
+        }
+    }
+
+    /**
+    *   writes all the events recorded so far. may be called while tracing.
+    *   the events of the exited threads are only written once: their buffers are reused afterwards.
+    */
+    static void write(std::ostream &out);
+    static bool writeFile(const std::string &path); // false (with a warning logged) on failure
+
+    /**
+    *   discards the recorded events; call it while no thread is tracing.
+    */
+    static void clear();
+    static uint64_t dropped(); // the events dropped so far, for the lack of capacity
+
+    static uint64_t timestamp(); // the raw clock ticks
+    static void complete(const char *name, const char *category, uint64_t start); // (used by TraceSpan)
+
+private:
+    static void event_(const char *name, const char *category, char phase, uint64_t ts, uint64_t dur, int64_t value);
+
+    static atomic<bool> enabled_;
+};
+
+/**
+ * @brief The TraceSpan class -- records the duration of its lifetime as a 'complete' event
+ */
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name, const char *category="ks"):
+        name_(name), category_(category), start_(Tracer::enabled()? Tracer::timestamp(): 0) {}
+    explicit TraceSpan(TraceSpan &ref); // cannot copy
+
+    ~TraceSpan()
+    {
+        if( start_ != 0 ){
+            Tracer::complete(name_, category_, start_);
+        }
+    }
+
+private:
+    const char *name_;
+    const char *category_;
+    uint64_t    start_;
+};
+
+}
+
+#endif // __KS_TRACE_H__
@@ -28,9 +28,15 @@
 #ifndef __KS_UTILS_H__
 #define __KS_UTILS_H__
 
+#include <stdint.h>
 #include <string>
 #include <map>
 #include <vector>
+#include "ks/compat.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #define hasKeyInMap(key, mapobj) ( (!((mapobj).empty())) && (((mapobj).find((key))) != ((mapobj).end())))
 
@@ -42,38 +48,72 @@ namespace ks {
 
     enum ResultType { Success, Failure };
 
+    /**
+     *  a value or an error message.
+     *  in the C++11 build, a Result is movable, and the value can be moved in (success(T&&))
+     *  or constructed in place (emplace(args...)).
+     */
     template <typename T>
     class Result {
     private:
         ResultType        _type;
         T                 _value;
-        const std::string _msg;
+        std::string       _msg;
 
         explicit Result(ResultType type):
             _type(type) {}
+#ifdef KS_HAS_CXX11
+        struct _in_place {};
+
+        template <typename... Args>
+        Result(ResultType type, _in_place, Args&&... args):
+            _type(type), _value(std::forward<Args>(args)...) {}
+#endif
 
     public:
         Result(ResultType type, const T& value):
             _type(type), _value(value) {}
         Result(ResultType type, const std::string& msg):
             _type(type), _msg(msg) {}
+#ifdef KS_HAS_CXX11
+        Result(ResultType type, T&& value):
+            _type(type), _value(std::move(value)) {}
+        Result(ResultType type, std::string&& msg):
+            _type(type), _msg(std::move(msg)) {}
+
+        template <typename... Args>
+        static Result<T> emplace(Args&&... args)
+        {
+            return Result<T>(Success, _in_place(), std::forward<Args>(args)...);
+        }
+
+        static Result<T> success(T&& value)
+        {
+            return Result<T>(Success, std::move(value));
+        }
 
-        const bool failed() const
+        static Result<T> failure(std::string&& msg)
+        {
+            return Result<T>(Failure, std::move(msg));
+        }
+#endif
+
+        const bool failed() const KS_NOEXCEPT
         {
             return (_type == Failure);
         }
 
-        const bool successful() const
+        const bool successful() const KS_NOEXCEPT
         {
             return (_type == Success);
         }
 
-        T& get()
+        T& get() KS_NOEXCEPT
         {
             return _value;
         }
 
-        const std::string& what() const
+        const std::string& what() const KS_NOEXCEPT
         {
             return _msg;
         }
@@ -101,50 +141,35 @@ namespace ks {
 
 
     /**
-     *  if finalize_element() involves erasing the key as well, put 'false' to erase_key
+     *  the map is taken by reference and emptied (swapped out) before finalize_element() is called
+     *  on each entry, so that nothing is copied, and finalize_element() may erase from (or re-insert
+     *  into) the map. erase_key is kept for compatibility: the entries are removed either way.
      */
     template<typename Cls, typename K, typename V>
-    void clear_byvalue(Cls instance, std::map<K, V> mapobj, void (*finalize_element)(Cls, V), bool erase_key)
+    void clear_byvalue(Cls instance, std::map<K, V> &mapobj, void (*finalize_element)(Cls, V), bool erase_key)
     {
-        typedef typename std::map<K, V>::iterator tmpiter;
-        K *keys = new K[mapobj.size()];
-        V *values = new V[mapobj.size()];
-        int sizeptr = 0;
-        for( tmpiter it=mapobj.begin(); it != mapobj.end(); ++it, ++sizeptr ){
-            *(keys+sizeptr) = static_cast<K>(it->first);
-            *(values+sizeptr) = static_cast<V>(it->second);
-        }
-        // now sizeptr should point to mapobj.size()
-        for(int idx=0; idx<sizeptr; idx++){
-            finalize_element(instance, *(values+idx));
-            if( erase_key == true ){
-                mapobj.erase(*(keys+idx));
-            }
+        (void)erase_key;
+        std::map<K, V> entries;
+        entries.swap(mapobj);
+        for( typename std::map<K, V>::iterator it=entries.begin(); it != entries.end(); ++it ){
+            finalize_element(instance, it->second);
         }
-        delete[] keys;
-        delete[] values;
     }
 
     template<typename Cls, typename K, typename V>
-    void clear_bykey(Cls instance, std::map<K, V> mapobj, void (*finalize_element)(Cls, K), bool erase_key)
+    void clear_bykey(Cls instance, std::map<K, V> &mapobj, void (*finalize_element)(Cls, K), bool erase_key)
     {
-        typedef typename std::map<K, V>::iterator tmpiter;
-        K *keys = new K[mapobj.size()];
-        int sizeptr = 0;
-        for( tmpiter it=mapobj.begin(); it != mapobj.end(); ++it, ++sizeptr ){
-            *(keys+sizeptr) = static_cast<K>(it->first);
-        }
-
-        // now sizeptr should point to mapobj.size()
-        for(int idx=0; idx<sizeptr; idx++){
-            finalize_element(instance, *(keys+idx));
-            if( erase_key == true ){
-                mapobj.erase(*(keys+idx));
-            }
+        (void)erase_key;
+        std::map<K, V> entries;
+        entries.swap(mapobj);
+        for( typename std::map<K, V>::iterator it=entries.begin(); it != entries.end(); ++it ){
+            finalize_element(instance, it->first);
         }
-        delete[] keys;
     }
 
+    /**
+     *  the vector is copied on purpose: finalize() may erase the element from the original (see LogPool)
+     */
     template<typename Cls, typename V>
     void clear_vector(Cls instance, std::vector<V> v, void (*finalize)(Cls, V))
     {
@@ -162,9 +187,24 @@ namespace ks {
         return ( str.find(c, str.length()-1) != std::string::npos );
     }
 
+    /**
+    *   the index of the highest bit set, i.e. the log2 histogram bucket of v (0 for both 0 and 1)
+    */
+    inline int log2_bucket(uint64_t v)
+    {
+#ifdef _MSC_VER
+        unsigned long idx;
+        return _BitScanReverse64(&idx, v)? static_cast<int>(idx): 0;
+#else
+        return (v == 0)? 0: (63 - __builtin_clzll(v));
+#endif
+    }
+
     /**
     *   the template class used for averaging lots of samples.
     *   the sum will be reset at a certain limit to avoid overflow.
+    *   (use ks::HdrHistogram in hdrhistogram.h for the percentiles, and the estimators
+    *   in stats.h for the variance, moving averages and quantiles without the reset.)
     */
     template <typename Val, typename Num>
     class averager
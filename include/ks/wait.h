@@ -0,0 +1,125 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   wait.h -- wait strategies for the blocking primitives
+*
+*   parking a thread in the kernel and waking it up again costs several microseconds.
+*   a waiter that expects to be notified soon can instead spin for a while,
+*   and (depending on the strategy) yield or park afterwards.
+*
+*   the strategy can be selected per primitive (e.g. Condition::setWaitPolicy())
+*   or per thread (WaitPolicy::setThreadDefault()); the primitives without their own
+*   policy use the default of the waiting thread.
+*/
+#ifndef __KS_WAIT_H__
+#define __KS_WAIT_H__
+
+#include <stdint.h>
+#include "ks/atomic.h"
+
+#ifdef _WIN32
+#include <winsock2.h> // instead of windows.h
+#endif
+
+namespace ks {
+
+enum WaitStrategy {
+    ParkWait      = 0,  // blocks in the kernel right away (the default)
+    SpinWait      = 1,  // busy-spins with a pause instruction; never blocks
+    SpinYieldWait = 2,  // spins, and then keeps yielding the CPU; never blocks
+    SpinParkWait  = 3,  // spins, and then blocks
+};
+
+const uint32_t WAIT_DEFAULT_SPINS = 0x400;
+
+/**
+ * @brief The WaitPolicy struct -- a strategy with its spin limit
+ */
+struct WaitPolicy
+{
+    WaitPolicy(): strategy(ParkWait), spins(0) {}
+    WaitPolicy(WaitStrategy s, uint32_t n): strategy(s), spins(n) {}
+
+    WaitStrategy strategy;
+    uint32_t     spins;     // the number of pause iterations before yielding/parking
+
+    static WaitPolicy park()                                { return WaitPolicy(ParkWait, 0); }
+    static WaitPolicy spin()                                { return WaitPolicy(SpinWait, 0); }
+    static WaitPolicy spinYield(uint32_t n=WAIT_DEFAULT_SPINS) { return WaitPolicy(SpinYieldWait, n); }
+    static WaitPolicy spinPark(uint32_t n=WAIT_DEFAULT_SPINS)  { return WaitPolicy(SpinParkWait, n); }
+
+    /**
+    *   a policy whose spin phase lasts about as long as a park/wake-up round
+    *   costs on this host (see calibrate_park_nsec()).
+    */
+    static WaitPolicy calibrated(WaitStrategy strategy);
+
+    static void       setThreadDefault(const WaitPolicy &policy); // for the calling thread
+    static WaitPolicy threadDefault();
+};
+
+/**
+ * the hint to the CPU that the thread is spinning
+ */
+inline void cpu_relax()
+{
+#if defined(_MSC_VER)
+    YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+void thread_yield(); // gives up the rest of the time slice
+
+enum SpinResult {
+    SpinChanged,    // *word no longer equals `seen`
+    SpinExhausted,  // the spin phase ended; the caller should park now
+    SpinTimedOut,   // `deadline_nsec` has passed
+};
+
+/**
+*   spins (and/or yields) according to `policy` while `word` == seen.
+*   `deadline_nsec` is on wait_now_nsec(), or 0 for no deadline.
+*   for ParkWait, returns SpinExhausted right away.
+*/
+SpinResult spin_until_changed(const atomic<uint32_t> &word, uint32_t seen, const WaitPolicy &policy, uint64_t deadline_nsec=0);
+
+uint64_t wait_now_nsec(); // a monotonic clock, in nanoseconds
+
+/**
+*   calibration helpers (measured on the first call, and cached afterwards)
+*/
+double   calibrate_spins_per_usec();   // the cpu_relax() iterations per microsecond
+uint64_t calibrate_park_nsec();        // the latency of waking up a parked thread, in nanoseconds
+
+}
+
+#endif // __KS_WAIT_H__
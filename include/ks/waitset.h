@@ -0,0 +1,124 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   waitset.h -- waiting on several Flags, Conditions, file descriptors and timers at once
+*
+*   a WaitSet is built on epoll (Linux only): file descriptors are watched directly,
+*   timers are timerfds, and the Flags/Conditions wake the WaitSet up through an eventfd
+*   (see ConditionListener).
+*
+*   a WaitSet is meant to be used from a single thread (e.g. as an event loop);
+*   the sources themselves may be notified from any thread, and so may wake() be called.
+*   a Flag or Condition must be removed (or the WaitSet destroyed) before it is destroyed.
+*/
+#ifndef __KS_WAITSET_H__
+#define __KS_WAITSET_H__
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include "ks/thread.h"
+#include "ks/hashmap.h"
+
+namespace ks {
+
+enum WaitSourceKind {
+    WaitFlag,
+    WaitCondition,
+    WaitDescriptor,
+    WaitTimer,
+};
+
+enum WaitEvents {
+    WaitReadable = 0x01,
+    WaitWritable = 0x02,
+    WaitError    = 0x04,    // reported only
+    WaitHangup   = 0x08,    // reported only
+};
+
+/**
+ * @brief The WaitEvent struct -- a ready source, as reported by WaitSet::wait()
+ */
+struct WaitEvent
+{
+    WaitEvent(): source(0), kind(WaitFlag), events(0), count(0) {}
+
+    int            source;  // the id returned by WaitSet::add*()
+    WaitSourceKind kind;
+    unsigned int   events;  // for a descriptor: the WaitEvents that are ready
+    uint64_t       count;   // for a timer: the expirations since the last report
+};
+
+class _WaitSource;
+
+/**
+ * @brief The WaitSet class
+ *
+ * readiness is reported as follows:
+ *
+ * + a Flag: as long as it is set (level-triggered)
+ * + a Condition: once per notify*() burst since the last report (edge-triggered)
+ * + a descriptor: as long as it is readable/writable (level-triggered, as with poll())
+ * + a timer: once per (batch of) expirations
+ */
+class WaitSet
+{
+public:
+    WaitSet(); // throws std::runtime_error (on the platforms other than Linux, always)
+    explicit WaitSet(WaitSet &ref); // cannot copy
+    ~WaitSet();
+
+    int  addFlag(Flag &flag);
+    int  addCondition(Condition &cond);
+    int  addDescriptor(int fd, unsigned int events=WaitReadable); // does not own 'fd'
+    int  addTimer(long interval_msec, bool periodic=true);        // the first expiry is after `interval_msec`
+    void remove(int source);
+
+    /**
+    *   blocks until at least one of the sources is ready, wake() is called,
+    *   or the timeout elapses. fills `ready` and returns the number of ready sources.
+    */
+    int  wait(std::vector<WaitEvent> &ready, long timeout_msec=-1);
+
+    void wake(); // makes the (next) wait() return, possibly with no ready source
+
+    size_t size() const { return sources_.size(); }
+
+private:
+    void   collect_(std::vector<WaitEvent> &ready);
+    int    add_(_WaitSource *source);
+    void   control_(int op, int fd, uint32_t events, int source);
+
+    int                             epfd_;
+    int                             wakefd_;
+    int                             nextid_;
+    atomic<int>                     wakes_;     // the pending wake() calls
+    FlatHashMap<int, _WaitSource *> sources_;
+};
+
+}
+
+#endif // __KS_WAITSET_H__
@@ -0,0 +1,196 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   clockdomain.cpp -- see clockdomain.h for description
+*/
+
+#include <cstdio>
+#include <time.h>
+#include "ks/clockdomain.h"
+#include "ks/atomic.h"
+
+namespace ks {
+
+const int CLOCK_SAMPLE_TRIALS = 7;
+
+#ifdef _WIN32
+const uint64_t FILETIME_UNIX_EPOCH = 116444736000000000ULL; // 1970-01-01 in 100-ns units since 1601-01-01
+#endif
+
+/**
+*   the wall clock in nanosec since the Unix epoch
+*/
+uint64_t wall_nsec()
+{
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    uint64_t ticks = (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    return (ticks - FILETIME_UNIX_EPOCH) * 100;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * NSEC_IN_SEC + static_cast<uint64_t>(ts.tv_nsec);
+#endif
+}
+
+/**
+ * the offsets of the clocks to the wall clock.
+ * the readers load them without a lock; refresh() is serialized by lock_.
+ */
+class _ClockDomainState
+{
+public:
+    _ClockDomainState(): refreshes_(0), lastrefresh_(0)
+    {
+        for( int i=0; i<CLOCK_SOURCES; i++ ){
+            clocks_[i] = new nanostamp(static_cast<ClockSource>(i));
+        }
+        // refresh() skips RealtimeClock, the reference of the offsets
+        offsets_[RealtimeClock].store(0, memory_order_relaxed);
+        uncertainty_[RealtimeClock].store(0, memory_order_relaxed);
+        refresh();
+    }
+
+    uint64_t now(ClockSource clock)
+    {
+        if( clock == RealtimeClock ){
+            return wall_nsec();
+        }
+        uint64_t nsec = 0;
+        clocks_[clock]->get(&nsec);
+        return nsec;
+    }
+
+    void refresh()
+    {
+        MutexLocker locker(&lock_);
+        // the TSC is re-based first, so that its offset is measured on the new calibration
+        if( clocks_[TSCClock]->source() == TSCClock ){
+            nanostamp::resync_tsc();
+        }
+        for( int i=1; i<CLOCK_SOURCES; i++ ){
+            ClockSource clock = static_cast<ClockSource>(i);
+            uint64_t window = ~static_cast<uint64_t>(0);
+            int64_t  offset = 0;
+            for( int j=0; j<CLOCK_SAMPLE_TRIALS; j++ ){
+                uint64_t before = now(clock);
+                uint64_t wall   = wall_nsec();
+                uint64_t after  = now(clock);
+                if( (after >= before) && ((after - before) < window) ){
+                    window = after - before;
+                    offset = static_cast<int64_t>(wall) - static_cast<int64_t>(before + window / 2);
+                }
+            }
+            offsets_[i].store(offset, memory_order_relaxed);
+            uncertainty_[i].store(window, memory_order_relaxed);
+        }
+        lastrefresh_.store(now(MonotonicClock), memory_order_relaxed);
+        refreshes_.fetch_add(1, memory_order_release);
+    }
+
+    int64_t offset(ClockSource clock) { return offsets_[clock].load(memory_order_relaxed); }
+    uint64_t uncertainty(ClockSource clock) { return uncertainty_[clock].load(memory_order_relaxed); }
+    uint64_t refreshes() { return refreshes_.load(memory_order_acquire); }
+    uint64_t lastRefresh() { return lastrefresh_.load(memory_order_relaxed); }
+
+private:
+    Mutex               lock_;
+    nanostamp          *clocks_[CLOCK_SOURCES];   // never deleted (the state lives until the exit)
+    atomic<int64_t>     offsets_[CLOCK_SOURCES];  // to the wall clock (0 for RealtimeClock)
+    atomic<uint64_t>    uncertainty_[CLOCK_SOURCES];
+    atomic<uint64_t>    refreshes_;
+    atomic<uint64_t>    lastrefresh_;
+};
+
+_ClockDomainState &clock_domains()
+{
+    static _ClockDomainState state_;
+    return state_;
+}
+
+// ClockDomains
+
+// static
+uint64_t ClockDomains::now(ClockSource clock) { return clock_domains().now(clock); }
+
+// static
+void ClockDomains::refresh() { clock_domains().refresh(); }
+
+// static
+int64_t ClockDomains::offset(ClockSource from, ClockSource to)
+{
+    _ClockDomainState &state = clock_domains();
+    return state.offset(from) - state.offset(to);
+}
+
+// static
+uint64_t ClockDomains::convert(uint64_t nsec, ClockSource from, ClockSource to)
+{
+    return nsec + static_cast<uint64_t>(offset(from, to));
+}
+
+// static
+std::string ClockDomains::format(uint64_t nsec, ClockSource from, bool utc)
+{
+    uint64_t wall = to_realtime(nsec, from);
+    time_t   sec  = static_cast<time_t>(wall / NSEC_IN_SEC);
+    struct tm parts;
+#ifdef _WIN32
+    if( utc ){
+        gmtime_s(&parts, &sec);
+    } else {
+        localtime_s(&parts, &sec);
+    }
+#else
+    if( utc ){
+        gmtime_r(&sec, &parts);
+    } else {
+        localtime_r(&sec, &parts);
+    }
+#endif
+    char date[32], frac[16];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &parts);
+    std::sprintf(frac, ".%09u", static_cast<unsigned int>(wall % NSEC_IN_SEC));
+    return std::string(date) + frac;
+}
+
+// static
+uint64_t ClockDomains::uncertainty(ClockSource clock) { return clock_domains().uncertainty(clock); }
+
+// static
+uint64_t ClockDomains::refreshes() { return clock_domains().refreshes(); }
+
+// static
+uint64_t ClockDomains::last_refresh() { return clock_domains().lastRefresh(); }
+
+// ClockDomainRefresher
+
+void ClockDomainRefresher::tick()
+{
+    ClockDomains::refresh();
+}
+
+}
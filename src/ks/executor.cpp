@@ -0,0 +1,151 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   executor.cpp -- see executor.h for description
+*/
+
+#include <stdexcept>
+#include "ks/executor.h"
+#include "ks/log.h"
+
+namespace ks {
+
+Task::Task() {}
+Task::~Task() {}
+
+Executor::Executor() {}
+Executor::~Executor() {}
+
+InlineExecutor::InlineExecutor(): Executor() {}
+
+void InlineExecutor::execute(Task *task)
+{
+    task->run();
+    delete task;
+}
+
+// static
+InlineExecutor *InlineExecutor::instance()
+{
+    static InlineExecutor instance_;
+    return &instance_;
+}
+
+ThreadPool::Worker::Worker(ThreadPool *pool): Thread(), pool_(pool) {}
+
+void ThreadPool::Worker::run()
+{
+    Task *task;
+    while( (task = pool_->next()) != 0 ){
+        try {
+            task->run();
+        } catch(std::exception &e) {
+            ks::logger::error("ks::ThreadPool") << "a task threw an exception: " << e.what() << ks::endl;
+        }
+        delete task;
+    }
+}
+
+ThreadPool::ThreadPool(unsigned int workers):
+    Executor(),
+    lock_(),
+    pending_(0),
+    stopping_(false)
+{
+    if( workers == 0 ){
+        workers = Thread::hardwareConcurrency();
+    }
+    for( unsigned int i=0; i<workers; i++ ){
+        Worker *w = new Worker(this);
+        workers_.push_back(w);
+        w->start();
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    shutdown();
+}
+
+void ThreadPool::execute(Task *task)
+{
+    lock_.lock();
+    if( stopping_ ){
+        lock_.unlock();
+        delete task;
+        throw std::runtime_error("ThreadPool::execute() called after shutdown()");
+    }
+    queue_.push_back(task);
+    lock_.unlock();
+    pending_.post();
+}
+
+unsigned int ThreadPool::size() const
+{
+    return static_cast<unsigned int>(workers_.size());
+}
+
+Task *ThreadPool::next()
+{
+    pending_.wait();
+
+    Task *task = 0;
+    lock_.lock();
+    if( !queue_.empty() ){
+        task = queue_.front();
+        queue_.pop_front();
+    }
+    lock_.unlock();
+    return task;
+}
+
+void ThreadPool::shutdown()
+{
+    lock_.lock();
+    if( stopping_ ){
+        lock_.unlock();
+        return;
+    }
+    stopping_ = true;
+    lock_.unlock();
+
+    // one extra count per worker: a worker exits when it finds the queue drained
+    pending_.post(static_cast<int32_t>(workers_.size()));
+    for( std::vector<Worker *>::iterator it=workers_.begin(); it!=workers_.end(); ++it ){
+        (*it)->join();
+        delete *it;
+    }
+    workers_.clear();
+}
+
+// static
+ThreadPool *ThreadPool::global()
+{
+    static ThreadPool pool_;
+    return &pool_;
+}
+
+}
@@ -0,0 +1,706 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   fiber.cpp -- see fiber.h for description
+*/
+
+#include <stdexcept>
+#include "ks/fiber.h"
+#include "ks/timing.h"
+#include "ks/utils.h"
+#include "ks/log.h"
+
+#if defined(_WIN32)
+#define KS_FIBER_UNSUPPORTED
+#elif defined(__x86_64__) || defined(__aarch64__)
+#define KS_FIBER_ASM
+#else
+#define KS_FIBER_UCONTEXT
+#endif
+
+#ifndef _WIN32
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef KS_FIBER_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+namespace ks {
+
+/**
+ * the saved execution context of a fiber or a carrier
+ */
+struct _FiberContext
+{
+    void      *sp;      // the saved stack pointer (KS_FIBER_ASM)
+    void      *stack;   // the lowest address of the mapping, including the guard page
+    size_t     size;    // the size of the mapping
+#ifdef KS_FIBER_UCONTEXT
+    ucontext_t uc;
+#endif
+};
+
+void _fiber_start(Fiber *fiber)
+{
+    fiber->entry_();
+}
+
+}
+
+extern "C" void ks_fiber_start_c(void *fiber)
+{
+    ks::_fiber_start(static_cast<ks::Fiber *>(fiber));
+}
+
+#ifdef KS_FIBER_ASM
+
+extern "C" void ks_fiber_switch(void **from_sp, void *to_sp);
+extern "C" void ks_fiber_trampoline();
+
+#ifdef __APPLE__
+#define KS_ASM_NAME(name)      "_" #name
+#define KS_ASM_FUNCTION(name)  ".globl _" #name "\n" ".p2align 4\n" "_" #name ":\n"
+#define KS_ASM_CALL(name)      "_" #name
+#else
+#if defined(__x86_64__)
+#define KS_ASM_FUNCTION(name)  ".globl " #name "\n" ".type " #name ",@function\n" ".p2align 4\n" #name ":\n"
+#define KS_ASM_CALL(name)      #name "@PLT"
+#else
+#define KS_ASM_FUNCTION(name)  ".globl " #name "\n" ".type " #name ",%function\n" ".p2align 4\n" #name ":\n"
+#define KS_ASM_CALL(name)      #name
+#endif
+#endif
+
+#if defined(__x86_64__)
+/*
+ * ks_fiber_switch(from_sp, to_sp): saves the callee-saved registers and the
+ * FPU control words onto the current stack, stores the stack pointer into
+ * *from_sp, and restores the same from to_sp.
+ *
+ * stack layout (from the saved sp upwards):
+ *     x87 control word, mxcsr, r15, r14, r13, r12, rbx, rbp, return address
+ */
+__asm__(
+    ".text\n"
+    KS_ASM_FUNCTION(ks_fiber_switch)
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $16, %rsp\n"
+    "    stmxcsr 8(%rsp)\n"
+    "    fnstcw (%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    fldcw (%rsp)\n"
+    "    ldmxcsr 8(%rsp)\n"
+    "    addq $16, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    KS_ASM_FUNCTION(ks_fiber_trampoline)
+    "    movq %r12, %rdi\n"
+    "    andq $-16, %rsp\n"
+    "    call " KS_ASM_CALL(ks_fiber_start_c) "\n"
+    "    ud2\n"
+);
+
+const size_t SWITCH_FRAME_SIZE = 80; // 16 (control words) + 6 registers + return address + padding
+#else // __aarch64__
+/*
+ * the same on aarch64, with x19-x30 and d8-d15 saved in a 176-byte frame:
+ *     x19..x28 at [0, 80), x29/x30 at [80, 96), d8..d15 at [96, 160)
+ */
+__asm__(
+    ".text\n"
+    KS_ASM_FUNCTION(ks_fiber_switch)
+    "    sub sp, sp, #176\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #176\n"
+    "    ret\n"
+    KS_ASM_FUNCTION(ks_fiber_trampoline)
+    "    mov x0, x19\n"
+    "    bl " KS_ASM_CALL(ks_fiber_start_c) "\n"
+    "    brk #0\n"
+);
+
+const size_t SWITCH_FRAME_SIZE = 176;
+#endif
+
+#endif // KS_FIBER_ASM
+
+#ifdef KS_FIBER_UCONTEXT
+extern "C" void ks_fiber_ucontext_entry(unsigned int hi, unsigned int lo)
+{
+    uintptr_t ptr = (static_cast<uintptr_t>(hi) << 16 << 16) | static_cast<uintptr_t>(lo);
+    ks_fiber_start_c(reinterpret_cast<void *>(ptr));
+}
+#endif
+
+namespace ks {
+
+/**
+ * switches from the context `from` to `to`
+ */
+inline void context_switch(_FiberContext *from, _FiberContext *to)
+{
+#if defined(KS_FIBER_ASM)
+    ks_fiber_switch(&(from->sp), to->sp);
+#elif defined(KS_FIBER_UCONTEXT)
+    swapcontext(&(from->uc), &(to->uc));
+#else
+    (void)from;
+    (void)to;
+#endif
+}
+
+/**
+ * prepares `context` (whose stack is already allocated) so that switching into it runs `fiber`
+ */
+void context_init(_FiberContext *context, Fiber *fiber)
+{
+#if defined(KS_FIBER_ASM)
+    uintptr_t top = (reinterpret_cast<uintptr_t>(context->stack) + context->size) & ~static_cast<uintptr_t>(15);
+    void    **frame = reinterpret_cast<void **>(top - SWITCH_FRAME_SIZE);
+    for( size_t i=0; i<SWITCH_FRAME_SIZE/sizeof(void *); i++ ){
+        frame[i] = 0;
+    }
+#if defined(__x86_64__)
+    uint32_t *control = reinterpret_cast<uint32_t *>(frame);
+    control[0] = 0x037F;    // the default x87 control word
+    control[2] = 0x1F80;    // the default mxcsr
+    frame[5] = fiber;       // r12
+    frame[8] = reinterpret_cast<void *>(&ks_fiber_trampoline); // return address
+#else
+    frame[0]  = fiber;      // x19
+    frame[11] = reinterpret_cast<void *>(&ks_fiber_trampoline); // x30
+#endif
+    context->sp = frame;
+#elif defined(KS_FIBER_UCONTEXT)
+    getcontext(&(context->uc));
+    context->uc.uc_stack.ss_sp   = context->stack;
+    context->uc.uc_stack.ss_size = context->size;
+    context->uc.uc_link          = 0;
+    uintptr_t ptr = reinterpret_cast<uintptr_t>(fiber);
+    makecontext(&(context->uc), reinterpret_cast<void (*)()>(&ks_fiber_ucontext_entry), 2,
+                static_cast<unsigned int>(ptr >> 16 >> 16), static_cast<unsigned int>(ptr & 0xFFFFFFFFU));
+#else
+    (void)context;
+    (void)fiber;
+#endif
+}
+
+/**
+ * @brief The _Carrier class -- an OS thread that runs fibers one after another.
+ * the action requested by the fiber that switched back is carried out by the
+ * carrier, after the fiber's context has been completely saved.
+ */
+class _Carrier: public Thread
+{
+public:
+    enum Action { None, Yield, Park, Sleep, Finish };
+
+    explicit _Carrier(FiberScheduler *scheduler):
+        Thread(), action(None), guard(0), running(0), scheduler_(scheduler)
+    {
+        context.sp    = 0;
+        context.stack = 0;
+        context.size  = 0;
+    }
+
+    _FiberContext context;
+    Action        action;
+    Mutex        *guard;
+    Fiber        *running;
+
+protected:
+    virtual void run();
+
+private:
+    FiberScheduler *scheduler_;
+};
+
+#ifndef KS_FIBER_UNSUPPORTED
+static KS_THREAD_LOCAL _Carrier *current_carrier_ = 0;
+
+/**
+ * a fiber may resume on a different carrier than the one it left,
+ * so the thread-local pointer is never cached across a switch.
+ */
+__attribute__((noinline)) _Carrier *current_carrier()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return current_carrier_;
+}
+
+__attribute__((noinline)) void set_current_carrier(_Carrier *carrier)
+{
+    current_carrier_ = carrier;
+}
+#else
+_Carrier *current_carrier() { return 0; }
+void set_current_carrier(_Carrier *) {}
+#endif
+
+/**
+ * makes a sleeping fiber runnable again
+ */
+class _FiberWakeup: public TimerTask
+{
+public:
+    _FiberWakeup(FiberScheduler *scheduler, Fiber *fiber): TimerTask(), scheduler_(scheduler), fiber_(fiber) {}
+    virtual void fire() { scheduler_->ready_(fiber_); }
+private:
+    FiberScheduler *scheduler_;
+    Fiber          *fiber_;
+};
+
+void _Carrier::run()
+{
+    set_current_carrier(this);
+    Fiber *fiber;
+    while( (fiber = scheduler_->next_()) != 0 ){
+        running = fiber;
+        action  = None;
+        context_switch(&context, fiber->context_);
+        running = 0;
+
+        switch( action )
+        {
+        case Yield:
+            scheduler_->ready_(fiber);
+            break;
+        case Park:
+            guard->unlock();
+            break;
+        case Sleep:
+            scheduler_->timers_->schedule(new _FiberWakeup(scheduler_, fiber), fiber->sleepfor_);
+            break;
+        case Finish:
+            scheduler_->finished_(fiber);
+            break;
+        case None:
+        default:
+            break;
+        }
+    }
+    set_current_carrier(0);
+}
+
+// Fiber
+
+/**
+ * the stack size rounded up to the page size, with room for the guard page and FIBER_MIN_STACK
+ */
+static size_t fiber_stack_size(size_t size)
+{
+#ifdef _WIN32
+    return size;
+#else
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t rounded = ((size + page - 1) / page) * page;
+    if( (rounded < size) || (rounded < page + FIBER_MIN_STACK) ){
+        ks::logger::error("ks::Fiber") << "stack size " << size << " is too small (the guard page is "
+                                       << page << " bytes)" << ks::endl;
+        throw std::runtime_error("ks::Fiber: stack size too small");
+    }
+    return rounded;
+#endif
+}
+
+Fiber::Fiber(size_t stack_size):
+    stacksize_(fiber_stack_size(stack_size)),
+    context_(new _FiberContext()),
+    scheduler_(0),
+    sleepfor_(0)
+{
+    context_->sp    = 0;
+    context_->stack = 0;
+    context_->size  = 0;
+}
+
+Fiber::~Fiber()
+{
+    if( (scheduler_ != 0) && (context_->stack != 0) ){
+        scheduler_->freeStack_(context_->stack, context_->size);
+    }
+    delete context_;
+}
+
+// static
+Fiber *Fiber::current()
+{
+    _Carrier *carrier = current_carrier();
+    return (carrier != 0)? carrier->running: 0;
+}
+
+// static
+void Fiber::yield()
+{
+    Fiber *self = current();
+    if( self != 0 ){
+        self->suspend_(_Carrier::Yield, 0);
+    }
+}
+
+// static
+void Fiber::sleep(long msec)
+{
+    Fiber *self = current();
+    if( self == 0 ){
+        sleep_msec(static_cast<unsigned int>(msec));
+        return;
+    }
+    self->sleepfor_ = msec;
+    self->suspend_(_Carrier::Sleep, 0);
+}
+
+void Fiber::entry_()
+{
+    try {
+        run();
+    } catch(std::exception &e) {
+        ks::logger::error("ks::Fiber") << "a fiber threw an exception: " << e.what() << ks::endl;
+    } catch(...) {
+        // unwinding must not go past this frame, as there is no caller to return to
+        ks::logger::error("ks::Fiber") << "a fiber threw an unknown exception" << ks::endl;
+    }
+    suspend_(_Carrier::Finish, 0);
+}
+
+void Fiber::suspend_(int action, Mutex *guard)
+{
+    _Carrier *carrier = current_carrier();
+    carrier->action = static_cast<_Carrier::Action>(action);
+    carrier->guard  = guard;
+    context_switch(context_, &(carrier->context));
+}
+
+void Fiber::park_(Mutex *guard)
+{
+    suspend_(_Carrier::Park, guard);
+}
+
+// FiberScheduler
+
+FiberScheduler::FiberScheduler(unsigned int carriers):
+    lock_(),
+    runnable_(0),
+    idle_(),
+    live_(0),
+    stopping_(false),
+    timers_(0)
+{
+#ifdef KS_FIBER_UNSUPPORTED
+    throw std::runtime_error("ks::Fiber is not supported on this platform");
+#endif
+    timers_ = new TimerScheduler(InlineExecutor::instance(), 1);
+    if( carriers == 0 ){
+        carriers = Thread::hardwareConcurrency();
+    }
+    for( unsigned int i=0; i<carriers; i++ ){
+        _Carrier *c = new _Carrier(this);
+        carriers_.push_back(c);
+        c->start();
+    }
+}
+
+FiberScheduler::~FiberScheduler()
+{
+    shutdown();
+}
+
+void FiberScheduler::spawn(Fiber *fiber)
+{
+    // counted as live before anything else, so that shutdown() cannot complete in between
+    idle_.lock();
+    if( stopping_ ){
+        idle_.unlock();
+        delete fiber;
+        ks::logger::error("ks::FiberScheduler") << "spawn() called after shutdown()" << ks::endl;
+        throw std::runtime_error("FiberScheduler::spawn() called after shutdown()");
+    }
+    live_++;
+    idle_.unlock();
+
+    try {
+        fiber->context_->stack = allocStack_(fiber->stacksize_);
+    } catch(std::exception &e) {
+        delete fiber;
+        idle_.lock();
+        if( --live_ == 0 ){
+            idle_.notifyAll();
+        }
+        idle_.unlock();
+        throw;
+    }
+    fiber->scheduler_      = this;
+    fiber->context_->size  = fiber->stacksize_;
+    context_init(fiber->context_, fiber);
+    ready_(fiber);
+}
+
+void FiberScheduler::join()
+{
+    idle_.lock();
+    while( live_ > 0 ){
+        idle_.wait();
+    }
+    idle_.unlock();
+}
+
+size_t FiberScheduler::live()
+{
+    idle_.lock();
+    size_t live = live_;
+    idle_.unlock();
+    return live;
+}
+
+void FiberScheduler::shutdown()
+{
+    idle_.lock();
+    while( live_ > 0 ){
+        idle_.wait();
+    }
+    if( stopping_ ){
+        idle_.unlock();
+        return;
+    }
+    stopping_ = true; // under the same lock as live_, see spawn()
+    idle_.unlock();
+
+    runnable_.post(static_cast<int32_t>(carriers_.size()));
+    for( std::vector<_Carrier *>::iterator it=carriers_.begin(); it!=carriers_.end(); ++it ){
+        (*it)->join();
+        delete *it;
+    }
+    carriers_.clear();
+
+    delete timers_;
+    timers_ = 0;
+
+    for( std::vector<void *>::iterator it=stacks_.begin(); it!=stacks_.end(); ++it ){
+#ifndef _WIN32
+        munmap(*it, FIBER_DEFAULT_STACK);
+#endif
+    }
+    stacks_.clear();
+}
+
+void FiberScheduler::ready_(Fiber *fiber)
+{
+    lock_.lock();
+    queue_.push_back(fiber);
+    lock_.unlock();
+    runnable_.post();
+}
+
+Fiber *FiberScheduler::next_()
+{
+    runnable_.wait();
+
+    Fiber *fiber = 0;
+    lock_.lock();
+    if( !queue_.empty() ){
+        fiber = queue_.front();
+        queue_.pop_front();
+    }
+    lock_.unlock();
+    return fiber;
+}
+
+void FiberScheduler::finished_(Fiber *fiber)
+{
+    delete fiber; // returns the stack to the cache
+
+    idle_.lock();
+    if( --live_ == 0 ){
+        idle_.notifyAll();
+    }
+    idle_.unlock();
+}
+
+const size_t MAX_CACHED_STACKS = 1024;
+
+void *FiberScheduler::allocStack_(size_t size)
+{
+    if( size == FIBER_DEFAULT_STACK ){
+        MutexLocker locker(&lock_);
+        if( !stacks_.empty() ){
+            void *stack = stacks_.back();
+            stacks_.pop_back();
+            return stack;
+        }
+    }
+#ifdef _WIN32
+    (void)size;
+    ks::logger::error("ks::FiberScheduler") << "fiber stacks are not supported on this platform" << ks::endl;
+    throw std::runtime_error("ks::Fiber is not supported on this platform");
+#else
+    void *stack = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if( stack == MAP_FAILED ){
+        throw std::runtime_error("could not allocate a fiber stack: " + error_message());
+    }
+    // the lowest page is the guard page against overflows
+    mprotect(stack, static_cast<size_t>(sysconf(_SC_PAGESIZE)), PROT_NONE);
+    return stack;
+#endif
+}
+
+void FiberScheduler::freeStack_(void *stack, size_t size)
+{
+    if( size == FIBER_DEFAULT_STACK ){
+        MutexLocker locker(&lock_);
+        if( stacks_.size() < MAX_CACHED_STACKS ){
+            stacks_.push_back(stack);
+            return;
+        }
+    }
+#ifndef _WIN32
+    munmap(stack, size);
+#endif
+}
+
+// FiberMutex
+
+FiberMutex::FiberMutex(): guard_(), locked_(false) {}
+
+void FiberMutex::lock()
+{
+    Fiber *self = Fiber::current();
+    if( self == 0 ){
+        throw std::runtime_error("FiberMutex::lock() called outside a fiber");
+    }
+
+    guard_.lock();
+    if( !locked_ ){
+        locked_ = true;
+        guard_.unlock();
+        return;
+    }
+    waiters_.push_back(self);
+    self->park_(&guard_); // unlock() hands the ownership over to us
+}
+
+bool FiberMutex::tryLock()
+{
+    MutexLocker locker(&guard_);
+    if( locked_ ){
+        return false;
+    }
+    locked_ = true;
+    return true;
+}
+
+void FiberMutex::unlock()
+{
+    MutexLocker locker(&guard_);
+    if( waiters_.empty() ){
+        locked_ = false;
+    } else {
+        Fiber *next = waiters_.front();
+        waiters_.pop_front();
+        next->scheduler_->ready_(next);
+    }
+}
+
+// FiberCondition
+
+FiberCondition::FiberCondition(): guard_() {}
+
+void FiberCondition::wait(FiberMutex &mutex)
+{
+    Fiber *self = Fiber::current();
+    if( self == 0 ){
+        throw std::runtime_error("FiberCondition::wait() called outside a fiber");
+    }
+
+    guard_.lock();
+    waiters_.push_back(self);
+    mutex.unlock();
+    self->park_(&guard_);
+    mutex.lock();
+}
+
+void FiberCondition::notify()
+{
+    MutexLocker locker(&guard_);
+    if( !waiters_.empty() ){
+        Fiber *next = waiters_.front();
+        waiters_.pop_front();
+        next->scheduler_->ready_(next);
+    }
+}
+
+void FiberCondition::notifyAll()
+{
+    MutexLocker locker(&guard_);
+    while( !waiters_.empty() ){
+        Fiber *next = waiters_.front();
+        waiters_.pop_front();
+        next->scheduler_->ready_(next);
+    }
+}
+
+}
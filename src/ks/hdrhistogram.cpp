@@ -0,0 +1,397 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   hdrhistogram.cpp -- see hdrhistogram.h for description
+*/
+
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include "ks/hdrhistogram.h"
+#include "ks/log.h"
+#include "internal.h"
+
+namespace ks {
+
+const char         HDR_SERIAL_MAGIC[]  = "KSH1";
+const size_t       HDR_SERIAL_MAGIC_LEN = 4;
+const unsigned int HDR_MAX_PRECISION   = 14; // 0.01%, at most 416K buckets (with 64 range bits)
+const unsigned int HDR_MAX_RANGE_BITS  = 64;
+
+inline bool hdr_valid_layout(unsigned int precision, unsigned int rangebits)
+{
+    return (precision >= 1) && (precision <= HDR_MAX_PRECISION) && (rangebits >= precision) && (rangebits <= HDR_MAX_RANGE_BITS);
+}
+
+void hdr_check_layout(unsigned int precision, unsigned int rangebits)
+{
+    if( !hdr_valid_layout(precision, rangebits) ){
+        std::stringstream ss;
+        ss << "invalid HDR histogram layout: precision " << precision << ", range bits " << rangebits;
+        ks::logger::error("ks::HdrHistogram") << ss.str() << ks::endl;
+        throw std::runtime_error(ss.str());
+    }
+}
+
+void hdr_malformed(const char *what)
+{
+    ks::logger::error("ks::HdrHistogram") << "cannot deserialize: " << what << ks::endl;
+    throw std::runtime_error(std::string("cannot deserialize an HDR histogram: ") + what);
+}
+
+// the variable-length integers: 7 bits per byte, least significant first
+
+void put_varint(std::string &out, uint64_t v)
+{
+    while( v >= 0x80 ){
+        out.push_back(static_cast<char>((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+uint64_t get_varint(const std::string &in, size_t &pos)
+{
+    uint64_t v = 0;
+    for( unsigned int shift=0; shift<64; shift+=7 ){
+        if( pos >= in.size() ){
+            hdr_malformed("truncated");
+        }
+        unsigned char c = static_cast<unsigned char>(in[pos++]);
+        v |= static_cast<uint64_t>(c & 0x7F) << shift;
+        if( (c & 0x80) == 0 ){
+            return v;
+        }
+    }
+    hdr_malformed("overlong integer");
+    return 0;
+}
+
+// HdrSnapshot
+
+HdrSnapshot::HdrSnapshot(unsigned int precision, unsigned int rangebits):
+    precision_(precision), rangebits_(rangebits), counts_(), total_(0), min_(0), max_(0)
+{
+    hdr_check_layout(precision, rangebits);
+    counts_.assign(hdr_bucket_count(precision, rangebits), 0);
+}
+
+void HdrSnapshot::record(uint64_t v, uint64_t count)
+{
+    if( count == 0 ){
+        return;
+    }
+    counts_[hdr_index(v, precision_, rangebits_)] += count;
+    min_ = (total_ == 0)? v: std::min(min_, v);
+    max_ = std::max(max_, v);
+    total_ += count;
+}
+
+void HdrSnapshot::merge(const HdrSnapshot &other)
+{
+    if( (other.precision_ != precision_) || (other.rangebits_ != rangebits_) ){
+        ks::logger::error("ks::HdrHistogram") << "cannot merge histograms of different layouts" << ks::endl;
+        throw std::runtime_error("cannot merge histograms of different layouts");
+    }
+    if( other.total_ == 0 ){
+        return;
+    }
+    for( size_t i=0; i<counts_.size(); i++ ){
+        counts_[i] += other.counts_[i];
+    }
+    min_ = (total_ == 0)? other.min_: std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    total_ += other.total_;
+}
+
+void HdrSnapshot::clear()
+{
+    std::fill(counts_.begin(), counts_.end(), 0);
+    total_ = 0;
+    min_   = 0;
+    max_   = 0;
+}
+
+double HdrSnapshot::mean() const
+{
+    if( total_ == 0 ){
+        return 0;
+    }
+    double sum = 0;
+    for( size_t i=0; i<counts_.size(); i++ ){
+        if( counts_[i] > 0 ){
+            // the middle of the bucket
+            double mid = (static_cast<double>(hdr_lowest_value(i, precision_)) + hdr_highest_value(i, precision_)) / 2;
+            sum += mid * counts_[i];
+        }
+    }
+    return sum / total_;
+}
+
+uint64_t HdrSnapshot::percentile(double fraction) const
+{
+    if( total_ == 0 ){
+        return 0;
+    }
+    if( fraction >= 1.0 ){
+        return max_;
+    }
+
+    uint64_t threshold = static_cast<uint64_t>(fraction * total_ + 0.5);
+    if( threshold == 0 ){
+        threshold = 1;
+    }
+    uint64_t cumulative = 0;
+    for( size_t i=0; i<counts_.size(); i++ ){
+        cumulative += counts_[i];
+        if( cumulative >= threshold ){
+            return std::min(hdr_highest_value(i, precision_), max_);
+        }
+    }
+    return max_;
+}
+
+std::string HdrSnapshot::serialize() const
+{
+    std::string out(HDR_SERIAL_MAGIC, HDR_SERIAL_MAGIC_LEN);
+    out.push_back(static_cast<char>(precision_));
+    out.push_back(static_cast<char>(rangebits_));
+    put_varint(out, min_);
+    put_varint(out, max_);
+
+    size_t nonempty = 0;
+    for( size_t i=0; i<counts_.size(); i++ ){
+        if( counts_[i] > 0 ){
+            nonempty++;
+        }
+    }
+    put_varint(out, nonempty);
+
+    size_t next = 0; // the index right after the last non-empty bucket
+    for( size_t i=0; i<counts_.size(); i++ ){
+        if( counts_[i] > 0 ){
+            put_varint(out, i - next);
+            put_varint(out, counts_[i]);
+            next = i + 1;
+        }
+    }
+    return out;
+}
+
+// static
+HdrSnapshot HdrSnapshot::deserialize(const std::string &data)
+{
+    if( (data.size() < HDR_SERIAL_MAGIC_LEN + 2) || (data.compare(0, HDR_SERIAL_MAGIC_LEN, HDR_SERIAL_MAGIC) != 0) ){
+        hdr_malformed("not a serialized histogram");
+    }
+    unsigned int precision = static_cast<unsigned char>(data[HDR_SERIAL_MAGIC_LEN]);
+    unsigned int rangebits = static_cast<unsigned char>(data[HDR_SERIAL_MAGIC_LEN + 1]);
+    if( !hdr_valid_layout(precision, rangebits) ){
+        hdr_malformed("invalid layout");
+    }
+
+    size_t pos = HDR_SERIAL_MAGIC_LEN + 2;
+    uint64_t minval   = get_varint(data, pos);
+    uint64_t maxval   = get_varint(data, pos);
+    uint64_t nonempty = get_varint(data, pos);
+    size_t   next     = 0;
+    // checked before the buckets are allocated: each non-empty bucket takes at least 2 bytes
+    if( nonempty > hdr_bucket_count(precision, rangebits) ){
+        hdr_malformed("too many buckets");
+    }
+    if( nonempty > (data.size() - pos) / 2 ){
+        hdr_malformed("truncated");
+    }
+    HdrSnapshot out(precision, rangebits);
+    for( uint64_t n=0; n<nonempty; n++ ){
+        uint64_t index = next + get_varint(data, pos);
+        if( index >= out.counts_.size() ){
+            hdr_malformed("bucket out of range");
+        }
+        out.counts_[index] = get_varint(data, pos);
+        out.total_ += out.counts_[index];
+        next = static_cast<size_t>(index) + 1;
+    }
+    if( pos != data.size() ){
+        hdr_malformed("trailing bytes");
+    }
+    out.min_ = minval;
+    out.max_ = maxval;
+    return out;
+}
+
+// _HdrRecord
+
+_HdrRecord::_HdrRecord(size_t buckets):
+    next(0), inuse(1), owner(Thread::id()), counts(new atomic<uint64_t>[buckets]),
+    total(0), min(~static_cast<uint64_t>(0)), max(0)
+{
+    for( size_t i=0; i<buckets; i++ ){
+        counts[i].store(0, memory_order_relaxed);
+    }
+}
+
+_HdrRecord::~_HdrRecord()
+{
+    delete [] counts;
+}
+
+/**
+ * the histogram ids are never reused, so that a stale cache entry never matches
+ */
+atomic<uint64_t> hdr_counter_(0);
+
+/**
+ * the per-thread cache of (histogram id -> record of the calling thread), see internal.h.
+ * on a miss, the records are looked up by their owner instead.
+ */
+static KS_THREAD_LOCAL _IdCacheEntry hdr_cache_[ID_CACHE_SIZE];
+
+_HdrRecord *find_own_record(const atomic<_HdrRecord *> &list)
+{
+    ks_thread_id self = Thread::id();
+    for( _HdrRecord *r=list.load(memory_order_acquire); r!=0; r=r->next ){
+        if( (r->inuse.load(memory_order_relaxed) != 0) && (r->owner == self) ){
+            return r;
+        }
+    }
+    return 0;
+}
+
+// _HdrHistogramBase
+
+_HdrHistogramBase::_HdrHistogramBase(unsigned int precision, unsigned int rangebits):
+    ThreadExitHandler(),
+    id_(++hdr_counter_),
+    precision_(precision),
+    rangebits_(rangebits),
+    records_(0)
+{
+    hdr_check_layout(precision, rangebits);
+    Thread::addExitHandler(this);
+}
+
+_HdrHistogramBase::~_HdrHistogramBase()
+{
+    Thread::removeExitHandler(this);
+    id_cache_remove(hdr_cache_, id_);
+
+    _HdrRecord *r = records_.load();
+    while( r != 0 ){
+        _HdrRecord *next = r->next;
+        delete r;
+        r = next;
+    }
+}
+
+_HdrRecord *_HdrHistogramBase::record_()
+{
+    _HdrRecord *r = static_cast<_HdrRecord *>(id_cache_find(hdr_cache_, id_));
+    if( r != 0 ){
+        return r;
+    }
+
+    r = find_own_record(records_);
+    if( r == 0 ){
+        // adopt the record of an exited thread, or add a new one
+        ks_thread_id self = Thread::id();
+        for( _HdrRecord *free=records_.load(memory_order_acquire); free!=0; free=free->next ){
+            int expected = 0;
+            if( (free->inuse.load(memory_order_relaxed) == 0) && free->inuse.compare_exchange_strong(expected, 1) ){
+                free->owner = self;
+                r = free;
+                break;
+            }
+        }
+    }
+    if( r == 0 ){
+        r = new _HdrRecord(hdr_bucket_count(precision_, rangebits_));
+        _HdrRecord *head = records_.load(memory_order_relaxed);
+        do {
+            r->next = head;
+        } while( !records_.compare_exchange_weak(head, r, memory_order_release) );
+    }
+    id_cache_put(hdr_cache_, id_, r);
+    return r;
+}
+
+void _HdrHistogramBase::snapshot(HdrSnapshot &out) const
+{
+    if( (out.precision_ != precision_) || (out.rangebits_ != rangebits_) ){
+        out = HdrSnapshot(precision_, rangebits_);
+    } else {
+        out.clear();
+    }
+
+    size_t buckets = out.counts_.size();
+    uint64_t minval = ~static_cast<uint64_t>(0), maxval = 0;
+    for( _HdrRecord *r=records_.load(memory_order_acquire); r!=0; r=r->next ){
+        if( r->total.load(memory_order_relaxed) == 0 ){
+            continue;
+        }
+        for( size_t i=0; i<buckets; i++ ){
+            uint64_t n = r->counts[i].load(memory_order_relaxed);
+            out.counts_[i] += n;
+            out.total_     += n;
+        }
+        minval = std::min(minval, r->min.load(memory_order_relaxed));
+        maxval = std::max(maxval, r->max.load(memory_order_relaxed));
+    }
+    if( out.total_ > 0 ){
+        // the exact extremes, as the buckets only keep them approximately
+        out.min_ = minval;
+        out.max_ = maxval;
+    }
+}
+
+void _HdrHistogramBase::reset()
+{
+    size_t buckets = hdr_bucket_count(precision_, rangebits_);
+    for( _HdrRecord *r=records_.load(memory_order_acquire); r!=0; r=r->next ){
+        for( size_t i=0; i<buckets; i++ ){
+            r->counts[i].store(0, memory_order_relaxed);
+        }
+        r->total.store(0, memory_order_relaxed);
+        r->min.store(~static_cast<uint64_t>(0), memory_order_relaxed);
+        r->max.store(0, memory_order_relaxed);
+    }
+}
+
+void _HdrHistogramBase::threadExiting(Thread *thread)
+{
+    (void)thread;
+    _HdrRecord *r = static_cast<_HdrRecord *>(id_cache_find(hdr_cache_, id_));
+    if( r == 0 ){
+        r = find_own_record(records_);
+        if( r == 0 ){
+            return; // the thread has never recorded into this histogram
+        }
+    }
+    id_cache_remove(hdr_cache_, id_);
+    r->owner = 0;
+    r->inuse.store(0, memory_order_release); // the counts stay, to be adopted by another thread
+}
+
+}
@@ -0,0 +1,188 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   internal.h -- the helpers shared by the library sources (not installed)
+*/
+#ifndef __KS_INTERNAL_H__
+#define __KS_INTERNAL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <winsock2.h> // instead of windows.h
+#else
+#include <time.h>
+#endif
+#include "ks/utils.h" // log2_bucket
+
+namespace ks {
+
+/**
+ * the monotonic clock in milliseconds, for the timeouts and the timer ticks
+ */
+#ifdef _WIN32
+inline uint64_t monotonic_msec()
+{
+    return static_cast<uint64_t>(GetTickCount64());
+}
+#else
+inline uint64_t monotonic_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + static_cast<uint64_t>(ts.tv_nsec) / 1000000;
+}
+#endif
+
+/**
+ * the monotonic clock in nanoseconds; monotonic_raw_nsec() is not slewed by NTP (where available).
+ * on Win32 both read the performance counter, converted as whole seconds plus the remainder
+ * so that the product does not overflow.
+ */
+#ifdef _WIN32
+inline uint64_t monotonic_nsec()
+{
+    static LARGE_INTEGER freq;
+    static bool initialized = (QueryPerformanceFrequency(&freq) != 0);
+    if( !initialized ){
+        return 0;
+    }
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    uint64_t ticks = static_cast<uint64_t>(count.QuadPart);
+    uint64_t rate  = static_cast<uint64_t>(freq.QuadPart);
+    return (ticks / rate) * 1000000000ULL + (ticks % rate) * 1000000000ULL / rate;
+}
+
+inline uint64_t monotonic_raw_nsec()
+{
+    return monotonic_nsec();
+}
+#else
+inline uint64_t monotonic_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+inline uint64_t monotonic_raw_nsec()
+{
+#ifdef CLOCK_MONOTONIC_RAW
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+#else
+    return monotonic_nsec();
+#endif
+}
+#endif
+
+/**
+ * an entry of a per-thread cache of (object id -> record of the calling thread).
+ * the object ids start at 1 and are never reused, so that a stale entry never matches,
+ * and 0 marks a free entry.
+ *
+ * the cache is set-associative: an id maps to one set of ID_CACHE_WAYS entries, kept
+ * in the most-recently-used order. when a set is full, put() evicts its least recently
+ * used entry, so the entries of the destroyed objects age out. a miss is not an error;
+ * the callers look the record up by its owner instead.
+ *
+ * each source file declares its own cache, e.g.
+ *   static KS_THREAD_LOCAL _IdCacheEntry my_cache_[ID_CACHE_SIZE];
+ */
+struct _IdCacheEntry
+{
+    uint64_t  id;
+    void     *record;
+};
+
+const size_t ID_CACHE_WAYS = 4;
+const size_t ID_CACHE_SETS = 4;
+const size_t ID_CACHE_SIZE = ID_CACHE_WAYS * ID_CACHE_SETS;
+
+inline _IdCacheEntry *id_cache_set(_IdCacheEntry *cache, uint64_t id)
+{
+    return cache + (id % ID_CACHE_SETS) * ID_CACHE_WAYS;
+}
+
+// moves set[way] to the front of the set
+inline void id_cache_promote(_IdCacheEntry *set, size_t way)
+{
+    _IdCacheEntry entry = set[way];
+    for( size_t i=way; i>0; i-- ){
+        set[i] = set[i - 1];
+    }
+    set[0] = entry;
+}
+
+inline void *id_cache_find(_IdCacheEntry *cache, uint64_t id)
+{
+    _IdCacheEntry *set = id_cache_set(cache, id);
+    if( set[0].id == id ){
+        return set[0].record;
+    }
+    for( size_t i=1; i<ID_CACHE_WAYS; i++ ){
+        if( set[i].id == id ){
+            id_cache_promote(set, i);
+            return set[0].record;
+        }
+    }
+    return 0;
+}
+
+inline void id_cache_put(_IdCacheEntry *cache, uint64_t id, void *record)
+{
+    _IdCacheEntry *set = id_cache_set(cache, id);
+    size_t way = ID_CACHE_WAYS - 1;     // the least recently used one, unless a better fit is found
+    for( size_t i=0; i<ID_CACHE_WAYS; i++ ){
+        if( set[i].id == id ){
+            way = i;
+            break;
+        }
+        if( (set[i].id == 0) && (way == ID_CACHE_WAYS - 1) ){
+            way = i;
+        }
+    }
+    set[way].id     = id;
+    set[way].record = record;
+    id_cache_promote(set, way);
+}
+
+inline void id_cache_remove(_IdCacheEntry *cache, uint64_t id)
+{
+    _IdCacheEntry *set = id_cache_set(cache, id);
+    for( size_t i=0; i<ID_CACHE_WAYS; i++ ){
+        if( set[i].id == id ){
+            set[i].id     = 0;
+            set[i].record = 0;
+        }
+    }
+}
+
+}
+
+#endif // __KS_INTERNAL_H__
@@ -0,0 +1,252 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   lockprofile.cpp -- see lockprofile.h for description
+*/
+
+#include <map>
+#include <algorithm>
+#include "ks/lockprofile.h"
+#include "internal.h"
+
+namespace ks {
+
+inline void add_histogram(atomic<uint64_t> *hist, uint64_t v)
+{
+    int idx = log2_bucket(v);
+    if( idx >= LOCK_HISTOGRAM_BUCKETS ){
+        idx = LOCK_HISTOGRAM_BUCKETS - 1;
+    }
+    hist[idx].fetch_add(1, memory_order_relaxed);
+}
+
+uint64_t histogram_percentile(const uint64_t *hist, double fraction)
+{
+    uint64_t total = 0;
+    for( int i=0; i<LOCK_HISTOGRAM_BUCKETS; i++ ){
+        total += hist[i];
+    }
+    if( total == 0 ){
+        return 0;
+    }
+
+    uint64_t threshold = static_cast<uint64_t>(fraction * total);
+    uint64_t cumulative = 0;
+    for( int i=0; i<LOCK_HISTOGRAM_BUCKETS; i++ ){
+        cumulative += hist[i];
+        if( cumulative >= threshold && cumulative > 0 ){
+            return (static_cast<uint64_t>(2) << i) - 1;
+        }
+    }
+    return (static_cast<uint64_t>(2) << (LOCK_HISTOGRAM_BUCKETS - 1)) - 1;
+}
+
+LockStats::LockStats():
+    acquisitions(0), contended(0), failedTries(0),
+    waitTotal(0), waitMax(0), holdTotal(0), holdMax(0)
+{
+    std::fill(waitHistogram, waitHistogram + LOCK_HISTOGRAM_BUCKETS, 0);
+    std::fill(holdHistogram, holdHistogram + LOCK_HISTOGRAM_BUCKETS, 0);
+}
+
+uint64_t LockStats::waitPercentile(double fraction) const { return histogram_percentile(waitHistogram, fraction); }
+uint64_t LockStats::holdPercentile(double fraction) const { return histogram_percentile(holdHistogram, fraction); }
+
+_LockRecord::_LockRecord(const std::string &name): name_(name)
+{
+    reset();
+}
+
+void _LockRecord::acquired(bool contended, uint64_t wait_nsec)
+{
+    acquisitions_.fetch_add(1, memory_order_relaxed);
+    if( contended ){
+        contended_.fetch_add(1, memory_order_relaxed);
+        waittotal_.fetch_add(wait_nsec, memory_order_relaxed);
+        atomic_fetch_max<uint64_t>(waitmax_, wait_nsec, memory_order_relaxed);
+        // the uncontended acquisitions are counted by acquisitions_ alone, so as not to pull the percentiles to zero
+        add_histogram(waithist_, wait_nsec);
+    }
+}
+
+void _LockRecord::failedTry()
+{
+    failedtries_.fetch_add(1, memory_order_relaxed);
+}
+
+void _LockRecord::released(uint64_t hold_nsec)
+{
+    holdtotal_.fetch_add(hold_nsec, memory_order_relaxed);
+    atomic_fetch_max<uint64_t>(holdmax_, hold_nsec, memory_order_relaxed);
+    add_histogram(holdhist_, hold_nsec);
+}
+
+void _LockRecord::snapshot(LockStats &out) const
+{
+    out.name         = name_;
+    out.acquisitions = acquisitions_.load(memory_order_relaxed);
+    out.contended    = contended_.load(memory_order_relaxed);
+    out.failedTries  = failedtries_.load(memory_order_relaxed);
+    out.waitTotal    = waittotal_.load(memory_order_relaxed);
+    out.waitMax      = waitmax_.load(memory_order_relaxed);
+    out.holdTotal    = holdtotal_.load(memory_order_relaxed);
+    out.holdMax      = holdmax_.load(memory_order_relaxed);
+    for( int i=0; i<LOCK_HISTOGRAM_BUCKETS; i++ ){
+        out.waitHistogram[i] = waithist_[i].load(memory_order_relaxed);
+        out.holdHistogram[i] = holdhist_[i].load(memory_order_relaxed);
+    }
+}
+
+void _LockRecord::reset()
+{
+    acquisitions_.store(0, memory_order_relaxed);
+    contended_.store(0, memory_order_relaxed);
+    failedtries_.store(0, memory_order_relaxed);
+    waittotal_.store(0, memory_order_relaxed);
+    waitmax_.store(0, memory_order_relaxed);
+    holdtotal_.store(0, memory_order_relaxed);
+    holdmax_.store(0, memory_order_relaxed);
+    for( int i=0; i<LOCK_HISTOGRAM_BUCKETS; i++ ){
+        waithist_[i].store(0, memory_order_relaxed);
+        holdhist_[i].store(0, memory_order_relaxed);
+    }
+}
+
+/**
+ * the registry of the records. the records are never deleted, as the
+ * lockable objects keep raw pointers to them.
+ */
+class _LockRegistry
+{
+public:
+    _LockRecord *get(const std::string &name)
+    {
+        MutexLocker locker(&lock_);
+        std::map<std::string, _LockRecord *>::iterator it = records_.find(name);
+        if( it != records_.end() ){
+            return it->second;
+        }
+        _LockRecord *record = new _LockRecord(name);
+        records_[name] = record;
+        return record;
+    }
+
+    void snapshot(std::vector<LockStats> &out)
+    {
+        MutexLocker locker(&lock_);
+        out.resize(records_.size());
+        size_t idx = 0;
+        for( std::map<std::string, _LockRecord *>::iterator it=records_.begin(); it!=records_.end(); ++it, ++idx ){
+            it->second->snapshot(out[idx]);
+        }
+    }
+
+    void reset()
+    {
+        MutexLocker locker(&lock_);
+        for( std::map<std::string, _LockRecord *>::iterator it=records_.begin(); it!=records_.end(); ++it ){
+            it->second->reset();
+        }
+    }
+
+private:
+    Mutex                                 lock_; // unnamed, hence never profiled itself
+    std::map<std::string, _LockRecord *>  records_;
+};
+
+_LockRegistry &lock_registry()
+{
+    static _LockRegistry registry_;
+    return registry_;
+}
+
+bool longer_wait(const LockStats &a, const LockStats &b)
+{
+    return (a.waitTotal > b.waitTotal);
+}
+
+atomic<bool> LockProfiler::enabled_(false);
+
+// static
+void LockProfiler::enable()  { enabled_.store(true); }
+// static
+void LockProfiler::disable() { enabled_.store(false); }
+
+// static
+_LockRecord *LockProfiler::record(const std::string &name)
+{
+    return lock_registry().get(name);
+}
+
+// static
+void LockProfiler::snapshot(std::vector<LockStats> &out)
+{
+    lock_registry().snapshot(out);
+    std::sort(out.begin(), out.end(), longer_wait);
+}
+
+// static
+void LockProfiler::reset()
+{
+    lock_registry().reset();
+}
+
+// static
+void LockProfiler::report(LogLevel level)
+{
+    std::vector<LockStats> stats;
+    snapshot(stats);
+    for( std::vector<LockStats>::iterator it=stats.begin(); it!=stats.end(); ++it ){
+        if( it->acquisitions == 0 ){
+            continue;
+        }
+        logger::log("ks::LockProfiler", level)
+                << it->name << ": acquired " << it->acquisitions
+                << ", contended " << it->contended
+                << " (" << (100.0 * it->contended / it->acquisitions) << "%)"
+                << ", failed tries " << it->failedTries
+                << "; wait total " << it->waitTotal << "ns, contended p99 <" << it->waitPercentile(0.99)
+                << "ns, max " << it->waitMax << "ns"
+                << "; hold avg " << (it->holdTotal / it->acquisitions) << "ns, p99 <" << it->holdPercentile(0.99)
+                << "ns, max " << it->holdMax << "ns" << ks::endl;
+    }
+}
+
+// static
+uint64_t LockProfiler::now()
+{
+    return monotonic_nsec();
+}
+
+LockProfileReporter::LockProfileReporter(long interval_msec, LogLevel level):
+    PeriodicThread(interval_msec), level_(level) {}
+
+void LockProfileReporter::tick()
+{
+    LockProfiler::report(level_);
+}
+
+}
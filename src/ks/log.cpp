@@ -26,6 +26,7 @@
 #include <iostream>
 #include <algorithm>
 #include "ks/log.h"
+#include "ks/pool.h"
 #include "ks/utils.h"
 
 //#define DEBUG_KS_LOG
@@ -118,42 +119,79 @@ void LogService::writeContent(std::ostream &out, const std::string &text) const
     }
 }
 
-logger &LogService::get(ks_thread_id id, std::string title, LogLevel level, const bool &autoflush)
+_ThreadLoggers::_ThreadLoggers()
 {
-    //std::cerr << "LogService::get" << std::endl;
-    if( pool_.find(id) == pool_.end() ){
-        pool_[id] = std::map<LogLevel, logger *>();
+    for( int i=0; i<LOG_LEVEL_SLOTS; i++ ){
+        levels[i] = 0;
+    }
+}
+
+/**
+ * the loggers of the calling thread, so that a log call does not take poollock_
+ */
+static KS_THREAD_LOCAL const LogService *cached_service_ = 0;
+static KS_THREAD_LOCAL ks_thread_id      cached_id_      = 0;
+static KS_THREAD_LOCAL _ThreadLoggers   *cached_loggers_ = 0;
+
+_ThreadLoggers *LogService::loggers_(ks_thread_id id)
+{
+    if( (cached_service_ == this) && (cached_id_ == id) ){
+        return cached_loggers_;
+    }
+
+    poollock_.lock();
+    _ThreadLoggers *&entry = pool_[id];
+    if( entry == 0 ){
+        entry = new _ThreadLoggers();
+    }
+    _ThreadLoggers *loggers = entry;
+    poollock_.unlock();
+
+    if( id == Thread::id() ){
+        cached_service_ = this;
+        cached_id_      = id;
+        cached_loggers_ = loggers;
     }
-    std::map<LogLevel, logger *> tlogger = pool_[id];
+    return loggers;
+}
+
+logger &LogService::get(ks_thread_id id, string_ref title, LogLevel level, const bool &autoflush)
+{
+    //std::cerr << "LogService::get" << std::endl;
+    _ThreadLoggers *loggers = loggers_(id);
+    logger *current = loggers->levels[level];
 
-    if( hasKeyInMap(level, tlogger) ){
-        if( (title.length() == 0) || (tlogger[level]->title() == title) ){
-            return *(tlogger[level]);
+    if( current != 0 ){
+        if( title.empty() || (current->title() == title) ){
+            return *current;
         }
 
-        // dispatch and clean up the existing logger
-        this->dispatch(tlogger[level]);
+        // dispatch and clean up the existing logger (outside the lock, as clean() takes it)
+        this->dispatch(current);
     }
 
     //std::cerr << "creating a new logger" << std::endl;
     logger *newlogger = new logger(id, title, level, autoflush);
-    pool_[id][level] = newlogger;
+    loggers->levels[level] = newlogger;
     return *(newlogger);
 }
 
-void LogService::dispatch_static(LogService *service, logger *msg)
-{
-    service->dispatch(msg);
-}
-
 void LogService::clean(logger *msg)
 {
     //std::cerr << "LogService::clean(logger)" << std::endl;
-    if( hasKeyInMap(msg->thread(), pool_) &&
-            hasKeyInMap(msg->level(), pool_[msg->thread()]) &&
-                (msg->title() == pool_[msg->thread()][msg->level()]->title()) )
-    {
-        pool_[msg->thread()].erase(msg->level());
+    bool managed = false;
+    poollock_.lock();
+    FlatHashMap<ks_thread_id, _ThreadLoggers *>::iterator it = pool_.find(msg->thread());
+    if( it != pool_.end() ){
+        logger *&current = it->second->levels[msg->level()];
+        if( (current != 0) && (msg->title() == current->title()) ){
+            current = 0;
+            managed = true;
+        }
+    }
+    poollock_.unlock();
+
+    if( managed ){
         delete msg;
     } else {
         throw std::runtime_error("clean() got a logger that LogService does not manage");
@@ -170,16 +208,48 @@ void LogService::clean(ks_thread_id id)
 #ifdef DEBUG_KS_LOG
     std::cerr << "LogService::clean(ks_thread_id)" << std::endl;
 #endif
-    if( hasKeyInMap(id, pool_) ){
-        clear_byvalue(this, pool_[id], LogService::dispatch_static, false);
-        pool_.erase(id);
+    _ThreadLoggers *loggers = 0;
+    poollock_.lock();
+    FlatHashMap<ks_thread_id, _ThreadLoggers *>::iterator it = pool_.find(id);
+    if( it != pool_.end() ){
+        loggers = it->second;
+    }
+    poollock_.unlock();
+    if( loggers == 0 ){
+        return;
     }
+
+    // dispatch() calls clean(logger), which takes the lock again
+    for( int i=0; i<LOG_LEVEL_SLOTS; i++ ){
+        if( loggers->levels[i] != 0 ){
+            dispatch(loggers->levels[i]);
+        }
+    }
+
+    poollock_.lock();
+    pool_.erase(id);
+    poollock_.unlock();
+    if( cached_loggers_ == loggers ){
+        cached_service_ = 0;
+        cached_loggers_ = 0;
+    }
+    delete loggers;
 }
 
 void LogService::clean()
 {
     //std::cerr << "LogService::clean" << std::endl;
-    clear_bykey(this, pool_, LogService::clean, false);
+    // only the ids are copied: clean(id) finds the loggers in pool_ (see clean(logger))
+    std::vector<ks_thread_id> ids;
+    poollock_.lock();
+    ids.reserve(pool_.size());
+    for( FlatHashMap<ks_thread_id, _ThreadLoggers *>::iterator it=pool_.begin(); it!=pool_.end(); ++it ){
+        ids.push_back(it->first);
+    }
+    poollock_.unlock();
+    for( std::vector<ks_thread_id>::iterator it=ids.begin(); it!=ids.end(); ++it ){
+        clean(*it);
+    }
 }
 
 
@@ -236,7 +306,7 @@ void LogPool::clean(logger *msg)
 }
 
 
-LogService logger::service_ = LogService();
+LogService logger::service_;
 
 //static
 void logger::addHandler(LogHandler *handler) { service_.addHandler(handler); }
@@ -244,32 +314,61 @@ void logger::addHandler(LogHandler *handler) { service_.addHandler(handler); }
 void logger::removeHandler(LogHandler *handler) { service_.removeHandler(handler); }
 
 //static
-logger &logger::log(std::string title, LogLevel level, const bool &autoflush)
+logger &logger::log(string_ref title, LogLevel level, const bool &autoflush)
 {
     return service_.get(Thread::id(), title, level, autoflush);
 }
 //static
-logger &logger::error(std::string title, const bool &autoflush) { return log(title, Error, autoflush); }
+logger &logger::error(string_ref title, const bool &autoflush) { return log(title, Error, autoflush); }
 //static
-logger &logger::warning(std::string title, const bool &autoflush) { return log(title, Warning, autoflush); }
+logger &logger::warning(string_ref title, const bool &autoflush) { return log(title, Warning, autoflush); }
 //static
-logger &logger::info(std::string title, const bool &autoflush) { return log(title, Info, autoflush); }
+logger &logger::info(string_ref title, const bool &autoflush) { return log(title, Info, autoflush); }
 //static
-logger &logger::fine(std::string title, const bool &autoflush) { return log(title, Fine, autoflush); }
+logger &logger::fine(string_ref title, const bool &autoflush) { return log(title, Fine, autoflush); }
 //static
-logger &logger::debug(std::string title, const bool &autoflush) { return log(title, Debug, autoflush); }
+logger &logger::debug(string_ref title, const bool &autoflush) { return log(title, Debug, autoflush); }
 //static
 void logger::setLoggedLevel(const LogLevel &level){ service_.seLoggedLevel(level); }
 
-logger::logger(ks_thread_id id, std::string title, LogLevel level, const bool &autoflush):
+logger::logger(ks_thread_id id, string_ref title, LogLevel level, const bool &autoflush):
     thread_(id),
-    title_(title),
+    title_(title.data(), title.size()),
     level_(level),
     autoflush_(autoflush)
 {
 
 }
 
+/**
+ * the allocator is never destroyed, since the loggers may still be
+ * deleted by LogService during the static destruction.
+ */
+static SlabAllocator &logger_allocator()
+{
+    static SlabAllocator *allocator_ = new SlabAllocator(sizeof(logger));
+    return *allocator_;
+}
+
+// static
+void *logger::operator new(size_t size)
+{
+    if( size != sizeof(logger) ){
+        return ::operator new(size);
+    }
+    return logger_allocator().allocate();
+}
+
+// static
+void logger::operator delete(void *ptr, size_t size)
+{
+    if( size != sizeof(logger) ){
+        ::operator delete(ptr);
+    } else {
+        logger_allocator().deallocate(ptr);
+    }
+}
+
 void logger::dispatch()
 {
     service_.dispatch(this);
@@ -0,0 +1,444 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   metrics.cpp -- see metrics.h for description
+*/
+
+#include <map>
+#include <new>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <errno.h>
+#include <string.h>
+#include "ks/metrics.h"
+#include "internal.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace ks {
+
+#ifdef _WIN32
+void *allocate_lines(size_t size)
+{
+    void *ptr = _aligned_malloc(size, KS_CACHE_LINE_SIZE);
+    if( ptr == 0 ){
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void free_lines(void *ptr) { _aligned_free(ptr); }
+#else
+/**
+ * `new` does not honor KS_CACHE_ALIGNED before C++17, so the shards are allocated here
+ */
+void *allocate_lines(size_t size)
+{
+    void *ptr = 0;
+    if( posix_memalign(&ptr, KS_CACHE_LINE_SIZE, size) != 0 ){
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void free_lines(void *ptr) { free(ptr); }
+#endif
+
+inline uint64_t bucket_upper_bound(int idx)
+{
+    return (idx >= 63)? ~static_cast<uint64_t>(0): ((static_cast<uint64_t>(2) << idx) - 1);
+}
+
+MetricSample::MetricSample(): name(), kind(CounterMetric), value(0), sum(0), max(0), buckets() {}
+
+uint64_t MetricSample::percentile(double fraction) const
+{
+    uint64_t total = 0;
+    for( std::vector<uint64_t>::const_iterator it=buckets.begin(); it!=buckets.end(); ++it ){
+        total += *it;
+    }
+    if( total == 0 ){
+        return 0;
+    }
+
+    uint64_t threshold = static_cast<uint64_t>(fraction * total);
+    uint64_t cumulative = 0;
+    for( size_t i=0; i<buckets.size(); i++ ){
+        cumulative += buckets[i];
+        if( cumulative >= threshold && cumulative > 0 ){
+            return bucket_upper_bound(static_cast<int>(i));
+        }
+    }
+    return bucket_upper_bound(METRIC_HISTOGRAM_BUCKETS - 1);
+}
+
+// Metric
+
+static atomic<int>          metric_next_shard_(0);
+static KS_THREAD_LOCAL int  metric_shard_ = -1;
+
+Metric::Metric(const std::string &name, MetricKind kind): name_(name), kind_(kind) {}
+Metric::~Metric() {}
+
+// static
+int Metric::shard()
+{
+    if( metric_shard_ < 0 ){
+        // round-robin, so that the first METRIC_SHARDS threads never share a slot
+        metric_shard_ = metric_next_shard_.fetch_add(1, memory_order_relaxed) % METRIC_SHARDS;
+    }
+    return metric_shard_;
+}
+
+// Counter
+
+Counter::Counter(const std::string &name):
+    Metric(name, CounterMetric),
+    shards_(static_cast<cache_padded<atomic<uint64_t> > *>(allocate_lines(sizeof(cache_padded<atomic<uint64_t> >) * METRIC_SHARDS)))
+{
+    for( int i=0; i<METRIC_SHARDS; i++ ){
+        new (shards_ + i) cache_padded<atomic<uint64_t> >();
+    }
+    reset();
+}
+
+Counter::~Counter()
+{
+    free_lines(shards_);
+}
+
+uint64_t Counter::value() const
+{
+    uint64_t total = 0;
+    for( int i=0; i<METRIC_SHARDS; i++ ){
+        total += shards_[i].value.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+void Counter::snapshot(MetricSample &out) const
+{
+    out.name  = name();
+    out.kind  = CounterMetric;
+    out.value = static_cast<int64_t>(value());
+    out.buckets.clear();
+}
+
+void Counter::reset()
+{
+    for( int i=0; i<METRIC_SHARDS; i++ ){
+        shards_[i].value.store(0, memory_order_relaxed);
+    }
+}
+
+// Gauge
+
+Gauge::Gauge(const std::string &name): Metric(name, GaugeMetric), value_(0)
+{
+    reset();
+}
+
+void Gauge::snapshot(MetricSample &out) const
+{
+    out.name  = name();
+    out.kind  = GaugeMetric;
+    out.value = value();
+    out.buckets.clear();
+}
+
+void Gauge::reset()
+{
+    value_.store(0, memory_order_relaxed);
+}
+
+// Histogram
+
+Histogram::Histogram(const std::string &name):
+    Metric(name, HistogramMetric),
+    shards_(static_cast<_HistogramShard *>(allocate_lines(sizeof(_HistogramShard) * METRIC_SHARDS)))
+{
+    for( int i=0; i<METRIC_SHARDS; i++ ){
+        new (shards_ + i) _HistogramShard();
+    }
+    reset();
+}
+
+Histogram::~Histogram()
+{
+    free_lines(shards_);
+}
+
+void Histogram::record(uint64_t v)
+{
+    _HistogramShard &s = shards_[shard()];
+    s.count.fetch_add(1, memory_order_relaxed);
+    s.sum.fetch_add(v, memory_order_relaxed);
+    atomic_fetch_max<uint64_t>(s.max, v, memory_order_relaxed);
+    s.buckets[log2_bucket(v)].fetch_add(1, memory_order_relaxed);
+}
+
+void Histogram::snapshot(MetricSample &out) const
+{
+    out.name  = name();
+    out.kind  = HistogramMetric;
+    out.value = 0;
+    out.sum   = 0;
+    out.max   = 0;
+    out.buckets.assign(METRIC_HISTOGRAM_BUCKETS, 0);
+    for( int i=0; i<METRIC_SHARDS; i++ ){
+        const _HistogramShard &s = shards_[i];
+        out.value += static_cast<int64_t>(s.count.load(memory_order_relaxed));
+        out.sum   += s.sum.load(memory_order_relaxed);
+        out.max    = std::max(out.max, s.max.load(memory_order_relaxed));
+        for( int b=0; b<METRIC_HISTOGRAM_BUCKETS; b++ ){
+            out.buckets[b] += s.buckets[b].load(memory_order_relaxed);
+        }
+    }
+}
+
+void Histogram::reset()
+{
+    for( int i=0; i<METRIC_SHARDS; i++ ){
+        _HistogramShard &s = shards_[i];
+        s.count.store(0, memory_order_relaxed);
+        s.sum.store(0, memory_order_relaxed);
+        s.max.store(0, memory_order_relaxed);
+        for( int b=0; b<METRIC_HISTOGRAM_BUCKETS; b++ ){
+            s.buckets[b].store(0, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * the registry of the metrics. the metrics are never deleted, as the
+ * users may keep references to them.
+ */
+class _MetricRegistry
+{
+public:
+    template <typename M>
+    M &get(const std::string &name, MetricKind kind)
+    {
+        MutexLocker locker(&lock_);
+        std::map<std::string, Metric *>::iterator it = metrics_.find(name);
+        if( it != metrics_.end() ){
+            if( it->second->kind() != kind ){
+                std::stringstream ss;
+                ss << "metric '" << name << "' is already registered with another kind";
+                ks::logger::error("ks::Metrics") << ss.str() << ks::endl;
+                throw std::runtime_error(ss.str());
+            }
+            return *static_cast<M *>(it->second);
+        }
+        M *metric = new M(name);
+        metrics_[name] = metric;
+        return *metric;
+    }
+
+    void snapshot(std::vector<MetricSample> &out)
+    {
+        MutexLocker locker(&lock_);
+        out.resize(metrics_.size());
+        size_t idx = 0;
+        for( std::map<std::string, Metric *>::iterator it=metrics_.begin(); it!=metrics_.end(); ++it, ++idx ){
+            it->second->snapshot(out[idx]);
+        }
+    }
+
+    void reset()
+    {
+        MutexLocker locker(&lock_);
+        for( std::map<std::string, Metric *>::iterator it=metrics_.begin(); it!=metrics_.end(); ++it ){
+            it->second->reset();
+        }
+    }
+
+private:
+    Mutex                             lock_;
+    std::map<std::string, Metric *>   metrics_;
+};
+
+_MetricRegistry &metric_registry()
+{
+    static _MetricRegistry registry_;
+    return registry_;
+}
+
+// static
+Counter &Metrics::counter(const std::string &name) { return metric_registry().get<Counter>(name, CounterMetric); }
+// static
+Gauge &Metrics::gauge(const std::string &name) { return metric_registry().get<Gauge>(name, GaugeMetric); }
+// static
+Histogram &Metrics::histogram(const std::string &name) { return metric_registry().get<Histogram>(name, HistogramMetric); }
+
+// static
+void Metrics::snapshot(std::vector<MetricSample> &out)
+{
+    metric_registry().snapshot(out); // std::map keeps them sorted by name
+}
+
+// static
+void Metrics::reset()
+{
+    metric_registry().reset();
+}
+
+// LogMetricsExporter
+
+LogMetricsExporter::LogMetricsExporter(LogLevel level): level_(level) {}
+
+void LogMetricsExporter::exportMetrics(const std::vector<MetricSample> &samples)
+{
+    for( std::vector<MetricSample>::const_iterator it=samples.begin(); it!=samples.end(); ++it ){
+        switch( it->kind )
+        {
+        case CounterMetric:
+            logger::log("ks::Metrics", level_) << it->name << ": count " << it->value << ks::endl;
+            break;
+        case GaugeMetric:
+            logger::log("ks::Metrics", level_) << it->name << ": value " << it->value << ks::endl;
+            break;
+        case HistogramMetric:
+            if( it->value == 0 ){
+                logger::log("ks::Metrics", level_) << it->name << ": no samples" << ks::endl;
+            } else {
+                logger::log("ks::Metrics", level_)
+                        << it->name << ": samples " << it->value
+                        << ", avg " << (it->sum / static_cast<uint64_t>(it->value))
+                        << ", p50 <" << it->percentile(0.5)
+                        << ", p99 <" << it->percentile(0.99)
+                        << ", max " << it->max << ks::endl;
+            }
+            break;
+        }
+    }
+}
+
+// TextMetricsExporter
+
+std::string exposition_name(const std::string &name)
+{
+    std::string ret(name);
+    for( size_t i=0; i<ret.size(); i++ ){
+        char c = ret[i];
+        bool valid = ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'))
+                        || (c == '_') || (c == ':') || ((i > 0) && (c >= '0') && (c <= '9'));
+        if( !valid ){
+            ret[i] = '_';
+        }
+    }
+    return ret;
+}
+
+TextMetricsExporter::TextMetricsExporter(const std::string &path): path_(path) {}
+
+// static
+std::string TextMetricsExporter::format(const std::vector<MetricSample> &samples)
+{
+    std::stringstream ss;
+    for( std::vector<MetricSample>::const_iterator it=samples.begin(); it!=samples.end(); ++it ){
+        std::string name = exposition_name(it->name);
+        switch( it->kind )
+        {
+        case CounterMetric:
+            ss << "# TYPE " << name << " counter\n" << name << " " << it->value << "\n";
+            break;
+        case GaugeMetric:
+            ss << "# TYPE " << name << " gauge\n" << name << " " << it->value << "\n";
+            break;
+        case HistogramMetric:
+            {
+                ss << "# TYPE " << name << " histogram\n";
+                int last = static_cast<int>(it->buckets.size()) - 1;
+                while( (last >= 0) && (it->buckets[last] == 0) ){
+                    last--;
+                }
+                uint64_t cumulative = 0;
+                for( int i=0; i<=last; i++ ){
+                    cumulative += it->buckets[i];
+                    ss << name << "_bucket{le=\"" << bucket_upper_bound(i) << "\"} " << cumulative << "\n";
+                }
+                ss << name << "_bucket{le=\"+Inf\"} " << it->value << "\n";
+                ss << name << "_sum " << it->sum << "\n";
+                ss << name << "_count " << it->value << "\n";
+            }
+            break;
+        }
+    }
+    return ss.str();
+}
+
+void TextMetricsExporter::exportMetrics(const std::vector<MetricSample> &samples)
+{
+    std::string text = format(samples);
+    std::string tmppath = path_ + ".tmp";
+
+    FILE *fp = std::fopen(tmppath.c_str(), "w");
+    if( fp == 0 ){
+        ks::logger::warning("ks::Metrics") << "could not open " << tmppath << ": " << strerror(errno) << ks::endl;
+        return;
+    }
+    bool written = (std::fwrite(text.data(), 1, text.size(), fp) == text.size());
+    written = (std::fclose(fp) == 0) && written;
+    if( !written ){
+        ks::logger::warning("ks::Metrics") << "could not write " << tmppath << ": " << strerror(errno) << ks::endl;
+        std::remove(tmppath.c_str());
+        return;
+    }
+
+#ifdef _WIN32
+    bool replaced = (MoveFileExA(tmppath.c_str(), path_.c_str(), MOVEFILE_REPLACE_EXISTING) != 0);
+#else
+    bool replaced = (std::rename(tmppath.c_str(), path_.c_str()) == 0);
+#endif
+    if( !replaced ){
+        ks::logger::warning("ks::Metrics") << "could not replace " << path_ << ": " << strerror(errno) << ks::endl;
+        std::remove(tmppath.c_str());
+    }
+}
+
+// MetricsReporter
+
+MetricsReporter::MetricsReporter(long interval_msec, MetricsExporter *exporter):
+    PeriodicThread(interval_msec), defaultexporter_(Info),
+    exporter_((exporter == 0)? &defaultexporter_: exporter), samples_() {}
+
+void MetricsReporter::tick()
+{
+    Metrics::snapshot(samples_);
+    exporter_->exportMetrics(samples_);
+}
+
+void MetricsReporter::finish()
+{
+    tick();
+}
+
+}
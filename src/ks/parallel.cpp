@@ -0,0 +1,118 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   parallel.cpp -- see parallel.h for description
+*/
+
+#include <stdexcept>
+#include "ks/parallel.h"
+
+namespace ks {
+
+const size_t CHUNKS_PER_THREAD = 4; // over-partitioning, to balance uneven chunks
+
+_ParallelJob::_ParallelJob(size_t chunks):
+    chunks_(chunks),
+    next_(0),
+    refs_(1),
+    done_(static_cast<int32_t>(chunks)),
+    errlock_(),
+    failed_(false)
+{}
+
+_ParallelJob::~_ParallelJob() {}
+
+_ParallelJob::Helper::Helper(_ParallelJob *job): Task(), job_(job)
+{
+    job_->acquire();
+}
+
+_ParallelJob::Helper::~Helper()
+{
+    job_->release();
+}
+
+void _ParallelJob::Helper::run()
+{
+    job_->work();
+}
+
+void _ParallelJob::acquire()
+{
+    refs_.fetch_add(1, memory_order_relaxed);
+}
+
+void _ParallelJob::release()
+{
+    if( refs_.fetch_sub(1, memory_order_acq_rel) == 1 ){
+        delete this;
+    }
+}
+
+void _ParallelJob::work()
+{
+    size_t idx;
+    while( (idx = next_.fetch_add(1, memory_order_relaxed)) < chunks_ ){
+        try {
+            runChunk(idx);
+        } catch(std::exception &e) {
+            MutexLocker locker(&errlock_);
+            if( !failed_ ){
+                failed_ = true;
+                error_  = e.what();
+            }
+        }
+        done_.countDown();
+    }
+}
+
+// static
+void _ParallelJob::run(_ParallelJob *job, ThreadPool *pool)
+{
+    size_t helpers = std::min(static_cast<size_t>(pool->size()), job->chunks_ - 1);
+    for( size_t i=0; i<helpers; i++ ){
+        pool->execute(new Helper(job));
+    }
+
+    job->work();
+    job->done_.wait();
+
+    bool failed = job->failed_;
+    std::string error = job->error_;
+    job->release();
+    if( failed ){
+        throw std::runtime_error(error);
+    }
+}
+
+// static
+size_t _ParallelJob::autoChunks(size_t count, ThreadPool *pool)
+{
+    size_t chunks = (pool->size() + 1) * CHUNKS_PER_THREAD;
+    return (chunks < count)? chunks: count;
+}
+
+}
@@ -0,0 +1,378 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   pool.cpp -- see pool.h for description
+*/
+
+#include <algorithm>
+#include <new>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include "ks/pool.h"
+#include "internal.h"
+
+namespace ks {
+
+const size_t POOL_ALIGNMENT  = 16;
+const size_t POOL_PAGE_SIZE  = 4096;
+
+atomic<uint64_t> allocator_counter_(0); // ids are never reused, so a stale cache entry never matches
+
+class _PoolMagazine
+{
+public:
+    explicit _PoolMagazine(size_t capacity): count(0), items(new void *[capacity]) {}
+    ~_PoolMagazine() { delete[] items; }
+
+    size_t  count;
+    void  **items;
+};
+
+/**
+ * the per-thread state. the fields except `inuse` and `owner` are only accessed by the owner
+ * (or under SlabAllocator::lock_ once the record has been released).
+ */
+class _PoolRecord
+{
+public:
+    _PoolRecord(): inuse(true), owner(Thread::id()), loaded(0), previous(0),
+        allocs(0), frees(0), hits(0), misses(0) {}
+
+    bool           inuse;
+    ks_thread_id   owner;
+    _PoolMagazine *loaded;
+    _PoolMagazine *previous;   // always either full or empty
+    uint64_t       allocs;
+    uint64_t       frees;
+    uint64_t       hits;
+    uint64_t       misses;
+};
+
+/**
+ * the per-thread cache of (allocator id -> record of the calling thread), see internal.h.
+ * on a miss, the record is looked up by its owner instead.
+ */
+static KS_THREAD_LOCAL _IdCacheEntry pool_cache_[ID_CACHE_SIZE];
+
+inline size_t round_up(size_t value, size_t unit)
+{
+    return ((value + unit - 1) / unit) * unit;
+}
+
+PoolStats::PoolStats():
+    objectSize(0), allocations(0), deallocations(0), live(0), cacheHits(0), cacheMisses(0),
+    depotGets(0), depotPuts(0), slabs(0), bytesReserved(0), hugePages(false) {}
+
+SlabAllocator::SlabAllocator(size_t object_size, size_t magazine, bool hugepages):
+    ThreadExitHandler(),
+    id_(++allocator_counter_),
+    size_(round_up(std::max(object_size, sizeof(void *)), POOL_ALIGNMENT)),
+    capacity_((magazine > 0)? magazine: 1),
+    hugepages_(hugepages),
+    huge_(false),
+    lock_(),
+    cursor_(0),
+    end_(0),
+    depotgets_(0),
+    depotputs_(0)
+{
+    // a slab holds at least one magazine worth of blocks
+    if( hugepages_ ){
+        slabsize_ = round_up(size_ * capacity_, POOL_HUGE_SLAB_SIZE);
+    } else {
+        slabsize_ = round_up(std::max(size_ * capacity_, POOL_SLAB_SIZE), POOL_PAGE_SIZE);
+    }
+    Thread::addExitHandler(this);
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    Thread::removeExitHandler(this);
+    id_cache_remove(pool_cache_, id_);
+
+    for( std::vector<_PoolRecord *>::iterator it=records_.begin(); it!=records_.end(); ++it ){
+        delete (*it)->loaded;
+        delete (*it)->previous;
+        delete *it;
+    }
+    for( std::vector<_PoolMagazine *>::iterator it=full_.begin(); it!=full_.end(); ++it ){
+        delete *it;
+    }
+    for( std::vector<_PoolMagazine *>::iterator it=empty_.begin(); it!=empty_.end(); ++it ){
+        delete *it;
+    }
+    for( std::vector<void *>::iterator it=slabs_.begin(); it!=slabs_.end(); ++it ){
+#ifdef _WIN32
+        VirtualFree(*it, 0, MEM_RELEASE);
+#else
+        munmap(*it, slabsize_);
+#endif
+    }
+}
+
+_PoolRecord *SlabAllocator::record_()
+{
+    void *cached = id_cache_find(pool_cache_, id_);
+    if( cached != 0 ){
+        return static_cast<_PoolRecord *>(cached);
+    }
+
+    ks_thread_id self = Thread::id();
+    _PoolRecord *record = 0;
+
+    lock_.lock();
+    for( std::vector<_PoolRecord *>::iterator it=records_.begin(); it!=records_.end(); ++it ){
+        if( (*it)->inuse && ((*it)->owner == self) ){
+            record = *it;
+            break;
+        }
+    }
+    if( record == 0 ){
+        for( std::vector<_PoolRecord *>::iterator it=records_.begin(); it!=records_.end(); ++it ){
+            if( !((*it)->inuse) ){
+                record = *it;
+                record->inuse = true;
+                record->owner = self;
+                break;
+            }
+        }
+    }
+    if( record == 0 ){
+        record = new _PoolRecord();
+        records_.push_back(record);
+    }
+    if( record->loaded == 0 ){
+        record->loaded   = emptyMagazine_();
+        record->previous = emptyMagazine_();
+    }
+    lock_.unlock();
+
+    id_cache_put(pool_cache_, id_, record);
+    return record;
+}
+
+void *SlabAllocator::allocate()
+{
+    _PoolRecord *record = record_();
+
+    if( record->loaded->count == 0 ){
+        if( record->previous->count > 0 ){
+            std::swap(record->loaded, record->previous);
+            record->hits++;
+        } else {
+            refill_(record);
+            record->misses++;
+        }
+    } else {
+        record->hits++;
+    }
+    record->allocs++;
+
+    _PoolMagazine *magazine = record->loaded;
+    return magazine->items[--(magazine->count)];
+}
+
+void SlabAllocator::deallocate(void *ptr)
+{
+    if( ptr == 0 ){
+        return;
+    }
+
+    _PoolRecord *record = record_();
+    if( record->loaded->count == capacity_ ){
+        if( record->previous->count == 0 ){
+            std::swap(record->loaded, record->previous);
+        } else {
+            flush_(record);
+        }
+    }
+    record->frees++;
+
+    _PoolMagazine *magazine = record->loaded;
+    magazine->items[(magazine->count)++] = ptr;
+}
+
+void SlabAllocator::refill_(_PoolRecord *record)
+{
+    lock_.lock();
+    try {
+        if( full_.size() > 0 ){
+            empty_.push_back(record->previous);
+            record->previous = record->loaded;
+            record->loaded   = full_.back();
+            full_.pop_back();
+            depotgets_++;
+        } else {
+            carve_(record->loaded);
+        }
+    } catch(...) {
+        lock_.unlock();
+        throw;
+    }
+    lock_.unlock();
+}
+
+void SlabAllocator::flush_(_PoolRecord *record)
+{
+    lock_.lock();
+    full_.push_back(record->previous);
+    record->previous = record->loaded;
+    record->loaded   = emptyMagazine_();
+    depotputs_++;
+    lock_.unlock();
+}
+
+_PoolMagazine *SlabAllocator::emptyMagazine_()
+{
+    if( empty_.size() > 0 ){
+        _PoolMagazine *magazine = empty_.back();
+        empty_.pop_back();
+        return magazine;
+    }
+    return new _PoolMagazine(capacity_);
+}
+
+void SlabAllocator::carve_(_PoolMagazine *magazine)
+{
+    while( magazine->count < capacity_ ){
+        if( (cursor_ + size_) > end_ ){
+            if( magazine->count > 0 ){
+                return;
+            }
+            mapSlab_();
+        }
+        magazine->items[(magazine->count)++] = cursor_;
+        cursor_ += size_;
+    }
+}
+
+void SlabAllocator::mapSlab_()
+{
+    void *slab = 0;
+#ifdef _WIN32
+    slab = VirtualAlloc(0, slabsize_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+    if( hugepages_ ){
+        slab = mmap(0, slabsize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if( slab == MAP_FAILED ){
+            slab = 0; // no huge pages reserved; fall back to the transparent ones
+        } else {
+            huge_ = true;
+        }
+    }
+#endif
+    if( slab == 0 ){
+        size_t mapped = hugepages_? (slabsize_ + POOL_HUGE_SLAB_SIZE): slabsize_;
+        char *base = static_cast<char *>(mmap(0, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if( base == MAP_FAILED ){
+            throw std::bad_alloc();
+        }
+        if( hugepages_ ){
+            // trims the mapping so that the slab is aligned to a huge page
+            char *aligned = reinterpret_cast<char *>(round_up(reinterpret_cast<size_t>(base), POOL_HUGE_SLAB_SIZE));
+            if( aligned > base ){
+                munmap(base, aligned - base);
+            }
+            if( (base + mapped) > (aligned + slabsize_) ){
+                munmap(aligned + slabsize_, (base + mapped) - (aligned + slabsize_));
+            }
+            base = aligned;
+#ifdef MADV_HUGEPAGE
+            if( madvise(base, slabsize_, MADV_HUGEPAGE) == 0 ){
+                huge_ = true;
+            }
+#endif
+        }
+        slab = base;
+    }
+#endif
+    if( slab == 0 ){
+        throw std::bad_alloc();
+    }
+    slabs_.push_back(slab);
+    cursor_ = static_cast<char *>(slab);
+    end_    = cursor_ + slabsize_;
+}
+
+PoolStats SlabAllocator::stats()
+{
+    PoolStats stats;
+    lock_.lock();
+    for( std::vector<_PoolRecord *>::iterator it=records_.begin(); it!=records_.end(); ++it ){
+        stats.allocations   += (*it)->allocs;
+        stats.deallocations += (*it)->frees;
+        stats.cacheHits     += (*it)->hits;
+        stats.cacheMisses   += (*it)->misses;
+    }
+    stats.objectSize    = size_;
+    stats.live          = stats.allocations - stats.deallocations;
+    stats.depotGets     = depotgets_;
+    stats.depotPuts     = depotputs_;
+    stats.slabs         = slabs_.size();
+    stats.bytesReserved = slabs_.size() * slabsize_;
+    stats.hugePages     = huge_;
+    lock_.unlock();
+    return stats;
+}
+
+void SlabAllocator::threadExiting(Thread *thread)
+{
+    (void)thread;
+    ks_thread_id self = Thread::id();
+
+    lock_.lock();
+    _PoolRecord *record = static_cast<_PoolRecord *>(id_cache_find(pool_cache_, id_));
+    if( record == 0 ){
+        for( std::vector<_PoolRecord *>::iterator it=records_.begin(); it!=records_.end(); ++it ){
+            if( (*it)->inuse && ((*it)->owner == self) ){
+                record = *it;
+                break;
+            }
+        }
+    }
+    if( record != 0 ){
+        _PoolMagazine *magazines[2] = { record->loaded, record->previous };
+        for( int i=0; i<2; i++ ){
+            if( magazines[i]->count > 0 ){
+                full_.push_back(magazines[i]);
+            } else {
+                empty_.push_back(magazines[i]);
+            }
+        }
+        record->loaded   = 0;
+        record->previous = 0;
+        record->inuse    = false;
+        record->owner    = 0;
+    }
+    lock_.unlock();
+    id_cache_remove(pool_cache_, id_);
+}
+
+}
@@ -0,0 +1,752 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   profile.cpp -- see profile.h for description
+*/
+
+#include <map>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include "ks/profile.h"
+#include "ks/thread.h"
+#include "ks/atomic.h"
+#include "ks/hashmap.h"
+#include "ks/log.h"
+
+#ifdef __linux__
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/syscall.h>
+
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID 4
+#endif
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+namespace ks {
+
+#ifdef __linux__
+
+const size_t    PROFILE_BUFFER_SAMPLES = 64;        // per thread; drained every PROFILE_DRAIN_MSEC
+const long      PROFILE_DRAIN_MSEC     = 100;
+const int       PROFILE_RESCAN_TICKS   = 10;        // looks for the new threads every second
+const int       PROFILE_HANDLER_FRAMES = 4;         // the frames of the signal handler in a backtrace(), at most
+const uintptr_t PROFILE_MAX_FRAME      = 1 << 18;   // how far above a frame the next one may be
+
+struct _ProfileSample
+{
+    uint32_t    depth;
+    uintptr_t   pcs[PROFILE_MAX_DEPTH];  // the innermost first
+};
+
+/**
+ * the samples of one thread: the signal handler (on the thread) appends at `head`,
+ * and the collector consumes from `tail`.
+ */
+class _ProfileBuffer
+{
+public:
+    _ProfileBuffer(): head(0), tail(0), dropped(0), stacklo(0), stackhi(0), seensp(0), tid(0), name(), timer() {}
+
+    _ProfileSample      samples[PROFILE_BUFFER_SAMPLES];
+    atomic<uint32_t>    head;
+    atomic<uint32_t>    tail;
+    atomic<uint64_t>    dropped;
+    atomic<uintptr_t>   stacklo;    // the stack of the thread, [stacklo, stackhi); 0 until known
+    atomic<uintptr_t>   stackhi;
+    atomic<uintptr_t>   seensp;     // a stack pointer of the thread, to look its stack up by
+    long                tid;
+    std::string         name;
+    timer_t             timer;
+};
+
+static atomic<bool> profile_active_(false);
+static atomic<int>  profile_unwinder_(UnwindTables);
+
+/**
+*   follows the chain of the saved frame pointers, as long as it stays on the live part
+*   [sp, stackhi) of the thread's stack. every frame must be aligned, and sit above
+*   the previous one by less than PROFILE_MAX_FRAME.
+*/
+uint32_t profile_walk_frames(uintptr_t pc, uintptr_t fp, uintptr_t sp, uintptr_t stacklo, uintptr_t stackhi, uintptr_t *pcs)
+{
+    uint32_t depth = 0;
+    pcs[depth++] = pc;
+    const uintptr_t low = (sp > stacklo)? sp: stacklo;
+    while( (depth < static_cast<uint32_t>(PROFILE_MAX_DEPTH)) && (fp >= low) && (fp < stackhi)
+           && (stackhi - fp >= 2 * sizeof(uintptr_t)) && ((fp & (sizeof(uintptr_t) - 1)) == 0) ){
+        const uintptr_t *frame = reinterpret_cast<const uintptr_t *>(fp);
+        if( frame[1] == 0 ){
+            break;
+        }
+        pcs[depth++] = frame[1];
+        if( (frame[0] <= fp) || (frame[0] - fp >= PROFILE_MAX_FRAME) ){
+            break;
+        }
+        fp = frame[0];
+    }
+    return depth;
+}
+
+uint32_t profile_unwind(void *context, _ProfileBuffer *buffer, uintptr_t *pcs)
+{
+    const ucontext_t *uc = static_cast<const ucontext_t *>(context);
+    uintptr_t pc = 0, fp = 0, sp = 0;
+#if defined(__x86_64__)
+    pc = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]);
+    fp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RBP]);
+    sp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RSP]);
+#elif defined(__i386__)
+    pc = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_EIP]);
+    fp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_EBP]);
+    sp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_ESP]);
+#elif defined(__aarch64__)
+    pc = static_cast<uintptr_t>(uc->uc_mcontext.pc);
+    fp = static_cast<uintptr_t>(uc->uc_mcontext.regs[29]);
+    sp = static_cast<uintptr_t>(uc->uc_mcontext.sp);
+#else
+    (void)uc;
+#endif
+    if( (pc != 0) && (profile_unwinder_.load(memory_order_relaxed) == FramePointers) ){
+        uintptr_t stackhi = buffer->stackhi.load(memory_order_acquire);
+        if( stackhi != 0 ){
+            return profile_walk_frames(pc, fp, sp, buffer->stacklo.load(memory_order_relaxed), stackhi, pcs);
+        }
+        // the stack is not known yet: the collector looks it up by this pointer (see resolveStacks_())
+        buffer->seensp.store(sp, memory_order_relaxed);
+    }
+
+    void *frames[PROFILE_MAX_DEPTH + PROFILE_HANDLER_FRAMES];
+    int   count = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_HANDLER_FRAMES);
+    // the interrupted frame comes right after those of the handler and the signal trampoline
+    int   first = (count < PROFILE_HANDLER_FRAMES)? count: PROFILE_HANDLER_FRAMES;
+    for( int i=0; i<count && i<PROFILE_HANDLER_FRAMES; i++ ){
+        if( reinterpret_cast<uintptr_t>(frames[i]) == pc ){
+            first = i;
+            break;
+        }
+    }
+    uint32_t depth = 0;
+    for( int i=first; (i<count) && (depth<static_cast<uint32_t>(PROFILE_MAX_DEPTH)); i++ ){
+        pcs[depth++] = reinterpret_cast<uintptr_t>(frames[i]);
+    }
+    return depth;
+}
+
+void profile_signal(int, siginfo_t *info, void *context)
+{
+    if( (info->si_code != SI_TIMER) || !profile_active_.load(memory_order_relaxed) ){
+        return;
+    }
+    _ProfileBuffer *buffer = static_cast<_ProfileBuffer *>(info->si_value.sival_ptr);
+    if( buffer == 0 ){
+        return;
+    }
+    int saved = errno;
+    uint32_t head = buffer->head.load(memory_order_relaxed);
+    if( head - buffer->tail.load(memory_order_acquire) >= PROFILE_BUFFER_SAMPLES ){
+        buffer->dropped.fetch_add(1, memory_order_relaxed);
+    } else {
+        _ProfileSample &sample = buffer->samples[head % PROFILE_BUFFER_SAMPLES];
+        sample.depth = profile_unwind(context, buffer, sample.pcs);
+        buffer->head.store(head + 1, memory_order_release);
+    }
+    errno = saved;
+}
+
+/**
+*   the CPU-time clock of another thread of the process (see pthread_getcpuclockid())
+*/
+inline clockid_t thread_cpu_clock(long tid)
+{
+    const clockid_t CPUCLOCK_PERTHREAD_SCHED = 6;
+    return static_cast<clockid_t>((~static_cast<unsigned long>(tid) << 3) | CPUCLOCK_PERTHREAD_SCHED);
+}
+
+inline bool thread_alive(long tid)
+{
+    return (syscall(SYS_tgkill, getpid(), tid, 0) == 0) || (errno != ESRCH);
+}
+
+/**
+*   the stack of the calling thread
+*/
+bool own_stack(uintptr_t *lo, uintptr_t *hi)
+{
+    pthread_attr_t attr;
+    if( pthread_getattr_np(pthread_self(), &attr) != 0 ){
+        return false;
+    }
+    void  *addr = 0;
+    size_t size = 0;
+    bool   found = (pthread_attr_getstack(&attr, &addr, &size) == 0) && (addr != 0);
+    pthread_attr_destroy(&attr);
+    if( found ){
+        *lo = reinterpret_cast<uintptr_t>(addr);
+        *hi = *lo + size;
+    }
+    return found;
+}
+
+/**
+*   the mapping that contains `addr` (i.e. the stack of the thread, for a stack pointer of it)
+*/
+bool stack_mapping(uintptr_t addr, uintptr_t *lo, uintptr_t *hi)
+{
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while( std::getline(maps, line) ){
+        unsigned long start, end;
+        if( (sscanf(line.c_str(), "%lx-%lx", &start, &end) == 2) && (addr >= start) && (addr < end) ){
+            *lo = static_cast<uintptr_t>(start);
+            *hi = static_cast<uintptr_t>(end);
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef std::vector<uintptr_t>                      ProfileStack;
+typedef std::map<ProfileStack, uint64_t>            ProfileCounts;
+typedef std::pair<long, std::string>                ProfileThreadKey;
+
+class _ProfileRegistry;
+
+class _ProfileCollector: public PeriodicThread
+{
+public:
+    explicit _ProfileCollector(_ProfileRegistry *registry): PeriodicThread(PROFILE_DRAIN_MSEC), registry_(registry) {}
+
+protected:
+    virtual void tick();
+
+private:
+    _ProfileRegistry   *registry_;
+};
+
+/**
+ * the buffers of the threads, and the stacks collected from them.
+ * a buffer is never freed: a signal may still be on its way to it after its timer is deleted.
+ * once the thread is gone, the buffer is reused for another thread.
+ */
+class _ProfileRegistry: public ThreadStartHandler, public ThreadExitHandler
+{
+public:
+    _ProfileRegistry():
+        lock_(), running_(false), installed_(false), registered_(false), interval_(0),
+        collector_(0), ticks_(0), samples_(0), dropped_(0) {}
+
+    void start(int frequency, ProfileUnwinder unwinder)
+    {
+        MutexLocker locker(&lock_);
+        if( running_ ){
+            return;
+        }
+        if( frequency <= 0 ){
+            fail_("the frequency must be positive");
+        }
+        install_();
+        if( !registered_ ){
+            Thread::addStartHandler(this);
+            Thread::addExitHandler(this);
+            registered_ = true;
+        }
+        profile_unwinder_.store(unwinder, memory_order_relaxed);
+        interval_ = static_cast<long>(NSEC_PER_SEC / frequency);
+        profile_active_.store(true, memory_order_relaxed);
+        running_ = true;
+        rescan_();
+
+        collector_ = new _ProfileCollector(this);
+        collector_->setName("ks-profiler");
+        collector_->start();
+    }
+
+    void stop()
+    {
+        _ProfileCollector *collector;
+        {
+            MutexLocker locker(&lock_);
+            if( !running_ ){
+                return;
+            }
+            running_   = false;
+            collector  = collector_;
+            collector_ = 0;
+        }
+        // the collector ticks with the lock, so it is stopped outside
+        collector->stop();
+        delete collector;
+
+        MutexLocker locker(&lock_);
+        while( !active_.empty() ){
+            retire_(active_.begin());
+        }
+        drainAll_();
+        profile_active_.store(false, memory_order_relaxed);
+    }
+
+    bool running()
+    {
+        MutexLocker locker(&lock_);
+        return running_;
+    }
+
+    void tick()
+    {
+        MutexLocker locker(&lock_);
+        drainAll_();
+        if( ++ticks_ % PROFILE_RESCAN_TICKS == 0 ){
+            rescan_();
+        }
+        resolveStacks_();
+        recycle_();
+    }
+
+    virtual void threadStarting(Thread *thread)
+    {
+        MutexLocker locker(&lock_);
+        if( running_ && (active_.find(thread->systemId()) == active_.end()) ){
+            // called on the thread itself, so that its stack is known from the first sample
+            uintptr_t lo = 0, hi = 0;
+            own_stack(&lo, &hi);
+            arm_(thread->systemId(), thread->name(), lo, hi);
+        }
+    }
+
+    virtual void threadExiting(Thread *thread)
+    {
+        MutexLocker locker(&lock_);
+        FlatHashMap<long, _ProfileBuffer *>::iterator it = active_.find(thread->systemId());
+        if( it != active_.end() ){
+            retire_(it);
+        }
+    }
+
+    void writeFolded(std::ostream &out)
+    {
+        MutexLocker locker(&lock_);
+        drainAll_();
+        std::map<uintptr_t, std::string> symbols;
+        for( std::map<ProfileThreadKey, ProfileCounts>::iterator th=counts_.begin(); th!=counts_.end(); ++th ){
+            // the stacks that differ only within the functions are merged
+            std::map<std::string, uint64_t> folded;
+            for( ProfileCounts::iterator it=th->second.begin(); it!=th->second.end(); ++it ){
+                std::stringstream line;
+                line << (th->first.second.empty()? "thread": th->first.second) << "-" << th->first.first;
+                const ProfileStack &stack = it->first;
+                for( size_t i=stack.size(); i>0; i-- ){
+                    // the outer frames are return addresses: look up the call instruction
+                    line << ';' << symbol_((i > 1)? (stack[i-1] - 1): stack[i-1], symbols);
+                }
+                folded[line.str()] += it->second;
+            }
+            for( std::map<std::string, uint64_t>::iterator it=folded.begin(); it!=folded.end(); ++it ){
+                out << it->first << ' ' << it->second << '\n';
+            }
+        }
+    }
+
+    void writePprof(std::ostream &out)
+    {
+        MutexLocker locker(&lock_);
+        drainAll_();
+        ProfileCounts merged;
+        for( std::map<ProfileThreadKey, ProfileCounts>::iterator th=counts_.begin(); th!=counts_.end(); ++th ){
+            for( ProfileCounts::iterator it=th->second.begin(); it!=th->second.end(); ++it ){
+                merged[it->first] += it->second;
+            }
+        }
+
+        // the header: the words 0, 3 (the header size), 0 (the version), the period in usec, 0 (padding)
+        long period = (interval_ > 0)? (interval_ / 1000): (1000000 / PROFILE_DEFAULT_HZ);
+        writeWord_(out, 0);
+        writeWord_(out, 3);
+        writeWord_(out, 0);
+        writeWord_(out, static_cast<uintptr_t>(period));
+        writeWord_(out, 0);
+        for( ProfileCounts::iterator it=merged.begin(); it!=merged.end(); ++it ){
+            writeWord_(out, static_cast<uintptr_t>(it->second));
+            writeWord_(out, static_cast<uintptr_t>(it->first.size()));
+            for( size_t i=0; i<it->first.size(); i++ ){
+                writeWord_(out, it->first[i]);
+            }
+        }
+        // the trailer, followed by the memory map for the symbolization
+        writeWord_(out, 0);
+        writeWord_(out, 1);
+        writeWord_(out, 0);
+        std::ifstream maps("/proc/self/maps");
+        out << maps.rdbuf();
+    }
+
+    void clear()
+    {
+        MutexLocker locker(&lock_);
+        drainAll_();
+        counts_.clear();
+        samples_ = 0;
+        dropped_ = 0;
+        for( FlatHashMap<long, _ProfileBuffer *>::iterator it=active_.begin(); it!=active_.end(); ++it ){
+            it->second->dropped.store(0);
+        }
+    }
+
+    uint64_t samples()
+    {
+        MutexLocker locker(&lock_);
+        drainAll_();
+        return samples_;
+    }
+
+    uint64_t dropped()
+    {
+        MutexLocker locker(&lock_);
+        uint64_t dropped = dropped_;
+        for( FlatHashMap<long, _ProfileBuffer *>::iterator it=active_.begin(); it!=active_.end(); ++it ){
+            dropped += it->second->dropped.load();
+        }
+        for( size_t i=0; i<retired_.size(); i++ ){
+            dropped += retired_[i]->dropped.load();
+        }
+        return dropped;
+    }
+
+private:
+    static const long NSEC_PER_SEC = 1000000000L;
+
+    void fail_(const std::string &msg)
+    {
+        ks::logger::error("ks::Profiler") << msg << ks::endl;
+        throw std::runtime_error(msg);
+    }
+
+    /**
+    *   the handler stays installed after stop(), so that a late signal cannot kill the process
+    */
+    void install_()
+    {
+        if( installed_ ){
+            return;
+        }
+        struct sigaction previous;
+        sigaction(SIGPROF, 0, &previous);
+        if( (previous.sa_flags & SA_SIGINFO)
+            || ((previous.sa_handler != SIG_DFL) && (previous.sa_handler != SIG_IGN)) ){
+            fail_("SIGPROF is already handled by another profiler");
+        }
+
+        // backtrace() loads the unwinder on its first call, which must not happen in the handler
+        void *warmup[2];
+        backtrace(warmup, 2);
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = profile_signal;
+        action.sa_flags     = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if( sigaction(SIGPROF, &action, 0) != 0 ){
+            fail_(std::string("could not install the SIGPROF handler: ") + strerror(errno));
+        }
+        installed_ = true;
+    }
+
+    /**
+    *   brings the timers in line with the running Threads
+    */
+    void rescan_()
+    {
+        std::vector<ThreadStats> threads = Thread::snapshot();
+        std::map<long, std::string> alive;
+        for( size_t i=0; i<threads.size(); i++ ){
+            if( threads[i].systemId != 0 ){
+                alive[threads[i].systemId] = threads[i].name;
+            }
+        }
+
+        FlatHashMap<long, _ProfileBuffer *>::iterator it = active_.begin();
+        while( it != active_.end() ){
+            std::map<long, std::string>::iterator found = alive.find(it->first);
+            if( found == alive.end() ){
+                retire_(it++);
+            } else {
+                it->second->name = found->second;
+                alive.erase(found);
+                ++it;
+            }
+        }
+        for( std::map<long, std::string>::iterator th=alive.begin(); th!=alive.end(); ++th ){
+            arm_(th->first, th->second, 0, 0); // the stack is looked up later, see resolveStacks_()
+        }
+    }
+
+    void arm_(long tid, const std::string &name, uintptr_t stacklo, uintptr_t stackhi)
+    {
+        _ProfileBuffer *buffer;
+        if( free_.empty() ){
+            buffer = new _ProfileBuffer();
+        } else {
+            buffer = free_.back();
+            free_.pop_back();
+        }
+        buffer->tid  = tid;
+        buffer->name = name;
+        buffer->seensp.store(0, memory_order_relaxed);
+        buffer->stacklo.store(stacklo, memory_order_relaxed);
+        buffer->stackhi.store(stackhi, memory_order_release);
+
+        struct sigevent event;
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify           = SIGEV_THREAD_ID;
+        event.sigev_signo            = SIGPROF;
+        event.sigev_value.sival_ptr  = buffer;
+        event.sigev_notify_thread_id = static_cast<pid_t>(tid);
+        if( timer_create(thread_cpu_clock(tid), &event, &buffer->timer) != 0 ){
+            // the thread has just exited, most likely
+            ks::logger::debug("ks::Profiler") << "could not create the timer for thread " << tid
+                                              << ": " << strerror(errno) << ks::endl;
+            free_.push_back(buffer);
+            return;
+        }
+
+        struct itimerspec spec;
+        spec.it_interval.tv_sec  = interval_ / NSEC_PER_SEC;
+        spec.it_interval.tv_nsec = interval_ % NSEC_PER_SEC;
+        spec.it_value            = spec.it_interval;
+        timer_settime(buffer->timer, 0, &spec, 0);
+        active_[tid] = buffer;
+    }
+
+    /**
+    *   the stacks of the threads armed by rescan_(), from the stack pointers of their first samples
+    *   (until then, their samples are taken with backtrace())
+    */
+    void resolveStacks_()
+    {
+        for( FlatHashMap<long, _ProfileBuffer *>::iterator it=active_.begin(); it!=active_.end(); ++it ){
+            _ProfileBuffer *buffer = it->second;
+            uintptr_t sp = buffer->seensp.load(memory_order_relaxed);
+            uintptr_t lo, hi;
+            if( (sp != 0) && (buffer->stackhi.load(memory_order_relaxed) == 0) && stack_mapping(sp, &lo, &hi) ){
+                buffer->stacklo.store(lo, memory_order_relaxed);
+                buffer->stackhi.store(hi, memory_order_release);
+            }
+        }
+    }
+
+    void retire_(FlatHashMap<long, _ProfileBuffer *>::iterator it)
+    {
+        timer_delete(it->second->timer);
+        retired_.push_back(it->second);
+        active_.erase(it);
+    }
+
+    /**
+    *   the buffers of the threads that are gone can take no more signals
+    */
+    void recycle_()
+    {
+        for( size_t i=0; i<retired_.size(); ){
+            _ProfileBuffer *buffer = retired_[i];
+            if( thread_alive(buffer->tid) ){
+                i++;
+                continue;
+            }
+            drain_(buffer);
+            dropped_ += buffer->dropped.load();
+            buffer->dropped.store(0);
+            buffer->head.store(0);
+            buffer->tail.store(0);
+            free_.push_back(buffer);
+            retired_[i] = retired_.back();
+            retired_.pop_back();
+        }
+    }
+
+    void drain_(_ProfileBuffer *buffer)
+    {
+        uint32_t tail = buffer->tail.load(memory_order_relaxed);
+        uint32_t head = buffer->head.load(memory_order_acquire);
+        if( tail == head ){
+            return;
+        }
+        ProfileCounts &counts = counts_[ProfileThreadKey(buffer->tid, buffer->name)];
+        for( ; tail != head; tail++ ){
+            const _ProfileSample &sample = buffer->samples[tail % PROFILE_BUFFER_SAMPLES];
+            counts[ProfileStack(sample.pcs, sample.pcs + sample.depth)]++;
+            samples_++;
+        }
+        buffer->tail.store(head, memory_order_release);
+    }
+
+    void drainAll_()
+    {
+        for( FlatHashMap<long, _ProfileBuffer *>::iterator it=active_.begin(); it!=active_.end(); ++it ){
+            drain_(it->second);
+        }
+        for( size_t i=0; i<retired_.size(); i++ ){
+            drain_(retired_[i]);
+        }
+    }
+
+    static std::string symbol_(uintptr_t pc, std::map<uintptr_t, std::string> &cache)
+    {
+        std::map<uintptr_t, std::string>::iterator cached = cache.find(pc);
+        if( cached != cache.end() ){
+            return cached->second;
+        }
+
+        std::stringstream ss;
+        Dl_info info;
+        memset(&info, 0, sizeof(info));
+        if( (dladdr(reinterpret_cast<void *>(pc), &info) != 0) && (info.dli_sname != 0) ){
+            int   status    = 0;
+            char *demangled = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
+            ss << ((status == 0)? demangled: info.dli_sname);
+            std::free(demangled);
+        } else if( (info.dli_fname != 0) && (info.dli_fname[0] != '\0') ){
+            const char *base = strrchr(info.dli_fname, '/');
+            ss << ((base != 0)? (base + 1): info.dli_fname) << "+0x" << std::hex
+               << (pc - reinterpret_cast<uintptr_t>(info.dli_fbase));
+        } else {
+            ss << "0x" << std::hex << pc;
+        }
+        cache[pc] = ss.str();
+        return cache[pc];
+    }
+
+    static void writeWord_(std::ostream &out, uintptr_t word)
+    {
+        out.write(reinterpret_cast<const char *>(&word), sizeof(word));
+    }
+
+    Mutex                                       lock_;
+    bool                                        running_;
+    bool                                        installed_;
+    bool                                        registered_;
+    long                                        interval_;   // in nanosec of CPU time
+    _ProfileCollector                          *collector_;
+    uint64_t                                    ticks_;
+    FlatHashMap<long, _ProfileBuffer *>         active_;     // by the kernel thread id
+    std::vector<_ProfileBuffer *>               retired_;    // the timer is deleted, but the thread may still run
+    std::vector<_ProfileBuffer *>               free_;
+    std::map<ProfileThreadKey, ProfileCounts>   counts_;
+    uint64_t                                    samples_;
+    uint64_t                                    dropped_;    // of the recycled buffers
+};
+
+void _ProfileCollector::tick()
+{
+    registry_->tick();
+}
+
+_ProfileRegistry &profile_registry()
+{
+    static _ProfileRegistry registry_;
+    return registry_;
+}
+
+// static
+void Profiler::start(int frequency, ProfileUnwinder unwinder) { profile_registry().start(frequency, unwinder); }
+
+// static
+void Profiler::stop() { profile_registry().stop(); }
+
+// static
+bool Profiler::running() { return profile_registry().running(); }
+
+// static
+void Profiler::writeFolded(std::ostream &out) { profile_registry().writeFolded(out); }
+
+// static
+void Profiler::writePprof(std::ostream &out) { profile_registry().writePprof(out); }
+
+// static
+void Profiler::clear() { profile_registry().clear(); }
+
+// static
+uint64_t Profiler::samples() { return profile_registry().samples(); }
+
+// static
+uint64_t Profiler::dropped() { return profile_registry().dropped(); }
+
+#else // __linux__
+
+void Profiler::start(int, ProfileUnwinder)
+{
+    ks::logger::error("ks::Profiler") << "the profiler is only supported on Linux" << ks::endl;
+    throw std::runtime_error("the profiler is only supported on Linux");
+}
+
+void     Profiler::stop() {}
+bool     Profiler::running() { return false; }
+void     Profiler::writeFolded(std::ostream &) {}
+void     Profiler::writePprof(std::ostream &) {}
+void     Profiler::clear() {}
+uint64_t Profiler::samples() { return 0; }
+uint64_t Profiler::dropped() { return 0; }
+
+#endif // __linux__
+
+/**
+*   writes a profile to `path` with one of the writers above
+*/
+bool write_profile_file(const std::string &path, void (*writer)(std::ostream &), bool binary)
+{
+    std::ofstream out(path.c_str(), binary? (std::ios::out | std::ios::binary): std::ios::out);
+    if( !out ){
+        ks::logger::warning("ks::Profiler") << "could not open " << path << ": " << strerror(errno) << ks::endl;
+        return false;
+    }
+    writer(out);
+    out.close();
+    if( !out ){
+        ks::logger::warning("ks::Profiler") << "could not write " << path << ks::endl;
+        return false;
+    }
+    return true;
+}
+
+// static
+bool Profiler::writeFoldedFile(const std::string &path) { return write_profile_file(path, &Profiler::writeFolded, false); }
+
+// static
+bool Profiler::writePprofFile(const std::string &path) { return write_profile_file(path, &Profiler::writePprof, true); }
+
+}
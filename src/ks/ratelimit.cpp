@@ -0,0 +1,186 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   ratelimit.cpp -- see ratelimit.h for description
+*/
+
+#include <stdexcept>
+#include <sstream>
+#include "ks/ratelimit.h"
+#include "ks/wait.h"
+#include "ks/log.h"
+
+namespace ks {
+
+const uint64_t RATE_NSEC_IN_MSEC = 1000000ULL;
+
+/**
+*   the cost of a permit in nanosec, checking the rate
+*/
+double permit_interval(double rate)
+{
+    if( !(rate > 0) ){
+        std::stringstream ss;
+        ss << "the rate must be positive: " << rate;
+        ks::logger::error("ks::RateLimiter") << ss.str() << ks::endl;
+        throw std::runtime_error(ss.str());
+    }
+    return NSEC_IN_SEC / rate;
+}
+
+uint64_t round_nsec(double nsec)
+{
+    return static_cast<uint64_t>(nsec + 0.5);
+}
+
+// RateLimiter
+
+RateLimiter::RateLimiter(double interval_nsec, uint64_t limit_nsec, uint64_t initial, ClockSource clock):
+    interval_(interval_nsec), limit_(limit_nsec), clock_(clock), spin_(0), tat_(0)
+{
+    tat_.store(now() + initial);
+}
+
+RateLimiter::~RateLimiter() {}
+
+uint64_t RateLimiter::now()
+{
+    uint64_t nsec = 0;
+    clock_.get(&nsec);
+    return nsec;
+}
+
+uint64_t RateLimiter::cost_(uint64_t n) const
+{
+    return round_nsec(interval_ * static_cast<double>(n));
+}
+
+uint64_t RateLimiter::tat_now_(uint64_t *current)
+{
+    uint64_t tat = tat_.load(memory_order_relaxed);
+    *current = now();
+    return (tat > *current)? tat: *current;
+}
+
+bool RateLimiter::try_acquire(uint64_t n)
+{
+    const uint64_t cost    = cost_(n);
+    const uint64_t current = now();
+    uint64_t tat = tat_.load(memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = ((tat > current)? tat: current) + cost;
+        if( next - current > limit_ ){
+            return false;
+        }
+    } while( !tat_.compare_exchange_weak(tat, next, memory_order_relaxed) );
+    return true;
+}
+
+uint64_t RateLimiter::acquire(uint64_t n)
+{
+    const uint64_t cost    = cost_(n);
+    const uint64_t current = now();
+    uint64_t tat = tat_.load(memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = ((tat > current)? tat: current) + cost;
+    } while( !tat_.compare_exchange_weak(tat, next, memory_order_relaxed) );
+
+    // the permits are ours; wait until their time has come
+    if( next - current <= limit_ ){
+        return 0;
+    }
+    sleep_until_(next - limit_);
+    return now() - current;
+}
+
+uint64_t RateLimiter::time_until_available(uint64_t n)
+{
+    uint64_t current;
+    uint64_t next = tat_now_(&current) + cost_(n);
+    return (next - current > limit_)? (next - current - limit_): 0;
+}
+
+void RateLimiter::sleep_until_(uint64_t deadline)
+{
+    nanotimer timer;
+    uint64_t  current;
+    while( (current = now()) < deadline ){
+        uint64_t remaining = deadline - current;
+        if( remaining <= spin_ ){
+            cpu_relax();
+            continue;
+        }
+#ifdef _WIN32
+        // nanotimer cannot sleep on Windows: sleep by milliseconds, and spin for the rest
+        if( remaining - spin_ < RATE_NSEC_IN_MSEC ){
+            cpu_relax();
+            continue;
+        }
+        sleep_msec(static_cast<unsigned int>((remaining - spin_) / RATE_NSEC_IN_MSEC));
+#else
+        timer.set_interval(remaining - spin_);
+        timer.sleep();
+#endif
+    }
+}
+
+// TokenBucket
+
+uint64_t bucket_limit(double rate, double burst)
+{
+    if( !(burst >= 1) ){
+        std::stringstream ss;
+        ss << "the burst must be at least one token: " << burst;
+        ks::logger::error("ks::TokenBucket") << ss.str() << ks::endl;
+        throw std::runtime_error(ss.str());
+    }
+    return round_nsec(permit_interval(rate) * burst);
+}
+
+TokenBucket::TokenBucket(double rate, double burst, bool full, ClockSource clock):
+    RateLimiter(permit_interval(rate), bucket_limit(rate, burst), full? 0: bucket_limit(rate, burst), clock) {}
+
+double TokenBucket::available()
+{
+    uint64_t current;
+    uint64_t tat = tat_now_(&current);
+    // the bucket is full when TAT is now, and empty when TAT is `limit_` ahead
+    return (static_cast<double>(limit_) - static_cast<double>(tat - current)) / interval_;
+}
+
+// LeakyBucket
+
+LeakyBucket::LeakyBucket(double rate, uint64_t tolerance_nsec, ClockSource clock):
+    RateLimiter(permit_interval(rate), round_nsec(permit_interval(rate)) + tolerance_nsec, 0, clock) {}
+
+uint64_t LeakyBucket::theoretical_arrival()
+{
+    uint64_t current;
+    return tat_now_(&current);
+}
+
+}
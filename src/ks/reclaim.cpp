@@ -0,0 +1,433 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   reclaim.cpp -- see reclaim.h for description
+*/
+
+#include <algorithm>
+#include "ks/reclaim.h"
+#include "internal.h"
+
+namespace ks {
+
+/**
+ * the domain ids are never reused, so that a stale cache entry never matches
+ */
+atomic<uint64_t> domain_counter_(0);
+
+/**
+ * the per-thread cache of (domain id -> record of the calling thread), see internal.h.
+ * on a miss, the records are looked up by their owner instead.
+ */
+static KS_THREAD_LOCAL _IdCacheEntry reclaim_cache_[ID_CACHE_SIZE];
+
+void free_nodes(std::vector<_RetiredNode> &nodes)
+{
+    for( std::vector<_RetiredNode>::iterator it=nodes.begin(); it!=nodes.end(); ++it ){
+        it->deleter(it->ptr);
+    }
+    nodes.clear();
+}
+
+/**
+ * the fields common to the records of both domains.
+ * records are linked into a push-only list, and are only freed along with the domain.
+ */
+class _ReclaimRecord
+{
+public:
+    _ReclaimRecord(): next(0), inuse(1), owner(Thread::id()) {}
+
+    _ReclaimRecord           *next;     // immutable once published
+    atomic<int>               inuse;
+    ks_thread_id              owner;
+    std::vector<_RetiredNode> retired;  // only accessed by the owner
+};
+
+/**
+ * finds the record of the calling thread in `head`, or claims a free one.
+ * returns 0 if a new record has to be allocated.
+ */
+_ReclaimRecord *find_record(const atomic<_ReclaimRecord *> &list)
+{
+    _ReclaimRecord *head = list.load(memory_order_acquire);
+    ks_thread_id self = Thread::id();
+    for( _ReclaimRecord *r=head; r!=0; r=r->next ){
+        if( (r->inuse.load(memory_order_relaxed) != 0) && (r->owner == self) ){
+            return r;
+        }
+    }
+    for( _ReclaimRecord *r=head; r!=0; r=r->next ){
+        int expected = 0;
+        if( (r->inuse.load(memory_order_relaxed) == 0) && r->inuse.compare_exchange_strong(expected, 1) ){
+            r->owner = self;
+            return r;
+        }
+    }
+    return 0;
+}
+
+void push_record(atomic<_ReclaimRecord *> &list, _ReclaimRecord *record)
+{
+    _ReclaimRecord *head = list.load(memory_order_relaxed);
+    do {
+        record->next = head;
+    } while( !list.compare_exchange_weak(head, record, memory_order_release) );
+}
+
+// EpochDomain
+
+/**
+ * `state` holds (local epoch << 1) | active
+ */
+class _EpochRecord: public _ReclaimRecord
+{
+public:
+    _EpochRecord(): _ReclaimRecord(), state(0), nesting(0) {}
+
+    atomic<uint64_t> state;
+    int              nesting;
+};
+
+EpochDomain::EpochDomain(size_t batch):
+    ThreadExitHandler(),
+    id_(++domain_counter_),
+    batch_((batch > 0)? batch: 1),
+    epoch_(2), // so that `epoch - 2` never underflows
+    records_(0),
+    orphanlock_()
+{
+    Thread::addExitHandler(this);
+}
+
+EpochDomain::~EpochDomain()
+{
+    Thread::removeExitHandler(this);
+    id_cache_remove(reclaim_cache_, id_);
+
+    _ReclaimRecord *r = records_.load();
+    while( r != 0 ){
+        _ReclaimRecord *next = r->next;
+        free_nodes(r->retired);
+        delete static_cast<_EpochRecord *>(r);
+        r = next;
+    }
+    free_nodes(orphans_);
+}
+
+_EpochRecord *EpochDomain::record_()
+{
+    void *cached = id_cache_find(reclaim_cache_, id_);
+    if( cached != 0 ){
+        return static_cast<_EpochRecord *>(cached);
+    }
+
+    _EpochRecord *r = static_cast<_EpochRecord *>(find_record(records_));
+    if( r == 0 ){
+        r = new _EpochRecord();
+        push_record(records_, r);
+    }
+    id_cache_put(reclaim_cache_, id_, r);
+    return r;
+}
+
+void EpochDomain::enter()
+{
+    _EpochRecord *r = record_();
+    if( r->nesting++ > 0 ){
+        return;
+    }
+
+    uint64_t e = epoch_.load();
+    while( true ){
+        r->state.store((e << 1) | 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t current = epoch_.load();
+        if( current == e ){
+            break;
+        }
+        e = current;
+    }
+}
+
+void EpochDomain::exit()
+{
+    _EpochRecord *r = record_();
+    if( --(r->nesting) > 0 ){
+        return;
+    }
+    r->state.store(0, memory_order_release);
+}
+
+uint64_t EpochDomain::epoch() const
+{
+    return epoch_.load();
+}
+
+bool EpochDomain::tryAdvance_()
+{
+    uint64_t e = epoch_.load();
+    for( _ReclaimRecord *r=records_.load(memory_order_acquire); r!=0; r=r->next ){
+        uint64_t state = static_cast<_EpochRecord *>(r)->state.load();
+        if( ((state & 1) != 0) && ((state >> 1) != e) ){
+            return false; // a thread is still in an older epoch
+        }
+    }
+    return epoch_.compare_exchange_strong(e, e + 1);
+}
+
+void EpochDomain::free_(std::vector<_RetiredNode> &nodes, uint64_t safe_before)
+{
+    std::vector<_RetiredNode>::iterator keep = nodes.begin();
+    for( std::vector<_RetiredNode>::iterator it=nodes.begin(); it!=nodes.end(); ++it ){
+        if( it->epoch < safe_before ){
+            it->deleter(it->ptr);
+        } else {
+            *(keep++) = *it;
+        }
+    }
+    nodes.erase(keep, nodes.end());
+}
+
+void EpochDomain::retire(void *ptr, ReclaimDeleter deleter)
+{
+    _EpochRecord *r = record_();
+    r->retired.push_back(_RetiredNode(ptr, deleter, epoch_.load()));
+    if( r->retired.size() >= batch_ ){
+        reclaim();
+    }
+}
+
+void EpochDomain::reclaim()
+{
+    tryAdvance_();
+    // the nodes retired two epochs ago can no longer be referred to
+    uint64_t safe_before = epoch_.load() - 1;
+
+    free_(record_()->retired, safe_before);
+    if( orphanlock_.tryLock() ){
+        free_(orphans_, safe_before);
+        orphanlock_.unlock();
+    }
+}
+
+void EpochDomain::threadExiting(Thread *thread)
+{
+    (void)thread;
+    _EpochRecord *r = static_cast<_EpochRecord *>(id_cache_find(reclaim_cache_, id_));
+    if( r == 0 ){
+        r = static_cast<_EpochRecord *>(find_record(records_));
+        if( r == 0 ){
+            return; // the thread has never used this domain
+        }
+    }
+    id_cache_remove(reclaim_cache_, id_);
+
+    orphanlock_.lock();
+    orphans_.insert(orphans_.end(), r->retired.begin(), r->retired.end());
+    orphanlock_.unlock();
+
+    r->retired.clear();
+    r->nesting = 0;
+    r->state.store(0);
+    r->owner = 0;
+    r->inuse.store(0, memory_order_release);
+}
+
+// static
+EpochDomain &EpochDomain::global()
+{
+    static EpochDomain domain_;
+    return domain_;
+}
+
+EpochGuard::EpochGuard(EpochDomain &domain): domain_(domain)
+{
+    domain_.enter();
+}
+
+EpochGuard::~EpochGuard()
+{
+    domain_.exit();
+}
+
+// HazardDomain
+
+class _HazardRecord: public _ReclaimRecord
+{
+public:
+    explicit _HazardRecord(int slots): _ReclaimRecord(), hazards(new atomic<void *>[slots]) {}
+
+    ~_HazardRecord()
+    {
+        delete[] hazards;
+    }
+
+    atomic<void *> *hazards;
+};
+
+HazardDomain::HazardDomain(int slots, size_t batch):
+    ThreadExitHandler(),
+    id_(++domain_counter_),
+    slots_((slots > 0)? slots: 1),
+    batch_((batch > 0)? batch: 1),
+    records_(0),
+    count_(0),
+    orphanlock_()
+{
+    Thread::addExitHandler(this);
+}
+
+HazardDomain::~HazardDomain()
+{
+    Thread::removeExitHandler(this);
+    id_cache_remove(reclaim_cache_, id_);
+
+    _ReclaimRecord *r = records_.load();
+    while( r != 0 ){
+        _ReclaimRecord *next = r->next;
+        free_nodes(r->retired);
+        delete static_cast<_HazardRecord *>(r);
+        r = next;
+    }
+    free_nodes(orphans_);
+}
+
+_HazardRecord *HazardDomain::record_()
+{
+    void *cached = id_cache_find(reclaim_cache_, id_);
+    if( cached != 0 ){
+        return static_cast<_HazardRecord *>(cached);
+    }
+
+    _HazardRecord *r = static_cast<_HazardRecord *>(find_record(records_));
+    if( r == 0 ){
+        r = new _HazardRecord(slots_);
+        push_record(records_, r);
+        count_.fetch_add(1);
+    }
+    id_cache_put(reclaim_cache_, id_, r);
+    return r;
+}
+
+void HazardDomain::publish_(int slot, void *ptr)
+{
+    record_()->hazards[slot].store(ptr);
+    atomic_thread_fence(memory_order_seq_cst); // the publication must precede the re-check of the source
+}
+
+void HazardDomain::clear(int slot)
+{
+    record_()->hazards[slot].store(0, memory_order_release);
+}
+
+void HazardDomain::clearAll()
+{
+    _HazardRecord *r = record_();
+    for( int i=0; i<slots_; i++ ){
+        r->hazards[i].store(0, memory_order_release);
+    }
+}
+
+void HazardDomain::retire(void *ptr, ReclaimDeleter deleter)
+{
+    _HazardRecord *r = record_();
+    r->retired.push_back(_RetiredNode(ptr, deleter, 0));
+
+    // scanning costs O(records * slots), so the threshold scales with it
+    size_t threshold = static_cast<size_t>(2 * slots_ * count_.load(memory_order_relaxed));
+    if( r->retired.size() >= std::max(batch_, threshold) ){
+        reclaim();
+    }
+}
+
+void HazardDomain::scan_(std::vector<_RetiredNode> &nodes)
+{
+    std::vector<void *> hazards;
+    for( _ReclaimRecord *r=records_.load(memory_order_acquire); r!=0; r=r->next ){
+        _HazardRecord *hr = static_cast<_HazardRecord *>(r);
+        for( int i=0; i<slots_; i++ ){
+            void *ptr = hr->hazards[i].load();
+            if( ptr != 0 ){
+                hazards.push_back(ptr);
+            }
+        }
+    }
+    std::sort(hazards.begin(), hazards.end());
+
+    std::vector<_RetiredNode>::iterator keep = nodes.begin();
+    for( std::vector<_RetiredNode>::iterator it=nodes.begin(); it!=nodes.end(); ++it ){
+        if( std::binary_search(hazards.begin(), hazards.end(), it->ptr) ){
+            *(keep++) = *it;
+        } else {
+            it->deleter(it->ptr);
+        }
+    }
+    nodes.erase(keep, nodes.end());
+}
+
+void HazardDomain::reclaim()
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    scan_(record_()->retired);
+    if( orphanlock_.tryLock() ){
+        scan_(orphans_);
+        orphanlock_.unlock();
+    }
+}
+
+void HazardDomain::threadExiting(Thread *thread)
+{
+    (void)thread;
+    _HazardRecord *r = static_cast<_HazardRecord *>(id_cache_find(reclaim_cache_, id_));
+    if( r == 0 ){
+        r = static_cast<_HazardRecord *>(find_record(records_));
+        if( r == 0 ){
+            return;
+        }
+    }
+    id_cache_remove(reclaim_cache_, id_);
+
+    for( int i=0; i<slots_; i++ ){
+        r->hazards[i].store(0);
+    }
+    orphanlock_.lock();
+    orphans_.insert(orphans_.end(), r->retired.begin(), r->retired.end());
+    orphanlock_.unlock();
+
+    r->retired.clear();
+    r->owner = 0;
+    r->inuse.store(0, memory_order_release);
+}
+
+// static
+HazardDomain &HazardDomain::global()
+{
+    static HazardDomain domain_;
+    return domain_;
+}
+
+}
@@ -0,0 +1,399 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   scheduler.cpp -- see scheduler.h for description
+*
+*   the wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots. a timer due in
+*   less than WHEEL_SIZE ticks sits in level 0 at the slot of its expiry tick;
+*   timers further away sit in the higher levels, and are cascaded down
+*   whenever the level below wraps around.
+*/
+
+#include <stdexcept>
+#include "ks/scheduler.h"
+#include "ks/log.h"
+#include "internal.h"
+
+namespace ks {
+
+TimerTask::TimerTask(): refs_(1) {}
+TimerTask::~TimerTask() {}
+
+void TimerTask::acquire()
+{
+    refs_.fetch_add(1, memory_order_relaxed);
+}
+
+void TimerTask::release()
+{
+    if( refs_.fetch_sub(1, memory_order_acq_rel) == 1 ){
+        delete this;
+    }
+}
+
+/**
+ * the intrusive list node of a timer. nodes are recycled, and the generation
+ * tells a stale TimerHandle from a live one.
+ */
+class _TimerNode
+{
+public:
+    _TimerNode(): prev(0), next(0), slot(0), expiry(0), period(0), task(0), generation(0) {}
+
+    _TimerNode  *prev;
+    _TimerNode  *next;
+    _TimerNode **slot;       // the list head this node is linked to (0 if unlinked)
+    uint64_t     expiry;     // in ticks
+    uint64_t     period;     // in ticks; 0 for a one-shot timer
+    TimerTask   *task;
+    uint32_t     generation;
+};
+
+/**
+ * runs TimerTask::fire() on the executor, holding a reference to the task
+ */
+class _TimerFire: public Task
+{
+public:
+    explicit _TimerFire(TimerTask *task): Task(), task_(task) {}
+    virtual ~_TimerFire() { task_->release(); }
+    virtual void run()    { task_->fire(); }
+private:
+    TimerTask *task_;
+};
+
+TimerScheduler::TimerThread::TimerThread(TimerScheduler *scheduler): Thread(), scheduler_(scheduler) {}
+
+void TimerScheduler::TimerThread::run()
+{
+    scheduler_->loop_();
+}
+
+TimerScheduler::TimerScheduler(Executor *executor, long tick_msec):
+    executor_((executor != 0)? executor: ThreadPool::global()),
+    tick_((tick_msec > 0)? tick_msec: 1),
+    origin_(monotonic_msec()),
+    current_(0),
+    wakeat_(0),
+    count_(0),
+    stopping_(false),
+    freelist_(0),
+    cond_(),
+    thread_(0)
+{
+    for( int level=0; level<WHEEL_LEVELS; level++ ){
+        for( int idx=0; idx<WHEEL_SIZE; idx++ ){
+            slots_[level][idx] = 0;
+        }
+    }
+    thread_ = new TimerThread(this);
+    thread_->start();
+}
+
+TimerScheduler::~TimerScheduler()
+{
+    stop();
+    for( int level=0; level<WHEEL_LEVELS; level++ ){
+        for( int idx=0; idx<WHEEL_SIZE; idx++ ){
+            for( _TimerNode *node=slots_[level][idx]; node!=0; node=node->next ){
+                node->task->release();
+            }
+        }
+    }
+    for( std::vector<_TimerNode *>::iterator it=allocated_.begin(); it!=allocated_.end(); ++it ){
+        delete *it;
+    }
+}
+
+TimerHandle TimerScheduler::schedule(TimerTask *task, long delay_msec)
+{
+    return add_(task, delay_msec, 0);
+}
+
+TimerHandle TimerScheduler::schedulePeriodic(TimerTask *task, long delay_msec, long period_msec)
+{
+    return add_(task, delay_msec, (period_msec > 0)? period_msec: 1);
+}
+
+uint64_t TimerScheduler::toTicks_(long msec) const
+{
+    uint64_t ticks = (msec > 0)? static_cast<uint64_t>((msec + tick_ - 1) / tick_): 0;
+    return (ticks > 0)? ticks: 1;
+}
+
+uint64_t TimerScheduler::nowTick_() const
+{
+    return (monotonic_msec() - origin_) / static_cast<uint64_t>(tick_);
+}
+
+TimerHandle TimerScheduler::add_(TimerTask *task, long delay_msec, long period_msec)
+{
+    TimerHandle handle;
+    uint64_t expiry = nowTick_() + toTicks_(delay_msec);
+
+    cond_.lock();
+    if( stopping_ ){
+        cond_.unlock();
+        task->release();
+        return handle;
+    }
+    _TimerNode *node = allocNode_();
+    node->expiry = expiry;
+    node->period = (period_msec > 0)? toTicks_(period_msec): 0;
+    node->task   = task;
+    link_(node, current_ + 1);
+    count_++;
+
+    handle.node       = node;
+    handle.generation = node->generation;
+
+    // wake the timer thread up if it is sleeping past the new timer
+    if( node->expiry < wakeat_ ){
+        cond_.notify();
+    }
+    cond_.unlock();
+    return handle;
+}
+
+bool TimerScheduler::cancel(const TimerHandle &handle)
+{
+    if( handle.node == 0 ){
+        return false;
+    }
+
+    TimerTask *task = 0;
+    cond_.lock();
+    _TimerNode *node = handle.node;
+    if( (node->generation == handle.generation) && (node->slot != 0) ){
+        unlink_(node);
+        task = node->task;
+        freeNode_(node);
+        count_--;
+    }
+    cond_.unlock();
+
+    if( task != 0 ){
+        task->release();
+        return true;
+    }
+    return false;
+}
+
+size_t TimerScheduler::pending()
+{
+    cond_.lock();
+    size_t count = count_;
+    cond_.unlock();
+    return count;
+}
+
+void TimerScheduler::stop()
+{
+    cond_.lock();
+    if( stopping_ ){
+        cond_.unlock();
+        return;
+    }
+    stopping_ = true;
+    cond_.notify();
+    cond_.unlock();
+
+    thread_->join();
+    delete thread_;
+    thread_ = 0;
+}
+
+_TimerNode *TimerScheduler::allocNode_()
+{
+    _TimerNode *node = freelist_;
+    if( node != 0 ){
+        freelist_ = node->next;
+    } else {
+        node = new _TimerNode();
+        allocated_.push_back(node);
+    }
+    node->prev = 0;
+    node->next = 0;
+    node->slot = 0;
+    return node;
+}
+
+void TimerScheduler::freeNode_(_TimerNode *node)
+{
+    node->generation++; // invalidates the outstanding handles
+    node->task = 0;
+    node->slot = 0;
+    node->prev = 0;
+    node->next = freelist_;
+    freelist_  = node;
+}
+
+/**
+ * `base` is the first tick whose level-0 slot has not been processed yet:
+ * current_ + 1 in general, or current_ itself while cascading into it.
+ * a node beyond the span of the wheel is parked in the top level at the far end
+ * of the span, with its expiry untouched, so that the cascade re-links it until it is due.
+ */
+void TimerScheduler::link_(_TimerNode *node, uint64_t base)
+{
+    if( node->expiry < base ){
+        node->expiry = base; // already due: fire on the next tick processed
+    }
+
+    const uint64_t span = static_cast<uint64_t>(1) << (WHEEL_BITS * WHEEL_LEVELS);
+    uint64_t delta = node->expiry - base;
+    uint64_t at    = (delta < span)? node->expiry: (base + span - 1);
+    int level = 0;
+    while( (level < WHEEL_LEVELS - 1) && ((at - base) >= (static_cast<uint64_t>(1) << (WHEEL_BITS * (level + 1)))) ){
+        level++;
+    }
+    int idx = static_cast<int>((at >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1));
+
+    _TimerNode **slot = &(slots_[level][idx]);
+    node->slot = slot;
+    node->prev = 0;
+    node->next = *slot;
+    if( *slot != 0 ){
+        (*slot)->prev = node;
+    }
+    *slot = node;
+}
+
+void TimerScheduler::unlink_(_TimerNode *node)
+{
+    if( node->prev != 0 ){
+        node->prev->next = node->next;
+    } else {
+        *(node->slot) = node->next;
+    }
+    if( node->next != 0 ){
+        node->next->prev = node->prev;
+    }
+    node->prev = 0;
+    node->next = 0;
+    node->slot = 0;
+}
+
+void TimerScheduler::cascade_(int level)
+{
+    int idx = static_cast<int>((current_ >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1));
+    _TimerNode *node = slots_[level][idx];
+    slots_[level][idx] = 0;
+    while( node != 0 ){
+        _TimerNode *next = node->next;
+        node->slot = 0;
+        link_(node, current_); // the level-0 slot of current_ is processed right after the cascade
+        node = next;
+    }
+    if( (idx == 0) && (level + 1 < WHEEL_LEVELS) ){
+        cascade_(level + 1);
+    }
+}
+
+void TimerScheduler::advance_(uint64_t until, std::vector<DueTimer> &due)
+{
+    while( current_ < until ){
+        current_++;
+        int idx = static_cast<int>(current_ & (WHEEL_SIZE - 1));
+        if( idx == 0 ){
+            cascade_(1);
+        }
+
+        _TimerNode *node = slots_[0][idx];
+        slots_[0][idx] = 0;
+        while( node != 0 ){
+            _TimerNode *next = node->next;
+            node->slot = 0;
+            DueTimer timer;
+            timer.task = node->task;
+            if( node->period > 0 ){
+                node->task->acquire();
+                timer.handle.node       = node;
+                timer.handle.generation = node->generation;
+                due.push_back(timer);
+                node->expiry += node->period;
+                link_(node, current_ + 1);
+            } else {
+                due.push_back(timer); // the reference moves to the fire task
+                freeNode_(node);
+                count_--;
+            }
+            node = next;
+        }
+    }
+}
+
+uint64_t TimerScheduler::nextEventTick_() const
+{
+    // the next non-empty slot of level 0, or the next cascade of level 1
+    uint64_t tick = current_ + 1;
+    for( ; (tick & (WHEEL_SIZE - 1)) != 0; tick++ ){
+        if( slots_[0][tick & (WHEEL_SIZE - 1)] != 0 ){
+            return tick;
+        }
+    }
+    return tick;
+}
+
+void TimerScheduler::loop_()
+{
+    std::vector<DueTimer> due;
+
+    cond_.lock();
+    while( !stopping_ ){
+        advance_(nowTick_(), due);
+        if( !due.empty() ){
+            cond_.unlock();
+            for( std::vector<DueTimer>::iterator it=due.begin(); it!=due.end(); ++it ){
+                try {
+                    executor_->execute(new _TimerFire(it->task));
+                } catch(std::exception &e) {
+                    // e.g. a ThreadPool after shutdown(): the executor has disposed of the fire task
+                    ks::logger::error("ks::TimerScheduler") << "could not run a timer: " << e.what() << ks::endl;
+                    cancel(it->handle); // a periodic timer fails for good
+                }
+            }
+            due.clear();
+            cond_.lock();
+            continue;
+        }
+
+        if( count_ == 0 ){
+            wakeat_ = static_cast<uint64_t>(-1);
+            cond_.wait();
+        } else {
+            wakeat_ = nextEventTick_();
+            uint64_t now = nowTick_();
+            if( wakeat_ > now ){
+                cond_.wait(static_cast<long>((wakeat_ - now) * static_cast<uint64_t>(tick_)));
+            }
+        }
+        wakeat_ = 0;
+    }
+    cond_.unlock();
+}
+
+}
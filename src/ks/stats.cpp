@@ -0,0 +1,204 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   stats.cpp -- see stats.h for description
+*/
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <sstream>
+#include "ks/stats.h"
+#include "ks/log.h"
+
+namespace ks {
+
+const double   KLL_SHRINK       = 2.0 / 3.0; // the ratio of the capacities of the adjacent levels
+const size_t   KLL_MIN_CAPACITY = 2;
+const uint64_t KLL_SEED         = 0x9E3779B97F4A7C15ULL;
+
+Ewma::Ewma(double halflife):
+    halflife_(halflife), decay_(0), sum_(0), weight_(0), time_(0)
+{
+    // also rejects NaN, for which both comparisons are false
+    if( !((halflife > 0) && (halflife <= std::numeric_limits<double>::max())) ){
+        std::stringstream ss;
+        ss << "the half-life must be positive and finite: " << halflife;
+        ks::logger::error("ks::Ewma") << ss.str() << ks::endl;
+        throw std::runtime_error(ss.str());
+    }
+    decay_ = std::pow(0.5, 1.0 / halflife);
+}
+
+QuantileSketch::QuantileSketch(unsigned int k):
+    k_(k), levels_(1), retained_(0), capacity_(0), count_(0), min_(0), max_(0), random_(KLL_SEED)
+{
+    if( k < 8 ){
+        std::stringstream ss;
+        ss << "k must be at least 8: " << k;
+        ks::logger::error("ks::QuantileSketch") << ss.str() << ks::endl;
+        throw std::runtime_error(ss.str());
+    }
+    // the sketches in different threads should not make the same coin flips
+    random_ ^= static_cast<uint64_t>(reinterpret_cast<size_t>(this));
+    recomputeCapacity_();
+}
+
+size_t QuantileSketch::levelCapacity_(size_t level) const
+{
+    size_t depth    = levels_.size() - 1 - level;
+    size_t capacity = static_cast<size_t>(std::ceil(k_ * std::pow(KLL_SHRINK, static_cast<double>(depth))));
+    return (capacity > KLL_MIN_CAPACITY)? capacity: KLL_MIN_CAPACITY;
+}
+
+void QuantileSketch::recomputeCapacity_()
+{
+    capacity_ = 0;
+    for( size_t h=0; h<levels_.size(); h++ ){
+        capacity_ += levelCapacity_(h);
+    }
+}
+
+void QuantileSketch::compress_()
+{
+    while( retained_ >= capacity_ ){
+        // compact the lowest level that is over its capacity
+        for( size_t h=0; h<levels_.size(); h++ ){
+            if( levels_[h].size() >= levelCapacity_(h) ){
+                compact_(h);
+                break;
+            }
+        }
+    }
+}
+
+void QuantileSketch::compact_(size_t level)
+{
+    if( level + 1 == levels_.size() ){
+        levels_.push_back(std::vector<double>());
+        recomputeCapacity_();
+    }
+    std::vector<double> &current = levels_[level];
+    std::vector<double> &next    = levels_[level + 1];
+    std::sort(current.begin(), current.end());
+
+    // an odd sample out stays at this level
+    size_t paired = current.size() & ~static_cast<size_t>(1);
+
+    // xorshift64 for the coin flip
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+    for( size_t i=(random_ & 1); i<paired; i+=2 ){
+        next.push_back(current[i]);
+    }
+    current.erase(current.begin(), current.begin() + paired);
+    retained_ -= paired / 2;
+}
+
+void QuantileSketch::merge(const QuantileSketch &other)
+{
+    if( other.count_ == 0 ){
+        return;
+    }
+    update_(other.min_, other.max_, other.count_);
+    if( other.levels_.size() > levels_.size() ){
+        levels_.resize(other.levels_.size());
+        recomputeCapacity_();
+    }
+    for( size_t h=0; h<other.levels_.size(); h++ ){
+        levels_[h].insert(levels_[h].end(), other.levels_[h].begin(), other.levels_[h].end());
+        retained_ += other.levels_[h].size();
+    }
+    compress_();
+}
+
+void QuantileSketch::clear()
+{
+    levels_.assign(1, std::vector<double>());
+    retained_ = 0;
+    count_    = 0;
+    min_      = 0;
+    max_      = 0;
+    recomputeCapacity_();
+}
+
+void QuantileSketch::weighted_(std::vector<std::pair<double, uint64_t> > &out) const
+{
+    out.clear();
+    out.reserve(retained_);
+    for( size_t h=0; h<levels_.size(); h++ ){
+        for( size_t i=0; i<levels_[h].size(); i++ ){
+            out.push_back(std::make_pair(levels_[h][i], static_cast<uint64_t>(1) << h));
+        }
+    }
+    std::sort(out.begin(), out.end());
+}
+
+double QuantileSketch::quantile(double fraction) const
+{
+    if( count_ == 0 ){
+        return 0;
+    } else if( fraction <= 0 ){
+        return min_;
+    } else if( fraction >= 1 ){
+        return max_;
+    }
+
+    std::vector<std::pair<double, uint64_t> > samples;
+    weighted_(samples);
+    uint64_t total = 0;
+    for( size_t i=0; i<samples.size(); i++ ){
+        total += samples[i].second;
+    }
+    double   target     = fraction * static_cast<double>(total);
+    uint64_t cumulative = 0;
+    for( size_t i=0; i<samples.size(); i++ ){
+        cumulative += samples[i].second;
+        if( static_cast<double>(cumulative) >= target ){
+            return samples[i].first;
+        }
+    }
+    return max_;
+}
+
+double QuantileSketch::rank(double v) const
+{
+    if( count_ == 0 ){
+        return 0;
+    }
+    uint64_t below = 0, total = 0;
+    for( size_t h=0; h<levels_.size(); h++ ){
+        for( size_t i=0; i<levels_[h].size(); i++ ){
+            total += static_cast<uint64_t>(1) << h;
+            if( levels_[h][i] <= v ){
+                below += static_cast<uint64_t>(1) << h;
+            }
+        }
+    }
+    return static_cast<double>(below) / static_cast<double>(total);
+}
+
+}
@@ -0,0 +1,505 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   sync.cpp -- see sync.h for description
+*/
+
+#include <stdexcept>
+#include <sstream>
+#include <climits>
+#include <errno.h>
+#include <string.h>
+
+#include "ks/sync.h"
+#include "ks/log.h"
+
+#ifdef KS_USE_FUTEX
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+namespace ks {
+
+/**
+ * the initial count of a Semaphore, which cannot be negative (wait() would never block)
+ */
+static int32_t semaphore_initial(int32_t initial)
+{
+    if( initial < 0 ){
+        ks::logger::error("ks::Semaphore") << "negative initial count " << initial << ks::endl;
+        throw std::runtime_error("ks::Semaphore: negative initial count");
+    }
+    return initial;
+}
+
+#ifdef KS_USE_FUTEX
+
+const long    FUTEX_MSEC_IN_SEC = 1000;
+const long    FUTEX_NSEC_IN_MSEC = 1000000;
+const long    FUTEX_NSEC_IN_SEC = 1000000000;
+
+/**
+ * futex_wait: sleeps as long as *addr == expected. returns false on timeout.
+ */
+bool futex_wait(volatile void *addr, uint32_t expected, const struct timespec *timeout)
+{
+    long rc = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, timeout, 0, 0);
+    if( rc == 0 ){
+        return true;
+    }
+    switch( errno )
+    {
+    case EAGAIN: // the value has already changed
+    case EINTR:
+        return true;
+    case ETIMEDOUT:
+        return false;
+    default:
+        std::stringstream ss;
+        ss << strerror(errno);
+        ks::logger::error("futex wait failed") << ss.str() << ks::endl;
+        throw std::runtime_error(ss.str());
+    }
+}
+
+void futex_wake(volatile void *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, 0, 0, 0);
+}
+
+/**
+ * the deadline helper for timed waits: futexes take a relative timeout,
+ * so the remaining time is re-computed after every wakeup.
+ */
+class futex_deadline
+{
+public:
+    explicit futex_deadline(long timeout_msec): infinite_(timeout_msec < 0)
+    {
+        if( !infinite_ ){
+            clock_gettime(CLOCK_MONOTONIC, &deadline_);
+            deadline_.tv_sec  += timeout_msec / FUTEX_MSEC_IN_SEC;
+            deadline_.tv_nsec += (timeout_msec % FUTEX_MSEC_IN_SEC) * FUTEX_NSEC_IN_MSEC;
+            if( deadline_.tv_nsec >= FUTEX_NSEC_IN_SEC ){
+                deadline_.tv_sec  += 1;
+                deadline_.tv_nsec -= FUTEX_NSEC_IN_SEC;
+            }
+        }
+    }
+
+    /**
+    *   returns the pointer to the remaining time (or 0 if infinite).
+    *   `expired` is set to true when the deadline has passed.
+    */
+    const struct timespec *remaining(bool &expired)
+    {
+        expired = false;
+        if( infinite_ ){
+            return 0;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining_.tv_sec  = deadline_.tv_sec - now.tv_sec;
+        remaining_.tv_nsec = deadline_.tv_nsec - now.tv_nsec;
+        if( remaining_.tv_nsec < 0 ){
+            remaining_.tv_sec  -= 1;
+            remaining_.tv_nsec += FUTEX_NSEC_IN_SEC;
+        }
+        if( remaining_.tv_sec < 0 ){
+            expired = true;
+        }
+        return &remaining_;
+    }
+
+private:
+    bool            infinite_;
+    struct timespec deadline_;
+    struct timespec remaining_;
+};
+
+// Semaphore
+
+Semaphore::Semaphore(int32_t initial): count_(semaphore_initial(initial)), waiters_(0) {}
+Semaphore::~Semaphore() {}
+
+bool Semaphore::tryWait()
+{
+    int32_t c = count_.load(memory_order_acquire);
+    while( c > 0 ){
+        if( count_.compare_exchange_weak(c, c-1, memory_order_acq_rel) ){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Semaphore::wait(long timeout_msec)
+{
+    if( tryWait() ){
+        return true;
+    }
+
+    futex_deadline deadline(timeout_msec);
+    bool expired;
+    while( true ){
+        waiters_.fetch_add(1);
+        const struct timespec *remaining = deadline.remaining(expired);
+        if( !expired ){
+            futex_wait(count_.address(), 0, remaining);
+        }
+        waiters_.fetch_sub(1);
+
+        if( tryWait() ){
+            return true;
+        } else if( expired ){
+            return false;
+        }
+    }
+}
+
+void Semaphore::post(int32_t count)
+{
+    count_.fetch_add(count);
+    if( waiters_.load() > 0 ){
+        futex_wake(count_.address(), count);
+    }
+}
+
+int32_t Semaphore::value() { return count_.load(memory_order_acquire); }
+
+// Latch
+
+Latch::Latch(int32_t count): count_(count) {}
+Latch::~Latch() {}
+
+void Latch::countDown(int32_t n)
+{
+    if( count_.fetch_sub(n) <= n ){
+        futex_wake(count_.address(), INT_MAX);
+    }
+}
+
+bool Latch::tryWait()
+{
+    return (count_.load(memory_order_acquire) <= 0);
+}
+
+bool Latch::wait(long timeout_msec)
+{
+    futex_deadline deadline(timeout_msec);
+    bool expired;
+    int32_t c;
+    while( (c = count_.load(memory_order_acquire)) > 0 ){
+        const struct timespec *remaining = deadline.remaining(expired);
+        if( expired ){
+            return false;
+        }
+        futex_wait(count_.address(), static_cast<uint32_t>(c), remaining);
+    }
+    return true;
+}
+
+// Barrier
+
+Barrier::Barrier(int32_t parties): parties_(parties), policy_(WaitPolicy::spinPark()), remaining_(parties), sense_(0) {}
+Barrier::~Barrier() {}
+
+void Barrier::setWaitPolicy(const WaitPolicy &policy)
+{
+    policy_ = policy;
+}
+
+bool Barrier::wait()
+{
+    uint32_t sense = sense_.load(memory_order_acquire);
+    if( remaining_.fetch_sub(1) == 1 ){
+        // the last one to arrive: reset the count and flip the sense
+        remaining_.store(parties_, memory_order_relaxed);
+        sense_.fetch_add(1);
+        futex_wake(sense_.address(), INT_MAX);
+        return true;
+    }
+
+    // fast path: the other parties are likely to be right behind us
+    if( spin_until_changed(sense_, sense, policy_) == SpinChanged ){
+        return false;
+    }
+    while( sense_.load(memory_order_acquire) == sense ){
+        futex_wait(sense_.address(), sense, 0);
+    }
+    return false;
+}
+
+// EventCount
+
+EventCount::EventCount(): epoch_(0), waiters_(0) {}
+EventCount::~EventCount() {}
+
+EventCount::Key EventCount::prepareWait()
+{
+    // the read-modify-write on waiters_ orders our subsequent re-check of the
+    // data structure against the producer's read of waiters_ in notify_()
+    waiters_.fetch_add(1);
+    return epoch_.load();
+}
+
+void EventCount::cancelWait()
+{
+    waiters_.fetch_sub(1);
+}
+
+void EventCount::commitWait(Key key)
+{
+    while( epoch_.load(memory_order_acquire) == key ){
+        futex_wait(epoch_.address(), key, 0);
+    }
+    waiters_.fetch_sub(1);
+}
+
+void EventCount::notify_(bool all)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if( waiters_.load() > 0 ){
+        epoch_.fetch_add(1);
+        futex_wake(epoch_.address(), all? INT_MAX: 1);
+    }
+}
+
+#else // !KS_USE_FUTEX
+
+const uint64_t SYNC_NSEC_IN_MSEC = 1000000;
+
+/**
+ * the deadline of a timed wait on wait_now_nsec() (0 if infinite), computed once,
+ * so that a spurious wakeup does not restart the timeout
+ */
+inline uint64_t sync_deadline(long timeout_msec)
+{
+    return (timeout_msec >= 0)? (wait_now_nsec() + static_cast<uint64_t>(timeout_msec) * SYNC_NSEC_IN_MSEC): 0;
+}
+
+/**
+ * the remaining time until `deadline` for Condition::wait(), or -1 if infinite.
+ * `expired` is set to true when the deadline has passed.
+ */
+inline long sync_remaining_msec(long timeout_msec, uint64_t deadline, bool &expired)
+{
+    expired = false;
+    if( timeout_msec < 0 ){
+        return -1;
+    }
+    uint64_t now = wait_now_nsec();
+    if( now >= deadline ){
+        expired = true;
+        return 0;
+    }
+    return static_cast<long>((deadline - now + SYNC_NSEC_IN_MSEC - 1) / SYNC_NSEC_IN_MSEC);
+}
+
+// Semaphore
+
+Semaphore::Semaphore(int32_t initial): count_(semaphore_initial(initial)), waiters_(0), cond_() {}
+Semaphore::~Semaphore() {}
+
+bool Semaphore::tryWait()
+{
+    bool taken = false;
+    cond_.lock();
+    if( count_ > 0 ){
+        count_--;
+        taken = true;
+    }
+    cond_.unlock();
+    return taken;
+}
+
+bool Semaphore::wait(long timeout_msec)
+{
+    bool     taken    = false;
+    bool     expired  = false;
+    uint64_t deadline = sync_deadline(timeout_msec);
+    cond_.lock();
+    waiters_++;
+    while( count_ <= 0 ){
+        long remaining = sync_remaining_msec(timeout_msec, deadline, expired);
+        if( expired ){
+            break;
+        }
+        cond_.wait(remaining);
+    }
+    waiters_--;
+    if( count_ > 0 ){
+        count_--;
+        taken = true;
+    }
+    cond_.unlock();
+    return taken;
+}
+
+void Semaphore::post(int32_t count)
+{
+    cond_.lock();
+    count_ += count;
+    if( waiters_ > 0 ){
+        cond_.notifyAll();
+    }
+    cond_.unlock();
+}
+
+int32_t Semaphore::value() { return count_; }
+
+// Latch
+
+Latch::Latch(int32_t count): count_(count), cond_() {}
+Latch::~Latch() {}
+
+void Latch::countDown(int32_t n)
+{
+    cond_.lock();
+    count_ -= n;
+    if( count_ <= 0 ){
+        cond_.notifyAll();
+    }
+    cond_.unlock();
+}
+
+bool Latch::tryWait()
+{
+    cond_.lock();
+    bool done = (count_ <= 0);
+    cond_.unlock();
+    return done;
+}
+
+bool Latch::wait(long timeout_msec)
+{
+    bool     expired  = false;
+    uint64_t deadline = sync_deadline(timeout_msec);
+    cond_.lock();
+    while( count_ > 0 ){
+        long remaining = sync_remaining_msec(timeout_msec, deadline, expired);
+        if( expired ){
+            break;
+        }
+        cond_.wait(remaining);
+    }
+    bool done = (count_ <= 0);
+    cond_.unlock();
+    return done;
+}
+
+// Barrier
+
+Barrier::Barrier(int32_t parties): parties_(parties), policy_(WaitPolicy::spinPark()), remaining_(parties), sense_(0), cond_()
+{
+    cond_.setWaitPolicy(policy_);
+}
+
+Barrier::~Barrier() {}
+
+void Barrier::setWaitPolicy(const WaitPolicy &policy)
+{
+    policy_ = policy;
+    cond_.setWaitPolicy(policy);
+}
+
+bool Barrier::wait()
+{
+    bool last = false;
+    cond_.lock();
+    uint32_t sense = sense_;
+    if( --remaining_ == 0 ){
+        remaining_ = parties_;
+        sense_++;
+        cond_.notifyAll();
+        last = true;
+    } else {
+        while( sense_ == sense ){
+            cond_.wait();
+        }
+    }
+    cond_.unlock();
+    return last;
+}
+
+// EventCount
+
+EventCount::EventCount(): epoch_(0), waiters_(0), cond_() {}
+EventCount::~EventCount() {}
+
+EventCount::Key EventCount::prepareWait()
+{
+    cond_.lock();
+    waiters_++;
+    Key key = epoch_;
+    cond_.unlock();
+    return key;
+}
+
+void EventCount::cancelWait()
+{
+    cond_.lock();
+    waiters_--;
+    cond_.unlock();
+}
+
+void EventCount::commitWait(Key key)
+{
+    cond_.lock();
+    while( epoch_ == key ){
+        cond_.wait();
+    }
+    waiters_--;
+    cond_.unlock();
+}
+
+void EventCount::notify_(bool all)
+{
+    cond_.lock();
+    if( waiters_ > 0 ){
+        epoch_++;
+        if( all ){
+            cond_.notifyAll();
+        } else {
+            cond_.notify();
+        }
+    }
+    cond_.unlock();
+}
+
+#endif // KS_USE_FUTEX
+
+void Latch::arriveAndWait()
+{
+    countDown();
+    wait();
+}
+
+void EventCount::notify()    { notify_(false); }
+void EventCount::notifyAll() { notify_(true); }
+
+}
@@ -27,9 +27,21 @@
 #include <iostream>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
 
 #include "ks/thread.h"
 #include "ks/log.h"
+#include "ks/lockprofile.h"
+#include "internal.h"
+
+#ifndef _WIN32
+#include <unistd.h> // sysconf
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 namespace ks {
 
@@ -49,7 +61,125 @@ inline ks_thread_id gettid(pthread_t ptid) {
 }
 #endif
 
-_ThreadService::_ThreadService(): pool_()
+/**
+ * the id of the calling thread, as known to the kernel (i.e. the one in /proc/self/task)
+ */
+inline long system_thread_id()
+{
+#if defined(_WIN32)
+    return static_cast<long>(GetCurrentThreadId());
+#elif defined(__linux__)
+    return static_cast<long>(syscall(SYS_gettid));
+#else
+    return 0;
+#endif
+}
+
+#ifdef __linux__
+/**
+ * reads the context switches, the scheduler statistics and the last CPU from /proc/self/task/<tid>/
+ */
+void read_proc_stats(long tid, ThreadStats &stats)
+{
+    char path[64];
+    char line[256];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%ld/status", tid);
+    if( (fp = fopen(path, "r")) != 0 ){
+        unsigned long long value;
+        while( fgets(line, sizeof(line), fp) != 0 ){
+            if( sscanf(line, "voluntary_ctxt_switches: %llu", &value) == 1 ){
+                stats.voluntarySwitches = value;
+            } else if( sscanf(line, "nonvoluntary_ctxt_switches: %llu", &value) == 1 ){
+                stats.involuntarySwitches = value;
+            }
+        }
+        fclose(fp);
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/task/%ld/schedstat", tid);
+    if( (fp = fopen(path, "r")) != 0 ){
+        unsigned long long run, wait, slices;
+        if( fscanf(fp, "%llu %llu %llu", &run, &wait, &slices) == 3 ){
+            stats.runNanos   = run;
+            stats.waitNanos  = wait;
+            stats.timeslices = slices;
+        }
+        fclose(fp);
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/task/%ld/stat", tid);
+    if( (fp = fopen(path, "r")) != 0 ){
+        char buf[1024];
+        size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+        buf[len] = '\0';
+        fclose(fp);
+
+        // the command name may contain spaces, so the fields are counted from the last ')'
+        char *p = strrchr(buf, ')');
+        if( p != 0 ){
+            int field = 2; // the field number of the command name
+            while( (*p != '\0') && (field < 39) ){
+                if( *(p++) == ' ' ){
+                    field++;
+                }
+            }
+            int cpu;
+            if( (field == 39) && (sscanf(p, "%d", &cpu) == 1) ){
+                stats.lastCpu = cpu;
+            }
+        }
+    }
+}
+#endif
+
+ThreadStats::ThreadStats():
+    id(0), systemId(0), name(), timestamp(0), interval(0), cpuNanos(0),
+    voluntarySwitches(0), involuntarySwitches(0), runNanos(0), waitNanos(0), timeslices(0),
+    lastCpu(-1)
+{
+
+}
+
+inline uint64_t counter_diff(uint64_t later, uint64_t earlier)
+{
+    return (later > earlier)? (later - earlier): 0;
+}
+
+ThreadStats ThreadStats::since(const ThreadStats &earlier) const
+{
+    ThreadStats d(*this);
+    d.interval            = counter_diff(timestamp, earlier.timestamp);
+    d.cpuNanos            = counter_diff(cpuNanos, earlier.cpuNanos);
+    d.voluntarySwitches   = counter_diff(voluntarySwitches, earlier.voluntarySwitches);
+    d.involuntarySwitches = counter_diff(involuntarySwitches, earlier.involuntarySwitches);
+    d.runNanos            = counter_diff(runNanos, earlier.runNanos);
+    d.waitNanos           = counter_diff(waitNanos, earlier.waitNanos);
+    d.timeslices          = counter_diff(timeslices, earlier.timeslices);
+    return d;
+}
+
+double ThreadStats::cpuUsage() const
+{
+    return (interval > 0)? (static_cast<double>(cpuNanos) / static_cast<double>(interval)): 0.0;
+}
+
+ThreadExitHandler::~ThreadExitHandler() {}
+ThreadStartHandler::~ThreadStartHandler() {}
+ConditionListener::~ConditionListener() {}
+
+/**
+ * the listeners of a Condition, with their own lock, as notify*() is not always called with the Condition locked
+ */
+class _ConditionListeners
+{
+public:
+    Mutex                            lock;
+    std::vector<ConditionListener *> items;
+};
+
+_ThreadService::_ThreadService(): pool_(), poollock_(), handlerlock_()
 {
 #ifdef _WIN32
     HANDLE main_t = GetCurrentThread();
@@ -70,29 +200,187 @@ _ThreadService::~_ThreadService()
 
 void _ThreadService::put(ks_thread_id tid, Thread *tptr)
 {
+    poollock_.lock();
     if( tptr == 0 ){
         pool_.erase(tid);
     } else {
         pool_[tid] = tptr;
     }
+    poollock_.unlock();
+}
+
+std::vector<ThreadStats> _ThreadService::snapshot()
+{
+    std::vector<ThreadStats> stats;
+    // holding the lock keeps the threads from exiting (see Thread::exit_()), so only the cheap part
+    // is sampled under it. the /proc files are read afterwards; those of a thread that has exited
+    // in between are gone, and its counters are left 0.
+    poollock_.lock();
+    stats.reserve(pool_.size());
+    for( FlatHashMap<ks_thread_id, Thread *>::iterator it=pool_.begin(); it!=pool_.end(); ++it ){
+        stats.push_back(it->second->sample_());
+    }
+    poollock_.unlock();
+#ifdef __linux__
+    for( std::vector<ThreadStats>::iterator it=stats.begin(); it!=stats.end(); ++it ){
+        if( it->systemId != 0 ){
+            read_proc_stats(it->systemId, *it);
+        }
+    }
+#endif
+    return stats;
+}
+
+void _ThreadService::addExitHandler(ThreadExitHandler *handler)
+{
+    handlerlock_.lock();
+    handlers_.push_back(handler);
+    handlerlock_.unlock();
+}
+
+void _ThreadService::removeExitHandler(ThreadExitHandler *handler)
+{
+    handlerlock_.lock();
+    std::vector<ThreadExitHandler *>::iterator it = std::find(handlers_.begin(), handlers_.end(), handler);
+    if( it != handlers_.end() ){
+        handlers_.erase(it);
+    }
+    waitCalls_(handler);
+    handlerlock_.unlock();
+}
+
+/**
+ * the handler being called on this thread (a handler may remove itself from within its call)
+ */
+static KS_THREAD_LOCAL const void *handler_in_call = 0;
+
+/**
+ * with handlerlock_ held: registers a call of `handler` and releases the lock,
+ * unless the handler has been removed since the list was copied
+ */
+bool _ThreadService::beginCall_(const void *handler, bool registered)
+{
+    if( !registered ){
+        return false;
+    }
+    calling_.push_back(handler);
+    handlerlock_.unlock();
+    handler_in_call = handler;
+    return true;
+}
+
+/**
+ * re-acquires handlerlock_, and wakes up the remove*Handler() calls waiting for `handler`
+ */
+void _ThreadService::endCall_(const void *handler, const void *outer)
+{
+    handler_in_call = outer;
+    handlerlock_.lock();
+    calling_.erase(std::find(calling_.begin(), calling_.end(), handler));
+    handlerlock_.notifyAll();
+}
+
+/**
+ * with handlerlock_ held: waits until no other thread is calling `handler`
+ */
+void _ThreadService::waitCalls_(const void *handler)
+{
+    while( true ){
+        ptrdiff_t calls = std::count(calling_.begin(), calling_.end(), handler);
+        if( handler_in_call == handler ){
+            calls--;
+        }
+        if( calls <= 0 ){
+            return;
+        }
+        handlerlock_.wait();
+    }
+}
+
+void _ThreadService::notifyExit(Thread *thread)
+{
+    handlerlock_.lock();
+    std::vector<ThreadExitHandler *> handlers = handlers_;
+    for( std::vector<ThreadExitHandler *>::iterator it=handlers.begin(); it!=handlers.end(); ++it ){
+        const void *outer = handler_in_call;
+        if( !beginCall_(*it, std::find(handlers_.begin(), handlers_.end(), *it) != handlers_.end()) ){
+            continue;
+        }
+        try {
+            (*it)->threadExiting(thread);
+        } catch(...) {
+            endCall_(*it, outer);
+            handlerlock_.unlock();
+            throw;
+        }
+        endCall_(*it, outer);
+    }
+    handlerlock_.unlock();
+}
+
+void _ThreadService::addStartHandler(ThreadStartHandler *handler)
+{
+    handlerlock_.lock();
+    starthandlers_.push_back(handler);
+    handlerlock_.unlock();
+}
+
+void _ThreadService::removeStartHandler(ThreadStartHandler *handler)
+{
+    handlerlock_.lock();
+    std::vector<ThreadStartHandler *>::iterator it = std::find(starthandlers_.begin(), starthandlers_.end(), handler);
+    if( it != starthandlers_.end() ){
+        starthandlers_.erase(it);
+    }
+    waitCalls_(handler);
+    handlerlock_.unlock();
+}
+
+void _ThreadService::notifyStart(Thread *thread)
+{
+    handlerlock_.lock();
+    std::vector<ThreadStartHandler *> handlers = starthandlers_;
+    for( std::vector<ThreadStartHandler *>::iterator it=handlers.begin(); it!=handlers.end(); ++it ){
+        const void *outer = handler_in_call;
+        if( !beginCall_(*it, std::find(starthandlers_.begin(), starthandlers_.end(), *it) != starthandlers_.end()) ){
+            continue;
+        }
+        try {
+            (*it)->threadStarting(thread);
+        } catch(...) {
+            endCall_(*it, outer);
+            handlerlock_.unlock();
+            throw;
+        }
+        endCall_(*it, outer);
+    }
+    handlerlock_.unlock();
 }
 
 Thread *_ThreadService::get(ks_thread_id tid)
 {
-    std::map<ks_thread_id, Thread *>::iterator it = pool_.find(tid);
-    if( it == pool_.end() ){
-        return 0;
-    } else {
+    Thread *thread = 0;
+    poollock_.lock();
+    FlatHashMap<ks_thread_id, Thread *>::iterator it = pool_.find(tid);
+    if( it != pool_.end() ){
         // returns the first occurrence
-        return it->second;
+        thread = it->second;
     }
+    poollock_.unlock();
+    return thread;
 }
 
 _ThreadService Thread::service_;
 
+/**
+ * the Thread of the calling thread, so that current() does not take poollock_.
+ * set by the thread itself in run_() (or on the first lookup of the main thread) and cleared in exit_().
+ */
+static KS_THREAD_LOCAL Thread *current_thread = 0;
+
 
 #ifdef _WIN32
-Thread::Thread(): running_(false), exitcode_(0)
+Thread::Thread(): running_(false), exitcode_(0), name_(), sysid_(0)
 {
     handle_ = CreateThread(
                 NULL,   // LPSECURITY_ATTRIBUTES lpThreadAttributes
@@ -105,19 +393,25 @@ Thread::Thread(): running_(false), exitcode_(0)
 }
 
 #else
-Thread::Thread(): handle_(0), exitcoderef_(0), running_(false), exitcode_(0)
+Thread::Thread(): handle_(0), exitcoderef_(0), running_(false), exitcode_(0), name_(), sysid_(0)
 {
     pthread_attr_init(&threadattr_);
     pthread_attr_setdetachstate(&threadattr_, PTHREAD_CREATE_JOINABLE);
 }
 #endif
 
-Thread::Thread(ks_thread_handle_t t): handle_(t), running_(true), exitcode_(0)
+Thread::Thread(ks_thread_handle_t t): handle_(t), running_(true), exitcode_(0), name_(), sysid_(0)
 {
-    // do nothing
     // threadattr_ will not be used
-#ifndef _WIN32
+#ifdef _WIN32
+    if( GetThreadId(t) == GetCurrentThreadId() ){
+        sysid_ = system_thread_id();
+    }
+#else
     exitcoderef_ = 0;
+    if( pthread_equal(t, pthread_self()) ){
+        sysid_ = system_thread_id();
+    }
 #endif
 }
 
@@ -151,7 +445,6 @@ void Thread::start()
         throw new std::runtime_error("Failed to create a Thread");
     } else {
         running_ = true;
-        service_.put(gettid(handle_), this);
     }
 }
 
@@ -171,6 +464,16 @@ void *Thread::run_static(Thread *t)
 
 void Thread::run_()
 {
+    // registered by the thread itself, so that it is found by current() as soon as it runs
+    service_.put(id(), this);
+    current_thread = this;
+    sysid_ = system_thread_id();
+#ifdef __linux__
+    if( name_.length() > 0 ){
+        pthread_setname_np(pthread_self(), name_.substr(0, 15).c_str());
+    }
+#endif
+    service_.notifyStart(this);
     this->run();
     Thread::exit(0);
 }
@@ -197,7 +500,9 @@ void Thread::join()
 void Thread::exit_(int code)
 {
     exitcode_ = code;
+    service_.notifyExit(this);
     service_.put(gettid(handle_), 0);
+    current_thread = 0;
     running_ = false;
 #ifdef _WIN32
     ExitThread(code);
@@ -209,7 +514,10 @@ void Thread::exit_(int code)
 // static
 Thread *Thread::current()
 {
-    return service_.get(id());
+    if( current_thread == 0 ){
+        current_thread = service_.get(id());
+    }
+    return current_thread;
 }
 
 // static
@@ -228,11 +536,131 @@ void Thread::exit(int code)
     current()->exit_(code);
 }
 
+// static
+void Thread::addExitHandler(ThreadExitHandler *handler) { service_.addExitHandler(handler); }
+// static
+void Thread::removeExitHandler(ThreadExitHandler *handler) { service_.removeExitHandler(handler); }
+
+// static
+void Thread::addStartHandler(ThreadStartHandler *handler) { service_.addStartHandler(handler); }
+
+// static
+void Thread::removeStartHandler(ThreadStartHandler *handler) { service_.removeStartHandler(handler); }
+
+void Thread::setName(const std::string &name)
+{
+    name_ = name;
+#ifdef __linux__
+    // the name is applied in run_() otherwise
+    if( running_ && (sysid_ != 0) ){
+        pthread_setname_np(handle_, name_.substr(0, 15).c_str()); // the kernel limits the names to 15 characters
+    }
+#endif
+}
+
+ThreadStats Thread::stats()
+{
+    ThreadStats stats = sample_();
+#ifdef __linux__
+    if( stats.systemId != 0 ){
+        read_proc_stats(stats.systemId, stats);
+    }
+#endif
+    return stats;
+}
+
+ThreadStats Thread::sample_()
+{
+    ThreadStats stats;
+    stats.id        = gettid(handle_);
+    stats.systemId  = sysid_;
+    stats.name      = name_;
+    stats.timestamp = monotonic_nsec();
+
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    if( GetThreadTimes(handle_, &creation, &exit, &kernel, &user) ){
+        uint64_t k = (static_cast<uint64_t>(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+        uint64_t u = (static_cast<uint64_t>(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+        stats.cpuNanos = (k + u) * 100;
+    }
+#elif defined(_POSIX_THREAD_CPUTIME) && (_POSIX_THREAD_CPUTIME >= 0)
+    clockid_t cid;
+    struct timespec ts;
+    if( (pthread_getcpuclockid(handle_, &cid) == 0) && (clock_gettime(cid, &ts) == 0) ){
+        stats.cpuNanos = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+    }
+#endif
+    return stats;
+}
+
+// static
+std::vector<ThreadStats> Thread::snapshot()
+{
+    return service_.snapshot();
+}
+
+// static
+std::vector<ThreadStats> Thread::diff(const std::vector<ThreadStats> &before, const std::vector<ThreadStats> &after)
+{
+    std::vector<ThreadStats> result;
+    for( std::vector<ThreadStats>::const_iterator a=after.begin(); a!=after.end(); ++a ){
+        std::vector<ThreadStats>::const_iterator b = before.begin();
+        for( ; b!=before.end(); ++b ){
+            if( (b->id == a->id) && (b->systemId == a->systemId) ){
+                break;
+            }
+        }
+        if( b != before.end() ){
+            result.push_back(a->since(*b));
+        } else {
+            // a thread that started in between: the counters are all since its start
+            ThreadStats d(*a);
+            d.interval = before.empty()? 0: counter_diff(a->timestamp, before.front().timestamp);
+            result.push_back(d);
+        }
+    }
+    return result;
+}
 
-lockableobject::lockableobject()
+// static
+unsigned int Thread::hardwareConcurrency()
 {
 #ifdef _WIN32
-    InitializeCriticalSectionAndSpinCount(&mutex_, 0x400); // try setting spin count this way for now
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long n = static_cast<long>(info.dwNumberOfProcessors);
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (n > 0)? static_cast<unsigned int>(n): 1;
+}
+
+
+lockableobject::lockableobject(): profile_(0), lockedat_(0)
+{
+    init_();
+}
+
+lockableobject::lockableobject(const std::string &name): profile_(0), lockedat_(0)
+{
+    init_();
+    setName(name);
+}
+
+void lockableobject::init_()
+{
+#ifdef _WIN32
+    // the spin count follows the default wait policy of the creating thread:
+    // ParkWait blocks right away, and SpinWait (which has no count of its own) spins the default count
+    WaitPolicy policy = WaitPolicy::threadDefault();
+    DWORD spins = policy.spins;
+    if( policy.strategy == ParkWait ){
+        spins = 0;
+    } else if( policy.strategy == SpinWait ){
+        spins = WAIT_DEFAULT_SPINS;
+    }
+    InitializeCriticalSectionAndSpinCount(&mutex_, spins);
 #else
     if( pthread_mutex_init(&mutex_, 0) ) // try setting mutexatttr this way for now
     {
@@ -257,7 +685,7 @@ lockableobject::~lockableobject()
 #endif
 }
 
-void lockableobject::lock()
+void lockableobject::lock_()
 {
 #ifdef _WIN32
     EnterCriticalSection(&mutex_);
@@ -272,7 +700,7 @@ void lockableobject::lock()
 #endif
 }
 
-bool lockableobject::tryLock()
+bool lockableobject::tryLock_()
 {
 #ifdef _WIN32
     return (TryEnterCriticalSection(&mutex_) != 0);
@@ -296,7 +724,7 @@ bool lockableobject::tryLock()
 #endif
 }
 
-void lockableobject::unlock()
+void lockableobject::unlock_()
 {
 #ifdef _WIN32
     LeaveCriticalSection(&mutex_);
@@ -311,12 +739,75 @@ void lockableobject::unlock()
 #endif
 }
 
+void lockableobject::setName(const std::string &name)
+{
+    profile_ = LockProfiler::record(name);
+}
+
+void lockableobject::lock()
+{
+    if( (profile_ == 0) || !LockProfiler::enabled() ){
+        lock_();
+        return;
+    }
+
+    uint64_t wait = 0;
+    bool contended = !tryLock_();
+    if( contended ){
+        uint64_t start = LockProfiler::now();
+        lock_();
+        lockedat_ = LockProfiler::now();
+        wait = lockedat_ - start;
+    } else {
+        lockedat_ = LockProfiler::now();
+    }
+    profile_->acquired(contended, wait);
+}
+
+bool lockableobject::tryLock()
+{
+    if( (profile_ == 0) || !LockProfiler::enabled() ){
+        return tryLock_();
+    }
+
+    if( tryLock_() ){
+        lockedat_ = LockProfiler::now();
+        profile_->acquired(false, 0);
+        return true;
+    } else {
+        profile_->failedTry();
+        return false;
+    }
+}
+
+void lockableobject::unlock()
+{
+    profileRelease();
+    unlock_();
+}
+
+void lockableobject::profileRelease()
+{
+    if( (profile_ != 0) && (lockedat_ != 0) ){
+        profile_->released(LockProfiler::now() - lockedat_);
+        lockedat_ = 0;
+    }
+}
+
+void lockableobject::profileReacquire()
+{
+    if( (profile_ != 0) && LockProfiler::enabled() ){
+        lockedat_ = LockProfiler::now();
+    }
+}
+
 ks_mutex_t *lockableobject::mutex() { return &mutex_; }
 
 const long million = 1000000;
 const long billion = 1000000000;
 
 Mutex::Mutex(): lockableobject() { }
+Mutex::Mutex(const std::string &name): lockableobject(name) { }
 
 MutexLocker::MutexLocker(Mutex *ref): ref_(ref)
 {
@@ -328,7 +819,17 @@ MutexLocker::~MutexLocker()
     ref_->unlock();
 }
 
-Condition::Condition(): lockableobject()
+Condition::Condition(): lockableobject(), listeners_(0), policy_(), custom_(false), seq_(0)
+{
+    init_();
+}
+
+Condition::Condition(const std::string &name): lockableobject(name), listeners_(0), policy_(), custom_(false), seq_(0)
+{
+    init_();
+}
+
+void Condition::init_()
 {
 #ifdef _WIN32
     InitializeConditionVariable(&cond_);
@@ -354,11 +855,103 @@ Condition::~Condition()
                                                    << strerror(errno) << ks::endl;
     }
 #endif
+    delete listeners_.load();
+}
+
+void Condition::addListener(ConditionListener *listener)
+{
+    _ConditionListeners *listeners = listeners_.load(memory_order_acquire);
+    if( listeners == 0 ){
+        _ConditionListeners *created = new _ConditionListeners();
+        if( listeners_.compare_exchange_strong(listeners, created, memory_order_acq_rel) ){
+            listeners = created;
+        } else {
+            delete created; // another thread has won
+        }
+    }
+    listeners->lock.lock();
+    listeners->items.push_back(listener);
+    listeners->lock.unlock();
+}
+
+void Condition::removeListener(ConditionListener *listener)
+{
+    _ConditionListeners *listeners = listeners_.load(memory_order_acquire);
+    if( listeners == 0 ){
+        return;
+    }
+    listeners->lock.lock();
+    std::vector<ConditionListener *>::iterator it = std::find(listeners->items.begin(), listeners->items.end(), listener);
+    if( it != listeners->items.end() ){
+        listeners->items.erase(it);
+    }
+    listeners->lock.unlock();
+}
+
+void Condition::notifyListeners_()
+{
+    _ConditionListeners *listeners = listeners_.load(memory_order_acquire);
+    if( listeners == 0 ){
+        return;
+    }
+    listeners->lock.lock();
+    for( std::vector<ConditionListener *>::iterator it=listeners->items.begin(); it!=listeners->items.end(); ++it ){
+        (*it)->conditionNotified(this);
+    }
+    listeners->lock.unlock();
+}
+
+void Condition::setWaitPolicy(const WaitPolicy &policy)
+{
+    policy_ = policy;
+    custom_ = true;
+#ifdef _WIN32
+    SetCriticalSectionSpinCount(mutex(), (policy.strategy == ParkWait)? WAIT_DEFAULT_SPINS: policy.spins);
+#endif
+}
+
+WaitPolicy Condition::waitPolicy() const
+{
+    return custom_? policy_: WaitPolicy::threadDefault();
 }
 
 bool Condition::wait(long timeout_msec)
+{
+    WaitPolicy policy = waitPolicy();
+    if( policy.strategy == ParkWait ){
+        return park_(timeout_msec);
+    }
+
+    uint64_t deadline = (timeout_msec >= 0)?
+                (wait_now_nsec() + static_cast<uint64_t>(timeout_msec) * million): 0;
+    uint32_t seen = seq_.load(memory_order_relaxed); // stable, as notify*() is called with the lock held
+    profileRelease();
+    unlock_();
+    SpinResult result = spin_until_changed(seq_, seen, policy, deadline);
+    lock_();
+    profileReacquire();
+
+    if( (result == SpinChanged) || (seq_.load(memory_order_relaxed) != seen) ){
+        return true;
+    } else if( result == SpinTimedOut ){
+        return false;
+    }
+
+    // SpinExhausted: park for the rest of the timeout
+    if( timeout_msec >= 0 ){
+        uint64_t now = wait_now_nsec();
+        if( now >= deadline ){
+            return false;
+        }
+        timeout_msec = static_cast<long>((deadline - now + million - 1) / million);
+    }
+    return park_(timeout_msec);
+}
+
+bool Condition::park_(long timeout_msec)
 {
     bool ret;
+    profileRelease();
 #ifdef _WIN32
     ret = (SleepConditionVariableCS(&cond_, mutex(), (timeout_msec>=0)? timeout_msec: INFINITE) != 0);
 #else
@@ -366,24 +959,38 @@ bool Condition::wait(long timeout_msec)
     if( timeout_msec < 0 ){
         err = pthread_cond_wait(&cond_, mutex());
     } else {
+        // pthread_cond_timedwait() takes an absolute deadline on CLOCK_REALTIME
         struct timespec timeout;
-        timeout.tv_nsec = (timeout_msec * million) % billion;
-        timeout.tv_sec = time(0) + ( timeout_msec - timeout.tv_nsec );
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec  += timeout_msec / 1000;
+        timeout.tv_nsec += (timeout_msec % 1000) * million;
+        if( timeout.tv_nsec >= billion ){
+            timeout.tv_sec  += 1;
+            timeout.tv_nsec -= billion;
+        }
         err = pthread_cond_timedwait(&cond_, mutex(), &timeout);
     }
-    if( err ){
+    profileReacquire();
+    if( err == ETIMEDOUT ){
+        return false;
+    } else if( err ){
         std::stringstream ss;
         ss << strerror(errno);
         ks::logger::error("pthread_cond_wait failed") << ss.str() << ks::endl;
         throw std::runtime_error(ss.str());
     }
     ret = (err == 0);
+#endif
+#ifdef _WIN32
+    profileReacquire();
 #endif
     return ret;
 }
 
 void Condition::notify()
 {
+    seq_.fetch_add(1, memory_order_release);
+    notifyListeners_();
 #ifdef _WIN32
     WakeConditionVariable(&cond_);
 #else
@@ -399,6 +1006,8 @@ void Condition::notify()
 
 void Condition::notifyAll()
 {
+    seq_.fetch_add(1, memory_order_release);
+    notifyListeners_();
 #ifdef _WIN32
     WakeAllConditionVariable(&cond_);
 #else
@@ -413,10 +1022,11 @@ void Condition::notifyAll()
 }
 
 Flag::Flag(): Condition(), state_(false) {}
+Flag::Flag(const std::string &name): Condition(name), state_(false) {}
 
 bool Flag::wait(long timeout_msec)
 {
-    if( state_ )
+    if( state_.load(memory_order_acquire) )
         return true;
 
     return Condition::wait(timeout_msec);
@@ -424,17 +1034,46 @@ bool Flag::wait(long timeout_msec)
 
 void Flag::set()
 {
-    if( !state_ ){
-        state_ = true;
+    if( !state_.load(memory_order_relaxed) ){
+        state_.store(true, memory_order_release);
         notifyAll();
     }
 }
 
 void Flag::unset()
 {
-    if( state_ ){
-        state_ = false;
+    if( state_.load(memory_order_relaxed) ){
+        state_.store(false, memory_order_release);
+    }
+}
+
+PeriodicThread::PeriodicThread(long interval_msec): Thread(), interval_(interval_msec), stop_() {}
+
+void PeriodicThread::run()
+{
+    stop_.lock();
+    while( !stop_.isset() ){
+        if( !stop_.wait(interval_) ){
+            stop_.unlock();
+            tick();
+            stop_.lock();
+        }
     }
+    stop_.unlock();
+    finish();
+}
+
+void PeriodicThread::finish()
+{
+    // do nothing
+}
+
+void PeriodicThread::stop()
+{
+    stop_.lock();
+    stop_.set();
+    stop_.unlock();
+    join();
 }
 
 }
@@ -28,10 +28,21 @@
 
 #include "ks/timing.h"
 #include "ks/utils.h"
+#include "ks/wait.h"
+#include "ks/atomic.h"
+#include "ks/thread.h"
+#include "internal.h"
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <errno.h>
+#include <string.h>
 #ifndef _WIN32
 #include <unistd.h> // sleep, usleep
 #endif
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
 
 namespace ks {
 
@@ -53,9 +64,255 @@ namespace ks {
 #endif
     }
 
+    const uint64_t TSC_CALIBRATION_MSEC = 10;
+    const int      TSC_SAMPLE_TRIALS    = 7;
+
+    /**
+    *   tells if the counter ticks at a constant rate in all the P-/C-states,
+    *   and (on Linux) if the kernel trusts it as its clocksource, i.e. it is
+    *   synchronized across the cores.
+    */
+    bool tsc_invariant()
+    {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+        unsigned int regs[4] = { 0, 0, 0, 0 };
+#ifdef _MSC_VER
+        __cpuid(reinterpret_cast<int *>(regs), 0x80000000);
+        if (regs[0] < 0x80000007) {
+            return false;
+        }
+        __cpuid(reinterpret_cast<int *>(regs), 0x80000007);
+#else
+        if (!__get_cpuid(0x80000000, &regs[0], &regs[1], &regs[2], &regs[3]) || (regs[0] < 0x80000007)) {
+            return false;
+        }
+        __get_cpuid(0x80000007, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        if ((regs[3] & (1u << 8)) == 0) {
+            return false;
+        }
+#elif !defined(__aarch64__)
+        return false;
+#endif
+
+#ifdef __linux__
+        std::ifstream source("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+        std::string name;
+        if (source >> name) {
+            return (name == "tsc") || (name == "arch_sys_counter");
+        }
+#endif
+        return true;
+    }
+
+    /**
+    *   reads the TSC and the reference clock at (as close as possible to) the same instant
+    */
+    void sample_tsc(bool raw, uint64_t *tsc, uint64_t *nsec)
+    {
+        uint64_t window = ~static_cast<uint64_t>(0);
+        for (int i=0; i<TSC_SAMPLE_TRIALS; i++) {
+            uint64_t before = read_tsc();
+            uint64_t ref    = (raw? monotonic_raw_nsec(): monotonic_nsec());
+            uint64_t after  = read_tsc();
+            if ((after >= before) && ((after - before) < window)) {
+                window = after - before;
+                *tsc   = before + window / 2;
+                *nsec  = ref;
+            }
+        }
+    }
+
+    inline uint64_t double_bits(double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    inline double bits_double(uint64_t bits)
+    {
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    /**
+    *   the TSC calibration, shared by all the nanostamps with TSCClock.
+    *   the rate and the base are measured against the same clock (the raw monotonic one, which
+    *   NTP does not slew), so the TSCClock reads on that clock. resync() updates them under a
+    *   sequence lock, so that the conversions never see a half-updated calibration, and never
+    *   moves the mapping backwards at the point where it switches over (see store_at_()).
+    */
+    class _TSCCalibration
+    {
+    public:
+        _TSCCalibration(): usable(false), tsc0_(0), raw0_(0), seq_(0), tscbase_(0), nsecbase_(0), nsecpertick_(0)
+        {
+            if (!tsc_invariant()) {
+                return;
+            }
+
+            uint64_t tsc1 = 0, raw1 = 0;
+            sample_tsc(true, &tsc0_, &raw0_);
+            sleep_msec(TSC_CALIBRATION_MSEC);
+            sample_tsc(true, &tsc1, &raw1);
+            double nsecpertick;
+            if (!rate_(tsc1, raw1, &nsecpertick)) {
+                return;
+            }
+            store_(tsc1, raw1, nsecpertick);
+            usable = true;
+        }
+
+        uint64_t to_nsec(uint64_t ticks) const
+        {
+            uint64_t tscbase, nsecbase, rate;
+            uint32_t seq;
+            do {
+                seq      = seq_.load(memory_order_acquire);
+                tscbase  = tscbase_.load(memory_order_relaxed);
+                nsecbase = nsecbase_.load(memory_order_relaxed);
+                rate     = nsecpertick_.load(memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);
+            } while (((seq & 1) != 0) || (seq != seq_.load(memory_order_relaxed)));
+
+            double nsecpertick = bits_double(rate);
+            if (ticks >= tscbase) {
+                return nsecbase + static_cast<uint64_t>(static_cast<double>(ticks - tscbase) * nsecpertick);
+            }
+            // taken before the base (e.g. before a resync()): counts backwards instead of wrapping
+            uint64_t before = static_cast<uint64_t>(static_cast<double>(tscbase - ticks) * nsecpertick);
+            return (before < nsecbase)? (nsecbase - before): 0;
+        }
+
+        void resync()
+        {
+            if (!usable) {
+                return;
+            }
+            MutexLocker locker(&lock_);
+            uint64_t tsc1 = 0, raw1 = 0;
+            sample_tsc(true, &tsc1, &raw1);
+            double nsecpertick;
+            if (rate_(tsc1, raw1, &nsecpertick)) {
+                store_at_(tsc1, raw1, nsecpertick);
+            }
+        }
+
+        bool usable;
+
+    private:
+        /**
+        *   re-bases the calibration at the current tick, no lower than the old mapping gives there:
+        *   the sample (tsc1, raw1) may be off by the sampling window, and the new rate may be
+        *   slower, so the new mapping could otherwise read a bit earlier than the old one did just
+        *   before. the TSCClock then runs ahead of the raw clock by that error, and the next resyncs
+        *   let the raw clock catch up instead of stepping back.
+        */
+        void store_at_(uint64_t tsc1, uint64_t raw1, double nsecpertick)
+        {
+            uint64_t tscnow = read_tsc();
+            if (tscnow < tsc1) {
+                tscnow = tsc1;
+            }
+            uint64_t nsecnow = raw1 + static_cast<uint64_t>(static_cast<double>(tscnow - tsc1) * nsecpertick);
+            uint64_t oldnsec = to_nsec(tscnow);
+            store_(tscnow, (nsecnow > oldnsec)? nsecnow: oldnsec, nsecpertick);
+        }
+
+        /**
+        *   the rate since the first sample; false for a counter that does not look like a TSC
+        */
+        bool rate_(uint64_t tsc1, uint64_t raw1, double *nsecpertick) const
+        {
+            if ((tsc1 <= tsc0_) || (raw1 <= raw0_)) {
+                return false;
+            }
+            *nsecpertick = static_cast<double>(raw1 - raw0_) / static_cast<double>(tsc1 - tsc0_);
+            // a counter slower than 1 MHz or faster than 20 GHz is not a TSC we can trust
+            return (*nsecpertick <= 1000.0) && (*nsecpertick >= 0.05);
+        }
+
+        void store_(uint64_t tscbase, uint64_t nsecbase, double nsecpertick)
+        {
+            uint32_t seq = seq_.load(memory_order_relaxed);
+            seq_.store(seq + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            tscbase_.store(tscbase, memory_order_relaxed);
+            nsecbase_.store(nsecbase, memory_order_relaxed);
+            nsecpertick_.store(double_bits(nsecpertick), memory_order_relaxed);
+            seq_.store(seq + 2, memory_order_release);
+        }
+
+        Mutex            lock_;     // serializes resync()
+        uint64_t         tsc0_;     // the first sample, from which the rate is measured
+        uint64_t         raw0_;
+        atomic<uint32_t> seq_;      // odd while store_() is in progress
+        atomic<uint64_t> tscbase_;
+        atomic<uint64_t> nsecbase_; // on the raw monotonic clock
+        atomic<uint64_t> nsecpertick_;
+    };
+
+    _TSCCalibration &tsc_calibration()
+    {
+        static _TSCCalibration calibration_;
+        return calibration_;
+    }
+
+    const char *clock_name(ClockSource source)
+    {
+        switch (source)
+        {
+        case RealtimeClock:     return "realtime";
+        case MonotonicClock:    return "monotonic";
+        case TSCClock:          return "tsc";
+        case MonotonicRawClock: return "monotonic-raw";
+        case BoottimeClock:     return "boottime";
+        }
+        return "unknown";
+    }
+
+    /**
+    *   sets up the TSC-related members; returns the source to be used
+    */
+    ClockSource setup_tsc(ClockSource source)
+    {
+        if (source != TSCClock) {
+#ifndef CLOCK_MONOTONIC_RAW
+            if (source == MonotonicRawClock) {
+                return MonotonicClock;
+            }
+#endif
+#ifndef CLOCK_BOOTTIME
+            if (source == BoottimeClock) {
+                return MonotonicClock;
+            }
+#endif
+            return source;
+        }
+        return tsc_calibration().usable? TSCClock: MonotonicClock;
+    }
+
+    // static
+    bool nanostamp::tsc_available() { return tsc_calibration().usable; }
+
+    // static
+    void nanostamp::resync_tsc() { tsc_calibration().resync(); }
+
+    uint64_t nanostamp::to_nsec(uint64_t ticks) const
+    {
+        if (source_ != TSCClock) {
+            return ticks;
+        }
+        return tsc_calibration().to_nsec(ticks);
+    }
+
 #ifdef _WIN32
-    nanostamp::nanostamp()
+    nanostamp::nanostamp(ClockSource source)
     {
+        source_ = setup_tsc(source);
+
         LARGE_INTEGER freq;
         int supported = QueryPerformanceFrequency(&freq);
         supported_ = (supported == 0)? false: true;
@@ -71,6 +328,10 @@ namespace ks {
 
     void nanostamp::get(uint64_t *holder)
     {
+        if (source_ == TSCClock) {
+            *holder = to_nsec(read_tsc());
+            return;
+        }
         if (!supported_) {
             return;
         }
@@ -87,10 +348,34 @@ namespace ks {
         *holder = (ucount*NSEC_IN_SEC)/freq_;
     }
 #else
-    nanostamp::nanostamp()
+    /**
+    *   the POSIX clock for a source (other than TSCClock) that setup_tsc() has accepted
+    */
+    clockid_t clock_id(ClockSource source)
+    {
+        switch (source)
+        {
+        case RealtimeClock:
+            return CLOCK_REALTIME;
+#ifdef CLOCK_MONOTONIC_RAW
+        case MonotonicRawClock:
+            return CLOCK_MONOTONIC_RAW;
+#endif
+#ifdef CLOCK_BOOTTIME
+        case BoottimeClock:
+            return CLOCK_BOOTTIME;
+#endif
+        default:
+            return CLOCK_MONOTONIC;
+        }
+    }
+
+    nanostamp::nanostamp(ClockSource source): supported_(true)
     {
+        source_ = setup_tsc(source);
+
         struct timespec test;
-        if (clock_gettime(CLOCK_REALTIME, &test)) {
+        if (clock_gettime(clock_id(source_), &test)) {
             std::cerr << "***real-time clock is not available on this platform.";
             std::cerr << "disabling calculation of transaction latency." << std::endl;
             supported_ = false;
@@ -99,16 +384,22 @@ namespace ks {
 
     void nanostamp::get(uint64_t *holder)
     {
+        if (source_ == TSCClock) {
+            *holder = to_nsec(read_tsc());
+            return;
+        }
         if (!supported_) {
             *holder = 0;
+            return;
         }
 
         struct timespec _clock;
-        if (clock_gettime(CLOCK_REALTIME, &_clock)) {
+        if (clock_gettime(clock_id(source_), &_clock)) {
             std::cerr << "***failure to get real-time clock: " << error_message() << std::endl;
             std::cerr << "***disabling latency calculation." << std::endl;
             supported_ = false;
             *holder = 0;
+            return;
         }
 
         *holder = ((uint64_t)(_clock.tv_sec))*NSEC_IN_SEC + (uint64_t)(_clock.tv_nsec);
@@ -117,31 +408,116 @@ namespace ks {
 
     bool nanostamp::is_available() { return supported_; }
 
+    /**
+    *   sleeps until `deadline` on monotonic_nsec(), without drifting on wakeups by signals
+    */
+    void sleep_until_nsec(uint64_t deadline)
+    {
+#if defined(_WIN32)
+        uint64_t now = monotonic_nsec();
+        if (deadline > now) {
+            Sleep(static_cast<DWORD>((deadline - now) / 1000000ULL));
+        }
+#elif defined(TIMER_ABSTIME) && !defined(__APPLE__)
+        struct timespec ts;
+        ts.tv_sec  = static_cast<time_t>(deadline / NSEC_IN_SEC);
+        ts.tv_nsec = static_cast<long>(deadline % NSEC_IN_SEC);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            // the deadline is absolute: simply retry
+        }
+#else
+        uint64_t now;
+        while ((now = monotonic_nsec()) < deadline) {
+            struct timespec ts;
+            ts.tv_sec  = static_cast<time_t>((deadline - now) / NSEC_IN_SEC);
+            ts.tv_nsec = static_cast<long>((deadline - now) % NSEC_IN_SEC);
+            nanosleep(&ts, NULL);
+        }
+#endif
+    }
+
+    nanotimer::nanotimer():
+        interval_(0), periodic_(false), spin_(0), deadline_(0),
+        overruns_(0), missed_(0), lastlate_(0), maxlate_(0)
+    {
+        set_interval(0);
+    }
+
 #ifdef _WIN32
     void nanotimer::set_interval(uint64_t value)
     {
-        return; // right now we cannot use nanosleep(), and I have not found any alternatives.
+        interval_ = value;
+        spec_.QuadPart = 0; // right now we cannot use nanosleep(), and I have not found any alternatives.
     }
 
     void nanotimer::sleep()
     {
+        if (periodic_) {
+            sleep_periodic_();
+        }
         return; // right now we cannot use nanosleep(), and I have not found any alternatives.
     }
 #else
     void nanotimer::set_interval(uint64_t value)
     {
-        if (value > NSEC_IN_SEC) {
-            spec_.tv_sec  = value / NSEC_IN_SEC;
-            spec_.tv_nsec = value % NSEC_IN_SEC;
-        } else {
-            spec_.tv_sec  = 0;
-            spec_.tv_nsec = value;
-        }
+        interval_ = value;
+        spec_.tv_sec  = value / NSEC_IN_SEC;
+        spec_.tv_nsec = value % NSEC_IN_SEC;
     }
 
     void nanotimer::sleep()
     {
-        nanosleep(&spec_, NULL);
+        if (periodic_) {
+            sleep_periodic_();
+        } else {
+            nanosleep(&spec_, NULL);
+        }
     }
 #endif
+
+    void nanotimer::start_periodic(uint64_t spin_nsec)
+    {
+        periodic_ = true;
+        spin_     = spin_nsec;
+        deadline_ = now() + interval_;
+        overruns_ = 0;
+        missed_   = 0;
+        lastlate_ = 0;
+        maxlate_  = 0;
+    }
+
+    void nanotimer::stop_periodic()
+    {
+        periodic_ = false;
+    }
+
+    void nanotimer::sleep_periodic_()
+    {
+        uint64_t current = now();
+        if (current >= deadline_) {
+            // we are late already
+            overruns_++;
+            if (interval_ > 0) {
+                uint64_t skipped = (current - deadline_) / interval_;
+                missed_   += skipped;
+                deadline_ += skipped * interval_;
+            }
+        } else {
+            if (deadline_ - current > spin_) {
+                sleep_until_nsec(deadline_ - spin_);
+            }
+            while ((current = now()) < deadline_) {
+                cpu_relax();
+            }
+        }
+
+        lastlate_ = current - deadline_;
+        if (lastlate_ > maxlate_) {
+            maxlate_ = lastlate_;
+        }
+        deadline_ += interval_;
+    }
+
+    // static
+    uint64_t nanotimer::now() { return monotonic_nsec(); }
 }
@@ -0,0 +1,398 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+*   trace.cpp -- see trace.h for description
+*/
+
+#include <vector>
+#include <map>
+#include <fstream>
+#include <cstdio>
+#include <string.h>
+#include <errno.h>
+#include "ks/trace.h"
+#include "ks/timing.h"
+#include "ks/log.h"
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace ks {
+
+inline long trace_thread_id()
+{
+#if defined(_WIN32)
+    return static_cast<long>(GetCurrentThreadId());
+#elif defined(__linux__)
+    return static_cast<long>(syscall(SYS_gettid));
+#else
+    return 0;
+#endif
+}
+
+inline long trace_process_id()
+{
+#ifdef _WIN32
+    return static_cast<long>(_getpid());
+#else
+    return static_cast<long>(getpid());
+#endif
+}
+
+struct _TraceEvent
+{
+    const char *name;
+    const char *category;
+    char        phase;      // 'X' (complete), 'i' (instant) or 'C' (counter)
+    uint64_t    ts;         // in raw clock ticks
+    uint64_t    dur;        // in raw clock ticks
+    int64_t     value;
+};
+
+/**
+ * the events of one thread. only the owner appends to `events`, and publishes
+ * them through `count`, so that the buffer can be read while being written.
+ */
+class _TraceBuffer
+{
+public:
+    explicit _TraceBuffer(size_t capacity):
+        events(new _TraceEvent[capacity]), capacity(capacity), count(0), dropped(0), tid(0), name(), exited(false) {}
+    ~_TraceBuffer() { delete [] events; }
+
+    _TraceEvent      *events;
+    const size_t      capacity;
+    atomic<size_t>    count;
+    atomic<uint64_t>  dropped;
+    long              tid;      // guarded by the registry lock, as the fields below
+    std::string       name;
+    bool              exited;   // the owner has exited; the events are still to be written out
+};
+
+static KS_THREAD_LOCAL _TraceBuffer *trace_buffer_ = 0;
+
+/**
+ * the registry of the buffers. the buffer of an exited thread is kept until its events have
+ * been written out (or cleared), and is then put on a free list, to be reused by a new thread.
+ * the buffers are never deleted otherwise, as the threads keep raw pointers to them.
+ */
+class _TraceRegistry: public ThreadExitHandler
+{
+public:
+    _TraceRegistry(): lock_(), buffers_(), free_(), capacity_(TRACE_DEFAULT_CAPACITY), clock_(TSCClock),
+        base_(clock_.ticks()), retireddropped_(0), anonymous_(0), registered_(false) {}
+
+    void setup(size_t capacity)
+    {
+        MutexLocker locker(&lock_);
+        capacity_ = (capacity > 0)? capacity: 1;
+        if( !registered_ ){
+            Thread::addExitHandler(this);
+            registered_ = true;
+        }
+    }
+
+    uint64_t ticks() { return clock_.ticks(); }
+
+    _TraceBuffer *buffer()
+    {
+        if( trace_buffer_ == 0 ){
+            Thread *thread = Thread::current();
+            long tid = trace_thread_id();
+            MutexLocker locker(&lock_);
+            _TraceBuffer *buffer = 0;
+            if( !free_.empty() ){
+                buffer = free_.back();
+                free_.pop_back();
+                if( buffer->capacity != capacity_ ){
+                    delete buffer;  // from before a setup() with another capacity
+                    buffer = 0;
+                }
+            }
+            if( buffer == 0 ){
+                buffer = new _TraceBuffer(capacity_);
+            }
+            buffer->count.store(0, memory_order_relaxed);
+            buffer->dropped.store(0, memory_order_relaxed);
+            buffer->tid    = (tid != 0)? tid: static_cast<long>(++anonymous_);
+            buffer->name   = (thread != 0)? thread->name(): std::string();
+            buffer->exited = false;
+            buffers_.push_back(buffer);
+            trace_buffer_ = buffer;
+        }
+        return trace_buffer_;
+    }
+
+    virtual void threadExiting(Thread *thread)
+    {
+        if( trace_buffer_ != 0 ){
+            MutexLocker locker(&lock_);
+            if( !thread->name().empty() ){
+                trace_buffer_->name = thread->name(); // the name may not be known afterwards
+            }
+            trace_buffer_->exited = true;
+            trace_buffer_ = 0;
+        }
+    }
+
+    void write(std::ostream &out);
+
+    void clear()
+    {
+        MutexLocker locker(&lock_);
+        recycle_();
+        for( std::vector<_TraceBuffer *>::iterator it=buffers_.begin(); it!=buffers_.end(); ++it ){
+            (*it)->count.store(0, memory_order_release);
+            (*it)->dropped.store(0, memory_order_relaxed);
+        }
+        retireddropped_ = 0;
+        base_ = clock_.ticks();
+    }
+
+    uint64_t dropped()
+    {
+        MutexLocker locker(&lock_);
+        uint64_t total = retireddropped_;
+        for( std::vector<_TraceBuffer *>::iterator it=buffers_.begin(); it!=buffers_.end(); ++it ){
+            total += (*it)->dropped.load(memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    /**
+    *   with lock_ held: moves the buffers of the exited threads to the free list
+    */
+    void recycle_()
+    {
+        std::vector<_TraceBuffer *>::iterator kept = buffers_.begin();
+        for( std::vector<_TraceBuffer *>::iterator it=buffers_.begin(); it!=buffers_.end(); ++it ){
+            if( (*it)->exited ){
+                retireddropped_ += (*it)->dropped.load(memory_order_relaxed);
+                free_.push_back(*it);
+            } else {
+                *(kept++) = *it;
+            }
+        }
+        buffers_.erase(kept, buffers_.end());
+    }
+
+    Mutex                        lock_;
+    std::vector<_TraceBuffer *>  buffers_;  // of the live threads, and of the exited ones not yet written out
+    std::vector<_TraceBuffer *>  free_;
+    size_t                       capacity_;
+    nanostamp                    clock_;
+    uint64_t                     base_;
+    uint64_t                     retireddropped_; // the drops counted in the recycled buffers
+    long                         anonymous_;      // for the threads without a system id
+    bool                         registered_;
+};
+
+_TraceRegistry &trace_registry()
+{
+    static _TraceRegistry registry_;
+    return registry_;
+}
+
+void write_json_string(std::ostream &out, const char *str)
+{
+    out << '"';
+    for( const char *c=(str != 0)? str: ""; *c!='\0'; ++c ){
+        switch( *c )
+        {
+        case '"':  out << "\\\""; break;
+        case '\\': out << "\\\\"; break;
+        case '\n': out << "\\n";  break;
+        case '\r': out << "\\r";  break;
+        case '\t': out << "\\t";  break;
+        default:
+            if( static_cast<unsigned char>(*c) < 0x20 ){
+                char escaped[8];
+                std::sprintf(escaped, "\\u%04x", static_cast<unsigned int>(static_cast<unsigned char>(*c)));
+                out << escaped;
+            } else {
+                out << *c;
+            }
+        }
+    }
+    out << '"';
+}
+
+/**
+ * writes a timestamp (or a duration) in nanosec as microseconds with 3 decimals
+ */
+void write_usec(std::ostream &out, uint64_t nsec)
+{
+    char buf[32];
+    std::sprintf(buf, "%llu.%03u", static_cast<unsigned long long>(nsec / 1000), static_cast<unsigned int>(nsec % 1000));
+    out << buf;
+}
+
+void _TraceRegistry::write(std::ostream &out)
+{
+    // the names of the live threads, as they may have been set after their first event
+    std::map<long, std::string> names;
+    std::vector<ThreadStats> threads = Thread::snapshot();
+    for( std::vector<ThreadStats>::iterator it=threads.begin(); it!=threads.end(); ++it ){
+        if( (it->systemId != 0) && !it->name.empty() ){
+            names[it->systemId] = it->name;
+        }
+    }
+
+    MutexLocker locker(&lock_);
+    long pid = trace_process_id();
+    uint64_t base = clock_.to_nsec(base_);
+    bool first = true;
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    for( std::vector<_TraceBuffer *>::iterator it=buffers_.begin(); it!=buffers_.end(); ++it ){
+        _TraceBuffer *buffer = *it;
+        std::map<long, std::string>::iterator named = names.find(buffer->tid);
+        const std::string &name = (named != names.end())? named->second: buffer->name;
+        if( !name.empty() ){
+            out << (first? "\n": ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+                << ",\"tid\":" << buffer->tid << ",\"args\":{\"name\":";
+            write_json_string(out, name.c_str());
+            out << "}}";
+            first = false;
+        }
+
+        size_t count = buffer->count.load(memory_order_acquire);
+        for( size_t i=0; i<count; i++ ){
+            const _TraceEvent &e = buffer->events[i];
+            uint64_t ts = clock_.to_nsec(e.ts);
+            out << (first? "\n": ",\n") << "{\"ph\":\"" << e.phase << "\",\"name\":";
+            write_json_string(out, e.name);
+            out << ",\"cat\":";
+            write_json_string(out, e.category);
+            out << ",\"pid\":" << pid << ",\"tid\":" << buffer->tid << ",\"ts\":";
+            write_usec(out, (ts > base)? (ts - base): 0);
+            switch( e.phase )
+            {
+            case 'X':
+                out << ",\"dur\":";
+                write_usec(out, clock_.to_nsec(e.ts + e.dur) - ts);
+                break;
+            case 'i':
+                out << ",\"s\":\"t\"";
+                break;
+            case 'C':
+                out << ",\"args\":{\"value\":" << e.value << "}";
+                break;
+            }
+            out << "}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+    recycle_();
+}
+
+atomic<bool> Tracer::enabled_(false);
+
+// static
+void Tracer::enable(size_t capacity)
+{
+    trace_registry().setup(capacity);
+    enabled_.store(true);
+}
+
+// static
+void Tracer::disable() { enabled_.store(false); }
+
+// static
+uint64_t Tracer::timestamp()
+{
+    return trace_registry().ticks();
+}
+
+// static
+void Tracer::complete(const char *name, const char *category, uint64_t start)
+{
+    uint64_t now = timestamp();
+    event_(name, category, 'X', start, (now > start)? (now - start): 0, 0);
+}
+
+// static
+void Tracer::event_(const char *name, const char *category, char phase, uint64_t ts, uint64_t dur, int64_t value)
+{
+    _TraceBuffer *buffer = trace_registry().buffer();
+    size_t idx = buffer->count.load(memory_order_relaxed);
+    if( idx >= buffer->capacity ){
+        buffer->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    _TraceEvent &e = buffer->events[idx];
+    e.name     = name;
+    e.category = category;
+    e.phase    = phase;
+    e.ts       = ts;
+    e.dur      = dur;
+    e.value    = value;
+    buffer->count.store(idx + 1, memory_order_release);
+}
+
+// static
+void Tracer::write(std::ostream &out)
+{
+    trace_registry().write(out);
+}
+
+// static
+bool Tracer::writeFile(const std::string &path)
+{
+    std::ofstream out(path.c_str());
+    if( !out ){
+        ks::logger::warning("ks::Tracer") << "could not open " << path << ": " << strerror(errno) << ks::endl;
+        return false;
+    }
+    write(out);
+    out.close();
+    if( !out ){
+        ks::logger::warning("ks::Tracer") << "could not write " << path << ks::endl;
+        return false;
+    }
+    return true;
+}
+
+// static
+void Tracer::clear()
+{
+    trace_registry().clear();
+}
+
+// static
+uint64_t Tracer::dropped()
+{
+    return trace_registry().dropped();
+}
+
+}
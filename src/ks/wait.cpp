@@ -0,0 +1,200 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   wait.cpp -- see wait.h for description
+*/
+
+#include <algorithm>
+#include <vector>
+#ifndef _WIN32
+#include <sched.h>
+#include <time.h>
+#endif
+
+#include "ks/wait.h"
+#include "ks/thread.h"
+#include "internal.h"
+
+namespace ks {
+
+const uint32_t WAIT_DEADLINE_CHECK   = 0x40;        // the spins between the checks of the deadline
+const int      CALIBRATION_SPINS     = 100000;
+const int      CALIBRATION_ROUNDS    = 200;
+const uint32_t CALIBRATED_MIN_SPINS  = 0x40;
+const uint32_t CALIBRATED_MAX_SPINS  = 1 << 20;
+
+/**
+ * the default policy of each thread (a WaitPolicy cannot be thread-local itself in C++03)
+ */
+static KS_THREAD_LOCAL int      thread_strategy_ = ParkWait;
+static KS_THREAD_LOCAL uint32_t thread_spins_    = 0;
+
+// static
+void WaitPolicy::setThreadDefault(const WaitPolicy &policy)
+{
+    thread_strategy_ = policy.strategy;
+    thread_spins_    = policy.spins;
+}
+
+// static
+WaitPolicy WaitPolicy::threadDefault()
+{
+    return WaitPolicy(static_cast<WaitStrategy>(thread_strategy_), thread_spins_);
+}
+
+// static
+WaitPolicy WaitPolicy::calibrated(WaitStrategy strategy)
+{
+    if( strategy == ParkWait ){
+        return park();
+    }
+    double spins = calibrate_spins_per_usec() * static_cast<double>(calibrate_park_nsec()) / 1000.0;
+    uint32_t n = static_cast<uint32_t>(std::min(std::max(spins, static_cast<double>(CALIBRATED_MIN_SPINS)),
+                                                static_cast<double>(CALIBRATED_MAX_SPINS)));
+    return WaitPolicy(strategy, n);
+}
+
+void thread_yield()
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+uint64_t wait_now_nsec()
+{
+    return monotonic_nsec();
+}
+
+SpinResult spin_until_changed(const atomic<uint32_t> &word, uint32_t seen, const WaitPolicy &policy, uint64_t deadline_nsec)
+{
+    if( policy.strategy == ParkWait ){
+        return SpinExhausted;
+    }
+
+    // the spin phase (unbounded for SpinWait)
+    for( uint32_t i=0; (policy.strategy == SpinWait) || (i < policy.spins); i++ ){
+        if( word.load(memory_order_acquire) != seen ){
+            return SpinChanged;
+        }
+        if( (deadline_nsec > 0) && ((i % WAIT_DEADLINE_CHECK) == 0) && (wait_now_nsec() >= deadline_nsec) ){
+            return SpinTimedOut;
+        }
+        cpu_relax();
+    }
+    if( policy.strategy == SpinParkWait ){
+        return (word.load(memory_order_acquire) != seen)? SpinChanged: SpinExhausted;
+    }
+
+    // SpinYieldWait
+    while( word.load(memory_order_acquire) == seen ){
+        if( (deadline_nsec > 0) && (wait_now_nsec() >= deadline_nsec) ){
+            return SpinTimedOut;
+        }
+        thread_yield();
+    }
+    return SpinChanged;
+}
+
+double calibrate_spins_per_usec()
+{
+    static volatile double spins_per_usec_ = 0; // a benign race: all threads measure about the same
+    if( spins_per_usec_ > 0 ){
+        return spins_per_usec_;
+    }
+
+    uint64_t start = wait_now_nsec();
+    for( int i=0; i<CALIBRATION_SPINS; i++ ){
+        cpu_relax();
+    }
+    uint64_t elapsed = std::max<uint64_t>(wait_now_nsec() - start, 1);
+    spins_per_usec_ = static_cast<double>(CALIBRATION_SPINS) * 1000.0 / static_cast<double>(elapsed);
+    return spins_per_usec_;
+}
+
+/**
+ * the other side of the ping-pong in calibrate_park_nsec()
+ */
+class _CalibrationPonger: public Thread
+{
+public:
+    _CalibrationPonger(Condition &cond, volatile int &turn): cond_(cond), turn_(turn) {}
+
+protected:
+    void run()
+    {
+        cond_.lock();
+        for( int i=0; i<CALIBRATION_ROUNDS; i++ ){
+            while( turn_ != 1 ){
+                cond_.wait();
+            }
+            turn_ = 0;
+            cond_.notify();
+        }
+        cond_.unlock();
+    }
+
+private:
+    Condition    &cond_;
+    volatile int &turn_;
+};
+
+uint64_t calibrate_park_nsec()
+{
+    static volatile uint64_t park_nsec_ = 0;
+    if( park_nsec_ > 0 ){
+        return park_nsec_;
+    }
+
+    Condition cond;
+    cond.setWaitPolicy(WaitPolicy::park());
+    volatile int turn = 0;
+    _CalibrationPonger ponger(cond, turn);
+    ponger.start();
+
+    std::vector<uint64_t> rounds;
+    cond.lock();
+    for( int i=0; i<CALIBRATION_ROUNDS; i++ ){
+        uint64_t start = wait_now_nsec();
+        turn = 1;
+        cond.notify();
+        while( turn != 0 ){
+            cond.wait();
+        }
+        rounds.push_back(wait_now_nsec() - start);
+    }
+    cond.unlock();
+    ponger.join();
+
+    // a round trip consists of two wake-ups; the median filters out the preemptions
+    std::sort(rounds.begin(), rounds.end());
+    park_nsec_ = std::max<uint64_t>(rounds[rounds.size() / 2] / 2, 1);
+    return park_nsec_;
+}
+
+}
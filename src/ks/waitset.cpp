@@ -0,0 +1,372 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018-2019 Keisuke Sehara
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+*   waitset.cpp -- see waitset.h for description
+*/
+
+#include <stdexcept>
+#include <sstream>
+#include <errno.h>
+#include <string.h>
+
+#include "ks/waitset.h"
+#include "ks/log.h"
+#include "internal.h"
+
+#ifdef __linux__
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+namespace ks {
+
+#ifdef __linux__
+
+const int      WAITSET_MAX_EVENTS = 64;
+const uint64_t WAITSET_WAKE_ID    = 0;  // the epoll id of the eventfd
+const long     WAITSET_NSEC_IN_MSEC = 1000000;
+
+void throw_waitset_error(const char *what)
+{
+    std::stringstream ss;
+    ss << what << ": " << strerror(errno);
+    ks::logger::error("WaitSet") << ss.str() << ks::endl;
+    throw std::runtime_error(ss.str());
+}
+
+class _WaitSource: public ConditionListener
+{
+public:
+    _WaitSource(WaitSourceKind k, int wake): id(0), kind(k), cond(0), fd(-1), events(0), pending(0), wakefd(wake) {}
+
+    /**
+    *   called from notify*() of the Flag/Condition, on any thread
+    */
+    void conditionNotified(Condition *)
+    {
+        pending.store(1, memory_order_release);
+        uint64_t one = 1;
+        if( write(wakefd, &one, sizeof(one)) < 0 ){
+            // EAGAIN: the counter is saturated, i.e. the WaitSet is awake anyway
+        }
+    }
+
+    int             id;
+    WaitSourceKind  kind;
+    Condition      *cond;   // for a Flag or a Condition
+    int             fd;     // for a descriptor or a timer
+    unsigned int    events;
+    atomic<int>     pending;
+    int             wakefd;
+};
+
+WaitSet::WaitSet(): epfd_(-1), wakefd_(-1), nextid_(1), wakes_(0), sources_()
+{
+    if( (epfd_ = epoll_create1(EPOLL_CLOEXEC)) < 0 ){
+        throw_waitset_error("epoll_create1 failed");
+    }
+    if( (wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ){
+        close(epfd_);
+        throw_waitset_error("eventfd failed");
+    }
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.u64 = WAITSET_WAKE_ID;
+    if( epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev) < 0 ){
+        close(wakefd_);
+        close(epfd_);
+        throw_waitset_error("epoll_ctl failed");
+    }
+}
+
+WaitSet::~WaitSet()
+{
+    while( !sources_.empty() ){
+        remove(sources_.begin()->first);
+    }
+    close(wakefd_);
+    close(epfd_);
+}
+
+int WaitSet::add_(_WaitSource *source)
+{
+    source->id = nextid_++;
+    sources_[source->id] = source;
+    return source->id;
+}
+
+void WaitSet::control_(int op, int fd, uint32_t events, int source)
+{
+    struct epoll_event ev;
+    ev.events   = events;
+    ev.data.u64 = static_cast<uint64_t>(source);
+    if( epoll_ctl(epfd_, op, fd, &ev) < 0 ){
+        throw_waitset_error("epoll_ctl failed");
+    }
+}
+
+int WaitSet::addFlag(Flag &flag)
+{
+    _WaitSource *source = new _WaitSource(WaitFlag, wakefd_);
+    source->cond = &flag;
+    int id = add_(source);
+    flag.addListener(source);
+    return id;
+}
+
+int WaitSet::addCondition(Condition &cond)
+{
+    _WaitSource *source = new _WaitSource(WaitCondition, wakefd_);
+    source->cond = &cond;
+    int id = add_(source);
+    cond.addListener(source);
+    return id;
+}
+
+int WaitSet::addDescriptor(int fd, unsigned int events)
+{
+    uint32_t epevents = 0;
+    if( events & WaitReadable ){
+        epevents |= EPOLLIN | EPOLLRDHUP;
+    }
+    if( events & WaitWritable ){
+        epevents |= EPOLLOUT;
+    }
+
+    _WaitSource *source = new _WaitSource(WaitDescriptor, wakefd_);
+    source->fd     = fd;
+    source->events = events;
+    int id = add_(source);
+    try {
+        control_(EPOLL_CTL_ADD, fd, epevents, id);
+    } catch(...) {
+        sources_.erase(id);
+        delete source;
+        throw;
+    }
+    return id;
+}
+
+int WaitSet::addTimer(long interval_msec, bool periodic)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if( fd < 0 ){
+        throw_waitset_error("timerfd_create failed");
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec  = interval_msec / 1000;
+    spec.it_value.tv_nsec = (interval_msec % 1000) * WAITSET_NSEC_IN_MSEC;
+    if( (spec.it_value.tv_sec == 0) && (spec.it_value.tv_nsec == 0) ){
+        spec.it_value.tv_nsec = 1; // a zero value would disarm the timer
+    }
+    if( periodic ){
+        spec.it_interval = spec.it_value;
+    }
+    if( timerfd_settime(fd, 0, &spec, 0) < 0 ){
+        close(fd);
+        throw_waitset_error("timerfd_settime failed");
+    }
+
+    _WaitSource *source = new _WaitSource(WaitTimer, wakefd_);
+    source->fd = fd;
+    int id = add_(source);
+    try {
+        control_(EPOLL_CTL_ADD, fd, EPOLLIN, id);
+    } catch(...) {
+        sources_.erase(id);
+        delete source;
+        close(fd);
+        throw;
+    }
+    return id;
+}
+
+void WaitSet::remove(int id)
+{
+    FlatHashMap<int, _WaitSource *>::iterator it = sources_.find(id);
+    if( it == sources_.end() ){
+        return;
+    }
+    _WaitSource *source = it->second;
+    sources_.erase(it);
+
+    switch( source->kind ){
+    case WaitFlag:
+    case WaitCondition:
+        // no notification is in progress once this returns
+        source->cond->removeListener(source);
+        break;
+    case WaitDescriptor:
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, source->fd, 0); // the descriptor may have been closed already
+        break;
+    case WaitTimer:
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, source->fd, 0);
+        close(source->fd);
+        break;
+    }
+    delete source;
+}
+
+void WaitSet::wake()
+{
+    wakes_.fetch_add(1, memory_order_release);
+    uint64_t one = 1;
+    if( write(wakefd_, &one, sizeof(one)) < 0 ){
+        // EAGAIN: the counter is saturated
+    }
+}
+
+inline bool already_ready(const std::vector<WaitEvent> &ready, int id)
+{
+    for( std::vector<WaitEvent>::const_iterator it=ready.begin(); it!=ready.end(); ++it ){
+        if( it->source == id ){
+            return true;
+        }
+    }
+    return false;
+}
+
+void WaitSet::collect_(std::vector<WaitEvent> &ready)
+{
+    for( FlatHashMap<int, _WaitSource *>::iterator it=sources_.begin(); it!=sources_.end(); ++it ){
+        _WaitSource *source = it->second;
+        bool fired = false;
+        if( source->kind == WaitFlag ){
+            source->pending.store(0, memory_order_relaxed);
+            Flag *flag = static_cast<Flag *>(source->cond);
+            flag->lock();
+            fired = flag->isset();
+            flag->unlock();
+        } else if( source->kind == WaitCondition ){
+            fired = (source->pending.exchange(0, memory_order_acq_rel) != 0);
+        }
+        if( fired && !already_ready(ready, source->id) ){
+            WaitEvent event;
+            event.source = source->id;
+            event.kind   = source->kind;
+            ready.push_back(event);
+        }
+    }
+}
+
+int WaitSet::wait(std::vector<WaitEvent> &ready, long timeout_msec)
+{
+    ready.clear();
+    uint64_t deadline = (timeout_msec >= 0)? (monotonic_msec() + static_cast<uint64_t>(timeout_msec)): 0;
+
+    struct epoll_event evs[WAITSET_MAX_EVENTS];
+    while( true ){
+        // the Flags may have been set before they were added, without any wake-up
+        collect_(ready);
+
+        int wait_msec = -1;
+        if( !ready.empty() ){
+            wait_msec = 0; // only picks up the descriptors that are ready as well
+        } else if( timeout_msec >= 0 ){
+            uint64_t now = monotonic_msec();
+            wait_msec = (now < deadline)? static_cast<int>(deadline - now): 0;
+        }
+
+        int n = epoll_wait(epfd_, evs, WAITSET_MAX_EVENTS, wait_msec);
+        if( n < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            throw_waitset_error("epoll_wait failed");
+        }
+
+        bool woken = false;
+        for( int i=0; i<n; i++ ){
+            if( evs[i].data.u64 == WAITSET_WAKE_ID ){
+                uint64_t count;
+                if( read(wakefd_, &count, sizeof(count)) > 0 ){
+                    woken = true;
+                }
+                continue;
+            }
+
+            FlatHashMap<int, _WaitSource *>::iterator it = sources_.find(static_cast<int>(evs[i].data.u64));
+            if( it == sources_.end() ){
+                continue;
+            }
+            _WaitSource *source = it->second;
+            WaitEvent event;
+            event.source = source->id;
+            event.kind   = source->kind;
+            if( source->kind == WaitTimer ){
+                if( (read(source->fd, &(event.count), sizeof(event.count)) <= 0) || (event.count == 0) ){
+                    continue;
+                }
+            } else {
+                if( evs[i].events & EPOLLIN )                  event.events |= WaitReadable;
+                if( evs[i].events & EPOLLOUT )                 event.events |= WaitWritable;
+                if( evs[i].events & EPOLLERR )                 event.events |= WaitError;
+                if( evs[i].events & (EPOLLHUP | EPOLLRDHUP) )  event.events |= WaitHangup;
+            }
+            ready.push_back(event);
+        }
+
+        if( woken ){
+            // the Flags/Conditions that have been notified meanwhile
+            collect_(ready);
+        }
+        bool explicit_wake = (wakes_.exchange(0, memory_order_acq_rel) != 0);
+        if( explicit_wake || !ready.empty() ){
+            return static_cast<int>(ready.size());
+        }
+        if( (timeout_msec >= 0) && (monotonic_msec() >= deadline) ){
+            return 0;
+        }
+    }
+}
+
+#else // __linux__
+
+class _WaitSource {};
+
+void throw_unsupported()
+{
+    throw std::runtime_error("WaitSet is only supported on Linux");
+}
+
+WaitSet::WaitSet(): epfd_(-1), wakefd_(-1), nextid_(1), wakes_(0), sources_() { throw_unsupported(); }
+WaitSet::~WaitSet() {}
+int  WaitSet::addFlag(Flag &) { throw_unsupported(); return 0; }
+int  WaitSet::addCondition(Condition &) { throw_unsupported(); return 0; }
+int  WaitSet::addDescriptor(int, unsigned int) { throw_unsupported(); return 0; }
+int  WaitSet::addTimer(long, bool) { throw_unsupported(); return 0; }
+void WaitSet::remove(int) {}
+int  WaitSet::wait(std::vector<WaitEvent> &, long) { throw_unsupported(); return 0; }
+void WaitSet::wake() {}
+
+#endif // __linux__
+
+}